@@ -6,6 +6,8 @@
 #include "ray.hxx"
 #include "radianceorimportance.hxx"
 
+#include <memory>
+
 
 class Camera : public RadianceOrImportance::PointEmitterArray
 {
@@ -34,6 +36,9 @@ public:
     
     return coord.second * xres + coord.first;
   }
+
+  // Same view with a different image size.
+  virtual std::unique_ptr<Camera> WithResolution(int xres, int yres) const = 0;
   
   struct Frame
   {
@@ -92,6 +97,11 @@ public:
     std::cout << "fwd=" << frame.dir << std::endl;
 	}
 
+  std::unique_ptr<Camera> WithResolution(int xres, int yres) const override
+  {
+    return std::make_unique<PerspectiveCamera>(pos, frame.dir, frame.up, fov*180./Pi, xres, yres);
+  }
+
 	double PixelPdfWrtSolidAngle(double x, double y) const
   {
     double screen_surface_area = xperpixel*yperpixel;
@@ -173,6 +183,11 @@ public:
     per_pixel_delta = 2./smallest_side;
   }
 
+  std::unique_ptr<Camera> WithResolution(int xres, int yres) const override
+  {
+    return std::make_unique<FisheyeHemisphereCamera>(pos, frame.dir, frame.up, xres, yres);
+  }
+
   virtual PositionSample TakePositionSample(int unit_index, Sampler &sampler, const PathContext &context) const override
   {
     PositionSample s{this->pos, Spectral3{1.}, Pdf::MakeFromDelta(1.)};    
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <array>
+
+#include <Eigen/Core>
+
+/* Binary (de)serialization of the progressive state of the rendering algorithms.
+ * A class takes part by providing a member
+ *   template<class Archive> void Serialize(Archive &ar) { ar(member1); ar(member2); ... }
+ * which serves for reading as well as for writing. Everything else must be an Eigen matrix
+ * or array, a std::vector (or ToyVector), a std::array, a string or trivially copyable.
+ * Data is stored in native byte order. Checkpoints are meant to be resumed on the same kind
+ * of machine by the same build.
+ */
+namespace checkpoint
+{
+
+class Error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+
+namespace detail
+{
+
+template<class T, class = void>
+struct has_serialize : std::false_type {};
+
+struct DummyArchive { template<class U> void operator()(U&); };
+
+template<class T>
+struct has_serialize<T, std::void_t<decltype(std::declval<T&>().Serialize(std::declval<DummyArchive&>()))>> : std::true_type {};
+
+// Also true for classes derived from Eigen types, like Vec, whose EigenBase is parameterized
+// with the Eigen base class instead of the derived class.
+template<class D>
+std::true_type test_eigen(const Eigen::EigenBase<D>*);
+std::false_type test_eigen(const void*);
+
+template<class T>
+constexpr bool is_eigen = decltype(test_eigen(std::declval<const T*>()))::value;
+
+template<class T>
+constexpr bool is_dynamic_eigen()
+{
+  if constexpr (is_eigen<T>)
+    return T::RowsAtCompileTime == Eigen::Dynamic || T::ColsAtCompileTime == Eigen::Dynamic;
+  else
+    return false;
+}
+
+template<class T, class A>
+std::true_type test_vector(const std::vector<T, A>*);
+std::false_type test_vector(const void*);
+
+template<class T>
+constexpr bool is_vector = decltype(test_vector(std::declval<const T*>()))::value;
+
+template<class T>
+struct is_std_array : std::false_type {};
+template<class T, std::size_t N>
+struct is_std_array<std::array<T, N>> : std::true_type {};
+
+// Can be written with a single memcpy.
+template<class T>
+constexpr bool is_raw()
+{
+  if constexpr (has_serialize<T>::value || std::is_pointer_v<T>)
+    return false;
+  else if constexpr (is_eigen<T>)
+    return !is_dynamic_eigen<T>() && std::is_trivially_copyable_v<typename T::Scalar>;
+  else
+    return std::is_trivially_copyable_v<T>;
+}
+
+} // namespace detail
+
+
+class Writer
+{
+  std::ostream &os;
+
+  void Bytes(const void *p, std::size_t n)
+  {
+    os.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+    if (!os)
+      throw Error("Failed to write checkpoint");
+  }
+
+  void Size(std::size_t n)
+  {
+    const std::uint64_t n64 = n;
+    Bytes(&n64, sizeof(n64));
+  }
+
+public:
+  static constexpr bool is_loading = false;
+
+  explicit Writer(std::ostream &os) : os{ os } {}
+
+  template<class T>
+  void operator()(const T &x)
+  {
+    if constexpr (detail::has_serialize<T>::value)
+    {
+      // Serialize is shared with the reader and therefore not const.
+      const_cast<T&>(x).Serialize(*this);
+    }
+    else if constexpr (detail::is_dynamic_eigen<T>())
+    {
+      Size(x.rows());
+      Size(x.cols());
+      Bytes(x.data(), sizeof(typename T::Scalar)*x.size());
+    }
+    else if constexpr (detail::is_vector<T>)
+    {
+      Size(x.size());
+      if constexpr (detail::is_raw<typename T::value_type>())
+        Bytes(x.data(), sizeof(typename T::value_type)*x.size());
+      else
+        for (const auto &item : x)
+          (*this)(item);
+    }
+    else if constexpr (detail::is_std_array<T>::value)
+    {
+      for (const auto &item : x)
+        (*this)(item);
+    }
+    else if constexpr (std::is_same_v<T, std::string>)
+    {
+      Size(x.size());
+      Bytes(x.data(), x.size());
+    }
+    else
+    {
+      static_assert(detail::is_raw<T>(), "Type cannot be written to checkpoints");
+      Bytes(std::addressof(x), sizeof(T));
+    }
+  }
+
+  // Counterpart of Reader::Expect.
+  template<class T>
+  void Expect(const T &x, const char*)
+  {
+    (*this)(x);
+  }
+};
+
+
+class Reader
+{
+  std::istream &is;
+
+  void Bytes(void *p, std::size_t n)
+  {
+    is.read(static_cast<char*>(p), static_cast<std::streamsize>(n));
+    if (!is)
+      throw Error("Checkpoint is truncated or unreadable");
+  }
+
+  std::size_t Size()
+  {
+    std::uint64_t n64;
+    Bytes(&n64, sizeof(n64));
+    return static_cast<std::size_t>(n64);
+  }
+
+public:
+  static constexpr bool is_loading = true;
+
+  explicit Reader(std::istream &is) : is{ is } {}
+
+  template<class T>
+  void operator()(T &x)
+  {
+    if constexpr (detail::has_serialize<T>::value)
+    {
+      x.Serialize(*this);
+    }
+    else if constexpr (detail::is_dynamic_eigen<T>())
+    {
+      const auto rows = Size();
+      const auto cols = Size();
+      if ((T::RowsAtCompileTime != Eigen::Dynamic && rows != (std::size_t)T::RowsAtCompileTime) ||
+          (T::ColsAtCompileTime != Eigen::Dynamic && cols != (std::size_t)T::ColsAtCompileTime))
+        throw Error("Checkpoint does not match the matrix shape");
+      x.resize(rows, cols);
+      Bytes(x.data(), sizeof(typename T::Scalar)*x.size());
+    }
+    else if constexpr (detail::is_vector<T>)
+    {
+      x.resize(Size());
+      if constexpr (detail::is_raw<typename T::value_type>())
+        Bytes(x.data(), sizeof(typename T::value_type)*x.size());
+      else
+        for (auto &item : x)
+          (*this)(item);
+    }
+    else if constexpr (detail::is_std_array<T>::value)
+    {
+      for (auto &item : x)
+        (*this)(item);
+    }
+    else if constexpr (std::is_same_v<T, std::string>)
+    {
+      x.resize(Size());
+      Bytes(x.data(), x.size());
+    }
+    else
+    {
+      static_assert(detail::is_raw<T>(), "Type cannot be read from checkpoints");
+      Bytes(std::addressof(x), sizeof(T));
+    }
+  }
+
+  // Reads a value which was stored for validation and throws if it differs from the expected one.
+  template<class T>
+  void Expect(const T &expected, const char* what)
+  {
+    T x;
+    (*this)(x);
+    if (!(x == expected))
+      throw Error(std::string("Checkpoint does not match: ") + what);
+  }
+};
+
+
+// FNV-1a. Unlike std::hash, it is the same for every build.
+inline std::uint64_t Fingerprint(const std::string &bytes)
+{
+  std::uint64_t h = 14695981039346656037ull;
+  for (const char c : bytes)
+  {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+
+// Copies the state through an in-memory archive. For handing learned data from one
+// render to the next.
+template<class T>
+void CopyState(const T &src, T &dst)
+{
+  std::stringstream buffer;
+  Writer writer{ buffer };
+  writer(src);
+  Reader reader{ buffer };
+  reader(dst);
+}
+
+
+} // namespace checkpoint
@@ -5,6 +5,9 @@
 
 #include <embree3/rtcore.h>
 
+#include <algorithm>
+#include <atomic>
+
 #ifdef _MSC_VER
 #pragma warning(push)
 #pragma warning(disable : 4244)  // Float to double conversion. I don't care. There are too many of them, and it is too much of a mess to try to make it right.
@@ -13,6 +16,45 @@
 using namespace EmbreeAcceleratorDetail;
 
 thread_local ToyVector<BoundaryIntersection> EmbreeAccelerator::intersections_result;
+thread_local ToyVector<RTCRayHit> EmbreeAccelerator::rayhit_stream;
+thread_local ToyVector<RTCRay> EmbreeAccelerator::ray_stream;
+
+namespace
+{
+
+std::atomic<std::uint64_t> num_rays_traced{ 0 };
+
+// Counts locally and publishes in batches in order to keep the shared atomic off the hot path.
+struct RayCounter
+{
+  static constexpr std::uint64_t BATCH_SIZE = 1024;
+  std::uint64_t count = 0;
+
+  void Add(std::uint64_t n)
+  {
+    count += n;
+    if (count >= BATCH_SIZE)
+    {
+      num_rays_traced.fetch_add(count, std::memory_order_relaxed);
+      count = 0;
+    }
+  }
+
+  ~RayCounter()
+  {
+    num_rays_traced.fetch_add(count, std::memory_order_relaxed);
+  }
+};
+
+thread_local RayCounter ray_counter;
+
+}
+
+
+std::uint64_t EmbreeAccelerator::NumRaysTraced()
+{
+  return num_rays_traced.load(std::memory_order_relaxed);
+}
 
 EmbreeAccelerator::EmbreeAccelerator()
 {
@@ -24,12 +66,21 @@ EmbreeAccelerator::EmbreeAccelerator()
 EmbreeAccelerator::~EmbreeAccelerator()
 {
   rtcReleaseScene(rtscene);
+  for (auto [prototype, scene] : prototype_scenes)
+    rtcReleaseScene(scene);
   rtcReleaseDevice(rtdevice);
 }
 
 
 void EmbreeAccelerator::Build(bool enable_intersection_in_order_call)
 {
+  // Instanced scenes must be committed first.
+  for (auto [prototype, scene] : prototype_scenes)
+  {
+    if (enable_intersection_in_order_call)
+      rtcSetSceneFlags(scene, RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION);
+    rtcCommitScene(scene);
+  }
   if (enable_intersection_in_order_call)
     rtcSetSceneFlags(rtscene, RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION);
   rtcCommitScene (rtscene);
@@ -37,9 +88,15 @@ void EmbreeAccelerator::Build(bool enable_intersection_in_order_call)
 
 
 void EmbreeAccelerator::InsertRefTo(Mesh& mesh)
+{
+  InsertRefTo(mesh, rtscene);
+}
+
+
+void EmbreeAccelerator::InsertRefTo(Mesh& mesh, RTCScene target)
 {
   RTCGeometry rtmesh = rtcNewGeometry(rtdevice, RTC_GEOMETRY_TYPE_TRIANGLE);
-  auto id = rtcAttachGeometry(rtscene, rtmesh);
+  auto id = rtcAttachGeometry(target, rtmesh);
   rtcSetGeometryUserData(rtmesh, (void*)&mesh);
   mesh.identifier = id;
   rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 
@@ -48,20 +105,32 @@ void EmbreeAccelerator::InsertRefTo(Mesh& mesh)
   rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
                              mesh.vert_indices.data(), 0,
                              sizeof(decltype(mesh.vert_indices)::Scalar)*3, mesh.vert_indices.rows());
-  rtcSetGeometryVertexAttributeCount(rtmesh,2);
-  rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, RTC_FORMAT_FLOAT3,
-                             mesh.normals.data(), 0,
-                             sizeof(decltype(mesh.normals)::Scalar)*3, mesh.NumVertices());
-  rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, RTC_FORMAT_FLOAT2,
-                             mesh.uvs.data(), 0,
-                             sizeof(decltype(mesh.uvs)::Scalar)*2, mesh.NumVertices());
+  // Embree cannot interpolate the packed attributes. They are decoded in FirstIntersectionTriangle.
+  if (!mesh.compact)
+  {
+    rtcSetGeometryVertexAttributeCount(rtmesh,2);
+    rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, RTC_FORMAT_FLOAT3,
+                               mesh.normals.data(), 0,
+                               sizeof(decltype(mesh.normals)::Scalar)*3, mesh.NumVertices());
+    rtcSetSharedGeometryBuffer(rtmesh, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, RTC_FORMAT_FLOAT2,
+                               mesh.uvs.data(), 0,
+                               sizeof(decltype(mesh.uvs)::Scalar)*2, mesh.NumVertices());
+  }
   rtcCommitGeometry(rtmesh);
   rtcReleaseGeometry(rtmesh);
 }
 
 
-void EmbreeAccelerator::InsertRefTo(Spheres& spheres)
+void EmbreeAccelerator::InsertRefTo(Spheres& spheres, bool force_callbacks)
 {
+#if RTC_VERSION >= 30600
+  // With few spheres the callbacks cost next to nothing. So keep the robust intersection for them.
+  if (!force_sphere_callbacks && !force_callbacks && spheres.NumSpheres() >= NATIVE_SPHERES_MIN_COUNT)
+  {
+    InsertNativeSpheresRefTo(spheres);
+    return;
+  }
+#endif
   RTCGeometry rtgeom = rtcNewGeometry(rtdevice, RTC_GEOMETRY_TYPE_USER);
   unsigned int id = rtcAttachGeometry(rtscene, rtgeom); 
   spheres.identifier = id;
@@ -75,21 +144,68 @@ void EmbreeAccelerator::InsertRefTo(Spheres& spheres)
 }
 
 
+#if RTC_VERSION >= 30600
+// Position and radius are already stored as 4 floats, as Embree wants it. So the buffer is shared.
+// Embree reports the unnormalized normal in Ng. Hence FirstIntersectionSphere works without change.
+void EmbreeAccelerator::InsertNativeSpheresRefTo(Spheres& spheres)
+{
+  static_assert(sizeof(Spheres::Vector4f) == 4*sizeof(float));
+  RTCGeometry rtgeom = rtcNewGeometry(rtdevice, RTC_GEOMETRY_TYPE_SPHERE_POINT);
+  unsigned int id = rtcAttachGeometry(rtscene, rtgeom);
+  spheres.identifier = id;
+  rtcSetGeometryUserData(rtgeom, (void*)&spheres);
+  rtcSetSharedGeometryBuffer(rtgeom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4,
+                             spheres.spheres.data(), 0,
+                             sizeof(Spheres::Vector4f), spheres.NumSpheres());
+  rtcCommitGeometry(rtgeom);
+  rtcReleaseGeometry(rtgeom);
+}
+#endif
+
+
+RTCScene EmbreeAccelerator::GetPrototypeScene(const Mesh &prototype)
+{
+  auto it = prototype_scenes.find(&prototype);
+  if (it != prototype_scenes.end())
+    return it->second;
+  RTCScene scene = rtcNewScene(rtdevice);
+  // Embree only reads the buffers. The const_cast is due to the signature of InsertRefTo.
+  InsertRefTo(const_cast<Mesh&>(prototype), scene);
+  prototype_scenes.emplace(&prototype, scene);
+  return scene;
+}
+
+
+void EmbreeAccelerator::InsertRefTo(Instance& instance)
+{
+  RTCGeometry rtgeom = rtcNewGeometry(rtdevice, RTC_GEOMETRY_TYPE_INSTANCE);
+  rtcSetGeometryInstancedScene(rtgeom, GetPrototypeScene(*instance.prototype));
+  rtcSetGeometryTimeStepCount(rtgeom, 1);
+  rtcSetGeometryTransform(rtgeom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, instance.transform.matrix().data());
+  unsigned int id = rtcAttachGeometry(rtscene, rtgeom);
+  instance.identifier = id;
+  rtcSetGeometryUserData(rtgeom, (void*)&instance);
+  rtcCommitGeometry(rtgeom);
+  rtcReleaseGeometry(rtgeom);
+}
+
+
 void EmbreeAccelerator::InsertRefTo(Geometry & geo)
 {
   if (geo.type == Geometry::PRIMITIVES_SPHERES)
     InsertRefTo(static_cast<Spheres&>(geo));
   else if (geo.type == Geometry::PRIMITIVES_TRIANGLES)
     InsertRefTo(static_cast<Mesh&>(geo));
+  else if (geo.type == Geometry::PRIMITIVES_INSTANCE)
+    InsertRefTo(static_cast<Instance&>(geo));
 }
 
 
-bool EmbreeAccelerator::FirstIntersection(const Ray &ray, double tnear, double &ray_length, SurfaceInteraction &intersection) const
+namespace
+{
+
+inline void InitRay(RTCRay &rtray, const Ray &ray, double tnear, double tfar)
 {
-  RTCIntersectContext context;
-  rtcInitIntersectContext(&context);
-  RTCRayHit rtrayhit;
-  RTCRay &rtray = rtrayhit.ray;
   rtray.org_x = ray.org[0];
   rtray.org_y = ray.org[1];
   rtray.org_z = ray.org[2];
@@ -98,36 +214,171 @@ bool EmbreeAccelerator::FirstIntersection(const Ray &ray, double tnear, double &
   rtray.dir_y = ray.dir[1];
   rtray.dir_z = ray.dir[2];
   rtray.time = 0.;
-  rtray.tfar = static_cast<float>(ray_length);
+  rtray.tfar = static_cast<float>(tfar);
   rtray.mask = -1;
   rtray.id = 0;
   rtray.flags = 0;
-  RTCHit &rthit = rtrayhit.hit;
+}
+
+inline void InitHit(RTCHit &rthit)
+{
   rthit.geomID = RTC_INVALID_GEOMETRY_ID;
   rthit.primID = RTC_INVALID_GEOMETRY_ID;
   rthit.instID[0] = RTC_INVALID_GEOMETRY_ID; 
-  // ----
-  // Here we do the work!!
+}
+
+}
+
+
+bool EmbreeAccelerator::FirstIntersection(const Ray &ray, double tnear, double &ray_length, SurfaceInteraction &intersection) const
+{
+  HitRecord hit;
+  if (!FirstHit(ray, tnear, ray_length, hit))
+    return false;
+  Resolve(hit, ray, intersection);
+  return true;
+}
+
+
+bool EmbreeAccelerator::FirstHit(const Ray &ray, double tnear, double &ray_length, HitRecord &hit) const
+{
+  RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  RTCRayHit rtrayhit;
+  InitRay(rtrayhit.ray, ray, tnear, ray_length);
+  InitHit(rtrayhit.hit);
   rtcIntersect1(rtscene, &context, &rtrayhit);
-  // ----
-  if (rthit.geomID == RTC_INVALID_GEOMETRY_ID)
+  ray_counter.Add(1);
+  if (rtrayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
     return false;
-  assert(rtray.tfar > rtray.tnear);
-  ray_length = rtray.tfar;
-  const Geometry* prim = (const Geometry*)rtcGetGeometryUserData(rtcGetGeometry(rtscene, rthit.geomID));
-  intersection.hitid.geom = prim;
-  intersection.hitid.index    = rthit.primID;
-  if (prim->type == Geometry::PRIMITIVES_TRIANGLES)
-    FirstIntersectionTriangle(rthit, ray, intersection);
+  assert(rtrayhit.ray.tfar > rtrayhit.ray.tnear);
+  ray_length = rtrayhit.ray.tfar;
+  hit = MakeHitRecord(rtrayhit.hit);
+  return true;
+}
+
+
+void EmbreeAccelerator::FirstHits(Span<const Ray> rays, double tnear, Span<double> ray_lengths, Span<std::optional<HitRecord>> hits) const
+{
+  assert(rays.size() == ray_lengths.size() && rays.size() == hits.size());
+  const auto n = rays.size();
+  auto &stream = rayhit_stream;
+  stream.resize(n);
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+  {
+    InitRay(stream[i].ray, rays[i], tnear, ray_lengths[i]);
+    InitHit(stream[i].hit);
+  }
+
+  RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+  rtcIntersect1M(rtscene, &context, stream.data(), static_cast<unsigned int>(n), sizeof(RTCRayHit));
+  ray_counter.Add(n);
+
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+  {
+    const RTCRayHit &rtrayhit = stream[i];
+    if (rtrayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+    {
+      hits[i].reset();
+      continue;
+    }
+    assert(rtrayhit.ray.tfar > rtrayhit.ray.tnear);
+    ray_lengths[i] = rtrayhit.ray.tfar;
+    hits[i] = MakeHitRecord(rtrayhit.hit);
+  }
+}
+
+
+HitRecord EmbreeAccelerator::MakeHitRecord(const RTCHit &rthit) const
+{
+  const unsigned int top_level_id = rthit.instID[0] != RTC_INVALID_GEOMETRY_ID ? rthit.instID[0] : rthit.geomID;
+  return HitRecord{
+    (const Geometry*)rtcGetGeometryUserData(rtcGetGeometry(rtscene, top_level_id)),
+    static_cast<scene_index_t>(rthit.primID),
+    rthit.geomID,
+    rthit.u, rthit.v,
+    { rthit.Ng_x, rthit.Ng_y, rthit.Ng_z }
+  };
+}
+
+
+void EmbreeAccelerator::Resolve(const HitRecord &hit, const Ray &ray, SurfaceInteraction &intersection) const
+{
+  // Embree's u, v and normal are all that is needed apart from the identifiers. Those come from
+  // InsertRefTo, or the hit for the geometry within the prototype's scene.
+  RTCHit rthit;
+  InitHit(rthit);
+  rthit.geomID = hit.geom_id;
+  rthit.primID = static_cast<unsigned int>(hit.prim);
+  rthit.u = hit.u;
+  rthit.v = hit.v;
+  rthit.Ng_x = hit.ng[0];
+  rthit.Ng_y = hit.ng[1];
+  rthit.Ng_z = hit.ng[2];
+  if (hit.geom->type == Geometry::PRIMITIVES_INSTANCE)
+  {
+    // Embree reports the hit in the object space of the prototype.
+    const auto* instance = static_cast<const Instance*>(hit.geom);
+    intersection.hitid.geom = instance->prototype;
+    intersection.hitid.index = rthit.primID;
+    FirstIntersectionTriangle(rthit, prototype_scenes.at(instance->prototype), intersection);
+    intersection.hitid.geom = instance;
+    instance->ToWorld(intersection);
+  }
   else
   {
-    assert (prim->type == Geometry::PRIMITIVES_SPHERES);
-    FirstIntersectionSphere(rthit, ray, intersection);
+    intersection.hitid.geom = hit.geom;
+    intersection.hitid.index = rthit.primID;
+    if (hit.geom->type == Geometry::PRIMITIVES_TRIANGLES)
+      FirstIntersectionTriangle(rthit, rtscene, intersection);
+    else
+    {
+      assert (hit.geom->type == Geometry::PRIMITIVES_SPHERES);
+      FirstIntersectionSphere(rthit, ray, intersection);
+    }
   }
   ASSERT_NORMALIZED(intersection.geometry_normal);
   ASSERT_NORMALIZED(intersection.smooth_normal);
   intersection.SetOrientedNormals(ray.dir);
-  return true;
+}
+
+
+// Hits on instances report the prototype's geometry and an object space normal.
+// This maps them to the instance in the top level scene.
+static BoundaryIntersection MakeBoundaryIntersection(RTCScene scene, const RTCFilterFunctionNArguments* args)
+{
+  const auto* hit = (const RTCHit*)args->hit;
+  const auto* ray = (const RTCRay*)args->ray;
+  const Float3 ng{ hit->Ng_x, hit->Ng_y, hit->Ng_z };
+  if (hit->instID[0] != RTC_INVALID_GEOMETRY_ID)
+  {
+    const auto* instance = static_cast<const Instance*>(rtcGetGeometryUserData(rtcGetGeometry(scene, hit->instID[0])));
+    return BoundaryIntersection{
+      instance->index_in_scene,
+      static_cast<scene_index_t>(hit->primID),
+      ray->tfar,
+      instance->NormalToWorld(ng)
+    };
+  }
+  const auto* geo = static_cast<const Geometry*>(args->geometryUserPtr);
+  return BoundaryIntersection{
+    geo->index_in_scene,
+    static_cast<scene_index_t>(hit->primID),
+    ray->tfar,
+    ng
+  };
+}
+
+
+// Should I compare the primitive, too, or is this enough.
+// If I compare the primitive naively it won't work near edges with adjacent triangles.
+// There the intersector registers both triangles.
+static bool SameCrossing(const BoundaryIntersection &a, const BoundaryIntersection &b)
+{
+  return (a.geom == b.geom) & (a.t == b.t);
+  //return (a.t == b.t) & (a.prim == b.prim) & (a.geom == b.geom); }
 }
 
 
@@ -135,40 +386,26 @@ struct RTCIntersectContextWithMyCallback : public RTCIntersectContext
 {
   mutable ToyVector<BoundaryIntersection> hitRecords;
   float tfarMax;
+  RTCScene scene;
 
   // TODO: filter duplicate intersections!
   static void MyFilterFunction(const struct RTCFilterFunctionNArguments* args)
   {
     assert(args->N == 1);
     assert(args->geometryUserPtr);
-    const auto* hit = (const RTCHit*)args->hit;
     const auto* ray = (const RTCRay*)args->ray;
     const auto* context = static_cast<const RTCIntersectContextWithMyCallback*>(args->context);
-    const auto previousHits = AsSpan(context->hitRecords);
 
     /* ignore inactive rays */
     if (args->valid[0] != -1 || ray->tfar > context->tfarMax) return;
 
     args->valid[0] = 0;
 
-    const auto* geo = static_cast<const Geometry*>(args->geometryUserPtr);
-
-    const auto current = BoundaryIntersection{
-      geo->index_in_scene,
-      static_cast<scene_index_t>(hit->primID),
-      ray->tfar,
-      { hit->Ng_x, hit->Ng_y, hit->Ng_z }
-    };
+    const auto current = MakeBoundaryIntersection(context->scene, args);
 
     auto [it, found] = FindPlaceIfUnique(context->hitRecords.begin(), context->hitRecords.end(), current, 
       /*less = */ [](const auto &a, const auto &b) { return a.t < b.t;  },
-      /*eq   = */ [](const auto &a, const auto &b) {
-      // Should I compare the primitive, too, or is this enough.
-      // If I compare the primitive naively it won't work near edges with adjacent triangles.
-      // There the intersector registers both triangles.
-      return (a.geom == b.geom) & (a.t == b.t);
-      //return (a.t == b.t) & (a.prim == b.prim) & (a.geom == b.geom); }
-    }
+      /*eq   = */ SameCrossing
     );
 
     if (!found)
@@ -187,23 +424,14 @@ Span<BoundaryIntersection> EmbreeAccelerator::IntersectionsInOrder(const Ray &ra
   context.hitRecords.clear();
   context.filter = RTCIntersectContextWithMyCallback::MyFilterFunction;
   context.tfarMax = tfar;
+  context.scene = rtscene;
 
   RTCRay rtray; // = rtrayhit.ray;
-  rtray.org_x = ray.org[0];
-  rtray.org_y = ray.org[1];
-  rtray.org_z = ray.org[2];
-  rtray.tnear = static_cast<float>(tnear);
-  rtray.dir_x = ray.dir[0];
-  rtray.dir_y = ray.dir[1];
-  rtray.dir_z = ray.dir[2];
-  rtray.time = 0.;
-  rtray.tfar = static_cast<float>(tfar);
-  rtray.mask = -1;
-  rtray.id = 0;
-  rtray.flags = 0;
+  InitRay(rtray, ray, tnear, tfar);
   // ----
   // Here we do the work!!
   rtcOccluded1(rtscene, &context, &rtray);
+  ray_counter.Add(1);
 
   // TODO: Since the memory returned comes from internal storage, I can
   // never hold on to it and call the IntersectionsInOrder function again.
@@ -213,19 +441,150 @@ Span<BoundaryIntersection> EmbreeAccelerator::IntersectionsInOrder(const Ray &ra
 }
 
 
-void EmbreeAccelerator::FirstIntersectionTriangle(const RTCHit &rthit, const Ray &ray, SurfaceInteraction &intersection) const
+struct RTCIntersectContextWithHitBuffer : public RTCIntersectContext
+{
+  BoundaryIntersection *hits;
+  int capacity;
+  mutable int count;
+  float tfarMax;
+  float tExclude;
+  Span<const BoundaryIntersection> exclude;
+  RTCScene scene;
+
+  // Like RTCIntersectContextWithMyCallback but keeps only the nearest hits that fit into the buffer.
+  // Meant for rtcIntersect1. Hits are rejected, except when the buffer is full and the hit went to
+  // its end. Accepting it then lets Embree cull everything farther than the hits in the buffer.
+  static void MyFilterFunction(const struct RTCFilterFunctionNArguments* args)
+  {
+    assert(args->N == 1);
+    assert(args->geometryUserPtr);
+    const auto* ray = (const RTCRay*)args->ray;
+    const auto* context = static_cast<const RTCIntersectContextWithHitBuffer*>(args->context);
+
+    /* ignore inactive rays */
+    if (args->valid[0] != -1 || ray->tfar > context->tfarMax) return;
+
+    args->valid[0] = 0;
+
+    const auto current = MakeBoundaryIntersection(context->scene, args);
+
+    // Already reported by the previous query? By the same rule by which duplicates are merged,
+    // so that the twin of a returned hit on an adjacent triangle is not reported either.
+    if (current.t == context->tExclude &&
+        std::any_of(context->exclude.begin(), context->exclude.end(), [&current](const BoundaryIntersection &other) {
+          return SameCrossing(other, current);
+        }))
+      return;
+
+    BoundaryIntersection* const end = context->hits + context->count;
+    auto [it, found] = FindPlaceIfUnique(context->hits, end, current,
+      /*less = */ [](const auto &a, const auto &b) { return a.t < b.t;  },
+      /*eq   = */ SameCrossing
+    );
+
+    if (found)
+      return;
+
+    if (context->count < context->capacity)
+    {
+      std::copy_backward(it, end, end + 1);
+      ++context->count;
+    }
+    else
+    {
+      // The farthest one falls out.
+      if (it == end)
+        return;
+      std::copy_backward(it, end - 1, end);
+    }
+    *it = current;
+
+    // Now tfar can shrink to the farthest hit in the buffer. Which happens only if it is this one.
+    if (context->count == context->capacity && it == context->hits + context->capacity - 1)
+      args->valid[0] = -1;
+  }
+};
+
+
+int EmbreeAccelerator::NearestIntersectionsInOrder(const Ray &ray, double tnear, double tfar, Span<const BoundaryIntersection> exclude_at_tnear, Span<BoundaryIntersection> hits) const
+{
+  RTCIntersectContextWithHitBuffer context;
+  rtcInitIntersectContext(&context);
+  context.hits = hits.begin();
+  context.capacity = isize(hits);
+  context.count = 0;
+  context.filter = RTCIntersectContextWithHitBuffer::MyFilterFunction;
+  context.tfarMax = tfar;
+  context.tExclude = tnear;
+  context.exclude = exclude_at_tnear;
+  context.scene = rtscene;
+
+  // Not rtcOccluded1, because there accepting a hit would end the traversal.
+  RTCRayHit rtrayhit;
+  InitRay(rtrayhit.ray, ray, tnear, tfar);
+  InitHit(rtrayhit.hit);
+  rtcIntersect1(rtscene, &context, &rtrayhit);
+  ray_counter.Add(1);
+
+  return context.count;
+}
+
+
+BoundaryIntersectionIterator::BoundaryIntersectionIterator(const EmbreeAccelerator &accelerator, const Ray &ray, double tnear, double tfar)
+  : accelerator{ &accelerator }, ray{ ray }, tfar{ tfar }
+{
+  Fetch(tnear, {});
+}
+
+
+void BoundaryIntersectionIterator::operator++()
 {
-  auto geom = rtcGetGeometry(rtscene, rthit.geomID);
+  assert(current < num_buffered);
+  ++current;
+  if (current < num_buffered || num_buffered < BUFFER_SIZE)
+    return;
+  // Continue behind the last hit. Hits at the same distance which were already returned must be excluded.
+  std::array<BoundaryIntersection, BUFFER_SIZE> exclude;
+  const float t_last = buffer[num_buffered-1].t;
+  int num_exclude = 0;
+  for (int i = num_buffered-1; i >= 0 && buffer[i].t == t_last; --i)
+    exclude[num_exclude++] = buffer[i];
+  Fetch(t_last, Span<const BoundaryIntersection>(exclude.data(), num_exclude));
+}
+
+
+void BoundaryIntersectionIterator::Fetch(double tnear, Span<const BoundaryIntersection> exclude_at_tnear)
+{
+  num_buffered = accelerator->NearestIntersectionsInOrder(ray, tnear, tfar, exclude_at_tnear, AsSpan(buffer));
+  current = 0;
+  ++num_queries;
+}
+
+
+void EmbreeAccelerator::FirstIntersectionTriangle(const RTCHit &rthit, RTCScene geom_scene, SurfaceInteraction &intersection) const
+{
+  auto geom = rtcGetGeometry(geom_scene, rthit.geomID);
+  const auto &mesh = static_cast<const Mesh&>(*intersection.hitid.geom);
   Float3 pos, n_sh;
   rtcInterpolate1(
     geom,
     rthit.primID, rthit.u, rthit.v, RTC_BUFFER_TYPE_VERTEX, 0, pos.data(), nullptr, nullptr, 3);
-  rtcInterpolate1(
-    geom,
-    rthit.primID, rthit.u, rthit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, n_sh.data(), nullptr, nullptr, 3);
-  rtcInterpolate1(
-    geom,
-    rthit.primID, rthit.u, rthit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, intersection.tex_coord.data(), nullptr, nullptr, 2);
+  if (mesh.compact)
+  {
+    // Embree's u and v are the weights of the second and third vertex.
+    const Float3 weights{ 1.f - rthit.u - rthit.v, rthit.u, rthit.v };
+    n_sh = mesh.InterpolatedNormal(rthit.primID, weights);
+    intersection.tex_coord = mesh.InterpolatedUv(rthit.primID, weights);
+  }
+  else
+  {
+    rtcInterpolate1(
+      geom,
+      rthit.primID, rthit.u, rthit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, n_sh.data(), nullptr, nullptr, 3);
+    rtcInterpolate1(
+      geom,
+      rthit.primID, rthit.u, rthit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, intersection.tex_coord.data(), nullptr, nullptr, 2);
+  }
   HitId &hit = intersection.hitid;
   hit.barry[0] = rthit.u;
   hit.barry[1] = rthit.v;
@@ -238,7 +597,6 @@ void EmbreeAccelerator::FirstIntersectionTriangle(const RTCHit &rthit, const Ray
   intersection.geometry_normal[2] = rthit.Ng_z;
   Normalize(intersection.geometry_normal);
   
-  const auto &mesh = static_cast<const Mesh&>(*hit.geom);
   const auto tri = mesh.vert_indices.row(hit.index);
   FillPosBoundsTriangle(intersection, mesh.vertices.row(tri[0]), mesh.vertices.row(tri[1]), mesh.vertices.row(tri[2]));
 }
@@ -257,6 +615,10 @@ void EmbreeAccelerator::FirstIntersectionSphere(const RTCHit &rthit, const Ray &
   intersection.smooth_normal = intersection.geometry_normal;
   intersection.tex_coord = Projections::SphericalToUv(Projections::KartesianToSpherical(delta));
   FillPosBoundsSphere(intersection);
+  // Embree's native spheres do not reject hits near the ray start like SphereIntersectFunc. Its error
+  // in telling inside from outside grows with the radius. The anti self intersection offset must cover it.
+  intersection.pos_bounds = intersection.pos_bounds.cwiseMax(
+    (pos.cwiseAbs() + Float3::Constant(radius))*util::Gamma<float>(5));
 }
 
 
@@ -286,41 +648,42 @@ bool EmbreeAccelerator::IsOccluded(const Ray & ray, double tnear, double tfar) c
   RTCIntersectContext context;
   rtcInitIntersectContext(&context);
   RTCRay rtray;
-  rtray.org_x = ray.org[0];
-  rtray.org_y = ray.org[1];
-  rtray.org_z = ray.org[2];
-  rtray.tnear = (float)tnear;
-  rtray.dir_x = ray.dir[0];
-  rtray.dir_y = ray.dir[1];
-  rtray.dir_z = ray.dir[2];
-  rtray.time = 0.;
-  rtray.tfar = static_cast<float>(tfar);
-  rtray.mask = -1;
-  rtray.id = 0;
-  rtray.flags = 0;
+  InitRay(rtray, ray, tnear, tfar);
 
   rtcOccluded1(rtscene, &context, &rtray);
+  ray_counter.Add(1);
   return rtray.tfar <= 0.;
 }
 
 
-void EmbreeAccelerator::SphereIntersectFunc(const RTCIntersectFunctionNArguments* args)
+void EmbreeAccelerator::AreOccluded(Span<const Ray> rays, double tnear, Span<const double> tfars, Span<std::uint8_t> occluded) const
 {
-  int* valid = args->valid;
-  assert(args->N == 1);
-  if (!valid[0]) return;
-  
-  auto* rtrayn = RTCRayHitN_RayN(args->rayhit, args->N);
-  auto* rthitn = RTCRayHitN_HitN(args->rayhit, args->N);
-  RTCRay rtray = rtcGetRayFromRayN(rtrayn, args->N, 0);
+  assert(rays.size() == tfars.size() && rays.size() == occluded.size());
+  const auto n = rays.size();
+  auto &stream = ray_stream; // Reused between calls. Avoids allocations.
+  stream.resize(n);
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+    InitRay(stream[i], rays[i], tnear, tfars[i]);
 
-  unsigned int primID = args->primID;
-  const Spheres* spheres = (const Spheres*) args->geometryUserPtr;
-  auto &sphere = spheres->spheres[primID];
-  
+  RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+  rtcOccluded1M(rtscene, &context, stream.data(), static_cast<unsigned int>(n), sizeof(RTCRay));
+  ray_counter.Add(n);
+
+  for (std::ptrdiff_t i = 0; i < n; ++i)
+    occluded[i] = stream[i].tfar <= 0.f;
+}
+
+
+namespace
+{
+
+// Returns false if the sphere is missed.
+inline bool IntersectSphere(const RTCRay &rtray, const Float3 &sphere_p, float sphere_r, float &t0, float &t1, float &err0, float &err1)
+{
   Eigen::Map<const Eigen::Vector3f> ray_dir{&rtray.dir_x};
   Eigen::Map<const Eigen::Vector3f> ray_org{&rtray.org_x};
-  Float3 sphere_p; float sphere_r; std::tie(sphere_p, sphere_r) = spheres->Get(args->primID);  
   Float3 v = ray_org - sphere_p;
   ASSERT_NORMALIZED(ray_dir);
   const float A = 1.f; //Dot(ray_dir,ray_dir);
@@ -328,182 +691,153 @@ void EmbreeAccelerator::SphereIntersectFunc(const RTCIntersectFunctionNArguments
   const float C = Dot(v,v) - Sqr(sphere_r);
   const float Berr = DotAbs(v, ray_dir)*util::Gamma<float>(3);
   const float Cerr = (2.f*Dot(v,v) + Sqr(sphere_r))*util::Gamma<float>(3);
-  float t0, t1, err0, err1;
-  const bool has_solution = util::Quadratic(A, B, C, 0.f, Berr, Cerr, t0, t1, err0, err1);
-//   float t0, t1;
+  return util::Quadratic(A, B, C, 0.f, Berr, Cerr, t0, t1, err0, err1);
 //   float err0 = 0.f, err1 = 0.f;
-//   const bool has_solution = Quadratic(A, B, C, t0, t1);
-  if (!has_solution)
-    return;
-  RTCHit potentialHit;
-  potentialHit.u = 0.0f;
-  potentialHit.v = 0.0f;
-  potentialHit.instID[0] = args->context->instID[0];
-  potentialHit.geomID = spheres->identifier;
-  potentialHit.primID = primID;
-
-  // First check the smaller one of the t-values. 
-  // See if it is within the [tnear,tfar] interval.
-  // If it is then this is our first hit.
-  if ((rtray.tnear < t0-err0) & (t0+err0 < rtray.tfar))
-  {
-    int imask;
-    bool mask = 1;
-    {
-      imask = mask ? -1 : 0;
-    }
-    
-    const Float3 Ng = ray_org+t0*ray_dir-sphere_p;
-    potentialHit.Ng_x = Ng[0];
-    potentialHit.Ng_y = Ng[1];
-    potentialHit.Ng_z = Ng[2];
-
-    RTCFilterFunctionNArguments fargs;
-    fargs.valid = (int*)&imask;
-    fargs.geometryUserPtr = args->geometryUserPtr;
-    fargs.context = args->context;
-    fargs.ray = (RTCRayN *)args->rayhit;
-    fargs.hit = (RTCHitN*)&potentialHit;
-    fargs.N = 1;
-
-    const float old_t = rtray.tfar;
-    RTCRayN_tfar(rtrayn, args->N, 0) = t0;
-    rtray.tfar = t0;
-    rtcFilterIntersection(args,&fargs);
-
-    // Did the filter function accept the hit?
-    if (imask == -1)
-    {
-      rtcCopyHitToHitN(rthitn, &potentialHit, args->N, 0);
-    }
-    else
-    {
-      rtray.tfar = old_t;
-      RTCRayN_tfar(rtrayn, args->N, 0) = old_t;
-    }
-  }
+//   return Quadratic(A, B, C, t0, t1);
+}
+
+}
+
+
+// Embree calls this with N > 1 when it traces packets, as happens in FirstHits.
+// The filter functions are then given a single-ray copy of the current lane.
+void EmbreeAccelerator::SphereIntersectFunc(const RTCIntersectFunctionNArguments* args)
+{
+  const unsigned int N = args->N;
+  auto* rtrayn = RTCRayHitN_RayN(args->rayhit, N);
+  auto* rthitn = RTCRayHitN_HitN(args->rayhit, N);
+
+  unsigned int primID = args->primID;
+  const Spheres* spheres = (const Spheres*) args->geometryUserPtr;
+  Float3 sphere_p; float sphere_r; std::tie(sphere_p, sphere_r) = spheres->Get(primID);
 
-  // Check the t-value which is further away.
-  // This can still be a hit, e.g. if the first hit was behind the ray origin.
-  if ((rtray.tnear < t1-err1) & (t1+err1 < rtray.tfar))
+  for (unsigned int lane = 0; lane < N; ++lane)
   {
-    int imask;
-    bool mask = 1;
+    if (!args->valid[lane]) continue;
+
+    RTCRay rtray = rtcGetRayFromRayN(rtrayn, N, lane);
+    float t0, t1, err0, err1;
+    if (!IntersectSphere(rtray, sphere_p, sphere_r, t0, t1, err0, err1))
+      continue;
+
+    RTCHit potentialHit;
+    potentialHit.u = 0.0f;
+    potentialHit.v = 0.0f;
+    potentialHit.instID[0] = args->context->instID[0];
+    potentialHit.geomID = spheres->identifier;
+    potentialHit.primID = primID;
+
+    auto checkPotentialHit = [&](float t)
     {
-      imask = mask ? -1 : 0;
-    }
-    
-    const Float3 Ng = ray_org+t1*ray_dir-sphere_p;
-    potentialHit.Ng_x = Ng[0];
-    potentialHit.Ng_y = Ng[1];
-    potentialHit.Ng_z = Ng[2];
-
-    RTCFilterFunctionNArguments fargs;
-    fargs.valid = (int*)&imask;
-    fargs.geometryUserPtr = args->geometryUserPtr;
-    fargs.context = args->context;
-    fargs.ray = (RTCRayN *)args->rayhit;
-    fargs.hit = (RTCHitN*)&potentialHit;
-    fargs.N = 1;
-
-    const float old_t = rtray.tfar;
-    RTCRayN_tfar(rtrayn, args->N, 0) = t1;
-    rtray.tfar = t1;
-    rtcFilterIntersection(args,&fargs);
-
-    if (imask == -1)
+      potentialHit.Ng_x = rtray.org_x + t * rtray.dir_x - sphere_p[0];
+      potentialHit.Ng_y = rtray.org_y + t * rtray.dir_y - sphere_p[1];
+      potentialHit.Ng_z = rtray.org_z + t * rtray.dir_z - sphere_p[2];
+
+      RTCRayHit filter_rayhit;
+      filter_rayhit.ray = rtray;
+      filter_rayhit.ray.tfar = t;
+      filter_rayhit.hit = potentialHit;
+
+      int imask = -1;
+      RTCFilterFunctionNArguments fargs;
+      fargs.valid = &imask;
+      fargs.geometryUserPtr = args->geometryUserPtr;
+      fargs.context = args->context;
+      fargs.ray = (RTCRayN *)&filter_rayhit.ray;
+      fargs.hit = (RTCHitN*)&filter_rayhit.hit;
+      fargs.N = 1;
+      rtcFilterIntersection(args,&fargs);
+
+      // Did the filter function accept the hit?
+      if (imask == -1)
+      {
+        rtray.tfar = t;
+        RTCRayN_tfar(rtrayn, N, lane) = t;
+        rtcCopyHitToHitN(rthitn, &potentialHit, N, lane);
+      }
+    };
+
+    // First check the smaller one of the t-values. 
+    // See if it is within the [tnear,tfar] interval.
+    // If it is then this is our first hit.
+    if ((rtray.tnear < t0-err0) & (t0+err0 < rtray.tfar))
     {
-      rtcCopyHitToHitN(rthitn, &potentialHit, args->N, 0);
+      checkPotentialHit(t0);
     }
-    else
+
+    // Check the t-value which is further away.
+    // This can still be a hit, e.g. if the first hit was behind the ray origin.
+    if ((rtray.tnear < t1-err1) & (t1+err1 < rtray.tfar))
     {
-      rtray.tfar = old_t;
-      RTCRayN_tfar(rtrayn, args->N, 0) = old_t;
+      checkPotentialHit(t1);
     }
-  }
   
-  assert(rtray.tfar > rtray.tnear);
+    assert(rtray.tfar > rtray.tnear);
+  }
 }
 
 
 void EmbreeAccelerator::SphereOccludedFunc(const RTCOccludedFunctionNArguments *args)
 {
-  int* valid = args->valid;
-  assert(args->N == 1);
-  if (!valid[0]) return;
-
-  RTCRay rtray = rtcGetRayFromRayN(args->ray, args->N, 0);
+  const unsigned int N = args->N;
 
   unsigned int primID = args->primID;
   const Spheres* spheres = (const Spheres*)args->geometryUserPtr;
-  auto &sphere = spheres->spheres[primID];
+  Float3 sphere_p; float sphere_r; std::tie(sphere_p, sphere_r) = spheres->Get(primID);
 
-  Eigen::Map<const Eigen::Vector3f> ray_dir{ &rtray.dir_x };
-  Eigen::Map<const Eigen::Vector3f> ray_org{ &rtray.org_x };
-  Float3 sphere_p; float sphere_r; std::tie(sphere_p, sphere_r) = spheres->Get(args->primID);
-  Float3 v = ray_org - sphere_p;
-  ASSERT_NORMALIZED(ray_dir);
-  const float A = 1.f; //Dot(ray_dir,ray_dir);
-  const float B = 2.0f*Dot(v, ray_dir);
-  const float C = Dot(v, v) - Sqr(sphere_r);
-  const float Berr = DotAbs(v, ray_dir)*util::Gamma<float>(3);
-  const float Cerr = (2.f*Dot(v, v) + Sqr(sphere_r))*util::Gamma<float>(3);
-  float t0, t1, err0, err1;
-  const bool has_solution = util::Quadratic(A, B, C, 0.f, Berr, Cerr, t0, t1, err0, err1);
-  //   float t0, t1;
-  //   float err0 = 0.f, err1 = 0.f;
-  //   const bool has_solution = Quadratic(A, B, C, t0, t1);
-  if (!has_solution)
-    return;
-  RTCHit potentialHit;
-  potentialHit.u = 0.0f;
-  potentialHit.v = 0.0f;
-  potentialHit.instID[0] = args->context->instID[0];
-  potentialHit.geomID = spheres->identifier;
-  potentialHit.primID = primID;
-
-  auto checkPotentialHit = [&potentialHit, &rtray, &sphere_p, args](float t)
+  for (unsigned int lane = 0; lane < N; ++lane)
   {
-    int imask = -1;
-
-    potentialHit.Ng_x = rtray.org_x + t * rtray.dir_x - sphere_p[0];
-    potentialHit.Ng_y = rtray.org_y + t * rtray.dir_y - sphere_p[1];
-    potentialHit.Ng_z = rtray.org_z + t * rtray.dir_z - sphere_p[2];
-
-    RTCFilterFunctionNArguments fargs;
-    fargs.valid = (int*)&imask;
-    fargs.geometryUserPtr = args->geometryUserPtr;
-    fargs.context = args->context;
-    fargs.ray = args->ray;
-    fargs.hit = (RTCHitN*)&potentialHit;
-    fargs.N = 1;
-
-    const float old_t = rtray.tfar;
-    RTCRayN_tfar(args->ray, args->N, 0) = t;
-    rtray.tfar = t;
-    rtcFilterOcclusion(args, &fargs);
-
-    // Did the filter function accept the hit?
-    if (imask == -1)
+    if (!args->valid[lane]) continue;
+
+    RTCRay rtray = rtcGetRayFromRayN(args->ray, N, lane);
+    float t0, t1, err0, err1;
+    if (!IntersectSphere(rtray, sphere_p, sphere_r, t0, t1, err0, err1))
+      continue;
+
+    RTCHit potentialHit;
+    potentialHit.u = 0.0f;
+    potentialHit.v = 0.0f;
+    potentialHit.instID[0] = args->context->instID[0];
+    potentialHit.geomID = spheres->identifier;
+    potentialHit.primID = primID;
+
+    auto checkPotentialHit = [&](float t)
     {
-      rtray.tfar = -std::numeric_limits<float>::infinity();
-      RTCRayN_tfar(args->ray, args->N, 0) = -std::numeric_limits<float>::infinity();
-    }
-    else
+      potentialHit.Ng_x = rtray.org_x + t * rtray.dir_x - sphere_p[0];
+      potentialHit.Ng_y = rtray.org_y + t * rtray.dir_y - sphere_p[1];
+      potentialHit.Ng_z = rtray.org_z + t * rtray.dir_z - sphere_p[2];
+
+      RTCRay filter_ray = rtray;
+      filter_ray.tfar = t;
+      RTCHit filter_hit = potentialHit;
+
+      int imask = -1;
+      RTCFilterFunctionNArguments fargs;
+      fargs.valid = &imask;
+      fargs.geometryUserPtr = args->geometryUserPtr;
+      fargs.context = args->context;
+      fargs.ray = (RTCRayN*)&filter_ray;
+      fargs.hit = (RTCHitN*)&filter_hit;
+      fargs.N = 1;
+      rtcFilterOcclusion(args, &fargs);
+
+      // Did the filter function accept the hit?
+      if (imask == -1)
+      {
+        rtray.tfar = -std::numeric_limits<float>::infinity();
+        RTCRayN_tfar(args->ray, N, lane) = -std::numeric_limits<float>::infinity();
+      }
+    };
+
+    if ((rtray.tnear < t0 - err0) & (t0 + err0 < rtray.tfar))
     {
-      rtray.tfar = old_t;
-      RTCRayN_tfar(args->ray, args->N, 0) = old_t;
+      checkPotentialHit(t0);
     }
-  };
-
-  if ((rtray.tnear < t0 - err0) & (t0 + err0 < rtray.tfar))
-  {
-    checkPotentialHit(t0);
-  }
 
-  if ((rtray.tnear < t1 - err1) & (t1 + err1 < rtray.tfar))
-  {
-    checkPotentialHit(t1);
+    if ((rtray.tnear < t1 - err1) & (t1 + err1 < rtray.tfar))
+    {
+      checkPotentialHit(t1);
+    }
   }
 }
 
@@ -2,20 +2,27 @@
 
 
 #include <optional>
+#include <cstdint>
+#include <array>
+#include <iterator>
+#include <unordered_map>
 
 #include "util.hxx"
 #include "span.hxx"
 #include "primitive.hxx"
+#include "ray.hxx"
 
 class Scene;
 class Spheres;
 class Geometry;
 class Mesh;
-struct Ray;
+class Instance;
 struct SurfaceInteraction;
 class Box;
 
 struct RTCHit;
+struct RTCRayHit;
+struct RTCRay;
 struct RTDevice_;
 struct RTScene_;
 typedef struct RTCDeviceTy* RTCDevice;
@@ -35,37 +42,119 @@ struct BoundaryIntersection
 static_assert(sizeof(BoundaryIntersection) == 24);
 
 
+// What the traversal yields. Turned into a SurfaceInteraction by EmbreeAccelerator::Resolve
+// only if needed, e.g. when there is going to be shading at the hit point. The distance is
+// returned separately as with FirstIntersection.
+struct HitRecord
+{
+  const Geometry* geom; // If an instance was hit, then this is the instance.
+  scene_index_t prim;
+  unsigned int geom_id; // Embree's geomID. Within the scene of the prototype if an instance was hit.
+  float u, v; // Embree's barycentric coordinates. Weights of the second and third vertex.
+  Float3 ng; // Unnormalized geometry normal in object space.
+};
+
+
 class EmbreeAccelerator
 {
 private:
   RTCDevice rtdevice = nullptr;
   RTCScene rtscene = nullptr;
   static thread_local ToyVector<BoundaryIntersection> intersections_result;
+  static thread_local ToyVector<RTCRayHit> rayhit_stream;
+  static thread_local ToyVector<RTCRay> ray_stream;
+  static constexpr int NATIVE_SPHERES_MIN_COUNT = 16;
+  bool force_sphere_callbacks = false;
+  std::unordered_map<const Mesh*, RTCScene> prototype_scenes; // BVHs of meshes that are referenced by instances.
 
-  void FirstIntersectionTriangle(const RTCHit &rthit, const Ray &, SurfaceInteraction &intersection) const;
+  HitRecord MakeHitRecord(const RTCHit &rthit) const;
+  void FirstIntersectionTriangle(const RTCHit &rthit, RTCScene geom_scene, SurfaceInteraction &intersection) const;
   void FirstIntersectionSphere(const RTCHit &rthit, const Ray &, SurfaceInteraction &intersection) const;
+  void InsertNativeSpheresRefTo(Spheres &spheres);
+  void InsertRefTo(Mesh &mesh, RTCScene target);
+  RTCScene GetPrototypeScene(const Mesh &prototype);
   static void SphereBoundsFunc(const RTCBoundsFunctionArguments*);
   static void SphereIntersectFunc(const RTCIntersectFunctionNArguments*);
   static void SphereOccludedFunc(const RTCOccludedFunctionNArguments*);
 public:
   EmbreeAccelerator();
   ~EmbreeAccelerator();
+  // Spheres are always intersected by the custom callbacks, which reject hits within the error
+  // bounds of the ray start. Required where the crossings are counted, i.e. for medium boundaries.
+  // Otherwise Embree's native sphere primitive is used for geometries with many spheres.
+  void ForceSphereCallbacks() { force_sphere_callbacks = true; }
   void InsertRefTo(Mesh &mesh);
-  void InsertRefTo(Spheres &spheres);
+  // Like ForceSphereCallbacks but only for these spheres.
+  void InsertRefTo(Spheres &spheres, bool force_callbacks = false);
+  // Two level BVH. The prototype of the instance gets its own BVH which is shared by all its instances.
+  void InsertRefTo(Instance &instance);
   void InsertRefTo(Geometry &geo);
   void Build(bool enable_intersections_in_order_call = false);
+  // FirstHit followed by Resolve.
   bool FirstIntersection(const Ray &ray, double tnear, double &ray_length, SurfaceInteraction &intersection) const;
+  // Like FirstIntersection but deferring the computation of the SurfaceInteraction.
+  bool FirstHit(const Ray &ray, double tnear, double &ray_length, HitRecord &hit) const;
+  // Batched FirstHit for many coherent rays, e.g. the camera rays of an image tile.
+  // They are traced with Embree's stream interface. ray_lengths holds tfar on input and the
+  // distance to the hit on output. Rays that miss get an empty optional.
+  void FirstHits(Span<const Ray> rays, double tnear, Span<double> ray_lengths, Span<std::optional<HitRecord>> hits) const;
+  // Ray must be the one which produced the hit.
+  void Resolve(const HitRecord &hit, const Ray &ray, SurfaceInteraction &intersection) const;
   // Note: Calling this twice will invalidate the array from the first call!
   Span<BoundaryIntersection> IntersectionsInOrder(const Ray &ray, double tnear, double tfar) const;
+  // Only the nearest hits in [tnear, tfar], as many as fit into hits. Returns how many were found. 
+  // If that is all of hits, there may be more behind the last one. Once hits is full, the traversal 
+  // is clamped to the farthest of them. Hits exactly at tnear which are, or would have been merged 
+  // with, one of exclude_at_tnear are ignored, so that the query can resume where the previous one stopped.
+  int NearestIntersectionsInOrder(const Ray &ray, double tnear, double tfar, Span<const BoundaryIntersection> exclude_at_tnear, Span<BoundaryIntersection> hits) const;
   bool IsOccluded(const Ray &ray, double tnear, double tfar) const;
+  // Batched IsOccluded. Sets occluded[i] to 1 or 0.
+  void AreOccluded(Span<const Ray> rays, double tnear, Span<const double> tfars, Span<std::uint8_t> occluded) const;
   Box GetSceneBounds() const;
+  // Summed over all accelerators and threads. Lags behind by a few rays per thread.
+  static std::uint64_t NumRaysTraced();
+};
+
+
+/* Boundary crossings along a ray in order of increasing distance, fetched a few at a time. 
+ * The buffer is refilled by querying the rest of the segment only when the caller advances 
+ * past the last buffered hit and the previous query filled the buffer. Each query stops 
+ * descending into the BVH beyond the farthest hit it keeps, once it has found BUFFER_SIZE of 
+ * them. Walks which stop early, e.g. due to scattering, thus pay for little more than the 
+ * boundaries up to the end of the buffer at the stopping point.
+ */
+class BoundaryIntersectionIterator
+{
+public:
+  static constexpr int BUFFER_SIZE = 8;
+
+  BoundaryIntersectionIterator(const EmbreeAccelerator &accelerator, const Ray &ray, double tnear, double tfar);
+
+  explicit operator bool() const noexcept { return current < num_buffered; }
+  const BoundaryIntersection& operator*() const noexcept { return buffer[current]; }
+  const BoundaryIntersection* operator->() const noexcept { return &buffer[current]; }
+  void operator++();
+
+  // Number of calls to EmbreeAccelerator::NearestIntersectionsInOrder so far.
+  int NumQueries() const noexcept { return num_queries; }
+
+private:
+  void Fetch(double tnear, Span<const BoundaryIntersection> exclude_at_tnear);
+
+  const EmbreeAccelerator *accelerator;
+  Ray ray;
+  double tfar;
+  std::array<BoundaryIntersection, BUFFER_SIZE> buffer;
+  int num_buffered = 0;
+  int current = 0;
+  int num_queries = 0;
 };
 
 
 namespace EmbreeAcceleratorDetail
 {
 template<class IterT, class Less, class Equal>
-std::pair<IterT, bool> FindPlaceIfUnique(IterT begin, IterT end, const typename IterT::value_type &item, Less less, Equal equal)
+std::pair<IterT, bool> FindPlaceIfUnique(IterT begin, IterT end, const typename std::iterator_traits<IterT>::value_type &item, Less less, Equal equal)
 {
   const auto backup = end;
   while (end != begin)
@@ -32,6 +32,13 @@ public:
 
     void Print(std::ostream &os) const;
 
+    template<class Archive>
+    void Serialize(Archive &ar)
+    {
+      ar(cummulative_probs);
+      ar(light_type_selection_probs);
+    }
+
     const Scene &scene;
     std::array<Eigen::ArrayXd, Lights::NUM_LIGHT_TYPES> cummulative_probs;
     Eigen::Array<double, 4, 1> light_type_selection_probs;
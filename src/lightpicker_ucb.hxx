@@ -73,6 +73,12 @@ public:
   int ArmCount() const {
     return accum.Size();
   }
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(accum);
+    ar(step_count);
+  }
 private:
   Accumulators::SoaOnlineVariance<double> accum;
   int step_count = 0;
@@ -89,6 +95,14 @@ public:
 
   const auto &Distribution() const { return distribution; }
 
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    for (auto &s : stats)
+      ar(s);
+    ar(distribution);
+  }
+
 private:
   Stats stats[Lights::NUM_LIGHT_TYPES];
   LightSelectionProbabilityMap distribution;
@@ -107,6 +121,15 @@ public:
 
     const auto &Distribution() const { return distribution; }
 
+    template<class Archive>
+    void Serialize(Archive &ar)
+    {
+      ar(ucb_photon_path_returns);
+      for (auto &s : stats)
+        ar(s);
+      ar(distribution);
+    }
+
 private:
     ToyVector<float> ucb_photon_path_returns;
     Stats stats[Lights::NUM_LIGHT_TYPES];
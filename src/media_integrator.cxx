@@ -335,10 +335,23 @@ Tracking(
   MediumTracker &medium_tracker,
   const PathContext &context)
 {
-  ThroughputAndPdfs weights;
-
   double tfar = LargeNumber;
-  const auto hit = scene.FirstIntersection(ray, 0., tfar);
+  const auto hit = scene.FirstHit(ray, 0., tfar);
+  return Tracking(scene, ray, hit, tfar, sampler, medium_tracker, context);
+}
+
+
+std::tuple<MaybeSomeInteraction, double, ThroughputAndPdfs>
+Tracking(
+  const Scene &scene,
+  const Ray &ray,
+  const std::optional<HitRecord> &hit,
+  double tfar,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  const PathContext &context)
+{
+  ThroughputAndPdfs weights;
 
   // The factor by which tfar is decreased is meant to prevent intersections which lie close to the end of the query segment.
   auto iter = VolumeSegmentIterator(scene, ray, medium_tracker, 0., tfar * 0.9999);
@@ -367,7 +380,7 @@ Tracking(
   // If we get here, there was no scattering in the medium.
   if (hit)
   {
-    return { *hit, tfar, weights };
+    return { scene.Resolve(*hit, ray), tfar, weights };
   }
   else
   {
@@ -383,17 +396,30 @@ ThroughputAndPdfs Transmission(
   MediumTracker &medium_tracker,
   const PathContext &context)
 {
-  ThroughputAndPdfs result;
-
-  seg.length *= 0.9999; // To avoid intersections with the adjacent nodes/positions/surfaces.
-
-  if (scene.IsOccluded(seg.ray, 0., seg.length))
+  const RaySegment shadow_seg = ShadowRaySegment(seg);
+  if (scene.IsOccluded(shadow_seg.ray, 0., shadow_seg.length))
   {
+    ThroughputAndPdfs result;
     result.weights_nulls.setConstant(Infinity);
     result.weights_track.setConstant(Infinity);
     return result;
   }
 
+  return UnoccludedTransmission(scene, seg, sampler, medium_tracker, context);
+}
+
+
+ThroughputAndPdfs UnoccludedTransmission(
+  const Scene &scene,
+  RaySegment seg,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  const PathContext &context)
+{
+  ThroughputAndPdfs result;
+
+  seg = ShadowRaySegment(seg);
+
   auto iter = VolumeSegmentIterator(scene, seg.ray, medium_tracker, 0., seg.length);
   for (; iter; ++iter)
   {
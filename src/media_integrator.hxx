@@ -89,6 +89,17 @@ Tracking(
   MediumTracker &medium_tracker,
   const PathContext &context);
 
+// With the surface hit precomputed, e.g. by PrimaryRayBatch.
+std::tuple<MaybeSomeInteraction, double, ThroughputAndPdfs>
+Tracking(
+  const Scene &scene,
+  const Ray &ray,
+  const std::optional<HitRecord> &hit,
+  double tfar,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  const PathContext &context);
+
 ThroughputAndPdfs Transmission(
   const Scene &scene, 
   RaySegment seg, 
@@ -96,4 +107,12 @@ ThroughputAndPdfs Transmission(
   MediumTracker &medium_tracker, 
   const PathContext &context);
 
+// Without the occlusion test. For when it is done separately, e.g. with a ShadowRayQueue.
+ThroughputAndPdfs UnoccludedTransmission(
+  const Scene &scene, 
+  RaySegment seg, 
+  Sampler &sampler,
+  MediumTracker &medium_tracker, 
+  const PathContext &context);
+
 } // namespace nullpath
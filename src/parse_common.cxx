@@ -1,12 +1,26 @@
 #include "parse_common.hxx"
+#include "checkpoint.hxx"
 
-#include <assimp/cimport.h>
+#include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <cctype>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_arena.h>
+
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 namespace scenereader
 {
@@ -63,6 +77,62 @@ fs::path GlobalContext::MakeFullPath(const fs::path &filename) const
     return filename;
 }
 
+
+FileContents::FileContents(const fs::path &filename)
+{
+#ifndef _WIN32
+  if (int fd = ::open(filename.c_str(), O_RDONLY); fd >= 0)
+  {
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED)
+      {
+        ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+        mapping = p;
+        mapping_size = st.st_size;
+        view = std::string_view(static_cast<const char*>(p), mapping_size);
+      }
+    }
+    ::close(fd);
+    if (mapping)
+      return;
+  }
+#endif
+  std::ifstream is(filename.string(), std::ios::binary);
+  if (!is.good())
+  {
+    throw std::runtime_error(fmt::format("Could not open input file {}", filename.string()));
+  }
+  ReadAll(is);
+}
+
+
+FileContents::~FileContents()
+{
+#ifndef _WIN32
+  if (mapping)
+    ::munmap(mapping, mapping_size);
+#endif
+}
+
+
+void FileContents::ReadAll(std::istream &is)
+{
+  constexpr std::size_t BLOCK_SIZE = 1 << 20;
+  std::size_t size = 0;
+  do
+  {
+    buffer.resize(size + BLOCK_SIZE);
+    is.read(buffer.data() + size, BLOCK_SIZE);
+    size += is.gcount();
+  } 
+  while (is);
+  buffer.resize(size);
+  view = buffer;
+}
+
 } // scenereader
 
 
@@ -195,7 +265,10 @@ struct NodeRef
 
 
 
-void ReadNode(Scene &scene, Transform model_transform, MaterialGetter material_getter, bool material_assignment_by_object_names, const aiScene* aiscene, const NodeRef &ndref)
+using MeshSink = std::function<void(Mesh &&, const std::optional<std::string> &)>;
+
+
+void ReadNode(const MeshSink &sink, Transform model_transform, bool material_assignment_by_object_names, const aiScene* aiscene, const NodeRef &ndref)
 {
   const auto *nd = ndref.node;
   for (unsigned int mesh_idx = 0; mesh_idx < nd->mNumMeshes; ++mesh_idx)
@@ -211,25 +284,27 @@ void ReadNode(Scene &scene, Transform model_transform, MaterialGetter material_g
       else
         return GetMaterialName(aiscene, aimesh);
     }();
-    scene.Append(mesh, material_getter(material_name));
+    sink(std::move(mesh), material_name);
   }
 }
 
 
-void Read(Scene & scene, Transform model_transform, MaterialGetter material_getter, bool material_assignment_by_object_names, const fs::path & filename_path)
+void ReadAll(const MeshSink &sink, Transform model_transform, bool material_assignment_by_object_names, const fs::path & filename_path)
 {
   // Example see: https://github.com/assimp/assimp/blob/master/samples/SimpleOpenGL/Sample_SimpleOpenGL.c
   const std::string filename_str = filename_path.string();
   const char* filename = filename_str.c_str();
 
   std::printf("Reading Mesh: %s\n", filename);
-  auto* aiscene = aiImportFile(filename,
+  // Own importer instead of the C api, which keeps the error string in a global. So that files can be loaded in parallel.
+  ::Assimp::Importer importer;
+  const auto* aiscene = importer.ReadFile(filename,
     aiProcess_Triangulate
   );
 
   if (!aiscene)
   {
-    throw std::runtime_error(fmt::format("Error: could not load file {}. because: {}", filename, aiGetErrorString()));
+    throw std::runtime_error(fmt::format("Error: could not load file {}. because: {}", filename, importer.GetErrorString()));
   }
 
   std::vector<NodeRef> nodestack{ { aiscene->mRootNode, aiMatrix4x4{} } };
@@ -242,10 +317,569 @@ void Read(Scene & scene, Transform model_transform, MaterialGetter material_gett
       nodestack.push_back({ ndref.node->mChildren[i], ndref.local_to_world });
     }
 
-    ReadNode(scene, model_transform, material_getter, material_assignment_by_object_names, aiscene, ndref);
+    ReadNode(sink, model_transform, material_assignment_by_object_names, aiscene, ndref);
+  }
+}
+
+
+bool IsObjFile(const fs::path &filename)
+{
+  auto ext = filename.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return ext == ".obj";
+}
+
+
+ToyVector<LoadedMesh> LoadUncached(Transform model_transform, bool material_assignment_by_object_names, const fs::path & filename_path)
+{
+  // Big scans come as OBJ files. These have their own reader which is much faster than assimp.
+  if (IsObjFile(filename_path))
+    return obj::Load(model_transform, material_assignment_by_object_names, filename_path);
+
+  ToyVector<LoadedMesh> meshes;
+  ReadAll([&](Mesh &&mesh, const std::optional<std::string> &material_name) {
+      meshes.push_back(LoadedMesh{ std::move(mesh), material_name });
+    }, model_transform, material_assignment_by_object_names, filename_path);
+  return meshes;
+}
+
+
+/* Scene cache. One file per model file and transform, holding the meshes as they come out of 
+ * LoadUncached. The name is a hash of the key. The key is stored in the file, too, so that 
+ * stale files and hash collisions are detected. The buffers are read back with one read per
+ * matrix straight into the Eigen storage. Native byte order, like the checkpoints.
+ */
+constexpr std::uint32_t MESH_CACHE_MAGIC = 0x4d435454; // "TTCM"
+constexpr std::uint32_t MESH_CACHE_VERSION = 1;
+
+struct MeshCacheKey
+{
+  std::string source;
+  std::uint64_t file_size = 0;
+  std::int64_t modification_time = 0;
+  Eigen::Matrix4d transform;
+  bool material_assignment_by_object_names = false;
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(source);
+    ar(file_size);
+    ar(modification_time);
+    ar(transform);
+    ar(material_assignment_by_object_names);
+  }
+
+  bool operator==(const MeshCacheKey &other) const
+  {
+    return source == other.source && file_size == other.file_size && modification_time == other.modification_time &&
+      transform == other.transform && material_assignment_by_object_names == other.material_assignment_by_object_names;
+  }
+};
+
+
+MeshCacheKey MakeMeshCacheKey(Transform model_transform, bool material_assignment_by_object_names, const fs::path & filename_path)
+{
+  MeshCacheKey key;
+  key.source = fs::absolute(filename_path).string();
+  key.file_size = fs::file_size(filename_path);
+  key.modification_time = static_cast<std::int64_t>(fs::last_write_time(filename_path));
+  key.transform = model_transform.matrix();
+  key.material_assignment_by_object_names = material_assignment_by_object_names;
+  return key;
+}
+
+
+fs::path MeshCacheFilename(const fs::path &cache_dir, const MeshCacheKey &key)
+{
+  std::ostringstream os;
+  checkpoint::Writer{ os }(key);
+  return cache_dir / fmt::format("{:016x}.meshcache", checkpoint::Fingerprint(os.str()));
+}
+
+
+template<class Archive>
+void SerializeMeshes(Archive &ar, ToyVector<LoadedMesh> &meshes)
+{
+  auto n = meshes.size();
+  ar(n);
+  if constexpr (Archive::is_loading)
+    for (std::size_t i = 0; i < n; ++i)
+      meshes.push_back(LoadedMesh{ Mesh{ 0, 0 }, {} });
+  for (auto &m : meshes)
+  {
+    ar(m.mesh.vertices);
+    ar(m.mesh.vert_indices);
+    ar(m.mesh.normals);
+    ar(m.mesh.uvs);
+    bool has_material_name = m.material_name.has_value();
+    ar(has_material_name);
+    if (has_material_name)
+    {
+      if constexpr (Archive::is_loading)
+        m.material_name.emplace();
+      ar(*m.material_name);
+    }
+  }
+}
+
+
+ToyVector<LoadedMesh> ReadMeshCache(const fs::path &filename, const MeshCacheKey &key)
+{
+  std::ifstream is(filename.string(), std::ios::binary);
+  if (!is)
+    throw checkpoint::Error("Cannot open " + filename.string());
+  checkpoint::Reader ar{ is };
+  ar.Expect(MESH_CACHE_MAGIC, "not a scene cache file");
+  ar.Expect(MESH_CACHE_VERSION, "format version");
+  ar.Expect(key, "source file or transform");
+  ToyVector<LoadedMesh> meshes;
+  SerializeMeshes(ar, meshes);
+  return meshes;
+}
+
+
+void WriteMeshCache(const fs::path &filename, const MeshCacheKey &key, ToyVector<LoadedMesh> &meshes)
+{
+  // Unique temporary name, in case another thread or process writes the same entry.
+  auto tmp_filename = filename;
+  tmp_filename += fs::unique_path(".%%%%%%%%.tmp");
+  {
+    std::ofstream os(tmp_filename.string(), std::ios::binary | std::ios::trunc);
+    if (!os)
+      throw checkpoint::Error("Cannot open for writing: " + tmp_filename.string());
+    checkpoint::Writer ar{ os };
+    ar(MESH_CACHE_MAGIC);
+    ar(MESH_CACHE_VERSION);
+    ar(key);
+    SerializeMeshes(ar, meshes);
+    os.flush();
+    if (!os)
+      throw checkpoint::Error("Failed to write " + tmp_filename.string());
+  }
+  fs::rename(tmp_filename, filename);
+}
+
+
+ToyVector<LoadedMesh> Load(Transform model_transform, bool material_assignment_by_object_names, const fs::path & filename_path, const fs::path &cache_dir)
+{
+  if (cache_dir.empty())
+    return LoadUncached(model_transform, material_assignment_by_object_names, filename_path);
+
+  const auto key = MakeMeshCacheKey(model_transform, material_assignment_by_object_names, filename_path);
+  const auto cache_file = MeshCacheFilename(cache_dir, key);
+  if (fs::exists(cache_file))
+  {
+    try
+    {
+      auto meshes = ReadMeshCache(cache_file, key);
+      fmt::print("Read {} from the scene cache\n", filename_path.string());
+      return meshes;
+    }
+    catch (const checkpoint::Error &e)
+    {
+      fmt::print("Ignoring scene cache file {}: {}\n", cache_file.string(), e.what());
+    }
+  }
+
+  auto meshes = LoadUncached(model_transform, material_assignment_by_object_names, filename_path);
+  try
+  {
+    WriteMeshCache(cache_file, key, meshes);
+  }
+  catch (const std::exception &e)
+  {
+    fmt::print("WARNING: Failed to write the scene cache: {}\n", e.what());
+  }
+  return meshes;
+}
+
+
+void Read(Scene & scene, Transform model_transform, MaterialGetter material_getter, bool material_assignment_by_object_names, const fs::path & filename_path, const fs::path &cache_dir)
+{
+  for (auto &m : Load(model_transform, material_assignment_by_object_names, filename_path, cache_dir))
+    scene.Append(std::move(m.mesh), material_getter(m.material_name));
+}
+
+
+ToyVector<ModelPart> AddPrototypes(Scene & scene, ToyVector<LoadedMesh> &&meshes)
+{
+  ToyVector<ModelPart> parts;
+  for (auto &m : meshes)
+  {
+    const Mesh &prototype = scene.AddPrototype(std::make_unique<Mesh>(std::move(m.mesh)));
+    parts.push_back(ModelPart{ std::move(m.material_name), &prototype });
+  }
+  meshes.clear();
+  return parts;
+}
+
+} //namespace scenereader::assimp
+
+
+/* Wavefront OBJ reader. The file is split into chunks at line boundaries which are parsed
+ * in parallel. Afterwards the chunks are stitched together: relative indices are resolved with 
+ * the element counts of the preceding chunks and material or object names carry over chunk 
+ * boundaries. Vertices are shared among the faces of a mesh where position, uv and normal 
+ * indices agree. Lines, points, smoothing groups and the mtllib are ignored.
+ */
+namespace scenereader::obj
+{
+
+using assimp::LoadedMesh;
+
+constexpr int NO_INDEX = std::numeric_limits<int>::min();
+
+// Indices of a face corner. Relative indices in the file are converted to indices counted 
+// from the start of the chunk. These may be negative, and need the offset of the chunk added.
+struct Corner
+{
+  enum : std::uint8_t { POSITION_LOCAL = 1, UV_LOCAL = 2, NORMAL_LOCAL = 4 };
+  int position = NO_INDEX;
+  int uv = NO_INDEX;
+  int normal = NO_INDEX;
+  std::uint8_t local = 0;
+
+  bool operator==(const Corner &other) const
+  {
+    return position == other.position && uv == other.uv && normal == other.normal && local == other.local;
+  }
+
+  struct Hash
+  {
+    std::size_t operator()(const Corner &c) const
+    {
+      std::size_t h = boost::hash_value(c.position);
+      boost::hash_combine(h, boost::hash_value(c.uv));
+      boost::hash_combine(h, boost::hash_value(c.normal));
+      return h;
+    }
+  };
+};
+
+// Triangles from first_triangle on use this material or object name. The first run of a 
+// chunk has no name. It continues with the name from the end of the previous chunk.
+struct Run
+{
+  std::optional<std::string> name;
+  int first_triangle;
+};
+
+struct Chunk
+{
+  std::string_view text;
+  ToyVector<Float3> positions;
+  ToyVector<Float2> uvs;
+  ToyVector<Float3> normals;
+  ToyVector<Corner> corners; // Three per triangle.
+  ToyVector<Run> runs;
+  int position_offset = 0;
+  int uv_offset = 0;
+  int normal_offset = 0;
+  int NumTriangles() const { return isize(corners) / 3; }
+};
+
+
+std::runtime_error MakeError(const fs::path &filename, std::string_view line, const char* msg)
+{
+  return std::runtime_error(fmt::format("{}: {} [{}]", filename.string(), msg, line));
+}
+
+
+// Element i counted from 1, or -i counted backwards from the last one so far.
+bool ParseIndex(std::string_view s, int num_so_far, int &index, bool &local)
+{
+  int i = 0;
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), i);
+  if (ec != std::errc{} || end != s.data() + s.size() || i == 0)
+    return false;
+  local = i < 0;
+  index = local ? num_so_far + i : i - 1;
+  return true;
+}
+
+
+bool ParseCorner(std::string_view s, const Chunk &chunk, Corner &corner)
+{
+  // position[/[uv][/normal]]
+  const auto slash1 = s.find('/');
+  const auto slash2 = slash1 == std::string_view::npos ? slash1 : s.find('/', slash1 + 1);
+  bool local = false;
+  if (!ParseIndex(s.substr(0, slash1), isize(chunk.positions), corner.position, local))
+    return false;
+  corner.local |= local ? Corner::POSITION_LOCAL : 0;
+  if (slash1 != std::string_view::npos)
+  {
+    const auto uv_str = s.substr(slash1 + 1, slash2 == std::string_view::npos ? slash2 : slash2 - slash1 - 1);
+    if (!uv_str.empty())
+    {
+      if (!ParseIndex(uv_str, isize(chunk.uvs), corner.uv, local))
+        return false;
+      corner.local |= local ? Corner::UV_LOCAL : 0;
+    }
+  }
+  if (slash2 != std::string_view::npos)
+  {
+    if (!ParseIndex(s.substr(slash2 + 1), isize(chunk.normals), corner.normal, local))
+      return false;
+    corner.local |= local ? Corner::NORMAL_LOCAL : 0;
+  }
+  return true;
+}
+
+
+void ParseChunk(Chunk &chunk, bool material_assignment_by_object_names, const fs::path &filename)
+{
+  chunk.runs.push_back(Run{ {}, 0 });
+  ToyVector<Corner> face;
+  std::string_view text = chunk.text;
+  std::string_view line;
+  while (TakeLine(text, line))
+  {
+    std::string_view args;
+    const std::string_view token = SplitFirstToken(line, args);
+    if (token == "v")
+    {
+      float v[3];
+      if (ParseNumbers(args, v, 3) != 3)
+        throw MakeError(filename, line, "Bad vertex");
+      chunk.positions.push_back(Float3{ v[0], v[1], v[2] });
+    }
+    else if (token == "vt")
+    {
+      float uv[2] = { 0.f, 0.f };
+      if (ParseNumbers(args, uv, 2) < 1)
+        throw MakeError(filename, line, "Bad texture coordinate");
+      chunk.uvs.push_back(Float2{ uv[0], uv[1] });
+    }
+    else if (token == "vn")
+    {
+      float n[3];
+      if (ParseNumbers(args, n, 3) != 3)
+        throw MakeError(filename, line, "Bad normal");
+      chunk.normals.push_back(Float3{ n[0], n[1], n[2] });
+    }
+    else if (token == "f")
+    {
+      face.clear();
+      std::string_view rest = args;
+      for (auto s = SplitFirstToken(rest, rest); !s.empty(); s = SplitFirstToken(rest, rest))
+      {
+        face.emplace_back();
+        if (!ParseCorner(s, chunk, face.back()))
+          throw MakeError(filename, line, "Bad face");
+      }
+      if (face.size() < 3)
+        throw MakeError(filename, line, "Face with less than 3 vertices");
+      for (int i = 1; i < isize(face) - 1; ++i) // Triangle fan
+        chunk.corners.insert(chunk.corners.end(), { face[0], face[i], face[i+1] });
+    }
+    else if (material_assignment_by_object_names ? (token == "o" || token == "g") : token == "usemtl")
+    {
+      std::string name{ args };
+      name.erase(0, name.find_first_not_of(" \t\r"));
+      name.erase(name.find_last_not_of(" \t\r") + 1);
+      if (chunk.runs.back().first_triangle == chunk.NumTriangles())
+        chunk.runs.back().name = std::move(name);
+      else
+        chunk.runs.push_back(Run{ std::move(name), chunk.NumTriangles() });
+    }
+  }
+}
+
+
+ToyVector<Chunk> SplitIntoChunks(std::string_view text, std::size_t chunk_size)
+{
+  if (chunk_size == 0)
+    chunk_size = std::max<std::size_t>(1 << 20, text.size() / (4 * tbb::this_task_arena::max_concurrency()));
+  ToyVector<Chunk> chunks;
+  while (!text.empty())
+  {
+    std::size_t end = text.find('\n', std::min(chunk_size, text.size()) - 1);
+    end = (end == std::string_view::npos) ? text.size() : end + 1;
+    chunks.emplace_back();
+    chunks.back().text = text.substr(0, end);
+    text.remove_prefix(end);
+  }
+  return chunks;
+}
+
+
+// The faces with one material or object name.
+struct Group
+{
+  std::optional<std::string> name;
+  struct Segment { int chunk, first_triangle, end_triangle; };
+  ToyVector<Segment> segments;
+};
+
+
+ToyVector<Group> GroupTriangles(const ToyVector<Chunk> &chunks)
+{
+  ToyVector<Group> groups;
+  std::unordered_map<std::optional<std::string>, int> group_indices;
+  const std::optional<std::string>* current_name = nullptr;
+  static const std::optional<std::string> no_name;
+  for (int k = 0; k < isize(chunks); ++k)
+  {
+    const auto &runs = chunks[k].runs;
+    for (int r = 0; r < isize(runs); ++r)
+    {
+      if (runs[r].name || !current_name)
+        current_name = runs[r].name ? &runs[r].name : &no_name;
+      const int end = r + 1 < isize(runs) ? runs[r+1].first_triangle : chunks[k].NumTriangles();
+      if (end == runs[r].first_triangle)
+        continue;
+      auto [it, is_new] = group_indices.emplace(*current_name, isize(groups));
+      if (is_new)
+        groups.push_back(Group{ *current_name, {} });
+      groups[it->second].segments.push_back({ k, runs[r].first_triangle, end });
+    }
+  }
+  return groups;
+}
+
+
+class MeshBuilder
+{
+  const ToyVector<Chunk> &chunks;
+  ToyVector<Float3> positions;
+  ToyVector<Float2> uvs;
+  ToyVector<Float3> normals;
+  std::unordered_map<Corner, int, Corner::Hash> vertex_of_corner; // Of the mesh being built.
+  const fs::path &filename;
+
+  Corner Resolve(const Chunk &chunk, Corner c) const;
+public:
+  MeshBuilder(const ToyVector<Chunk> &chunks, const fs::path &filename);
+  std::optional<Mesh> Build(const Group &group, const Transform &model_transform);
+};
+
+
+MeshBuilder::MeshBuilder(const ToyVector<Chunk> &chunks_, const fs::path &filename_)
+  : chunks{ chunks_ }, filename{ filename_ }
+{
+  auto Concatenate = [this](auto member, auto &dst) 
+  {
+    std::size_t n = 0;
+    for (const auto &c : chunks)
+      n += (c.*member).size();
+    dst.reserve(n);
+    for (const auto &c : chunks)
+      dst.insert(dst.end(), (c.*member).begin(), (c.*member).end());
+  };
+  Concatenate(&Chunk::positions, positions);
+  Concatenate(&Chunk::uvs, uvs);
+  Concatenate(&Chunk::normals, normals);
+}
+
+
+Corner MeshBuilder::Resolve(const Chunk &chunk, Corner c) const
+{
+  auto ResolveOne = [&](int &i, std::uint8_t local_flag, int offset, int count)
+  {
+    if (i == NO_INDEX)
+      return;
+    if (c.local & local_flag)
+      i += offset;
+    if (i < 0 || i >= count)
+      throw std::runtime_error(fmt::format("{}: Invalid face. Vertex index beyond bounds.", filename.string()));
+  };
+  ResolveOne(c.position, Corner::POSITION_LOCAL, chunk.position_offset, isize(positions));
+  ResolveOne(c.uv, Corner::UV_LOCAL, chunk.uv_offset, isize(uvs));
+  ResolveOne(c.normal, Corner::NORMAL_LOCAL, chunk.normal_offset, isize(normals));
+  c.local = 0;
+  return c;
+}
+
+
+std::optional<Mesh> MeshBuilder::Build(const Group &group, const Transform &model_transform)
+{
+  ToyVector<Corner> vertex_sources;
+  ToyVector<UInt3> triangles;
+  bool has_normals = true;
+  bool has_uvs = false;
+  for (const auto &segment : group.segments)
+  {
+    const Chunk &chunk = chunks[segment.chunk];
+    for (int t = segment.first_triangle; t < segment.end_triangle; ++t)
+    {
+      const Corner corners[3] = { 
+        Resolve(chunk, chunk.corners[3*t]), 
+        Resolve(chunk, chunk.corners[3*t+1]), 
+        Resolve(chunk, chunk.corners[3*t+2]) };
+      // Degenerate triangles are dropped. Like in the assimp code path.
+      const Double3 p0 = positions[corners[0].position].cast<double>();
+      const Double3 p1 = positions[corners[1].position].cast<double>();
+      const Double3 p2 = positions[corners[2].position].cast<double>();
+      if (!(Length(Cross(p1 - p0, p2 - p0)) > 0.))
+        continue;
+      UInt3 triangle;
+      for (int j = 0; j < 3; ++j)
+      {
+        const Corner &c = corners[j];
+        has_normals &= c.normal != NO_INDEX;
+        has_uvs |= c.uv != NO_INDEX;
+        const auto [it, is_new] = vertex_of_corner.emplace(c, isize(vertex_sources));
+        if (is_new)
+          vertex_sources.push_back(c);
+        triangle[j] = it->second;
+      }
+      triangles.push_back(triangle);
+    }
+  }
+  vertex_of_corner.clear();
+
+  if (triangles.empty())
+    return {};
+
+  Mesh mesh(isize(triangles), isize(vertex_sources));
+  const auto normal_trafo = NormalTrafo(model_transform);
+  tbb::parallel_for(tbb::blocked_range<int>(0, isize(vertex_sources)), [&](const tbb::blocked_range<int> &r) 
+  {
+    for (int i = r.begin(); i < r.end(); ++i)
+    {
+      const Corner &c = vertex_sources[i];
+      mesh.vertices.row(i) = (model_transform * positions[c.position].cast<double>()).cast<float>();
+      if (has_normals)
+        mesh.normals.row(i) = Normalized(normal_trafo * normals[c.normal].cast<double>()).cast<float>();
+      mesh.uvs.row(i) = (c.uv != NO_INDEX) ? uvs[c.uv] : Float2{ 0.f, 0.f };
+    }
+  });
+  for (int i = 0; i < isize(triangles); ++i)
+    mesh.vert_indices.row(i) = triangles[i];
+  if (!has_normals)
+    mesh.MakeFlatNormals();
+  return mesh;
+}
+
+
+ToyVector<LoadedMesh> Load(Transform model_transform, bool material_assignment_by_object_names, const fs::path &filename_path, std::size_t chunk_size)
+{
+  std::printf("Reading Mesh: %s\n", filename_path.string().c_str());
+  const FileContents contents{ filename_path };
+  auto chunks = SplitIntoChunks(contents.View(), chunk_size);
+  tbb::parallel_for(0, isize(chunks), 1, [&](int i) {
+    ParseChunk(chunks[i], material_assignment_by_object_names, filename_path);
+  });
+  for (int k = 1; k < isize(chunks); ++k)
+  {
+    chunks[k].position_offset = chunks[k-1].position_offset + isize(chunks[k-1].positions);
+    chunks[k].uv_offset = chunks[k-1].uv_offset + isize(chunks[k-1].uvs);
+    chunks[k].normal_offset = chunks[k-1].normal_offset + isize(chunks[k-1].normals);
   }
 
-  aiReleaseImport(aiscene);
+  MeshBuilder builder{ chunks, filename_path };
+  ToyVector<LoadedMesh> meshes;
+  for (const auto &group : GroupTriangles(chunks))
+  {
+    auto mesh = builder.Build(group, model_transform);
+    if (!mesh)
+      continue;
+    fmt::print("Mesh {}, {} triangles\n", group.name.value_or("<unnamed>"), mesh->NumTriangles());
+    meshes.push_back(LoadedMesh{ std::move(*mesh), group.name });
+  }
+  return meshes;
 }
 
-} //namespace scenereader::assimp
\ No newline at end of file
+} // namespace scenereader::obj
@@ -8,6 +8,10 @@
 
 #include <vector>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
@@ -108,6 +112,7 @@ public:
   auto& GetScene() const { return *scene; }
   auto* GetParams() const { return params; }
   auto GetFilename() const { return filename; }
+  fs::path GetSceneCacheDir() const { return params ? fs::path{ params->scene_cache_dir } : fs::path{}; }
   fs::path MakeFullPath(const fs::path &filename) const;
 };
 
@@ -153,16 +158,154 @@ inline auto NormalTrafo(const Transform &trafo)
 
 
 
+// The bytes of a file. Memory mapped where the platform allows, else read into memory.
+class FileContents
+{
+  std::string buffer;
+  std::string_view view;
+#ifndef _WIN32
+  void* mapping = nullptr;
+  std::size_t mapping_size = 0;
+#endif
+  void ReadAll(std::istream &is);
+public:
+  explicit FileContents(const fs::path &filename);
+  // Reads the stream to its end in large blocks. For stdin, for instance.
+  explicit FileContents(std::istream &is) { ReadAll(is); }
+  ~FileContents();
+  FileContents(const FileContents &) = delete;
+  FileContents& operator=(const FileContents &) = delete;
+  std::string_view View() const { return view; }
+};
+
+
+inline bool IsSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+
+// Moves the first line of text to line. Like std::getline, except that a '\r' before the newline is dropped, too.
+inline bool TakeLine(std::string_view &text, std::string_view &line)
+{
+  if (text.empty())
+  {
+    line = {};
+    return false;
+  }
+  const std::size_t newline = text.find('\n');
+  line = text.substr(0, newline);
+  text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+  return true;
+}
+
+
+// Returns the first whitespace separated token. rest gets what comes after it.
+inline std::string_view SplitFirstToken(std::string_view s, std::string_view &rest)
+{
+  std::size_t begin = 0;
+  while (begin < s.size() && IsSpace(s[begin]))
+    ++begin;
+  std::size_t end = begin;
+  while (end < s.size() && !IsSpace(s[end]))
+    ++end;
+  rest = s.substr(end);
+  return s.substr(begin, end - begin);
+}
+
+
+// Floating point from_chars came late to some standard libraries (GCC 11, for instance).
+#ifdef __cpp_lib_to_chars
+template<class T>
+constexpr bool HAVE_FROM_CHARS = true;
+#else
+template<class T>
+constexpr bool HAVE_FROM_CHARS = !std::is_floating_point_v<T>;
+#endif
+
+// Reads up to max_count whitespace separated numbers. Returns how many were read. Like sscanf 
+// with a sequence of %lg or %d, but without the format string interpretation and locale lookups.
+template<class T>
+int ParseNumbers(std::string_view s, T* values, int max_count)
+{
+  const char* p = s.data();
+  const char* end = p + s.size();
+  int n = 0;
+  for (; n < max_count; ++n)
+  {
+    while (p != end && IsSpace(*p))
+      ++p;
+    if (p != end && *p == '+') // Not accepted by from_chars.
+      ++p;
+    if (p == end)
+      break;
+    if constexpr (HAVE_FROM_CHARS<T>)
+    {
+      auto [next, ec] = std::from_chars(p, end, values[n]);
+      if (ec != std::errc{})
+        break;
+      p = next;
+    }
+    else
+    {
+      // strtod needs a terminated string.
+      char buffer[64];
+      const std::size_t len = std::min<std::size_t>(std::find_if(p, end, IsSpace) - p, sizeof(buffer)-1);
+      std::memcpy(buffer, p, len);
+      buffer[len] = 0;
+      char* buffer_end;
+      values[n] = static_cast<T>(std::strtod(buffer, &buffer_end));
+      if (buffer_end == buffer)
+        break;
+      p += buffer_end - buffer;
+    }
+  }
+  return n;
+}
+
+
 namespace assimp
 {
 
 using MaterialGetter = std::function<Material(const std::optional<std::string> &)>;
 
-void Read(Scene &scene, Transform model_transform, MaterialGetter material_getter, bool material_assignment_by_object_names, const fs::path &filename_path);
+// With a cache directory, the meshes are read from there if the file was loaded before with the same transform. Else they are stored there.
+void Read(Scene &scene, Transform model_transform, MaterialGetter material_getter, bool material_assignment_by_object_names, const fs::path &filename_path, const fs::path &cache_dir = {});
+
+struct ModelPart
+{
+  std::optional<std::string> material_name;
+  const Mesh* mesh;
+};
+
+struct LoadedMesh
+{
+  Mesh mesh;
+  std::optional<std::string> material_name;
+};
+
+// Like Read but leaves the scene alone. Safe to call concurrently.
+ToyVector<LoadedMesh> Load(Transform model_transform, bool material_assignment_by_object_names, const fs::path &filename_path, const fs::path &cache_dir = {});
+
+// Hands meshes, loaded in object space, to the scene as prototypes for instancing.
+ToyVector<ModelPart> AddPrototypes(Scene &scene, ToyVector<LoadedMesh> &&meshes);
 
 
 } // namespace assimp
 
+
+namespace obj
+{
+
+// Reads Wavefront OBJ files on all cores, in chunks of about chunk_size bytes. Zero picks a size 
+// based on the number of threads. Gives one mesh per material name, or per object name if 
+// material_assignment_by_object_names. Faces before the first name have none.
+ToyVector<assimp::LoadedMesh> Load(Transform model_transform, bool material_assignment_by_object_names, const fs::path &filename_path, std::size_t chunk_size = 0);
+
+} // namespace obj
+
 } // namespace scenereader
 
 
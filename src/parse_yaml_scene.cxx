@@ -1,6 +1,8 @@
 #include "parse_common.hxx"
 #include "shader.hxx"
 
+#include <tbb/parallel_for.h>
+
 namespace scenereader
 {
 
@@ -30,6 +32,20 @@ class YamlSceneReader
 {
   GlobalContext ctx;
   YAML::Node doc;
+  // Models loaded for instancing, by file and material assignment mode. Further instances reuse the meshes.
+  std::unordered_map<string, ToyVector<assimp::ModelPart>> prototypes;
+  // Model files are loaded in parallel once the document has been read. Then the models are
+  // inserted into the scene in document order, so the scene does not depend on the timing.
+  struct ModelLoad
+  {
+    fs::path fullpath;
+    Transform transform;
+    bool material_assignment_by_object_names;
+    ToyVector<assimp::LoadedMesh> meshes;
+  };
+  ToyVector<ModelLoad> model_loads;
+  std::unordered_map<string, int> prototype_loads; // Index into model_loads. Same keys as prototypes.
+  ToyVector<std::function<void()>> model_insertions;
 public:
   YamlSceneReader(
     Scene& scene,
@@ -42,7 +58,11 @@ public:
   void Parse(std::istream &is, Scope &scope)
   {
     auto doc = YAML::Load(is);
+    // Top level only. Same as --compact-meshes.
+    if (auto node = doc["compact_meshes"]; node && node.as<bool>() && ctx.GetParams())
+      ctx.GetParams()->compact_meshes = true;
     ParseScope(doc, scope);
+    LoadAndInsertModels();
   }
 
   //using ItemParsFunc = std::function<void (YamlSceneReader*, const YAML::Node &, Scope&)>;
@@ -73,6 +93,7 @@ public:
   void ParseAndInsertLight(const YAML::Node &node, Scope &scope);
   void ParseAndInsertTransform(const YAML::Node &node, Scope &scope);
   void ParseAndInsertModel(const YAML::Node &original_node, Scope &scope);
+  void LoadAndInsertModels();
   void ParseView(const YAML::Node &node);
 
   template<class U>
@@ -305,13 +326,36 @@ void YamlSceneReader::ParseAndInsertModel(const YAML::Node & original_node, Scop
 
     auto material_map = ParseMaterialMap(node, scope);
     auto material_assignment_by_object_names = TryPop(node, "material_assignment_by_object_names", false);
-    auto material_getter = std::bind(
-      &YamlSceneReader::LookupMaterial, 
-      this, 
-      std::placeholders::_1, 
-      std::cref(material_map),
-      std::cref(scope));
-    assimp::Read(ctx.GetScene(), scope.currentTransform, material_getter, material_assignment_by_object_names, fullpath);
+    auto instanced = TryPop(node, "instanced", false);
+    // Captures copies because the insertion happens after parsing.
+    auto material_getter = [this, material_map, scope](const std::optional<std::string> &name) {
+      return LookupMaterial(name, material_map, scope);
+    };
+    if (instanced)
+    {
+      const auto key = fullpath.string() + (material_assignment_by_object_names ? "#by_object_names" : "");
+      auto [it, is_new] = prototype_loads.emplace(key, isize(model_loads));
+      if (is_new)
+        model_loads.push_back(ModelLoad{ fullpath, Transform::Identity(), material_assignment_by_object_names, {} });
+      model_insertions.push_back([this, key, load_index = it->second, transform = scope.currentTransform, material_getter]() {
+        auto p = prototypes.find(key);
+        if (p == prototypes.end())
+          p = prototypes.emplace(key, assimp::AddPrototypes(ctx.GetScene(), std::move(model_loads[load_index].meshes))).first;
+        for (const auto &part : p->second)
+          ctx.GetScene().AppendInstance(*part.mesh, transform.cast<float>(), material_getter(part.material_name));
+      });
+    }
+    else
+    {
+      const int load_index = isize(model_loads);
+      model_loads.push_back(ModelLoad{ fullpath, scope.currentTransform, material_assignment_by_object_names, {} });
+      model_insertions.push_back([this, load_index, material_getter]() {
+        auto &meshes = model_loads[load_index].meshes;
+        for (const auto &m : meshes)
+          ctx.GetScene().Append(m.mesh, material_getter(m.material_name));
+        meshes.clear();
+      });
+    }
   }
   else if (node["sphere"])
   {
@@ -322,15 +366,38 @@ void YamlSceneReader::ParseAndInsertModel(const YAML::Node & original_node, Scop
       Pop(node, "radius").as<double>();
     auto  sphere = Spheres();
     sphere.Append(pos.cast<float>(), rad);
-    ctx.GetScene().Append(sphere, material_map.default_material);
+    // Deferred as well, to keep the document order.
+    model_insertions.push_back([this, sphere, material = material_map.default_material]() {
+      ctx.GetScene().Append(sphere, material);
+    });
   }
   ErrorOnRemainingKeys(node);
 }
 
+void YamlSceneReader::LoadAndInsertModels()
+{
+  tbb::parallel_for(0, isize(model_loads), 1, [this](int i) {
+    auto &load = model_loads[i];
+    load.meshes = assimp::Load(load.transform, load.material_assignment_by_object_names, load.fullpath, ctx.GetSceneCacheDir());
+  });
+  for (auto &insert : model_insertions)
+    insert();
+  model_insertions.clear();
+  model_loads.clear();
+  prototype_loads.clear();
+}
+
+
 void YamlSceneReader::ParseView(const YAML::Node &original_node)
 {
   if (!original_node)
     return;
+  if (original_node.IsSequence()) // Several views. The last one is the default camera.
+  {
+    for (const auto &item : original_node)
+      ParseView(item);
+    return;
+  }
   YAML::Node node = original_node;
   auto from = Pop(node, "from").as<Double3>();
   auto at = Pop(node, "at").as<Double3>();
@@ -343,7 +410,7 @@ void YamlSceneReader::ParseView(const YAML::Node &original_node)
     resx = p->width;
     resy = p->height;
   }
-  ctx.GetScene().camera = std::make_unique<PerspectiveCamera>(from, at - from, up, angle, resx, resy);
+  ctx.GetScene().AddView(CameraView{false, from, at, up, angle}, resx, resy);
   ErrorOnRemainingKeys(node);
 }
 
@@ -625,5 +692,6 @@ void Scene::ParseYAML(std::istream &is, RenderingParameters *render_params, cons
   scenereader::Scope scope;
   scenereader::AddDefaultMaterials(scope, *this);
   reader.Parse(is, scope);
+  FlushAppends();
   envlight = std::make_unique<RadianceOrImportance::TotalEnvironmentalRadianceField>(this->envlights);
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "light.hxx"
 #include "parse_common.hxx"
 
+
 // To whomever dares to read this code!
 // I know what this looks like. 
 // I'm making a half way sensible yaml-based scene parser. parse_yaml_scene.cxx.
@@ -71,26 +72,89 @@ Material GetMaterial(Scope &scope, std::optional<std::string> name)
 }
 
 
+// Hands out the lines of a scene file as views into one buffer.
+class NFFInput
+{
+  FileContents contents;
+  std::string_view remaining;
+public:
+  explicit NFFInput(const fs::path &filename) : contents{ filename }, remaining{ contents.View() } {}
+  explicit NFFInput(std::istream &is) : contents{ is }, remaining{ contents.View() } {}
+  bool NextLine(std::string_view &line) { return TakeLine(remaining, line); }
+};
+
+
+// Consecutive polygons and spheres end up in the scene as one piece each. Going through
+// Scene::Append with every record would cost a geometry allocation per record.
+struct NFFPrimitiveBatch
+{
+  ToyVector<float> vertices; // xyz
+  ToyVector<float> normals; // xyz
+  ToyVector<float> uvs;
+  ToyVector<unsigned int> vert_indices;
+  Spheres spheres;
+  // Scratch space for the polygon currently read.
+  ToyVector<Float3> polygon_vertices;
+  ToyVector<Float3> polygon_normals;
+  ToyVector<Float2> polygon_uvs;
+
+  Mesh::index_t NumVertices() const { return isize(vertices) / 3; }
+  void AddVertex(const Float3 &v, const Float3 &n, const Float2 &uv)
+  {
+    vertices.insert(vertices.end(), { v[0], v[1], v[2] });
+    normals.insert(normals.end(), { n[0], n[1], n[2] });
+    uvs.insert(uvs.end(), { uv[0], uv[1] });
+  }
+  bool HasPolygons() const { return !vert_indices.empty(); }
+  bool HasSpheres() const { return spheres.NumSpheres() > 0; }
+  Mesh MakeMesh() const;
+  void Clear();
+};
+
+
+Mesh NFFPrimitiveBatch::MakeMesh() const
+{
+  const Mesh::index_t num_vertices = NumVertices();
+  const Mesh::index_t num_triangles = isize(vert_indices) / 3;
+  Mesh mesh(num_triangles, num_vertices);
+  mesh.vertices = Eigen::Map<const Mesh::Vectors3d>(vertices.data(), num_vertices, 3);
+  mesh.normals = Eigen::Map<const Mesh::Vectors3d>(normals.data(), num_vertices, 3);
+  mesh.uvs = Eigen::Map<const Mesh::Vectors2d>(uvs.data(), num_vertices, 2);
+  mesh.vert_indices = Eigen::Map<const Mesh::Indices3d>(vert_indices.data(), num_triangles, 3);
+  return mesh;
+}
+
+
+void NFFPrimitiveBatch::Clear()
+{
+  vertices.clear();
+  normals.clear();
+  uvs.clear();
+  vert_indices.clear();
+  spheres.spheres.clear();
+}
+
+
 class NFFParser : public GlobalContext
 {
-  std::string line;
-  bool        line_stream_state;
-  std::string peek_line;
+  std::string_view current; // Points into the input.
+  std::string line; // Copy of current, terminated for sscanf.
+  std::string_view peek_line;
   bool        peek_stream_state;
-  std::istream &input;
+  NFFInput &input;
   int lineno;
+  NFFPrimitiveBatch batch;
 public:
   NFFParser(
       Scene* _scene,
       RenderingParameters *_render_params,
-      std::istream &_is,
+      NFFInput &_input,
       const fs::path &_path_hint) :
     GlobalContext{*_scene, _render_params, _path_hint},
-    input{_is},
+    input{_input},
     lineno{0}
   {
-    line_stream_state = true;
-    peek_stream_state = (bool)std::getline(input, peek_line);
+    peek_stream_state = input.NextLine(peek_line);
   }
 
   void Parse(Scope &scope);
@@ -104,6 +168,9 @@ private:
   void InsertAndActivate(const char*, Scope &scope, std::unique_ptr<Medium> x);
   void InsertAndActivate(const char*, Scope &scope, std::unique_ptr<Shader> x);
   bool NextLine();
+  bool NextLineNoCopy();
+  void ParsePolygon(std::string_view args, const Scope &scope);
+  void FlushBatch(const Scope &scope);
   std::runtime_error MakeException(const std::string &msg) const;
   fs::path MakeFullPath(const fs::path &filename) const;
   void AddPointLight(std::unique_ptr<RadianceOrImportance::PointEmitter> p);
@@ -115,19 +182,45 @@ void NFFParser::Parse(Scope &scope)
   using namespace materials;
 
   char token[LINESIZE+1];
-  while (NextLine())
+  while (NextLineNoCopy())
   {
-    if (line.empty())
+    std::string_view args;
+    const std::string_view token_view = SplitFirstToken(current, args);
+    if (token_view.empty()) // empty line, except for whitespaces
       continue;
     
-    if (line[0] == '#') // '#' : comment
+    if (current[0] == '#') // '#' : comment
       continue;
     
-    // TODO: streams: https://stackoverflow.com/questions/1033207/what-should-i-use-instead-of-sscanf
-    int numtokens = sscanf(line.c_str(),"%s",token);
-    if (numtokens <= 0) // empty line, except for whitespaces
-      continue; 
+    /* sphere */
+    if (token_view == "s")
+    {
+      if (batch.HasPolygons())
+        FlushBatch(scope);
+      double values[4];
+      if (ParseNumbers(args, values, 4) != 4)
+        throw MakeException("Error");
+      const Double3 pos = scope.currentTransform*Double3{values[0], values[1], values[2]};
+      batch.spheres.Append(pos.cast<float>(), values[3]);
+      continue;
+    }
     
+    /* polygon (with normals and uv) */
+    if (token_view == "p")
+    {
+      if (batch.HasSpheres())
+        FlushBatch(scope);
+      ParsePolygon(args, scope);
+      continue;
+    }
+    
+    // Everything else is rare enough to go the slow but easy way through sscanf.
+    FlushBatch(scope);
+    line.assign(current);
+    if (token_view.size() > LINESIZE)
+      throw MakeException("Directive too long");
+    token_view.copy(token, token_view.size());
+    token[token_view.size()] = 0;
     
     if (!strcmp(token,"{")) {
       Scope child{scope};
@@ -241,7 +334,7 @@ void NFFParser::Parse(Scope &scope)
       NextLine();
       auto cd = ParseCameraData();
       MakeConsistentResolutionSettings(cd);
-      GetScene().camera = std::make_unique<FisheyeHemisphereCamera>(cd.pos,cd.at-cd.pos,cd.up,cd.resX,cd.resY);
+      GetScene().AddView(CameraView{true, cd.pos, cd.at, cd.up}, cd.resX, cd.resY);
       continue;
     }
     
@@ -261,78 +354,10 @@ void NFFParser::Parse(Scope &scope)
       if (1 != std::sscanf(line.c_str(),"angle %lg\n",&angle)) 
         throw MakeException("Error");
       NextLine();
-      GetScene().camera = std::make_unique<PerspectiveCamera>(cd.pos,cd.at-cd.pos,cd.up,angle,cd.resX,cd.resY);
-      continue;
-    }
-    
-    /* sphere */
-
-    if (!strcmp(token,"s"))
-    {
-      Double3 pos;
-      double rad;
-      int n = sscanf(line.c_str(),"s %lg %lg %lg %lg",&pos[0],&pos[1],&pos[2],&rad);
-      if (n == 4)
-      {
-          pos = scope.currentTransform*pos;
-          auto  sphere = Spheres();
-          sphere.Append(pos.cast<float>(), rad);
-          GetScene().Append(sphere, MakeMaterialFromActiveThings(scope));
-      }
-      else throw MakeException("Error");
-      continue;
-    }
-
-    /* polygon (with normals and uv) */
-    if (!strcmp(token,"p")) 
-    {
-      int num_vertices;
-      sscanf(line.c_str(),"p %d",&num_vertices);
-      
-      if (num_vertices < 3)
-        throw MakeException("Polygon must be specified with at least 3 vertices");
-      
-      auto mesh = Mesh(num_vertices-2, num_vertices);
-      bool must_compute_normal = false;
-      
-      for (int i=0;i<num_vertices;i++)
-      {
-        Double3 v{0.};
-        Double3 n{0.};
-        Double2 uv{0.};
-        if (!NextLine())
-          throw MakeException("Cannot read specified number of vertices");
-        int n_read = sscanf(line.c_str(),"%lg %lg %lg %lg %lg %lg %lg %lg\n", 
-                            &v[0],&v[1],&v[2], &n[0],&n[1],&n[2], &uv[0],&uv[1]);
-        if (n_read < 3)
-          throw MakeException("Cannot vertex coordinates");
-        
-        // Compute normals from vertices if one vertex has no or invalid normal specification.
-        must_compute_normal |= (n_read < 6);
-        v = scope.currentTransform * v;
-        n = Normalized(NormalTrafo(scope.currentTransform)*n);
-        mesh.vertices.row(i) = v.cast<float>();
-        mesh.normals.row(i) = n.cast<float>();
-        mesh.uvs.row(i) = uv.cast<float>();
-      }
-
-      for (int i=0; i<num_vertices-2; i++) 
-      {
-        mesh.vert_indices(i, 0) = 0;
-        mesh.vert_indices(i, 1) = i+1;
-        mesh.vert_indices(i, 2) = i+2;
-      }
-
-      if (must_compute_normal)
-        mesh.MakeFlatNormals();
-      
-      // TODO: This is O(n*n)! Collect all meshes and concatenate them all at once in the end.
-      //AddModel(mesh, scope);
-      GetScene().Append(mesh, MakeMaterialFromActiveThings(scope));
+      GetScene().AddView(CameraView{false, cd.pos, cd.at, cd.up, angle}, cd.resX, cd.resY);
       continue;
     }
     
-    
     /* shader parameters */
     if (!strcmp(token, "shader"))
     {
@@ -797,13 +822,9 @@ void NFFParser::Parse(Scope &scope)
     {
       auto fullpath = MakeFullPath(name);
       std::cout << "including file " << fullpath << std::endl;
-      std::ifstream is(fullpath.string());
-      if (!is.good())
-      {
-        throw std::runtime_error(fmt::format("Could not open input file {}", fullpath.string()));
-      }
+      NFFInput included_input(fullpath);
       // Using this scope.
-      NFFParser(&GetScene(), GetParams(), is, fullpath).Parse(scope);
+      NFFParser(&GetScene(), GetParams(), included_input, fullpath).Parse(scope);
     }
     continue;
   }
@@ -827,9 +848,86 @@ void NFFParser::Parse(Scope &scope)
 
     throw MakeException("Unkown directive");
   }
+  FlushBatch(scope);
 };
 
 
+void NFFParser::ParsePolygon(std::string_view args, const Scope &scope)
+{
+  int num_vertices = 0;
+  ParseNumbers(args, &num_vertices, 1);
+  if (num_vertices < 3)
+    throw MakeException("Polygon must be specified with at least 3 vertices");
+
+  const auto normal_trafo = NormalTrafo(scope.currentTransform);
+  auto &vertices = batch.polygon_vertices;
+  auto &normals = batch.polygon_normals;
+  auto &uvs = batch.polygon_uvs;
+  vertices.clear();
+  normals.clear();
+  uvs.clear();
+  bool must_compute_normal = false;
+  
+  for (int i=0;i<num_vertices;i++)
+  {
+    double values[8] = { 0., 0., 0., 0., 0., 0., 0., 0. };
+    if (!NextLineNoCopy())
+      throw MakeException("Cannot read specified number of vertices");
+    const int n_read = ParseNumbers(current, values, 8);
+    if (n_read < 3)
+      throw MakeException("Cannot vertex coordinates");
+    
+    // Compute normals from vertices if one vertex has no or invalid normal specification.
+    must_compute_normal |= (n_read < 6);
+    const Double3 v = scope.currentTransform * Double3{values[0], values[1], values[2]};
+    const Double3 n = normal_trafo*Double3{values[3], values[4], values[5]};
+    vertices.push_back(v.cast<float>());
+    normals.push_back(Normalized(n).cast<float>());
+    uvs.push_back(Float2{float(values[6]), float(values[7])});
+  }
+
+  // Triangle fan around the first vertex. Like Mesh::MakeFlatNormals, flat shaded triangles get their own vertices.
+  if (must_compute_normal)
+  {
+    for (int i=0; i<num_vertices-2; i++) 
+    {
+      const Float3 n = Normalized(Cross(vertices[i+1]-vertices[0], vertices[i+2]-vertices[0]));
+      for (int c : { 0, i+1, i+2 })
+      {
+        batch.vert_indices.push_back(batch.NumVertices());
+        batch.AddVertex(vertices[c], n, uvs[c]);
+      }
+    }
+  }
+  else
+  {
+    const unsigned int first = batch.NumVertices();
+    for (int i=0; i<num_vertices; i++)
+      batch.AddVertex(vertices[i], normals[i], uvs[i]);
+    for (int i=0; i<num_vertices-2; i++) 
+    {
+      batch.vert_indices.push_back(first);
+      batch.vert_indices.push_back(first+i+1);
+      batch.vert_indices.push_back(first+i+2);
+    }
+  }
+}
+
+
+void NFFParser::FlushBatch(const Scope &scope)
+{
+  if (!batch.HasPolygons() && !batch.HasSpheres())
+    return;
+  const Material material = MakeMaterialFromActiveThings(scope);
+  if (batch.HasPolygons())
+    GetScene().Append(batch.MakeMesh(), material);
+  if (batch.HasSpheres())
+    GetScene().Append(batch.spheres, material);
+  batch.Clear();
+}
+
+
+
 void NFFParser::ParseYaml(const std::string& yaml_section_str, Scope& scope)
 {
   std::cout << "Parse YAML:\n--------\n" << yaml_section_str << "\n-------\n" << std::flush;
@@ -983,21 +1081,19 @@ void NFFParser::ParseMesh(const fs::path &filename, Scope &original_scope)
   auto material_getter = [&](const std::optional<std::string> &name) -> Material {
     return GetMaterial(scope, name);
   };
-  assimp::Read(GetScene(), scope.currentTransform, material_getter, false, filename);
+  const fs::path cache_dir = GetParams() ? GetParams()->scene_cache_dir : std::string{};
+  assimp::Read(GetScene(), scope.currentTransform, material_getter, false, filename, cache_dir);
 }
 
 
 void Scene::ParseNFF(const fs::path &filename, RenderingParameters *render_params)
 {
-  std::ifstream is(filename.string());
-  if (!is.good())
-  {
-    throw std::runtime_error(fmt::format("Could not open input file {}", filename.string()));
-  }
-  NFFParser parser(this, render_params, is, filename);
+  NFFInput input(filename);
+  NFFParser parser(this, render_params, input, filename);
   Scope scope;
   AddDefaultMaterials(scope, *this);
   parser.Parse(scope);
+  FlushAppends();
   envlight = std::make_unique<TotalEnvironmentalRadianceField>(this->envlights);
 }
 
@@ -1011,21 +1107,31 @@ void Scene::ParseNFFString(const std::string &scenestr, RenderingParameters *ren
 
 void Scene::ParseNFF(std::istream &is, RenderingParameters *render_params)
 {
-  NFFParser parser(this, render_params, is, std::string());
+  NFFInput input(is);
+  NFFParser parser(this, render_params, input, std::string());
   Scope scope;
   AddDefaultMaterials(scope, *this);
   parser.Parse(scope);
+  FlushAppends();
   envlight = std::make_unique<TotalEnvironmentalRadianceField>(this->envlights);
 }
 
 
 bool NFFParser::NextLine()
 {
-  line = peek_line;
-  line_stream_state = peek_stream_state;
+  const bool ok = NextLineNoCopy();
+  line.assign(current);
+  return ok;
+}
+
+
+bool NFFParser::NextLineNoCopy()
+{
+  const bool ok = peek_stream_state;
+  current = ok ? peek_line : std::string_view{};
   ++lineno;
-  peek_stream_state = (bool)std::getline(input, peek_line);
-  return line_stream_state;
+  peek_stream_state = ok && input.NextLine(peek_line);
+  return ok;
 }
 
 
@@ -1072,7 +1178,7 @@ std::runtime_error NFFParser::MakeException(const std::string &msg) const
   std::stringstream os;
   if (!GetFilename().empty())
     os << GetFilename() << ":";
-  os << lineno << ": " << msg << " [" << line << "]";
+  os << lineno << ": " << msg << " [" << current << "]";
   return std::runtime_error(os.str());
 }
 
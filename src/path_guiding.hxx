@@ -293,6 +293,16 @@ public:
   Float3 ComputeStochasticFilteredDirection(const IncidentRadiance & rec, RandGen &sampler) const;
 
   rapidjson::Value ToJSON(rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator> &a) const;
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(tree);
+    ar(node_means);
+    ar(node_stddev);
+    ar(node_sample_probs);
+    ar(node_sample_prior);
+  }
 };
 
 
@@ -334,6 +344,13 @@ public:
   RadianceDistributionSampled Bake() const;
 
   rapidjson::Value ToJSON(rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator> &a) const;
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(tree);
+    ar(node_weights);
+  }
 };
 
 
@@ -374,6 +391,22 @@ struct CellData
     long last_num_samples = 0;
     long max_num_samples = 0;
     int index = -1;
+
+    template<class Archive>
+    void Serialize(Archive &ar)
+    {
+      ar(current_estimate.radiance_distribution);
+      ar(current_estimate.cell_bbox.min);
+      ar(current_estimate.cell_bbox.max);
+      ar(current_estimate.points_cov_frame);
+      ar(current_estimate.points_mean);
+      ar(current_estimate.points_stddev);
+      ar(learned.radiance_distribution);
+      ar(learned.leaf_stats);
+      ar(last_num_samples);
+      ar(max_num_samples);
+      ar(index);
+    }
 };
 
 
@@ -454,6 +487,18 @@ class PathGuiding
           return CellIterator{recording_tree, AsSpan(cell_data), ray, tnear_init, tfar_init};
         }
 
+        // The learned distributions and the adapted tree. Only consistent between rounds.
+        template<class Archive>
+        void Serialize(Archive &ar)
+        {
+          ar(recording_tree);
+          ar(cell_data);
+          ar(previous_max_samples_per_cell);
+          ar(previous_total_samples);
+          ar(round);
+          ar(sub_round);
+        }
+
     private:
         void WriteDebugData();
         void AdaptIncremental();
@@ -118,6 +118,13 @@ public:
     });
   }
 
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(storage);
+    ar(root);
+  }
+
   rapidjson::Value ToJSON(rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator> &a) const;
 };
 
@@ -143,6 +143,14 @@ public:
     return const_cast<Tree*>(this)->Lookup(p);
   }
 
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(storage);
+    ar(root);
+    ar(num_leafs);
+  }
+
 #ifdef HAVE_JSON
   void DumpTo(rapidjson::Document &doc, rapidjson::Value & parent) const;
 #endif
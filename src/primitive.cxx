@@ -3,6 +3,9 @@
 #include "ray.hxx"
 #include "scene.hxx"
 
+#include <algorithm>
+#include <cstdint>
+
 
 Mesh::Mesh(index_t num_triangles, index_t num_vertices)
   : Geometry{Geometry::PRIMITIVES_TRIANGLES}
@@ -17,6 +20,8 @@ Mesh::Mesh(index_t num_triangles, index_t num_vertices)
 
 void Mesh::MakeFlatNormals()
 {
+  if (compact)
+    throw std::runtime_error("Cannot modify compacted mesh");
   auto old_vertices = vertices;
   auto old_uvs      = uvs;
   auto num_vertices = NumTriangles()*3;
@@ -49,43 +54,186 @@ void Mesh::Append(const Geometry & other)
 {
   if (other.type != this->type)
     throw std::runtime_error("Geometry type mismatch!");
+  if (compact || static_cast<const Mesh&>(other).compact)
+    throw std::runtime_error("Cannot append compacted meshes");
   this->Append(static_cast<const Mesh&>(other));
 }
 
 
-template<class M>
-static void AppendVertical(M &a, const M &b)
+void  Mesh::Append(const Mesh &other)
 {
-  // Did NOT work for me: https://stackoverflow.com/questions/21496157/eigen-how-to-concatenate-matrix-along-a-specific-dimension
-  auto prev_a_rows = a.rows();
-  M c(a.rows()+b.rows(), a.cols());
-  c << a, b;
-  a.resizeLike(c); // Resizing uninitializes the matrix! Unlike e.g. numpy where the data is copied over.
-  a = c;
+  AppendAll({ &other });
 }
-  
 
-void  Mesh::Append(const Mesh &other)
+
+void Mesh::AppendAll(const ToyVector<const Mesh*> &others)
 {
-  //if (other.material_index != material_index)
-  //  throw std::runtime_error("Cannot merge geometries with mismatching materials");
-  // a + b > overflow => b > overflow - a
-  if (other.NumTriangles() > std::numeric_limits<decltype(NumTriangles())>::max() - NumTriangles())
+  assert(!compact);
+  // Sizes first, so that every buffer is allocated and copied only once.
+  std::int64_t num_triangles = NumTriangles();
+  std::int64_t num_vertices = NumVertices();
+  for (const Mesh* other : others)
+  {
+    num_triangles += other->NumTriangles();
+    num_vertices += other->NumVertices();
+  }
+  if (num_triangles > std::numeric_limits<index_t>::max())
     throw std::range_error("Cannot handle that many triangles in a mesh.");
-  if (other.NumVertices() > std::numeric_limits<decltype(NumVertices())>::max() - NumVertices())
+  if (num_vertices > std::numeric_limits<index_t>::max())
     throw std::range_error("Cannot handle that many vertices in a mesh.");
-  auto tri_start = vert_indices.rows();
-  auto vert_start = vertices.rows();
-  AppendVertical(vertices, other.vertices);
-  AppendVertical(normals, other.normals);
-  AppendVertical(uvs, other.uvs);
-  AppendVertical(vert_indices, other.vert_indices);
-  for (auto i=tri_start; i<vert_indices.rows(); ++i)
+
+  Vectors3d new_vertices(num_vertices, 3);
+  Vectors3d new_normals(num_vertices, 3);
+  Vectors2d new_uvs(num_vertices, 2);
+  Indices3d new_vert_indices(num_triangles, 3);
+  index_t tri_start = 0;
+  index_t vert_start = 0;
+  auto Copy = [&](const Mesh &m)
+  {
+    new_vertices.middleRows(vert_start, m.NumVertices()) = m.vertices;
+    new_normals.middleRows(vert_start, m.NumVertices()) = m.normals;
+    new_uvs.middleRows(vert_start, m.NumVertices()) = m.uvs;
+    new_vert_indices.middleRows(tri_start, m.NumTriangles()) = (m.vert_indices.array() + static_cast<unsigned int>(vert_start)).matrix();
+    tri_start += m.NumTriangles();
+    vert_start += m.NumVertices();
+  };
+  Copy(*this);
+  for (const Mesh* other : others)
+    Copy(*other);
+
+  vertices.swap(new_vertices);
+  normals.swap(new_normals);
+  uvs.swap(new_uvs);
+  vert_indices.swap(new_vert_indices);
+}
+
+
+namespace
+{
+
+// See "A Survey of Efficient Representations for Independent Unit Vectors" by Cigolle et al. (2014).
+inline float SignNotZero(float x)
+{
+  return x >= 0.f ? 1.f : -1.f;
+}
+
+inline std::uint32_t EncodeOctahedral(const Float3 &n)
+{
+  const float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+  float x = n[0] / l1;
+  float y = n[1] / l1;
+  if (n[2] < 0.f)
+  {
+    const float tmp = (1.f - std::abs(y)) * SignNotZero(x);
+    y = (1.f - std::abs(x)) * SignNotZero(y);
+    x = tmp;
+  }
+  auto to_snorm = [](float v) -> std::uint32_t {
+    return static_cast<std::uint16_t>(static_cast<std::int16_t>(std::round(std::clamp(v, -1.f, 1.f) * 32767.f)));
+  };
+  return to_snorm(x) | (to_snorm(y) << 16);
+}
+
+inline Float3 DecodeOctahedral(std::uint32_t packed)
+{
+  const float x = static_cast<std::int16_t>(packed & 0xFFFFu) / 32767.f;
+  const float y = static_cast<std::int16_t>(packed >> 16) / 32767.f;
+  Float3 n{ x, y, 1.f - std::abs(x) - std::abs(y) };
+  const float t = std::max(-n[2], 0.f);
+  n[0] += n[0] >= 0.f ? -t : t;
+  n[1] += n[1] >= 0.f ? -t : t;
+  return n;
+}
+
+} // namespace
+
+
+void Mesh::Compact()
+{
+  if (compact)
+    return;
+  packed_normals.resize(NumVertices());
+  for (index_t i = 0; i < NumVertices(); ++i)
+    packed_normals[i] = EncodeOctahedral(normals.row(i));
+
+  // Each chunk of vertices gets its own range, so that the precision does not depend on
+  // the extent of the whole mesh. Neighboring vertices are mostly close in texture space, too.
+  const index_t num_chunks = (NumVertices() + UV_CHUNK_SIZE - 1) / UV_CHUNK_SIZE;
+  uv_offsets.resize(num_chunks);
+  uv_scales.resize(num_chunks);
+  bool uvs_fit = true;
+  for (index_t c = 0; c < num_chunks && uvs_fit; ++c)
   {
-    vert_indices(i, 0) += vert_start;
-    vert_indices(i, 1) += vert_start;
-    vert_indices(i, 2) += vert_start;
+    const auto chunk = uvs.middleRows(c*UV_CHUNK_SIZE, std::min(UV_CHUNK_SIZE, NumVertices() - c*UV_CHUNK_SIZE));
+    const Float2 uv_min = chunk.colwise().minCoeff();
+    const Float2 uv_max = chunk.colwise().maxCoeff();
+    uvs_fit = ((uv_max - uv_min).array() <= MAX_UV_CHUNK_RANGE).all();
+    uv_offsets[c] = uv_min;
+    uv_scales[c] = (uv_max - uv_min) / 65535.f;
   }
+
+  if (uvs_fit)
+  {
+    packed_uvs.resize(NumVertices(), Eigen::NoChange);
+    for (index_t i = 0; i < NumVertices(); ++i)
+    {
+      const Float2 &offset = uv_offsets[i / UV_CHUNK_SIZE];
+      const Float2 &scale = uv_scales[i / UV_CHUNK_SIZE];
+      for (int j = 0; j < 2; ++j)
+      {
+        const float q = scale[j] > 0.f ? std::round((uvs(i, j) - offset[j]) / scale[j]) : 0.f;
+        packed_uvs(i, j) = static_cast<std::uint16_t>(std::clamp(q, 0.f, 65535.f));
+      }
+    }
+    uvs = Vectors2d{};
+  }
+  else
+  {
+    uv_offsets.clear();
+    uv_scales.clear();
+  }
+  // Release the memory. Resizing alone would keep it.
+  normals = Vectors3d{};
+  compact = true;
+}
+
+
+Float3 Mesh::Normal(index_t vertex) const
+{
+  return compact ? DecodeOctahedral(packed_normals[vertex]) : Float3{ normals.row(vertex) };
+}
+
+
+Float2 Mesh::Uv(index_t vertex) const
+{
+  if (packed_uvs.rows() == 0)
+    return uvs.row(vertex);
+  const index_t chunk = vertex / UV_CHUNK_SIZE;
+  return uv_offsets[chunk] + uv_scales[chunk].cwiseProduct(packed_uvs.row(vertex).transpose().cast<float>());
+}
+
+
+Float3 Mesh::InterpolatedNormal(index_t triangle, const Float3 &weights) const
+{
+  const auto tri = vert_indices.row(triangle);
+  return weights[0]*Normal(tri[0]) + weights[1]*Normal(tri[1]) + weights[2]*Normal(tri[2]);
+}
+
+
+Float2 Mesh::InterpolatedUv(index_t triangle, const Float3 &weights) const
+{
+  const auto tri = vert_indices.row(triangle);
+  return weights[0]*Uv(tri[0]) + weights[1]*Uv(tri[1]) + weights[2]*Uv(tri[2]);
+}
+
+
+std::size_t Mesh::MemoryUsage() const
+{
+  return sizeof(float)*(vertices.size() + normals.size() + uvs.size()) +
+         sizeof(unsigned int)*vert_indices.size() +
+         sizeof(std::uint32_t)*packed_normals.size() +
+         sizeof(std::uint16_t)*packed_uvs.size() +
+         sizeof(Float2)*(uv_offsets.size() + uv_scales.size());
 }
 
 
@@ -103,10 +251,7 @@ void Mesh::GetLocalGeometry(SurfaceInteraction& ia) const
   ia.pos = pos.cast<double>();
   const Float3 normal = Normalized(Cross(vertices.row(b)-vertices.row(a),vertices.row(c)-vertices.row(a)));
   ia.geometry_normal = normal.cast<double>();
-  const Float3 smooth_normal = Normalized(
-                    normals.row(a)*f[0]+
-                    normals.row(b)*f[1]+
-                    normals.row(c)*f[2]);
+  const Float3 smooth_normal = Normalized(InterpolatedNormal(ia.hitid.index, f));
   ia.smooth_normal = smooth_normal.cast<double>();
   assert  (ia.pos.allFinite());
   assert  (ia.geometry_normal.allFinite());
@@ -228,6 +373,72 @@ std::unique_ptr<Geometry> Spheres::Clone() const
 }
 
 
+//////////////////////////////////////////////////////////////////////
+
+Instance::Instance(const Mesh &prototype, const Transform &transform)
+  : Geometry(Geometry::PRIMITIVES_INSTANCE),
+    prototype{ &prototype },
+    transform{ transform },
+    normal_transform{ transform.linear().inverse().transpose() }
+{
+}
+
+
+void Instance::Append(const Geometry &)
+{
+  throw std::runtime_error("Instances cannot be merged with other geometry");
+}
+
+
+HitId Instance::SampleUniformPosition(index_t index, Sampler &sampler) const
+{
+  HitId hit = prototype->SampleUniformPosition(index, sampler);
+  hit.geom = this;
+  return hit;
+}
+
+
+double Instance::Area(index_t index) const
+{
+  assert(index >= 0 && index < Size());
+  const auto tri = prototype->vert_indices.row(index);
+  const Float3 a = transform * Float3{ prototype->vertices.row(tri[0]) };
+  const Float3 b = transform * Float3{ prototype->vertices.row(tri[1]) };
+  const Float3 c = transform * Float3{ prototype->vertices.row(tri[2]) };
+  return 0.5*Length(Cross(b - a, c - a));
+}
+
+
+void Instance::GetLocalGeometry(SurfaceInteraction& ia) const
+{
+  assert(ia.hitid.geom == this);
+  ia.hitid.geom = prototype;
+  prototype->GetLocalGeometry(ia);
+  ia.hitid.geom = this;
+  ToWorld(ia);
+}
+
+
+void Instance::ToWorld(SurfaceInteraction &ia) const
+{
+  // Error bounds of the transformed position according to PBRT Chpt. 2.8.5.
+  const Float3 p = ia.pos.cast<float>();
+  const Eigen::Matrix3f abs_linear = transform.linear().cwiseAbs();
+  ia.pos_bounds = 
+    (util::Gamma<float>(3) + 1.f) * (abs_linear * ia.pos_bounds) + 
+    util::Gamma<float>(3) * (abs_linear * p.cwiseAbs() + transform.translation().cwiseAbs());
+  ia.pos = (transform * p).cast<double>();
+  ia.geometry_normal = Normalized(NormalToWorld(ia.geometry_normal.cast<float>())).cast<double>();
+  ia.smooth_normal = Normalized(NormalToWorld(ia.smooth_normal.cast<float>())).cast<double>();
+}
+
+
+std::unique_ptr<Geometry> Instance::Clone() const
+{
+  return std::make_unique<Instance>(*this);
+}
+
+
 //////////////////////////////////////////////////////////////////////
 #if 0
 Points::Points()  :
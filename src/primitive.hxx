@@ -41,6 +41,7 @@ public:
     PRIMITIVES_TRIANGLES,
     PRIMITIVES_SPHERES,
     PRIMITIVES_POINTS,
+    PRIMITIVES_INSTANCE,
   } const type;
   MaterialIndex material_index{ -1 };
   index_t light_num_offset = -1;
@@ -53,6 +54,7 @@ public:
   virtual void GetLocalGeometry(SurfaceInteraction &interaction) const = 0;
   virtual void Append(const Geometry &other) = 0;
   virtual std::unique_ptr<Geometry> Clone() const = 0;
+  virtual std::size_t MemoryUsage() const = 0; // In bytes. Only the geometry data, not the BVH.
 };
 
 
@@ -70,21 +72,42 @@ class Mesh : public Geometry
     Indices3d vert_indices; // Vertex indices per triangle.
     Vectors3d normals; // Per vertex.
     Vectors2d uvs; // Per vertex.
+    // Compact layout replacing normals and uvs after Compact() was called.
+    using PackedUvs = Eigen::Matrix<std::uint16_t, Eigen::Dynamic, 2, Eigen::RowMajor>;
+    static constexpr int UV_CHUNK_SIZE = 256; // Consecutive vertices which share the quantization range of the uvs.
+    static constexpr float MAX_UV_CHUNK_RANGE = 8.f; // Beyond this the uvs are not quantized.
+    ToyVector<std::uint32_t> packed_normals; // Octahedral encoding with 16 bit per coordinate.
+    PackedUvs packed_uvs; // uv = uv_offsets[c] + uv_scales[c] * packed_uv, with c = vertex / UV_CHUNK_SIZE. Empty if uvs is used.
+    ToyVector<Float2> uv_offsets;
+    ToyVector<Float2> uv_scales;
+    bool compact = false;
 
     Mesh(index_t num_triangles, index_t num_vertices);
     
     void Append(const Mesh &other);
     void Append(const Geometry &other) override;
+    // Like Append for each, but the buffers are reallocated only once.
+    void AppendAll(const ToyVector<const Mesh*> &others);
     void MakeFlatNormals();
+    // Quantizes the vertex attributes to 4 bytes per normal and 4 bytes per uv pair. The uvs are kept
+    // as they are if some chunk of vertices spans more than MAX_UV_CHUNK_RANGE.
+    // Afterwards the mesh can no longer be modified.
+    void Compact();
     
     inline index_t NumVertices() const { return (index_t)vertices.rows(); }
     inline index_t NumTriangles() const { return (index_t)vert_indices.rows(); }
+    Float3 Normal(index_t vertex) const; // Not normalized
+    Float2 Uv(index_t vertex) const;
+    // Interpolation weights correspond to the vertices of the triangle in the order of vert_indices.
+    Float3 InterpolatedNormal(index_t triangle, const Float3 &weights) const;
+    Float2 InterpolatedUv(index_t triangle, const Float3 &weights) const;
     
     HitId SampleUniformPosition(index_t index, Sampler &sampler) const override;
     double Area(index_t index) const override;
     index_t Size() const override { return NumTriangles(); }
     void GetLocalGeometry(SurfaceInteraction &interaction) const override;
     std::unique_ptr<Geometry> Clone() const override;
+    std::size_t MemoryUsage() const override;
 };
 
 void AppendSingleTriangle(Mesh &mesh,
@@ -106,10 +129,37 @@ class Spheres : public Geometry
     HitId SampleUniformPosition(index_t index, Sampler &sampler) const override;
     double Area(index_t index) const override;
     int Size() const override { return NumSpheres(); }
+    std::size_t MemoryUsage() const override { return spheres.size()*sizeof(Vector4f); }
     void GetLocalGeometry(SurfaceInteraction &interaction) const override;
     std::unique_ptr<Geometry> Clone() const override;
 };
 
+/* Placement of a shared prototype mesh, e.g. of a model which occurs many times in the scene.
+ * The prototype is stored once. Embree sees it as instance of a separate BVH. Primitive indices 
+ * and barycentric coordinates refer to the prototype. Positions, normals and areas are in world space.
+ * Each instance has its own material, light index offset and index in the scene. So it is 
+ * the instance which HitId::geom points to. */
+class Instance : public Geometry
+{
+  public:
+    using Transform = Eigen::Transform<float, 3, Eigen::Affine>;
+    const Mesh* prototype;
+    Transform transform; // Object to world
+    Eigen::Matrix3f normal_transform;
+
+    Instance(const Mesh &prototype, const Transform &transform);
+    HitId SampleUniformPosition(index_t index, Sampler &sampler) const override;
+    double Area(index_t index) const override;
+    index_t Size() const override { return prototype->Size(); }
+    void GetLocalGeometry(SurfaceInteraction &interaction) const override;
+    void Append(const Geometry &other) override;
+    std::unique_ptr<Geometry> Clone() const override;
+    std::size_t MemoryUsage() const override { return sizeof(Instance); } // The prototype is counted separately.
+    // Takes the geometry of a hit on the prototype to world space.
+    void ToWorld(SurfaceInteraction &interaction) const;
+    Float3 NormalToWorld(const Float3 &n) const { return normal_transform * n; } // Not normalized
+};
+
 #if 0
 class Points : public Geometry
 {
@@ -0,0 +1,443 @@
+#include "render_server.hxx"
+#include "image.hxx"
+#include "scene.hxx"
+#include "camera.hxx"
+#include "renderingalgorithms_interface.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fmt/core.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+namespace render_server
+{
+
+namespace
+{
+
+Error SystemError(const std::string &what)
+{
+  return Error(what + ": " + std::strerror(errno));
+}
+
+
+// Left over from a previous server. Anything but a socket is not ours to delete.
+void RemoveStaleSocket(const std::string &address)
+{
+  struct stat st;
+  if (::lstat(address.c_str(), &st) != 0)
+  {
+    if (errno == ENOENT)
+      return;
+    throw SystemError("Cannot stat " + address);
+  }
+  if (!S_ISSOCK(st.st_mode))
+    throw Error(address + " exists and is not a socket");
+  if (::unlink(address.c_str()) != 0)
+    throw SystemError("Cannot remove " + address);
+}
+
+} // namespace
+
+
+bool Connection::ReadMore()
+{
+  char tmp[4096];
+  while (true)
+  {
+    const auto n = ::read(in_fd, tmp, sizeof(tmp));
+    if (n > 0)
+    {
+      buffer.append(tmp, n);
+      return true;
+    }
+    if (n == 0)
+      return false;
+    if (errno != EINTR)
+      throw SystemError("Read failed");
+  }
+}
+
+
+bool Connection::ReadLine(std::string &line)
+{
+  std::size_t newline;
+  while ((newline = buffer.find('\n')) == std::string::npos)
+  {
+    if (!ReadMore())
+    {
+      if (buffer.empty())
+        return false;
+      line = std::move(buffer);
+      buffer.clear();
+      return true;
+    }
+  }
+  line = buffer.substr(0, newline);
+  buffer.erase(0, newline + 1);
+  if (!line.empty() && line.back() == '\r')
+    line.pop_back();
+  return true;
+}
+
+
+void Connection::ReadBytes(void *dst, std::size_t n)
+{
+  auto *p = static_cast<char*>(dst);
+  while (buffer.size() < n)
+  {
+    if (!ReadMore())
+      throw Error("Connection closed");
+  }
+  std::memcpy(p, buffer.data(), n);
+  buffer.erase(0, n);
+}
+
+
+void Connection::Write(const void *src, std::size_t n)
+{
+  auto *p = static_cast<const char*>(src);
+  while (n > 0)
+  {
+    const auto written = ::write(out_fd, p, n);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw SystemError("Write failed");
+    }
+    p += written;
+    n -= written;
+  }
+}
+
+
+SocketConnection::~SocketConnection()
+{
+  ::close(fd);
+}
+
+
+namespace
+{
+
+sockaddr_un MakeSocketAddress(const std::string &socket_path)
+{
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+    throw Error("Socket path is too long: " + socket_path);
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+} // namespace
+
+
+std::unique_ptr<SocketConnection> ConnectToServer(const std::string &socket_path)
+{
+  const auto addr = MakeSocketAddress(socket_path);
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw SystemError("Cannot create socket");
+  auto connection = std::make_unique<SocketConnection>(fd);
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+    throw SystemError("Cannot connect to " + socket_path);
+  return connection;
+}
+
+
+void SendImage(Connection &connection, const Image &image, int num_passes, bool is_final)
+{
+  const int w = image.width();
+  const int h = image.height();
+  std::string data = fmt::format("image {} {} {} {}\n", w, h, num_passes, is_final ? 1 : 0);
+  const auto header_size = data.size();
+  data.resize(header_size + 3*std::size_t(w)*h);
+  char* p = &data[header_size];
+  for (int y = 0; y < h; ++y)
+  {
+    for (int x = 0; x < w; ++x, p += 3)
+    {
+      const auto rgb = image.get_pixel_uc3(x, y);
+      std::memcpy(p, rgb.data(), 3);
+    }
+  }
+  connection.Write(data);
+}
+
+
+bool ReceiveImage(Connection &connection, const std::string &header, Image &image, int *num_passes)
+{
+  std::istringstream is(header);
+  std::string tag;
+  int w = 0, h = 0, passes = 0, is_final = 0;
+  is >> tag >> w >> h >> passes >> is_final;
+  if (!is || tag != "image" || w <= 0 || h <= 0 || w > MAX_IMG_SIZE || h > MAX_IMG_SIZE)
+    throw Error("Bad image header: " + header);
+  std::string data(3*std::size_t(w)*h, '\0');
+  connection.ReadBytes(data.data(), data.size());
+  image.init(w, h);
+  const auto* p = reinterpret_cast<const Image::uchar*>(data.data());
+  for (int y = 0; y < h; ++y)
+  {
+    for (int x = 0; x < w; ++x, p += 3)
+      image.set_pixel(x, y, p[0], p[1], p[2]);
+  }
+  if (num_passes)
+    *num_passes = passes;
+  return is_final != 0;
+}
+
+
+namespace
+{
+
+struct Job
+{
+  RenderingParameters params;
+  bool has_view = false;
+  Double3 from, at, up;
+  double fov = 0.;
+  bool progressive = false;
+};
+
+
+Job ParseJob(const std::string &args, const RenderingParameters &base_params)
+{
+  Job job;
+  job.params = base_params;
+  auto &params = job.params;
+
+  // The exceptions of stoi and stod do not say much.
+  auto ParsePositiveInt = [](const std::string &key, const std::string &value) -> int {
+    std::size_t end = 0;
+    int x = 0;
+    try { x = std::stoi(value, &end); } catch (const std::logic_error &) {}
+    if (end != value.size() || x <= 0)
+      throw std::invalid_argument(key + " must be a positive integer");
+    return x;
+  };
+  auto ParsePositiveDouble = [](const std::string &key, const std::string &value) -> double {
+    std::size_t end = 0;
+    double x = 0.;
+    try { x = std::stod(value, &end); } catch (const std::logic_error &) {}
+    if (end != value.size() || !(x > 0.))
+      throw std::invalid_argument(key + " must be a positive number");
+    return x;
+  };
+  auto ParseVector = [](const std::string &key, std::string value) -> Double3 {
+    std::replace(value.begin(), value.end(), ',', ' ');
+    std::istringstream is(value);
+    Double3 v;
+    is >> v[0] >> v[1] >> v[2];
+    if (!is)
+      throw std::invalid_argument(key + " must be given as x,y,z");
+    return v;
+  };
+
+  int num_view_keys = 0;
+  std::istringstream is(args);
+  std::string token;
+  while (is >> token)
+  {
+    const auto eq = token.find('=');
+    if (eq == std::string::npos)
+      throw std::invalid_argument("Expected key=value but got " + token);
+    const auto key = token.substr(0, eq);
+    const auto value = token.substr(eq + 1);
+    if (key == "algo")
+    {
+      static const char* algos[] = { "pt", "pt2", "ptw", "bdpt", "normalvis", "ptg", "photonmap" };
+      if (std::find(std::begin(algos), std::end(algos), value) == std::end(algos))
+        throw std::invalid_argument("Unknown algorithm " + value);
+      params.algo_name = value;
+    }
+    else if (key == "w")
+      params.width = ParsePositiveInt(key, value);
+    else if (key == "h")
+      params.height = ParsePositiveInt(key, value);
+    else if (key == "spp")
+      params.max_samples_per_pixel = ParsePositiveInt(key, value);
+    else if (key == "rd")
+      params.max_ray_depth = ParsePositiveInt(key, value);
+    else if (key == "time-limit")
+      params.time_limit = ParsePositiveDouble(key, value);
+    else if (key == "target-error")
+      params.target_error = ParsePositiveDouble(key, value);
+    else if (key == "from" || key == "at" || key == "up")
+    {
+      (key == "from" ? job.from : key == "at" ? job.at : job.up) = ParseVector(key, value);
+      ++num_view_keys;
+    }
+    else if (key == "fov")
+    {
+      job.fov = ParsePositiveDouble(key, value);
+      ++num_view_keys;
+    }
+    else if (key == "progressive")
+      job.progressive = value == "1";
+    else
+      throw std::invalid_argument("Unknown key " + key);
+  }
+  if (num_view_keys != 0 && num_view_keys != 4)
+    throw std::invalid_argument("The camera needs all of from, at, up and fov");
+  job.has_view = num_view_keys == 4;
+  // Else the job would occupy the server until the client disconnects.
+  if (params.max_samples_per_pixel <= 0 && params.time_limit <= 0.)
+    throw std::invalid_argument("The job needs spp or time-limit");
+  return job;
+}
+
+
+void RenderJob(Scene &scene, const Camera *scene_camera, const Job &job, Connection &connection)
+{
+  const auto &params = job.params;
+  if (job.has_view)
+    scene.ReplaceCamera(std::make_unique<PerspectiveCamera>(job.from, job.at - job.from, job.up, job.fov, params.width, params.height));
+  else if (scene_camera)
+    scene.ReplaceCamera(scene_camera->WithResolution(params.width, params.height));
+  else
+    throw std::invalid_argument("The scene has no camera. Give from, at, up and fov.");
+
+  std::cout << "Rendering job with " << params.algo_name << " at " << params.width << "x" << params.height << std::endl;
+  auto algo = RenderAlgorithmFactory(scene, params);
+  algo->InitializeScene(scene);
+
+  int num_passes = 0;
+  bool connection_lost = false;
+  algo->SetInterruptCallback([&](bool is_complete_pass) {
+    if (!is_complete_pass)
+      return;
+    ++num_passes;
+    if (!job.progressive || connection_lost)
+      return;
+    try
+    {
+      SendImage(connection, *algo->GenerateImage(), num_passes, false);
+    }
+    catch (const Error &)
+    {
+      // No point in going on.
+      connection_lost = true;
+      algo->RequestFullStop();
+    }
+  });
+
+  algo->Run();
+
+  if (connection_lost)
+    throw Error("Connection lost during rendering");
+  SendImage(connection, *algo->GenerateImage(), num_passes, true);
+}
+
+
+// Returns true if the server should quit.
+bool HandleClient(Scene &scene, const Camera *scene_camera, const RenderingParameters &base_params, Connection &connection)
+{
+  std::string line;
+  while (connection.ReadLine(line))
+  {
+    std::istringstream is(line);
+    std::string command;
+    is >> command;
+    if (command.empty())
+      continue;
+    if (command == "quit")
+      return true;
+    try
+    {
+      if (command != "render")
+        throw std::invalid_argument("Unknown command " + command);
+      std::string args;
+      std::getline(is, args);
+      RenderJob(scene, scene_camera, ParseJob(args, base_params), connection);
+    }
+    catch (const Error &)
+    {
+      throw; // Connection problems end the session.
+    }
+    catch (const std::exception &e)
+    {
+      std::string msg = e.what();
+      std::replace(msg.begin(), msg.end(), '\n', ' ');
+      std::cout << "Job failed: " << msg << std::endl;
+      connection.Write("error " + msg + "\n");
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+
+void Serve(Scene &scene, const RenderingParameters &base_params, const std::string &address)
+{
+  // A client which goes away must not kill the server.
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // The scene camera is only the template for the cameras of the jobs.
+  auto scene_camera = scene.ReplaceCamera(nullptr);
+
+  if (address == "-")
+  {
+    // Everything else which would go to stdout, like the log, goes to stderr instead.
+    std::cout.flush();
+    const int out_fd = ::dup(STDOUT_FILENO);
+    if (out_fd < 0 || ::dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+      throw SystemError("Cannot redirect stdout");
+    Connection connection{ STDIN_FILENO, out_fd };
+    std::cout << "Waiting for jobs on stdin" << std::endl;
+    HandleClient(scene, scene_camera.get(), base_params, connection);
+    ::close(out_fd);
+  }
+  else
+  {
+    const auto addr = MakeSocketAddress(address);
+    const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+      throw SystemError("Cannot create socket");
+    SocketConnection listen_socket{ listen_fd }; // For closing it.
+    RemoveStaleSocket(address);
+    if (::bind(listen_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+      throw SystemError("Cannot bind to " + address);
+    if (::listen(listen_fd, 4) != 0)
+      throw SystemError("Cannot listen on " + address);
+    std::cout << "Waiting for jobs on " << address << std::endl;
+    // One client at a time. Rendering occupies all threads anyway.
+    bool quit = false;
+    while (!quit)
+    {
+      const int client_fd = ::accept(listen_fd, nullptr, nullptr);
+      if (client_fd < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw SystemError("Accept failed");
+      }
+      SocketConnection connection{ client_fd };
+      try
+      {
+        quit = HandleClient(scene, scene_camera.get(), base_params, connection);
+      }
+      catch (const Error &e)
+      {
+        std::cout << "Client dropped: " << e.what() << std::endl;
+      }
+    }
+    ::unlink(address.c_str());
+  }
+
+  scene.ReplaceCamera(std::move(scene_camera));
+}
+
+} // namespace render_server
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+class Image;
+class Scene;
+struct RenderingParameters;
+
+/* Keeps a scene with its acceleration structures in memory and renders one job after
+ * another, for many small renders of the same scene. Jobs arrive over a UNIX domain socket,
+ * or over stdin if the address is "-". Then images go to stdout and the log to stderr.
+ *
+ * Protocol. The client sends one line per job:
+ *   render [key=value ...]
+ * Keys are
+ *   algo, w, h, spp, rd, time-limit, target-error  - Like the command line options of toytrace.
+ *                                                    Defaults are taken from the server's command line.
+ *                                                    Jobs which end up with neither spp nor time-limit are refused.
+ *   from=x,y,z at=x,y,z up=x,y,z fov=degrees       - Perspective camera. All four or none.
+ *                                                    Else the camera of the scene file is used.
+ *   progressive=1                                  - Send the image after every pass, too.
+ * The server answers with any number of
+ *   image <width> <height> <number of passes> <final: 0 or 1>
+ * each followed by width*height*3 bytes of 8 bit RGB in the row order of Image. After the
+ * image with final=1 the next job can be sent. Failed jobs are answered with
+ *   error <message>
+ * The line
+ *   quit
+ * makes the server exit.
+ */
+namespace render_server
+{
+
+class Error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+
+// Buffered line and binary io on file descriptors.
+class Connection
+{
+  int in_fd;
+  int out_fd;
+  std::string buffer;
+  bool ReadMore();
+
+public:
+  Connection(int in_fd, int out_fd) : in_fd{ in_fd }, out_fd{ out_fd } {}
+  Connection(const Connection &) = delete;
+  Connection& operator=(const Connection &) = delete;
+
+  // False at end of input.
+  bool ReadLine(std::string &line);
+  void ReadBytes(void *dst, std::size_t n);
+  void Write(const void *src, std::size_t n);
+  void Write(const std::string &s) { Write(s.data(), s.size()); }
+};
+
+
+// Socket connections close their descriptor when destroyed.
+class SocketConnection : public Connection
+{
+  int fd;
+public:
+  explicit SocketConnection(int fd) : Connection{ fd, fd }, fd{ fd } {}
+  ~SocketConnection();
+};
+
+std::unique_ptr<SocketConnection> ConnectToServer(const std::string &socket_path);
+
+void SendImage(Connection &connection, const Image &image, int num_passes, bool is_final);
+
+// Reads the pixels which follow an "image" header line. Returns is_final.
+bool ReceiveImage(Connection &connection, const std::string &header, Image &image, int *num_passes = nullptr);
+
+// Runs until the "quit" command. base_params provides the defaults for the jobs.
+void Serve(Scene &scene, const RenderingParameters &base_params, const std::string &address);
+
+} // namespace render_server
@@ -3,6 +3,17 @@
 #include "vec3f.hxx"
 #include "util.hxx"
 #include "spectral.hxx"
+#include "span.hxx"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+#include <tbb/spin_mutex.h>
+#include <tbb/parallel_for.h>
 
 
 class ImageTileSet
@@ -14,8 +25,8 @@ public:
         Int2 shape;
     };
 
-    ImageTileSet(Int2 im_shape_)
-        : im_shape_{im_shape_}
+    ImageTileSet(Int2 im_shape_, int tile_size_ = basicTileSize())
+        : tile_size_{tile_size_}, im_shape_{im_shape_}
     {
         // Careful with rounding ...
 
@@ -25,7 +36,7 @@ public:
         //    32               1
         //    33               2
         //  ...
-        shape_ = (im_shape_ + basicTileSize() - 1) / basicTileSize();
+        shape_ = (im_shape_ + tile_size_ - 1) / tile_size_;
     }
 
     int size() const { return shape_.prod(); }
@@ -37,15 +48,45 @@ public:
         int i = idx - shape_[0] * j;
         // Pixel coordinates
         Int2 xy{ i, j };
-        xy *= basicTileSize();
-        Int2 s = (im_shape_ - xy).cwiseMin(basicTileSize());
+        xy *= tile_size_;
+        Int2 s = (im_shape_ - xy).cwiseMin(tile_size_);
         return { xy, s };
     }
 
+    int tileSize() const { return tile_size_; }
+    Int2 imageShape() const { return im_shape_; }
+
+    // Tile indices ordered along a Z-curve through the tile grid. Consecutive tiles are 
+    // neighbours most of the time, which is good for cache reuse.
+    ToyVector<int> mortonOrder() const
+    {
+        auto spread_bits = [](std::uint32_t x) -> std::uint32_t {
+            x &= 0x0000ffff;
+            x = (x | (x << 8)) & 0x00ff00ff;
+            x = (x | (x << 4)) & 0x0f0f0f0f;
+            x = (x | (x << 2)) & 0x33333333;
+            x = (x | (x << 1)) & 0x55555555;
+            return x;
+        };
+        ToyVector<std::pair<std::uint32_t, int>> keyed; keyed.reserve(size());
+        for (int idx = 0; idx < size(); ++idx)
+        {
+            const int j = idx / shape_[0];
+            const int i = idx - shape_[0] * j;
+            keyed.emplace_back(spread_bits(i) | (spread_bits(j) << 1), idx);
+        }
+        std::sort(keyed.begin(), keyed.end());
+        ToyVector<int> order; order.reserve(size());
+        for (const auto &[key, idx] : keyed)
+            order.push_back(idx);
+        return order;
+    }
+
     static constexpr int basicTileSize() { return 16;  }
     static constexpr int basicPixelsPerTile() { return basicTileSize()*basicTileSize(); }
 
 private:
+    int tile_size_;
     Int2 shape_; // Size of the tile grid
     Int2 im_shape_;
 };
@@ -96,6 +137,25 @@ private:
 namespace framebuffer
 {
 
+// Clamps and converts to 8 bit. y runs from the top of the image.
+inline void SetPixel(Image &dest, int x, int y, RGB average, const bool convert_linear_to_srgb = true)
+{
+  bool isfinite = average.isFinite().all();
+  assert(isfinite);
+
+  Image::uchar rgb[3];
+
+  average = average.max(0._rgb).min(1._rgb);
+  if (isfinite)
+  {
+    for (int i = 0; i < 3; ++i)
+    {
+      rgb[i] = Image::uchar(convert_linear_to_srgb ? value(Color::LinearToSRGB(average[i])*255.999_rgb) : value(average[i] * 255.999_rgb));
+    }
+    dest.set_pixel(x, dest.height() - 1 - y, rgb[0], rgb[1], rgb[2]);
+  }
+}
+
 inline void ToImage(Image &dest, int xstart, int xend, int ystart, int yend, Span<const RGB> framebuffer, std::uint64_t sampleCount, const bool convert_linear_to_srgb = true)
 {
   assert(ystart >= 0 && yend >= ystart && yend <= dest.height());
@@ -105,21 +165,7 @@ inline void ToImage(Image &dest, int xstart, int xend, int ystart, int yend, Spa
     for (int x = xstart; x < xend; ++x)
     {
       int pixel_index = xres * y + x;
-      RGB average = framebuffer[pixel_index] / Color::RGBScalar(sampleCount);
-      bool isfinite = average.isFinite().all();
-      assert(isfinite);
-
-      Image::uchar rgb[3];
-
-      average = average.max(0._rgb).min(1._rgb);
-      if (isfinite)
-      {
-        for (int i = 0; i < 3; ++i)
-        {
-          rgb[i] = Image::uchar(convert_linear_to_srgb ? value(Color::LinearToSRGB(average[i])*255.999_rgb) : value(average[i] * 255.999_rgb));
-        }
-        dest.set_pixel(x, dest.height() - 1 - y, rgb[0], rgb[1], rgb[2]);
-      }
+      SetPixel(dest, x, y, framebuffer[pixel_index] / Color::RGBScalar(sampleCount), convert_linear_to_srgb);
     }
   }
 }
@@ -139,11 +185,389 @@ inline void ToImage(Image &dest, const ImageTileSet::Tile &tile, Span<const RGB>
 }
 
 
+/* Accumulation buffer for the algorithms which render tile by tile. The sums are stored
+ * tile-major, so that the pixels of a tile are contiguous and every tile starts on its own
+ * cache line. The sample counts of the tiles are padded to cache lines, too. Workers may 
+ * therefore add to different tiles concurrently without false sharing.
+ * Samples are added to float sums, which hold only the current pass of the tile. When the
+ * tile is done, they are folded into the double sums over all passes and reset. Thus the
+ * additions write half the memory of double sums, while long renders keep their precision.
+ * Pixels are addressed by their scanline index, like everywhere else.
+ */
+class TiledFramebuffer
+{
+  static constexpr int CACHE_LINE_SIZE = 64;
+
+  struct alignas(CACHE_LINE_SIZE) TileCount
+  {
+    std::uint64_t samples = 0;
+  };
+
+  ImageTileSet tileset;
+  int xres = 0;
+  int tile_size = 0;
+  int tiles_x = 0;
+  // Elements per tile, padded to whole cache lines.
+  int pass_tile_stride = 0;
+  int total_tile_stride = 0;
+  ToyVector<float, util::AlignedAllocator<float, CACHE_LINE_SIZE>> pass_sums;
+  ToyVector<double, util::AlignedAllocator<double, CACHE_LINE_SIZE>> total_sums;
+  ToyVector<TileCount, util::AlignedAllocator<TileCount, CACHE_LINE_SIZE>> counts;
+
+  // Index of the pixel within its tile, and the tile index.
+  std::pair<int, int> Locate(int pixel_index) const
+  {
+    const int y = pixel_index / xres;
+    const int x = pixel_index - y*xres;
+    const int ty = y / tile_size;
+    const int tx = x / tile_size;
+    const int tile_index = tx + ty*tiles_x;
+    const int local = (x - tx*tile_size) + (y - ty*tile_size)*tile_size;
+    return { local, tile_index };
+  }
+
+  template<class T>
+  static int PaddedStride(int num_elements)
+  {
+    constexpr int per_line = CACHE_LINE_SIZE / sizeof(T);
+    return (num_elements + per_line - 1) / per_line * per_line;
+  }
+
+public:
+  explicit TiledFramebuffer(const ImageTileSet &tileset_)
+    : tileset{ tileset_ }, xres{ tileset_.imageShape()[0] }, tile_size{ tileset_.tileSize() }, tiles_x{ tileset_.shape()[0] }
+  {
+    // Border tiles waste some space, but all tiles have the same layout.
+    pass_tile_stride = PaddedStride<float>(3 * tile_size * tile_size);
+    total_tile_stride = PaddedStride<double>(3 * tile_size * tile_size);
+    pass_sums.resize(tileset.size() * pass_tile_stride, 0.f);
+    total_sums.resize(tileset.size() * total_tile_stride, 0.);
+    counts.resize(tileset.size());
+  }
+
+  const ImageTileSet& Tiles() const { return tileset; }
+
+  // Call from the worker which renders the tile of the pixel.
+  void Add(int pixel_index, const RGB &color)
+  {
+    const auto [local, tile_index] = Locate(pixel_index);
+    float* sum = &pass_sums[tile_index*pass_tile_stride + 3*local];
+    for (int c = 0; c < 3; ++c)
+      sum[c] += float(value(color[c]));
+  }
+
+  // Sum of the samples of the pixel. Includes the pass in progress.
+  RGB Sum(int pixel_index) const
+  {
+    const auto [local, tile_index] = Locate(pixel_index);
+    const float* pass = &pass_sums[tile_index*pass_tile_stride + 3*local];
+    const double* total = &total_sums[tile_index*total_tile_stride + 3*local];
+    return RGB{ 
+      Color::RGBScalar{ total[0] + pass[0] }, 
+      Color::RGBScalar{ total[1] + pass[1] }, 
+      Color::RGBScalar{ total[2] + pass[2] } };
+  }
+
+  RGB Average(int pixel_index) const
+  {
+    const std::uint64_t n = counts[Locate(pixel_index).second].samples;
+    return n > 0 ? RGB{ Sum(pixel_index) / Color::RGBScalar(n) } : RGB{ RGB::Zero() };
+  }
+
+  // Call from the worker which rendered the tile, when it is done with it. Folds the pass into the total sums.
+  void AddSampleCount(int tile_index, std::uint64_t samples_per_pixel)
+  {
+    counts[tile_index].samples += samples_per_pixel;
+    float* pass = &pass_sums[tile_index*pass_tile_stride];
+    double* total = &total_sums[tile_index*total_tile_stride];
+    for (int i = 0; i < 3*tile_size*tile_size; ++i)
+    {
+      total[i] += pass[i];
+      pass[i] = 0.f;
+    }
+  }
+
+  std::uint64_t SampleCount(int tile_index) const
+  {
+    return counts[tile_index].samples;
+  }
+
+  std::uint64_t MaxSampleCount() const
+  {
+    std::uint64_t n = 0;
+    for (const auto &c : counts)
+      n = std::max(n, c.samples);
+    return n;
+  }
+
+  void Clear()
+  {
+    std::fill(pass_sums.begin(), pass_sums.end(), 0.f);
+    std::fill(total_sums.begin(), total_sums.end(), 0.);
+    std::fill(counts.begin(), counts.end(), TileCount{});
+  }
+
+  // Runs along the contiguous rows of the tile. Only the folded sums are read, since
+  // images are made between passes.
+  void TileToImage(Image &dest, int tile_index, const bool convert_linear_to_srgb = true) const
+  {
+    const std::uint64_t n = counts[tile_index].samples;
+    if (n == 0)
+      return;
+    const auto tile = tileset[tile_index];
+    const double inv_n = 1. / double(n);
+    const double* sums = &total_sums[tile_index*total_tile_stride];
+    for (int ly = 0; ly < tile.shape[1]; ++ly)
+    {
+      const double* row = sums + 3*ly*tile_size;
+      for (int lx = 0; lx < tile.shape[0]; ++lx, row += 3)
+      {
+        const RGB average{ Color::RGBScalar{ row[0]*inv_n }, Color::RGBScalar{ row[1]*inv_n }, Color::RGBScalar{ row[2]*inv_n } };
+        framebuffer::SetPixel(dest, tile.corner[0] + lx, tile.corner[1] + ly, average, convert_linear_to_srgb);
+      }
+    }
+  }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar.Expect(tileset.size(), "number of tiles");
+    ar.Expect(tile_size, "tile size");
+    // Checkpoints are made between passes, when everything is folded into the totals.
+    ar(total_sums);
+    ar(counts);
+  }
+};
+
+
+namespace framebuffer
+{
+
+inline void ToImage(Image &dest, const TiledFramebuffer &framebuffer, const bool convert_linear_to_srgb = true)
+{
+  tbb::parallel_for(0, framebuffer.Tiles().size(), [&dest, &framebuffer, convert_linear_to_srgb](int i) {
+    framebuffer.TileToImage(dest, i, convert_linear_to_srgb);
+  });
+}
+
+}
+
+
+/* Preview of the image which is updated while the workers keep going. A worker publishes
+ * the pixel averages of a tile when it is done with it. A snapshot tone-maps only the tiles
+ * published since the previous snapshot. The lock of a tile is shared only between the
+ * worker which publishes it and the one taking the snapshot, so it is hardly ever contended.
+ */
+class TileSnapshot
+{
+  struct alignas(64) Slot
+  {
+    tbb::spin_mutex mutex;
+    ToyVector<RGB> pixels; // Row by row within the tile.
+    std::uint64_t version = 0;
+  };
+
+  ImageTileSet tileset;
+  std::unique_ptr<Slot[]> slots;
+  ToyVector<std::uint64_t> seen_versions; // Only used by the snapshot taker.
+
+public:
+  explicit TileSnapshot(const ImageTileSet &tileset_)
+    : tileset{ tileset_ }, slots{ std::make_unique<Slot[]>(tileset_.size()) }, seen_versions(tileset_.size(), 0)
+  {
+  }
+
+  // average_of_pixel(pixel_index) -> RGB. Must only read pixels which the calling worker owns.
+  template<class PixelAverage>
+  void Publish(int tile_index, PixelAverage &&average_of_pixel)
+  {
+    const auto tile = tileset[tile_index];
+    const int xres = tileset.imageShape()[0];
+    auto &slot = slots[tile_index];
+    tbb::spin_mutex::scoped_lock lock(slot.mutex);
+    slot.pixels.resize(tile.shape.prod());
+    int k = 0;
+    for (int iy = tile.corner[1]; iy < tile.corner[1] + tile.shape[1]; ++iy)
+      for (int ix = tile.corner[0]; ix < tile.corner[0] + tile.shape[0]; ++ix)
+        slot.pixels[k++] = average_of_pixel(ix + iy*xres);
+    ++slot.version;
+  }
+
+  // Returns the number of tiles which were updated in dest. Not thread safe w.r.t. itself.
+  int Update(Image &dest, const bool convert_linear_to_srgb = true)
+  {
+    int num_updated = 0;
+    for (int i = 0; i < tileset.size(); ++i)
+    {
+      auto &slot = slots[i];
+      tbb::spin_mutex::scoped_lock lock(slot.mutex);
+      if (slot.version == seen_versions[i])
+        continue;
+      const auto tile = tileset[i];
+      int k = 0;
+      for (int iy = tile.corner[1]; iy < tile.corner[1] + tile.shape[1]; ++iy)
+        for (int ix = tile.corner[0]; ix < tile.corner[0] + tile.shape[0]; ++ix)
+          framebuffer::SetPixel(dest, ix, iy, slot.pixels[k++], convert_linear_to_srgb);
+      seen_versions[i] = slot.version;
+      ++num_updated;
+    }
+    return num_updated;
+  }
+};
+
+
+
+
+// For adaptive sampling. Estimates the relative error of each tile from the spread of
+// the per-pass pixel means, and marks a tile as converged once its error falls below the
+// target. Only luminance is considered. The framebuffer is expected to hold sums over all
+// samples taken so far. Different tiles may be updated concurrently.
+class TileConvergenceTracker
+{
+public:
+  TileConvergenceTracker(const ImageTileSet &tileset, Int2 im_shape, double target_error)
+    : tiles(tileset.size()), width{ im_shape[0] }, target_error{ target_error }
+  {
+    if (Enabled())
+    {
+      prev_sums.resize(im_shape.prod(), 0.);
+      sum_sqr_means.resize(im_shape.prod(), 0.);
+    }
+  }
+
+  bool Enabled() const { return target_error > 0.; }
+
+  bool IsActive(int tile_index) const { return !tiles[tile_index].converged; }
+
+  int NumActive() const
+  {
+    return (int)std::count_if(tiles.begin(), tiles.end(), [](const TileState &t) { return !t.converged; });
+  }
+
+  bool AllConverged() const { return Enabled() && NumActive() == 0; }
+
+  double Error(int tile_index) const { return tiles[tile_index].error; }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar.Expect(tiles.size(), "number of tiles");
+    ar(tiles);
+    ar(prev_sums);
+    ar(sum_sqr_means);
+    if constexpr (Archive::is_loading)
+    {
+      if (Enabled() && prev_sums.empty())
+        throw std::runtime_error("Cannot enable the error target when resuming a render which was started without");
+      // The target may have changed.
+      for (auto &t : tiles)
+        t.converged = Enabled() && t.num_passes >= MIN_PASSES && t.error < target_error;
+    }
+  }
+
+  // Call after the pixels of the tile received samples_added more samples each.
+  void Update(int tile_index, const ImageTileSet::Tile &tile, Span<const RGB> framebuffer, std::uint64_t samples_added)
+  {
+    UpdateWith(tile_index, tile, [framebuffer](int pixel_index) { return framebuffer[pixel_index]; }, samples_added);
+  }
+
+  void Update(int tile_index, const ImageTileSet::Tile &tile, const TiledFramebuffer &framebuffer, std::uint64_t samples_added)
+  {
+    UpdateWith(tile_index, tile, [&framebuffer](int pixel_index) { return framebuffer.Sum(pixel_index); }, samples_added);
+  }
+
+private:
+  template<class PixelSum>
+  void UpdateWith(int tile_index, const ImageTileSet::Tile &tile, PixelSum &&pixel_sum, std::uint64_t samples_added)
+  {
+    if (!Enabled() || samples_added == 0)
+      return;
+    auto &t = tiles[tile_index];
+    t.num_samples += samples_added;
+    ++t.num_passes;
+    // Pass means m_k over n_k samples have variance sigma^2/n_k. Hence 
+    // sum_k n_k (m_k - m)^2 is an estimate of (K-1) sigma^2, where m is the overall mean.
+    const double n = double(samples_added);
+    const double total = double(t.num_samples);
+    double sum_sqr_errors = 0.;
+    const Int2 end = tile.corner + tile.shape;
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+    {
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+      {
+        const int pixel_index = ix + iy*width;
+        const double sum = Luminance(pixel_sum(pixel_index));
+        const double pass_mean = (sum - prev_sums[pixel_index]) / n;
+        prev_sums[pixel_index] = sum;
+        sum_sqr_means[pixel_index] += n*pass_mean*pass_mean;
+        if (t.num_passes < 2)
+          continue;
+        const double mean = sum / total;
+        const double variance = std::max(0., (sum_sqr_means[pixel_index] - sum*mean) / (t.num_passes - 1));
+        const double rel_error = std::sqrt(variance / total) / (std::abs(mean) + DARK_PIXEL_EPS);
+        sum_sqr_errors += rel_error*rel_error;
+      }
+    }
+    t.error = t.num_passes >= 2 ? std::sqrt(sum_sqr_errors / tile.shape.prod()) : std::numeric_limits<double>::infinity();
+    t.converged = t.num_passes >= MIN_PASSES && t.error < target_error;
+  }
+
+  static double Luminance(const RGB &c)
+  {
+    return 0.2126*value(c[0]) + 0.7152*value(c[1]) + 0.0722*value(c[2]);
+  }
+
+  // Few passes give unreliable variance estimates.
+  static constexpr int MIN_PASSES = 4;
+  // Keeps near black pixels from dominating the relative error.
+  static constexpr double DARK_PIXEL_EPS = 1.e-2;
+
+  struct TileState
+  {
+    std::uint64_t num_samples = 0;
+    int num_passes = 0;
+    double error = std::numeric_limits<double>::infinity();
+    bool converged = false;
+  };
+
+  ToyVector<TileState> tiles;
+  ToyVector<double> prev_sums; // Luminance of the framebuffer at the last update.
+  ToyVector<double> sum_sqr_means; // Sum over passes of n_k m_k^2.
+  int width;
+  double target_error;
+};
+
+
+/* Raw sums and sample counts of a render which covers only some of the tiles or
+ * samples of the image. The parts of a frame rendered by different processes are
+ * added up with toytrace-merge.
+ */
+struct PartialImage
+{
+  int xres = 0, yres = 0;
+  ToyVector<int> count; // Per pixel
+  long splat_count = 0;
+  ToyVector<RGB> accumulator;
+  ToyVector<RGB> light_accum;
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(xres);
+    ar(yres);
+    ar(count);
+    ar(splat_count);
+    ar(accumulator);
+    ar(light_accum);
+    if (isize(count) != xres*yres || isize(accumulator) != xres*yres || isize(light_accum) != xres*yres)
+      throw std::runtime_error("Partial image has inconsistent size");
+  }
+};
 
 
 class Spectral3ImageBuffer
 {
-  int count;
+  ToyVector<int> count; // Per pixel, because adaptive sampling may skip parts of the image.
   long splat_count;
   ToyVector<RGB>  accumulator;
   ToyVector<RGB>  light_accum;
@@ -151,23 +575,84 @@ public:
   const int xres, yres;
   
   Spectral3ImageBuffer(int _xres, int _yres)
-    : count{0}, splat_count{0}, xres(_xres), yres(_yres)
+    : splat_count{0}, xres(_xres), yres(_yres)
   {
     int sz = _xres * _yres;
     assert(sz > 0);
+    count.resize(sz, 0);
     accumulator.resize(sz, RGB::Zero());
     light_accum.resize(sz, RGB::Zero());
   }
   
   void AddSampleCount(int samples_per_pixel)
   {
-    count += samples_per_pixel;
+    for (auto &c : count)
+      c += samples_per_pixel;
+  }
+
+  void AddSampleCount(const ImageTileSet::Tile &tile, int samples_per_pixel)
+  {
+    const Int2 end = tile.corner + tile.shape;
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+        count[ix + iy*xres] += samples_per_pixel;
+  }
+
+  Span<const RGB> Accumulator() const
+  {
+    return AsSpan(accumulator);
+  }
+
+  int SampleCount(int pixel_index) const
+  {
+    return count[pixel_index];
+  }
+
+  PartialImage ToPartialImage() const
+  {
+    return PartialImage{ xres, yres, count, splat_count, accumulator, light_accum };
+  }
+
+  void Add(const PartialImage &other)
+  {
+    if (other.xres != xres || other.yres != yres)
+      throw std::invalid_argument("Partial image size does not match");
+    for (int i = 0; i < xres*yres; ++i)
+    {
+      count[i] += other.count[i];
+      accumulator[i] += other.accumulator[i];
+      light_accum[i] += other.light_accum[i];
+    }
+    splat_count += other.splat_count;
+  }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar.Expect(xres, "image width");
+    ar.Expect(yres, "image height");
+    ar(count);
+    ar(splat_count);
+    ar(accumulator);
+    ar(light_accum);
   }
   
   void Splat(int pixel_index, const RGB &value)
   {
     light_accum[pixel_index] += value;
   }
+
+  // Like Insert but for concurrent use on distinct pixels. The caller accounts for the
+  // splat count through AddSplatCount.
+  void Accumulate(int pixel_index, const RGB &value)
+  {
+    accumulator[pixel_index] += value;
+  }
+
+  void AddSplatCount(long n)
+  {
+    splat_count += n;
+  }
   
   void Insert(int pixel_index, const RGB &value)
   {
@@ -180,29 +665,22 @@ public:
     ++splat_count;
   }
   
+  RGB Average(int pixel_index) const
+  {
+    const Color::RGBScalar splat_weight(splat_count>0 ? double(xres*yres)/(splat_count) : 0.); // Multiply with xres*yres because I divided it out in the path tracer code.
+    RGB average = count[pixel_index] > 0 ? RGB{accumulator[pixel_index] / Color::RGBScalar(count[pixel_index])} : RGB::Zero();
+    average += splat_weight * light_accum[pixel_index];
+    return average;
+  }
+
   void ToImage(Image &dest, int xstart, int xend, int ystart, int yend, const bool convert_linear_to_srgb = true) const
   {
     assert (ystart >= 0 && yend>= ystart && yend <= dest.height());
-    Color::RGBScalar splat_weight(splat_count>0 ? double(xres*yres)/(splat_count) : 0.); // Multiply with xres*yres because I divided it out in the path tracer code.
     for (int y = ystart; y < yend; ++y)
     {
         for (int x = xstart; x < xend; ++x)
         {
-            int pixel_index = xres * y + x;
-            RGB average = accumulator[pixel_index] / Color::RGBScalar(count);
-            average += splat_weight * light_accum[pixel_index];
-            Image::uchar rgb[3];
-            bool isfinite = average.isFinite().all();
-            assert(isfinite);
-            average = average.max(0._rgb).min(1._rgb);
-            if (isfinite)
-            {
-                for (int i = 0; i < 3; ++i)
-                {
-                    rgb[i] = Image::uchar(convert_linear_to_srgb ? value(Color::LinearToSRGB(average[i])*255.999_rgb) : value(average[i] * 255.999_rgb));
-                }
-                dest.set_pixel(x, dest.height() - 1 - y, rgb[0], rgb[1], rgb[2]);
-            }
+            framebuffer::SetPixel(dest, x, y, Average(xres * y + x), convert_linear_to_srgb);
         }
     }
   }
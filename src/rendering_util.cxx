@@ -38,13 +38,20 @@ void MediumTracker::initializePosition(const Double3& pos)
 
 
 Spectral3 TransmittanceEstimate(const Scene &scene, RaySegment seg, MediumTracker &medium_tracker, const PathContext &context, Sampler &sampler, VolumePdfCoefficients *volume_pdf_coeff)
+{
+    const RaySegment shadow_seg = ShadowRaySegment(seg);
+    if (scene.IsOccluded(shadow_seg.ray, 0., shadow_seg.length))
+      return Spectral3::Zero();
+
+    return UnoccludedTransmittanceEstimate(scene, seg, medium_tracker, context, sampler, volume_pdf_coeff);
+}
+
+
+Spectral3 UnoccludedTransmittanceEstimate(const Scene &scene, RaySegment seg, MediumTracker &medium_tracker, const PathContext &context, Sampler &sampler, VolumePdfCoefficients *volume_pdf_coeff)
 {
     Spectral3 result{1.};
     
-    seg.length *= 0.9999; // To avoid intersections with the adjacent nodes/positions/surfaces.
-
-    if (scene.IsOccluded(seg.ray, 0., seg.length))
-      return Spectral3::Zero();
+    seg = ShadowRaySegment(seg);
 
     auto iter = VolumeSegmentIterator(scene, seg.ray, medium_tracker, 0., seg.length);
     for (; iter; ++iter)
@@ -161,11 +161,11 @@ class SegmentIterator
 {
   MediumTracker *medium_tracker;
   Double3 dir; // Ray direction
-  BoundaryIntersection const *start, *end;
+  BoundaryIntersectionIterator boundaries;
   double tnear, tfar;
 public:
-  SegmentIterator(const Ray &ray, MediumTracker &medium_tracker, const Span<BoundaryIntersection> is, double tnear, double tfar) noexcept
-    : medium_tracker{&medium_tracker}, dir{ray.dir}, start{ is.begin() }, end{ is.end() }, tnear{ tnear }, tfar{ tfar }
+  SegmentIterator(const Ray &ray, MediumTracker &medium_tracker, const BoundaryIntersectionIterator &boundaries, double tnear, double tfar) noexcept
+    : medium_tracker{&medium_tracker}, dir{ray.dir}, boundaries{ boundaries }, tnear{ tnear }, tfar{ tfar }
   {
   }
 
@@ -177,22 +177,22 @@ public:
   void operator++()
   {
     //assert(static_cast<float>(tnear) < static_cast<float>(tfar)); // Not done yet
-    if (start == end)
+    if (!boundaries)
     {
       // Mark as invalid.
       tnear = tfar;
     }
     else
     {
-      medium_tracker->goingThroughSurface(dir, *start);
-      tnear = start->t;
-      ++start;
+      medium_tracker->goingThroughSurface(dir, *boundaries);
+      tnear = boundaries->t;
+      ++boundaries;
     }
   }
 
   std::pair<double, double> Interval() const noexcept
   {
-    return std::make_pair(tnear, (start==end ? tfar : start->t));
+    return std::make_pair(tnear, (boundaries ? (double)boundaries->t : tfar));
   }
 
   const Medium& operator*() const
@@ -203,18 +203,47 @@ public:
 
 inline SegmentIterator VolumeSegmentIterator(const Scene &scene, const Ray &ray, MediumTracker &medium_tracker, double tnear, double tfar)
 {
-  return SegmentIterator{ ray, medium_tracker, scene.IntersectionsWithVolumes(ray, tnear, tfar), tnear, tfar };
+  return SegmentIterator{ ray, medium_tracker, scene.VolumeBoundariesInOrder(ray, tnear, tfar), tnear, tfar };
 }
 
 
 
+/* Scratch space for intersecting the camera rays of an image tile in one go.
+ * Fill in the rays, call Intersect, then hand hits[i] and tfars[i] to the 
+ * tracking functions which take a precomputed surface hit.
+ */
+struct PrimaryRayBatch
+{
+  ToyVector<Ray> rays;
+  ToyVector<double> tfars;
+  ToyVector<std::optional<HitRecord>> hits;
+
+  void Clear()
+  {
+    rays.clear();
+  }
+
+  void Intersect(const Scene &scene)
+  {
+    tfars.assign(rays.size(), LargeNumber);
+    hits.resize(rays.size());
+    scene.FirstHits(AsSpan(rays), 0., AsSpan(tfars), AsSpan(hits));
+  }
+};
+
+
 /* Ray is the ray to shoot. It must already include the anti-self-intersection offset.
+ * hit and tfar must be what Scene::FirstHit returns for the ray. This variant
+ * exists for when the intersection was already computed, e.g. by PrimaryRayBatch.
+ * The hit is resolved only if the surface is reached.
   */
 template<class VolumeHitVisitor, class SurfaceHitVisitor, class EscapeVisitor>
 decltype(((EscapeVisitor*)nullptr)->operator()(Spectral3{}))  // Return type of the escape visitor
 inline TrackToNextInteraction(
   const Scene &scene,
   const Ray &ray,
+  const std::optional<HitRecord> &hit,
+  double tfar,
   const PathContext &context,
   const Spectral3 &initial_weight,
   Sampler &sampler,
@@ -225,9 +254,6 @@ inline TrackToNextInteraction(
   EscapeVisitor &&escape_visitor)
 {
   Spectral3 weight{1.};
-  
-  double tfar = LargeNumber;
-  const auto hit = scene.FirstIntersection(ray, 0., tfar);
 
   // The factor by which tfar is decreased is meant to prevent intersections which lie close to the end of the query segment.
   auto iter = VolumeSegmentIterator(scene, ray, medium_tracker, 0., tfar * 0.9999);
@@ -260,7 +286,7 @@ inline TrackToNextInteraction(
   // If we get here, there was no scattering in the medium.
   if (hit)
   {
-    return surface_visitor(*hit, tfar, weight);
+    return surface_visitor(scene.Resolve(*hit, ray), tfar, weight);
   }
   else
   {
@@ -269,10 +295,35 @@ inline TrackToNextInteraction(
 };
 
 
+/* Ray is the ray to shoot. It must already include the anti-self-intersection offset.
+  */
+template<class VolumeHitVisitor, class SurfaceHitVisitor, class EscapeVisitor>
+decltype(((EscapeVisitor*)nullptr)->operator()(Spectral3{}))  // Return type of the escape visitor
+inline TrackToNextInteraction(
+  const Scene &scene,
+  const Ray &ray,
+  const PathContext &context,
+  const Spectral3 &initial_weight,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  VolumePdfCoefficients *volume_pdf_coeff,
+  SurfaceHitVisitor &&surface_visitor,
+  VolumeHitVisitor &&volume_visitor,
+  EscapeVisitor &&escape_visitor)
+{
+  double tfar = LargeNumber;
+  const auto hit = scene.FirstHit(ray, 0., tfar);
+  return TrackToNextInteraction(scene, ray, hit, tfar, context, initial_weight, sampler, medium_tracker, volume_pdf_coeff,
+    std::forward<SurfaceHitVisitor>(surface_visitor), std::forward<VolumeHitVisitor>(volume_visitor), std::forward<EscapeVisitor>(escape_visitor));
+}
+
+
 std::tuple<MaybeSomeInteraction, double, Spectral3>
 inline TrackToNextInteraction(
   const Scene &scene,
   const Ray &ray,
+  const std::optional<HitRecord> &hit,
+  double tfar,
   const PathContext &context,
   const Spectral3 &initial_weight,
   Sampler &sampler,
@@ -281,7 +332,7 @@ inline TrackToNextInteraction(
 {
   using RetType = std::tuple<MaybeSomeInteraction, double, Spectral3>;
 
-  return TrackToNextInteraction(scene, ray, context, initial_weight, sampler, medium_tracker, volume_pdf_coeff,
+  return TrackToNextInteraction(scene, ray, hit, tfar, context, initial_weight, sampler, medium_tracker, volume_pdf_coeff,
     [&](const SurfaceInteraction &si, double tfar, const Spectral3 &weight) -> RetType
   {
     return RetType{ si, tfar, weight };
@@ -296,11 +347,30 @@ inline TrackToNextInteraction(
 }
 
 
+std::tuple<MaybeSomeInteraction, double, Spectral3>
+inline TrackToNextInteraction(
+  const Scene &scene,
+  const Ray &ray,
+  const PathContext &context,
+  const Spectral3 &initial_weight,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  VolumePdfCoefficients *volume_pdf_coeff)
+{
+  double tfar = LargeNumber;
+  const auto hit = scene.FirstHit(ray, 0., tfar);
+  return TrackToNextInteraction(scene, ray, hit, tfar, context, initial_weight, sampler, medium_tracker, volume_pdf_coeff);
+}
+
 
+
+// With precomputed intersection. See TrackToNextInteraction.
 template<class SurfaceHitVisitor, class EscapeVisitor, class SegmentVisitor>
 inline void TrackBeam(
   const Scene &scene,
   const Ray &ray,
+  const std::optional<HitRecord> &hit,
+  double tfar,
   const PathContext &context,
   Sampler &sampler,
   MediumTracker &medium_tracker,
@@ -309,9 +379,6 @@ inline void TrackBeam(
   EscapeVisitor &&escape_visitor)
 {
   Spectral3 weight{1.};
-  
-  double tfar = LargeNumber;
-  const auto hit = scene.FirstIntersection(ray, 0., tfar);
 
   PiecewiseConstantTransmittance pct;
   
@@ -336,7 +403,7 @@ inline void TrackBeam(
 
   if (hit)
   {
-    surface_visitor(*hit, weight);
+    surface_visitor(scene.Resolve(*hit, ray), weight);
   }
   else
   {
@@ -345,11 +412,93 @@ inline void TrackBeam(
 };
 
 
+template<class SurfaceHitVisitor, class EscapeVisitor, class SegmentVisitor>
+inline void TrackBeam(
+  const Scene &scene,
+  const Ray &ray,
+  const PathContext &context,
+  Sampler &sampler,
+  MediumTracker &medium_tracker,
+  SurfaceHitVisitor &&surface_visitor,
+  SegmentVisitor &&segment_visitor,
+  EscapeVisitor &&escape_visitor)
+{
+  double tfar = LargeNumber;
+  const auto hit = scene.FirstHit(ray, 0., tfar);
+  TrackBeam(scene, ray, hit, tfar, context, sampler, medium_tracker,
+    std::forward<SurfaceHitVisitor>(surface_visitor), std::forward<SegmentVisitor>(segment_visitor), std::forward<EscapeVisitor>(escape_visitor));
+}
+
+
 
 Spectral3 TransmittanceEstimate(const Scene &scene, RaySegment seg, MediumTracker &medium_tracker, 
                                 const PathContext &context, Sampler &sampler, 
                                 VolumePdfCoefficients *volume_pdf_coeff = nullptr);
 
+// Like TransmittanceEstimate but does not test for occlusion by surfaces. 
+// That is left to the caller, which must use ShadowRaySegment(seg).
+Spectral3 UnoccludedTransmittanceEstimate(const Scene &scene, RaySegment seg, MediumTracker &medium_tracker, 
+                                const PathContext &context, Sampler &sampler, 
+                                VolumePdfCoefficients *volume_pdf_coeff = nullptr);
+
+
+// The part of a connection segment which is tested for occlusion.
+inline RaySegment ShadowRaySegment(RaySegment seg)
+{
+  seg.length *= 0.9999; // To avoid intersections with the adjacent nodes/positions/surfaces.
+  return seg;
+}
+
+
+/* Shadow rays of next event estimation, collected together with whatever the caller
+ * needs to add the contribution later, e.g. pixel index and measurement. Flush traces all 
+ * of them in one batch and calls visitor(payload, is_occluded) for each.
+ */
+template<class Payload>
+class ShadowRayQueue
+{
+  ToyVector<Ray> rays;
+  ToyVector<double> tfars;
+  ToyVector<std::uint8_t> occluded;
+  ToyVector<Payload> payloads;
+  int capacity;
+
+public:
+  explicit ShadowRayQueue(int capacity_ = 1024)
+    : capacity{ capacity_ }
+  {
+    rays.reserve(capacity);
+    tfars.reserve(capacity);
+    payloads.reserve(capacity);
+  }
+
+  void Push(const RaySegment &segment, const Payload &payload)
+  {
+    rays.push_back(segment.ray);
+    tfars.push_back(segment.length);
+    payloads.push_back(payload);
+  }
+
+  bool IsFull() const
+  {
+    return isize(rays) >= capacity;
+  }
+
+  template<class Visitor>
+  void Flush(const Scene &scene, Visitor &&visitor)
+  {
+    occluded.resize(rays.size());
+    scene.AreOccluded(AsSpan(rays), 0., AsSpan(tfars), AsSpan(occluded));
+    for (int i = 0; i < isize(rays); ++i)
+    {
+      visitor(payloads[i], (bool)occluded[i]);
+    }
+    rays.clear();
+    tfars.clear();
+    payloads.clear();
+  }
+};
+
 
 /* Straight forwardly following Cpt 5.3 Veach's thesis.
   * Basically when multiplied, it turns fs(wi -> wo, Nshd) into the corrected BSDF fs(wi->wo, Nsh)*Dot(Nshd,wi)/Dot(N,wi),
@@ -1,4 +1,8 @@
 #include "renderingalgorithms_simplebase.hxx"
+#include "checkpoint.hxx"
+
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
 
 
 template<typename WorkerType>
@@ -23,6 +27,7 @@ std::unique_ptr<RenderingAlgo> AllocatBptPathTracer(const Scene &scene, const Re
 std::unique_ptr<RenderingAlgo> AllocatForwardPathTracer(const Scene &scene, const RenderingParameters &params);
 std::unique_ptr<RenderingAlgo> AllocatePathtracing2RenderingAlgo(const Scene &scene, const RenderingParameters &params);
 std::unique_ptr<RenderingAlgo> AllocatePathtracingGuidedRenderingAlgo(const Scene &scene, const RenderingParameters &params);
+std::unique_ptr<RenderingAlgo> AllocateWavefrontRenderingAlgo(const Scene &scene, const RenderingParameters &params);
 
 std::unique_ptr<RenderingAlgo> RenderAlgorithmFactory(const Scene &scene, const RenderingParameters &params)
 {
@@ -37,6 +42,118 @@ std::unique_ptr<RenderingAlgo> RenderAlgorithmFactory(const Scene &scene, const
     return AllocatePathtracing2RenderingAlgo(scene, params);
   else if (params.algo_name == "ptg")
     return AllocatePathtracingGuidedRenderingAlgo(scene, params);
+  else if (params.algo_name == "ptw")
+    return AllocateWavefrontRenderingAlgo(scene, params);
   else
     return AllocatForwardPathTracer(scene, params);
 }
+
+
+void RenderingAlgo::SaveState(checkpoint::Writer &)
+{
+  throw checkpoint::Error("Checkpoints are not supported by this rendering algorithm");
+}
+
+
+void RenderingAlgo::LoadState(checkpoint::Reader &)
+{
+  throw checkpoint::Error("Checkpoints are not supported by this rendering algorithm");
+}
+
+
+std::unique_ptr<PartialImage> RenderingAlgo::GeneratePartialImage()
+{
+  throw std::runtime_error("Partial rendering is not supported by this rendering algorithm");
+}
+
+
+namespace
+{
+constexpr std::uint32_t CHECKPOINT_MAGIC = 0x4b435454; // "TTCK"
+constexpr std::uint32_t CHECKPOINT_VERSION = 5;
+constexpr std::uint32_t PARTIAL_IMAGE_MAGIC = 0x52505454; // "TTPR"
+constexpr std::uint32_t PARTIAL_IMAGE_VERSION = 1;
+
+
+// Written by the writer and checked by the reader. Parameters which only affect how long the render
+// goes on, like the time limit, the error target or the number of threads, may change on resume.
+template<class Archive>
+void CheckpointHeader(Archive &ar, const RenderingParameters &params, std::uint64_t scene_fingerprint)
+{
+  ar.Expect(CHECKPOINT_MAGIC, "not a checkpoint file");
+  ar.Expect(CHECKPOINT_VERSION, "format version");
+  ar.Expect(scene_fingerprint, "scene file");
+  ar.Expect(params.algo_name, "rendering algorithm");
+  ar.Expect(params.width, "image width");
+  ar.Expect(params.height, "image height");
+  ar.Expect(params.max_samples_per_pixel, "samples per pixel");
+  ar.Expect(params.max_ray_depth, "max ray depth");
+  ar.Expect(params.qmc, "qmc");
+  ar.Expect(params.pt_sample_mode, "pt sample mode");
+  ar.Expect(params.tile_begin, "tile range");
+  ar.Expect(params.tile_end, "tile range");
+  ar.Expect(params.sample_offset, "sample offset");
+  ar.Expect(params.compact_meshes, "compact meshes");
+  ar.Expect(params.initial_photon_radius, "initial photon radius");
+  ar.Expect(params.guiding_prior_strength, "guiding prior strength");
+  ar.Expect(params.guiding_em_every, "guiding em every");
+  ar.Expect(params.guiding_tree_subdivision_factor, "guiding tree subdivision factor");
+  ar.Expect(params.guiding_max_spp, "guiding max spp");
+}
+}
+
+
+void SaveCheckpoint(const boost::filesystem::path &filename, RenderingAlgo &algo, const RenderingParameters &params, std::uint64_t scene_fingerprint)
+{
+  auto tmp_filename = filename;
+  tmp_filename += ".tmp";
+  {
+    std::ofstream os(tmp_filename.string(), std::ios::binary | std::ios::trunc);
+    if (!os)
+      throw checkpoint::Error("Cannot open checkpoint file for writing: " + tmp_filename.string());
+    checkpoint::Writer ar{ os };
+    CheckpointHeader(ar, params, scene_fingerprint);
+    algo.SaveState(ar);
+    os.flush();
+    if (!os)
+      throw checkpoint::Error("Failed to write checkpoint");
+  }
+  boost::filesystem::rename(tmp_filename, filename);
+}
+
+
+void LoadCheckpoint(const boost::filesystem::path &filename, RenderingAlgo &algo, const RenderingParameters &params, std::uint64_t scene_fingerprint)
+{
+  std::ifstream is(filename.string(), std::ios::binary);
+  if (!is)
+    throw checkpoint::Error("Cannot open checkpoint file: " + filename.string());
+  checkpoint::Reader ar{ is };
+  CheckpointHeader(ar, params, scene_fingerprint);
+  algo.LoadState(ar);
+}
+
+
+void SavePartialImage(const boost::filesystem::path &filename, const PartialImage &image)
+{
+  std::ofstream os(filename.string(), std::ios::binary | std::ios::trunc);
+  if (!os)
+    throw checkpoint::Error("Cannot open file for writing: " + filename.string());
+  checkpoint::Writer ar{ os };
+  ar(PARTIAL_IMAGE_MAGIC);
+  ar(PARTIAL_IMAGE_VERSION);
+  ar(image);
+}
+
+
+PartialImage LoadPartialImage(const boost::filesystem::path &filename)
+{
+  std::ifstream is(filename.string(), std::ios::binary);
+  if (!is)
+    throw checkpoint::Error("Cannot open file: " + filename.string());
+  checkpoint::Reader ar{ is };
+  ar.Expect(PARTIAL_IMAGE_MAGIC, "not a partial image");
+  ar.Expect(PARTIAL_IMAGE_VERSION, "format version");
+  PartialImage image;
+  ar(image);
+  return image;
+}
@@ -3,12 +3,22 @@
 #include <functional>
 #include <memory>
 
+#include <boost/filesystem/path.hpp>
+
 #include "image.hxx"
 #include "scene.hxx"
 
 
 using InterruptCallback = std::function<void(bool)>;
 
+namespace checkpoint
+{
+class Writer;
+class Reader;
+}
+
+struct PartialImage;
+
 
 class RenderingAlgo
 {
@@ -25,6 +35,26 @@ public:
   virtual void RequestFullStop() = 0; // Early termination due to user interaction.
   // May be called from within the interrupt callback, or after Run returned.
   virtual std::unique_ptr<Image> GenerateImage() = 0;
+  // Previews without pausing the workers. If supported, UpdateSnapshot may be called from one 
+  // other thread while Run goes on. It tone-maps the tiles finished since the previous call 
+  // into dest and returns their number. Else previews need RequestInterrupt.
+  virtual bool SupportsSnapshots() const { return false; }
+  virtual int UpdateSnapshot(Image &dest) { return 0; }
+  // Progressive state for checkpoints. SaveState may be called from within the interrupt
+  // callback or after Run returned. LoadState must be called before Run.
+  // The default implementations throw because the algorithm has no support for it.
+  virtual void SaveState(checkpoint::Writer &ar);
+  virtual void LoadState(checkpoint::Reader &ar);
+  // If false, the state is only consistent at the end of complete passes.
+  virtual bool SupportsMidPassCheckpoints() const { return true; }
+  // Rendering of a tile range or with a sample offset, see RenderingParameters.
+  virtual bool SupportsPartialRendering() const { return false; }
+  // Raw sums for toytrace-merge. Same calling rules as GenerateImage. Throws if not supported.
+  virtual std::unique_ptr<PartialImage> GeneratePartialImage();
+  // Takes over what a previous instance of the same algorithm learned about the scene, like light
+  // selection statistics or guiding data, when rendering several views. Call before Run and LoadState.
+  // Returns false if there was nothing to take over.
+  virtual bool AdoptSceneKnowledge(const RenderingAlgo &previous) { return false; }
 protected:
   void CallInterruptCb(bool is_complete_pass) { irq_cb(is_complete_pass); }
 };
@@ -32,3 +62,13 @@ protected:
 
 
 std::unique_ptr<RenderingAlgo> RenderAlgorithmFactory(const Scene &_scene, const RenderingParameters &_params);
+
+// The file is replaced atomically, so a crash while writing leaves the previous checkpoint intact.
+// scene_fingerprint is checkpoint::Fingerprint of the scene file. Files which it includes are not covered.
+void SaveCheckpoint(const boost::filesystem::path &filename, RenderingAlgo &algo, const RenderingParameters &params, std::uint64_t scene_fingerprint);
+// Throws checkpoint::Error if the file does not belong to the same scene file, algorithm, image size
+// and parameters which affect the image.
+void LoadCheckpoint(const boost::filesystem::path &filename, RenderingAlgo &algo, const RenderingParameters &params, std::uint64_t scene_fingerprint);
+
+void SavePartialImage(const boost::filesystem::path &filename, const PartialImage &image);
+PartialImage LoadPartialImage(const boost::filesystem::path &filename);
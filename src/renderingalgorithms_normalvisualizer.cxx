@@ -38,6 +38,11 @@ public:
   {
     return rgb_responses;
   }
+
+  Sampler& GetSampler() override
+  {
+    return sampler;
+  }
 };
 
 
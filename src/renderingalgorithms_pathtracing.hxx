@@ -665,6 +665,11 @@ public:
   {
     return rgb_responses;
   }
+
+  Sampler& GetSampler() override
+  {
+    return sampler;
+  }
   
   
   void AddToDebugBuffer(int unit_index, int s, int t, double mis_weight, const Spectral3 &path_weight)
@@ -821,6 +826,11 @@ public:
   {
     return rgb_responses;
   }
+
+  Sampler& GetSampler() override
+  {
+    return sampler;
+  }
   
 
   double MisWeight(Pdf pdf_or_pmf_taken, double pdf_other) const
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <algorithm>
 #include <functional>
 
 #include <tbb/atomic.h>
@@ -23,10 +24,12 @@
 #include "renderingalgorithms_interface.hxx"
 #include "renderingalgorithms_simplebase.hxx"
 #include "lightpicker_ucb.hxx"
+#include "checkpoint.hxx"
 
 namespace pathtracing2
 {
 using SimplePixelByPixelRenderingDetails::SamplesPerPixelSchedule;
+using SimplePixelByPixelRenderingDetails::TimeBudget;
 using Lights::LightRef;
 using Lightpickers::UcbLightPicker;
 class PathTracingAlgo2;
@@ -90,6 +93,13 @@ public:
   }
 
   const Lightpickers::LightSelectionProbabilityMap& GetDistributionNee() const { return picker_nee.Distribution(); }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    graph.wait_for_all(); // Pending returns belong into the stats.
+    ar(picker_nee);
+  }
 };
 #else
 class LightPickerUcbBufferedQueue
@@ -118,6 +128,11 @@ public:
   }
 
   const Lightpickers::LightSelectionProbabilityMap& GetDistributionNee() const { return distribution; }
+
+  template<class Archive>
+  void Serialize(Archive &)
+  {
+  }
 };
 #endif
 
@@ -140,6 +155,29 @@ struct PathState
   double shader_roughness = 0.;
   int current_node_count;
   bool monochromatic;
+  std::uint32_t subsequence_position = 0; // Where the sampler left off when the path was put aside.
+  Int2 pixel;
+  int point_num;
+};
+
+
+// NEE connection waiting for the result of the shadow ray. The transmittance through media and
+// thereby the MIS weight are only computed if it is not occluded.
+struct DeferredNee
+{
+  LightRef light_ref;
+  RaySegment segment_to_light;
+  MediumTracker medium_tracker;
+  PathContext context;
+  nullpath::Spectral33 weights_track;
+  Spectral3 weight; // Path throughput times light sample weight.
+  Pdf light_pdf;
+  double bsdf_pdf;
+  // Where the sampler left off after sampling the light.
+  Int2 pixel;
+  int point_num;
+  std::uint32_t subsequence_id;
+  std::uint32_t subsequence_position;
 };
 
 
@@ -149,16 +187,48 @@ class alignas(128) CameraRenderWorker
   LightPickerUcbBufferedQueue* const pickers;
   mutable LightPickerUcbBufferedQueue::ThreadLocal picker_local;
   mutable Sampler sampler;
-  mutable Span<RGB> framebuffer;
+  TiledFramebuffer* framebuffer = nullptr;
   RayTermination ray_termination;
   LambdaSelectionStrategy lambda_selection_factory;
   //static constexpr int num_lambda_sweeps = decltype(lambda_selection_factory)::NUM_SAMPLES_REQUIRED;
   bool use_nee = true;
   bool use_emission = true;
+  ToyVector<PathState> tile_paths;
+  PrimaryRayBatch primary_rays;
+  mutable ShadowRayQueue<DeferredNee> shadow_rays;
+
+  static constexpr int MAX_PATHS_IN_FLIGHT = 4096;
+  // Paths in flight of RenderWavefront. The path states live in slots which are allocated once
+  // and reused. The stages exchange their data through the arrays below, where index i refers
+  // to the path in slot paths[i].
+  struct WavefrontQueue
+  {
+    ToyVector<PathState> slots;
+    ToyVector<int> free_slots;
+    ToyVector<int> paths;
+    PrimaryRayBatch rays; // Not only camera rays.
+    ToyVector<MaybeSomeInteraction> interactions;
+    ToyVector<nullpath::ThroughputAndPdfs> factors;
+    ToyVector<std::uint8_t> alive;
+    ToyVector<const void*> shading_keys;
+    ToyVector<int> shading_order;
+
+    int size() const { return isize(paths); }
+    PathState& operator[](int i) { return slots[paths[i]]; }
+    void Allocate(const Scene &scene, int capacity);
+    PathState& Add();
+    void RemoveTerminated();
+  } wavefront;
 
 private:
+  // Reseeds the sampler for the pixel sample. Later random decisions of the path, e.g. Russian roulette,
+  // continue the generator from there. Hence they depend on which other paths were started in between.
+  void StartPath(PathState &ps, Int2 pixel, int point_num) const;
+  void ResumePath(const PathState &ps) const;
   void InitializePathState(PathState &p, Int2 pixel) const;
   bool TrackToNextInteractionAndRecordPixel(PathState &ps) const;
+  bool TrackToNextInteractionAndRecordPixel(PathState &ps, const std::optional<HitRecord> &hit, double tfar) const;
+  bool RecordPixelAndMaybeScatter(PathState &ps, const MaybeSomeInteraction &interaction, const nullpath::ThroughputAndPdfs &factors) const;
 
   bool MaybeScatter(const SomeInteraction &interaction, PathState &ps) const;
 
@@ -166,6 +236,8 @@ private:
   void AddEnvEmission(const PathState &ps) const;
   
   void AddDirectLighting(const SomeInteraction &interaction, const PathState &ps) const;
+  Spectral3 FinishDirectLighting(const DeferredNee &nee) const;
+  void FlushShadowRays() const;
   
   void RecordMeasurementToCurrentPixel(const Spectral3 &measurement, const PathState &ps) const;
 
@@ -179,9 +251,15 @@ private:
 
   std::pair<double,Spectral3> MisWeight(std::optional<Pdf> scatter_pdf, double scatter_pdf_other, const nullpath::Spectral33 &distance_pdfs, const nullpath::Spectral33 &distance_pdfs_other) const;
 
+  void GenerateWavefront(const ImageTileSet::Tile &tile, int num_samples, int &next_sample);
+  void ExtendWavefront();
+  void ShadeWavefront();
+  const void* ShadingKey(const MaybeSomeInteraction &interaction) const;
+
 public:
   CameraRenderWorker(PathTracingAlgo2 *master, int worker_index);
   void Render(const ImageTileSet::Tile & tile);
+  void RenderWavefront(const ImageTileSet::Tile & tile);
 
 };
 
@@ -192,24 +270,28 @@ class PathTracingAlgo2 : public RenderingAlgo
   friend class PhotonmappingWorker;
   friend class CameraRenderWorker;
 private:
-  ToyVector<RGB> framebuffer;
   ImageTileSet tileset;
-  ToyVector<std::uint64_t> samplesPerTile; // False sharing!
+  TiledFramebuffer framebuffer;
+  TileConvergenceTracker convergence;
+  TileSnapshot snapshot;
 
   int num_pixels = 0;
   SamplesPerPixelSchedule spp_schedule;
+  TimeBudget time_budget;
   tbb::task_group the_task_group;
   tbb::task_arena the_task_arena;
   tbb::atomic<bool> stop_flag = false;
   ToyVector<CameraRenderWorker> camerarender_workers;
   std::unique_ptr<LightPickerUcbBufferedQueue> pickers;
+  bool wavefront = false;
 
 public:
   const RenderingParameters &render_params;
   const Scene &scene;
 
 public:
-  PathTracingAlgo2(const Scene &scene_, const RenderingParameters &render_params_);
+  // With wavefront=true, this is the "ptw" algorithm. See CameraRenderWorker::RenderWavefront.
+  PathTracingAlgo2(const Scene &scene_, const RenderingParameters &render_params_, bool wavefront_ = false);
 
   void Run() override;
 
@@ -228,6 +310,27 @@ public:
 
   std::unique_ptr<Image> GenerateImage() override;
 
+  bool SupportsSnapshots() const override { return true; }
+  int UpdateSnapshot(Image &dest) override { return snapshot.Update(dest, !render_params.linear_output); }
+
+  void SaveState(checkpoint::Writer &ar) override { SerializeState(ar); }
+  void LoadState(checkpoint::Reader &ar) override 
+  { 
+    SerializeState(ar);
+    for (int i = 0; i < tileset.size(); ++i)
+      if (framebuffer.SampleCount(i) > 0)
+        PublishSnapshot(i);
+  }
+
+  bool AdoptSceneKnowledge(const RenderingAlgo &previous) override
+  {
+    const auto *other = dynamic_cast<const PathTracingAlgo2*>(&previous);
+    if (!other)
+      return false;
+    checkpoint::CopyState(*other->pickers, *pickers);
+    return true;
+  }
+
 protected:
   inline int GetNumPixels() const { return num_pixels; }
   inline int GetSamplesPerPixel() const { return spp_schedule.GetPerIteration(); }
@@ -235,25 +338,43 @@ protected:
   inline int NumThreads() const {
     return the_task_arena.max_concurrency();
   }
+
+private:
+  template<class Archive>
+  void SerializeState(Archive &ar)
+  {
+    ar.Expect(tileset.size(), "number of tiles");
+    ar(spp_schedule);
+    ar(framebuffer);
+    ar(convergence);
+    ar(*pickers);
+  }
+
+  void PublishSnapshot(int tile_index)
+  {
+    snapshot.Publish(tile_index, [this](int pixel_index) { return framebuffer.Average(pixel_index); });
+  }
 };
 
 
 
 PathTracingAlgo2::PathTracingAlgo2(
-  const Scene &scene_, const RenderingParameters &render_params_)
+  const Scene &scene_, const RenderingParameters &render_params_, bool wavefront_)
   :
   RenderingAlgo{},
   tileset({ render_params_.width, render_params_.height }),
+  framebuffer{ tileset },
+  convergence{ tileset, { render_params_.width, render_params_.height }, render_params_.target_error },
+  snapshot{ tileset },
   spp_schedule{ render_params_ }, 
+  time_budget{ render_params_ },
+  wavefront{ wavefront_ },
   render_params{ render_params_ },
    scene{ scene_ }
 {
   the_task_arena.initialize(std::max(1, this->render_params.num_threads));
   num_pixels = render_params.width * render_params.height;
 
-  framebuffer.resize(num_pixels, RGB{});
-  samplesPerTile.resize(tileset.size(), 0);
-
   pickers = std::make_unique<LightPickerUcbBufferedQueue>(scene, NumThreads());
 
   for (int i = 0; i < the_task_arena.max_concurrency(); ++i)
@@ -268,16 +389,29 @@ PathTracingAlgo2::PathTracingAlgo2(
 
 inline void PathTracingAlgo2::Run()
 {
-  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0)
+  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0 && !convergence.AllConverged() && !time_budget.Expired())
   {
+    const int num_active_tiles = convergence.NumActive();
+    spp_schedule.LimitPerIteration(time_budget.FitSamplesPerPixel(GetSamplesPerPixel(), num_active_tiles));
+    if (GetSamplesPerPixel() <= 0)
+      break;
+    time_budget.StartPass(num_active_tiles);
     pickers->ComputeDistribution();
 
     the_task_arena.execute([this] {
       parallel_for_interruptible(0, this->tileset.size(), 1, [this](int i)
       {
+        if (!convergence.IsActive(i) || time_budget.Expired())
+          return;
         const int worker_num = tbb::this_task_arena::current_thread_index();
-        camerarender_workers[worker_num].Render(this->tileset[i]);
-        this->samplesPerTile[i] += spp_schedule.GetPerIteration();
+        if (wavefront)
+          camerarender_workers[worker_num].RenderWavefront(this->tileset[i]);
+        else
+          camerarender_workers[worker_num].Render(this->tileset[i]);
+        this->framebuffer.AddSampleCount(i, spp_schedule.GetPerIteration());
+        convergence.Update(i, this->tileset[i], this->framebuffer, spp_schedule.GetPerIteration());
+        PublishSnapshot(i);
+        time_budget.TileDone();
       },
         /*irq_handler=*/[this]() -> bool
       {
@@ -287,24 +421,22 @@ inline void PathTracingAlgo2::Run()
         return true;
       }, the_task_group);
     });
+    time_budget.EndPass(GetSamplesPerPixel());
     
     std::cout << "Sweep " << spp_schedule.GetTotal() << " finished" << std::endl;
-    CallInterruptCb(true);
+    if (convergence.Enabled())
+      std::cout << "Tiles still active " << convergence.NumActive() << " of " << tileset.size() << std::endl;
     spp_schedule.UpdateForNextPass();
+    CallInterruptCb(true); // After the update, so that checkpoints taken here account for the pass.
   } // Pass iteration
+  time_budget.PrintSummary(spp_schedule.GetTotal());
 }
 
 
 inline std::unique_ptr<Image> PathTracingAlgo2::GenerateImage()
 {
   auto bm = std::make_unique<Image>(render_params.width, render_params.height);
-  tbb::parallel_for(0, tileset.size(), [this, bm{ bm.get() }](int i) {
-    const auto tile = tileset[i];
-    if (this->samplesPerTile[i] > 0)
-    {
-      framebuffer::ToImage(*bm, tile, AsSpan(this->framebuffer), this->samplesPerTile[i], !render_params.linear_output);
-    }
-  });
+  framebuffer::ToImage(*bm, framebuffer, !render_params.linear_output);
   return bm;
 }
 
@@ -317,7 +449,7 @@ CameraRenderWorker::CameraRenderWorker(PathTracingAlgo2* master, int worker_inde
   sampler{ master->render_params.qmc },
   ray_termination{ master->render_params }
 {
-  framebuffer = AsSpan(master->framebuffer);
+  framebuffer = &master->framebuffer;
   if (master->render_params.pt_sample_mode == "bsdf")
   {
     use_nee = false;
@@ -335,30 +467,215 @@ void CameraRenderWorker::PrepSamplerDimension(const PathState &ps, SmplNodeType
 }
 
 
+void CameraRenderWorker::StartPath(PathState &ps, Int2 pixel, int point_num) const
+{
+  sampler.SetPixelSample(pixel, point_num);
+  InitializePathState(ps, pixel);
+  ps.pixel = pixel;
+  ps.point_num = point_num;
+  ps.subsequence_position = sampler.GetSubsequencePosition();
+}
+
+
+void CameraRenderWorker::ResumePath(const PathState &ps) const
+{
+  // The next ray is tracked with the BSDF subsequence of the previous node, i.e. the one of the
+  // camera or of the last scattering. It continues where it left off, as if the path had been
+  // traced without interruption.
+  sampler.SetPixelIndex(ps.pixel);
+  sampler.SetPointNum(ps.point_num);
+  sampler.SetSubsequenceId(((ps.current_node_count - 1) << 1) | BSDF);
+  sampler.SetSubsequencePosition(ps.subsequence_position);
+}
+
+
 void CameraRenderWorker::Render(const ImageTileSet::Tile &tile)
 {
   const Int2 end = tile.corner + tile.shape;
-  const int image_width = master->render_params.width;
   const int samples_per_pixel = master->GetSamplesPerPixel();
   
-  PathState state{ master->scene };
-  for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+  // One path per pixel is started at a time, so that all camera rays of the tile can be intersected in one batch.
+  while (isize(tile_paths) < tile.shape[0]*tile.shape[1])
+    tile_paths.emplace_back(master->scene);
+
+  for (int i = 0; i < samples_per_pixel; ++i)
   {
-    for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+    const int point_num = i + master->GetTotalSamplesPerPixel();
+    
+    primary_rays.Clear();
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
     {
-      sampler.SetPixelIndex({ ix, iy });
-      for (int i = 0; i < samples_per_pixel; ++i)
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix)
       {
-        sampler.SetPointNum(i + master->GetTotalSamplesPerPixel());
-        InitializePathState(state, { ix, iy });
-        bool keepgoing = true;
-        do
+        PathState &state = tile_paths[isize(primary_rays.rays)];
+        StartPath(state, { ix, iy }, point_num);
+        primary_rays.rays.push_back(state.ray);
+      }
+    }
+
+    primary_rays.Intersect(master->scene);
+
+    int path_index = 0;
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+    {
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix, ++path_index)
+      {
+        PathState &state = tile_paths[path_index];
+        ResumePath(state);
+        bool keepgoing = TrackToNextInteractionAndRecordPixel(state, primary_rays.hits[path_index], primary_rays.tfars[path_index]);
+        while (keepgoing)
         {
           keepgoing = TrackToNextInteractionAndRecordPixel(state);
-        } while (keepgoing);
+        }
+        // Only between paths, because the flush moves the sampler elsewhere.
+        if (shadow_rays.IsFull())
+          FlushShadowRays();
       }
     }
   }
+
+  // Everything must be in the framebuffer when the tile is done.
+  FlushShadowRays();
+}
+
+
+/* Wavefront variant of Render. Instead of following one path after another to the end, many
+ * paths are kept in flight and advanced together stage by stage:
+ *
+ *   Generate -> Extend -> Shade -> Shadow
+ *
+ * Generate refills free slots with camera paths. Extend intersects all rays in one batch and
+ * tracks them through the media. Shade processes the paths grouped by shader / medium. Shadow
+ * traces the NEE shadow rays in one batch. Terminated paths are then removed.
+ *
+ * The shading code and the sampler dimensions are those of Render. Only the order of
+ * operations differs. Hence the QMC points are the same, but not the pseudo-random numbers.
+ */
+void CameraRenderWorker::RenderWavefront(const ImageTileSet::Tile &tile)
+{
+  const int num_samples = tile.shape.prod() * master->GetSamplesPerPixel();
+  int next_sample = 0;
+  while (next_sample < num_samples || wavefront.size() > 0)
+  {
+    GenerateWavefront(tile, num_samples, next_sample);
+    ExtendWavefront();
+    ShadeWavefront();
+    FlushShadowRays();
+    wavefront.RemoveTerminated();
+  }
+}
+
+
+void CameraRenderWorker::GenerateWavefront(const ImageTileSet::Tile &tile, int num_samples, int &next_sample)
+{
+  // Samples are enumerated pixel by pixel within the tile, and then by sample number.
+  const int pixels_in_tile = tile.shape.prod();
+  if (wavefront.slots.empty())
+    wavefront.Allocate(master->scene, MAX_PATHS_IN_FLIGHT);
+  for (; wavefront.size() < MAX_PATHS_IN_FLIGHT && next_sample < num_samples; ++next_sample)
+  {
+    const int k = next_sample % pixels_in_tile;
+    const int point_num = next_sample / pixels_in_tile + master->GetTotalSamplesPerPixel();
+    StartPath(wavefront.Add(), tile.corner + Int2{ k % tile.shape[0], k / tile.shape[0] }, point_num);
+  }
+}
+
+
+void CameraRenderWorker::ExtendWavefront()
+{
+  const int n = wavefront.size();
+  auto &batch = wavefront.rays;
+  batch.Clear();
+  for (int i = 0; i < n; ++i)
+    batch.rays.push_back(wavefront[i].ray);
+  batch.Intersect(master->scene);
+
+  // Media are tracked path by path. Only the surface intersection is batched.
+  wavefront.interactions.resize(n);
+  wavefront.factors.resize(n);
+  for (int i = 0; i < n; ++i)
+  {
+    PathState &ps = wavefront[i];
+    ResumePath(ps);
+    auto[interaction, tfar, factors] = nullpath::Tracking(master->scene, ps.ray, batch.hits[i], batch.tfars[i], sampler, ps.medium_tracker, ps.context);
+    wavefront.interactions[i] = std::move(interaction);
+    wavefront.factors[i] = factors;
+  }
+}
+
+
+const void* CameraRenderWorker::ShadingKey(const MaybeSomeInteraction &interaction) const
+{
+  if (!interaction)
+    return nullptr;
+  return mpark::visit(Overload(
+    [this](const SurfaceInteraction &si) -> const void* { return &GetShaderOf(si, master->scene); },
+    [](const VolumeInteraction &vi) -> const void* { return &vi.medium(); }
+  ), *interaction);
+}
+
+
+void CameraRenderWorker::ShadeWavefront()
+{
+  // Paths which hit the same shader or medium are processed back to back, so that
+  // the same code and material data is used over and over.
+  const int n = wavefront.size();
+  wavefront.shading_keys.resize(n);
+  wavefront.shading_order.resize(n);
+  wavefront.alive.resize(n);
+  for (int i = 0; i < n; ++i)
+  {
+    wavefront.shading_keys[i] = ShadingKey(wavefront.interactions[i]);
+    wavefront.shading_order[i] = i;
+  }
+  std::stable_sort(wavefront.shading_order.begin(), wavefront.shading_order.end(), [this](int a, int b) {
+    return std::less<const void*>{}(wavefront.shading_keys[a], wavefront.shading_keys[b]);
+  });
+
+  for (int i : wavefront.shading_order)
+  {
+    PathState &ps = wavefront[i];
+    // The subsequences of the interaction are set up in there.
+    sampler.SetPixelIndex(ps.pixel);
+    sampler.SetPointNum(ps.point_num);
+    wavefront.alive[i] = RecordPixelAndMaybeScatter(ps, wavefront.interactions[i], wavefront.factors[i]);
+    ps.subsequence_position = sampler.GetSubsequencePosition();
+  }
+}
+
+
+void CameraRenderWorker::WavefrontQueue::Allocate(const Scene &scene, int capacity)
+{
+  slots.reserve(capacity);
+  for (int i = 0; i < capacity; ++i)
+    slots.emplace_back(scene);
+  // Reversed, so that the slots are handed out in order.
+  for (int i = capacity - 1; i >= 0; --i)
+    free_slots.push_back(i);
+}
+
+
+PathState& CameraRenderWorker::WavefrontQueue::Add()
+{
+  assert(!free_slots.empty());
+  paths.push_back(free_slots.back());
+  free_slots.pop_back();
+  return slots[paths.back()];
+}
+
+
+void CameraRenderWorker::WavefrontQueue::RemoveTerminated()
+{
+  int j = 0;
+  for (int i = 0; i < size(); ++i)
+  {
+    if (alive[i])
+      paths[j++] = paths[i];
+    else
+      free_slots.push_back(paths[i]);
+  }
+  paths.resize(j);
+  // The other arrays are overwritten by the next stages.
 }
 
 
@@ -411,7 +728,19 @@ bool CameraRenderWorker::TrackToNextInteractionAndRecordPixel(PathState &ps) con
 {
   // TODO: fix the nonsensical use of initial weight in Atmosphere Material!!
   auto[interaction, tfar, factors] = nullpath::Tracking(master->scene, ps.ray, sampler, ps.medium_tracker, ps.context);
-  
+  return RecordPixelAndMaybeScatter(ps, interaction, factors);
+}
+
+
+bool CameraRenderWorker::TrackToNextInteractionAndRecordPixel(PathState &ps, const std::optional<HitRecord> &hit, double tfar) const
+{
+  auto[interaction, tfar_interaction, factors] = nullpath::Tracking(master->scene, ps.ray, hit, tfar, sampler, ps.medium_tracker, ps.context);
+  return RecordPixelAndMaybeScatter(ps, interaction, factors);
+}
+
+
+bool CameraRenderWorker::RecordPixelAndMaybeScatter(PathState &ps, const MaybeSomeInteraction &interaction, const nullpath::ThroughputAndPdfs &factors) const
+{
   // Careful here. First part is from delta tracking. Last part for connection, corresponding to NEE technique.
   ps.weights_track_then_null = ps.weights_track;
   nullpath::AccumulateContributions(ps.weights_track_then_null, factors.weights_nulls); 
@@ -534,12 +863,27 @@ void CameraRenderWorker::AddDirectLighting(const SomeInteraction & interaction,
     path_weights *= coeffs.sigma_s / (coeffs.sigma_t + Epsilon);
   }
 
-  auto factors = nullpath::Transmission(master->scene, segment_to_light, sampler, medium_tracker, ps.context);
+  shadow_rays.Push(ShadowRaySegment(segment_to_light), DeferredNee{ 
+    light_ref, segment_to_light, medium_tracker, ps.context, ps.weights_track, path_weights*light_weight, pdf, bsdf_pdf,
+    ps.pixel, ps.point_num, (std::uint32_t(ps.current_node_count) << 1) | NEE_LIGHT, sampler.GetSubsequencePosition() });
+}
+
+
+Spectral3 CameraRenderWorker::FinishDirectLighting(const DeferredNee &nee) const
+{
+  // Continue the NEE subsequence of the path node, as if the transmittance had been estimated right away.
+  sampler.SetPixelIndex(nee.pixel);
+  sampler.SetPointNum(nee.point_num);
+  sampler.SetSubsequenceId(nee.subsequence_id);
+  sampler.SetSubsequencePosition(nee.subsequence_position);
+
+  MediumTracker medium_tracker{ nee.medium_tracker };
+  auto factors = nullpath::UnoccludedTransmission(master->scene, nee.segment_to_light, sampler, medium_tracker, nee.context);
 
-  nullpath::AccumulateContributions(factors.weights_track, ps.weights_track);
-  nullpath::AccumulateContributions(factors.weights_nulls, ps.weights_track);
+  nullpath::AccumulateContributions(factors.weights_track, nee.weights_track);
+  nullpath::AccumulateContributions(factors.weights_nulls, nee.weights_track);
 
-  auto [mis_weight, mis_pdf_mix] = MisWeight(pdf, bsdf_pdf, factors.weights_nulls, factors.weights_track);
+  auto [mis_weight, mis_pdf_mix] = MisWeight(nee.light_pdf, nee.bsdf_pdf, factors.weights_nulls, factors.weights_track);
 
   /*
   contrib = distance_throughput * scatter_weight / distance_pdf
@@ -549,10 +893,21 @@ void CameraRenderWorker::AddDirectLighting(const SomeInteraction & interaction,
   MisWeight(scatter_pdfs,{scatter_pdf_j}) * distance_throughput * scatter_weight / (sum_i distance_pdf_i)
   */
 
-  Spectral3 measurement_estimator = mis_weight*(path_weights*light_weight)/mis_pdf_mix;
+  return mis_weight*nee.weight/mis_pdf_mix;
+}
+
 
-  pickers->ObserveReturnNee(this->picker_local, light_ref, measurement_estimator);
-  RecordMeasurementToCurrentPixel(measurement_estimator, ps);
+void CameraRenderWorker::FlushShadowRays() const
+{
+  shadow_rays.Flush(master->scene, [this](const DeferredNee &nee, bool occluded)
+  {
+    const Spectral3 measurement = occluded ? Spectral3{ 0. } : FinishDirectLighting(nee);
+    pickers->ObserveReturnNee(this->picker_local, nee.light_ref, measurement);
+    if (occluded)
+      return;
+    assert(measurement.isFinite().all());
+    framebuffer->Add(nee.context.pixel_index, Color::SpectralSelectionToRGB(measurement, nee.context.lambda_idx));
+  });
 }
 
 
@@ -696,7 +1051,7 @@ void CameraRenderWorker::RecordMeasurementToCurrentPixel(const Spectral3 &measur
 {
   assert(measurement.isFinite().all());
   auto color = Color::SpectralSelectionToRGB(measurement, ps.context.lambda_idx);
-  framebuffer[ps.context.pixel_index] += color;
+  framebuffer->Add(ps.context.pixel_index, color);
 }
 
 
@@ -709,3 +1064,9 @@ std::unique_ptr<RenderingAlgo> AllocatePathtracing2RenderingAlgo(const Scene &sc
 {
   return std::make_unique<pathtracing2::PathTracingAlgo2>(scene, params);
 }
+
+
+std::unique_ptr<RenderingAlgo> AllocateWavefrontRenderingAlgo(const Scene &scene, const RenderingParameters &params)
+{
+  return std::make_unique<pathtracing2::PathTracingAlgo2>(scene, params, /*wavefront=*/true);
+}
@@ -30,6 +30,7 @@
 #include "renderingalgorithms_simplebase.hxx"
 #include "lightpicker_ucb.hxx"
 #include "path_guiding.hxx"
+#include "checkpoint.hxx"
 
 namespace fs = boost::filesystem;
 
@@ -58,6 +59,7 @@ inline void GenerateImage(Image &img, Span<const RGB> framebuffer, Span<const ui
 namespace pathtracing_guided
 {
 using SimplePixelByPixelRenderingDetails::SamplesPerPixelSchedule;
+using SimplePixelByPixelRenderingDetails::TimeBudget;
 using Lights::LightRef;
 using Lightpickers::UcbLightPicker;
 class PathTracingAlgo2;
@@ -121,6 +123,13 @@ public:
   }
 
   const Lightpickers::LightSelectionProbabilityMap& GetDistributionNee() const { return picker_nee.Distribution(); }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    graph.wait_for_all(); // Pending returns belong into the stats.
+    ar(picker_nee);
+  }
 };
 #else
 class LightPickerUcbBufferedQueue
@@ -151,6 +160,11 @@ public:
   }
 
   const Lightpickers::LightSelectionProbabilityMap& GetDistributionNee() const { return distribution; }
+
+  template<class Archive>
+  void Serialize(Archive &)
+  {
+  }
 };
 #endif
 
@@ -253,7 +267,7 @@ inline TrackToNextInteractionGuided(
   RadianceFilterState filt_l{ initial_radiance };
 
   double tfar = LargeNumber;
-  const auto hit = scene.FirstIntersection(ray, 0., tfar);
+  const auto hit = scene.FirstHit(ray, 0., tfar);
   // The factor by which tfar is decreased is meant to prevent intersections which lie close to the end of the query segment.
   tfar *= 0.9999;
   
@@ -334,7 +348,7 @@ inline TrackToNextInteractionGuided(
   // If we get here, there was no scattering in the medium.
   if (hit)
   {
-    return RetType{ *hit, tfar, weight };
+    return RetType{ scene.Resolve(*hit, ray), tfar, weight };
   }
   else
   {
@@ -593,6 +607,15 @@ struct PathNode
   // PathNode(const Scene &scene, PathContext &context, int prev_index, const PathNode &prev, const PathIntermediateState &pis, const MaybeSomeInteraction &interaction, double tfar, Spectral3 track_weight);
 };
 
+// The part of the path start which happens before intersecting the camera ray with the scene.
+struct CameraRaySample
+{
+  PathContext context;
+  Spectral3 weight;
+  Ray ray;
+};
+
+
 struct RGBErr {
   RGB value{Eigen::zero};
   RGB err{Eigen::zero};
@@ -635,7 +658,7 @@ class alignas(128) CameraRenderWorker
   guiding::PathGuiding::ThreadLocal radrec_local_surface;
   guiding::PathGuiding::ThreadLocal radrec_local_volume;
   mutable Sampler sampler;
-  mutable Span<RGB> framebuffer;
+  TiledFramebuffer* framebuffer = nullptr;
   mutable Span<RGB> debugbuffer;
   Span<RGBErr> pixel_intensity_approximations;
   RayTermination ray_termination;
@@ -643,10 +666,12 @@ class alignas(128) CameraRenderWorker
   static constexpr int num_lambda_sweeps = decltype(lambda_selection_factory)::NUM_SAMPLES_REQUIRED;
   PathContext context;
   bool enable_nee;
+  ToyVector<CameraRaySample> tile_camera_samples;
+  PrimaryRayBatch primary_rays;
 
 public:
   CameraRenderWorker(PathTracingAlgo2 *master, int worker_index);
-  void Render(const ImageTileSet::Tile & tile, const int samples_per_pixel);
+  void Render(const ImageTileSet::Tile & tile, const int samples_per_pixel, const long first_sample);
   void PrepassRender(long sample_count);
   
   auto* GetGuidingLocalDataSurface() { return &radrec_local_surface;  }
@@ -658,10 +683,11 @@ public:
   int max_split      = 1;
 
 private:
-  void RenderPixel(int pixel);
+  void RenderPixel(const CameraRaySample &camera_sample, const std::optional<HitRecord> &hit, double tfar);
   void PathTraceRecursive(PathNode &ps);
 
-  PathNode GenerateFirstInteractionNode(const LambdaSelection &lambda_selection);
+  CameraRaySample SampleCameraRay(int pixel);
+  PathNode GenerateFirstInteractionNode(const CameraRaySample &camera_sample, const std::optional<HitRecord> &hit, double tfar);
   PathIntermediateState PrepareStartAfterScatter(const PathNode &pn, const ScatterSample &smpl) const;
   PathNode GeneratePathNode(const PathNode &ps, const ScatterSample &scatter_smpl, const PathIntermediateState &after_scatter, const MaybeSomeInteraction &interaction, const Spectral3 &track_weight, double rr_weight);
   void DoTheSplittingAndRussianRoutlettePartPushingSuccessorNodes(PathNode &ps);
@@ -703,15 +729,17 @@ class PathTracingAlgo2 : public RenderingAlgo
   friend class CameraRenderWorker;
   friend class ApproximatePixelWorker;
 private:
-  ToyVector<RGB> framebuffer;
   ToyVector<RGB> debugbuffer;
   ToyVector<RGBErr> pixel_intensity_approximations;
   ImageTileSet tileset;
-  ToyVector<std::uint64_t> samplesPerTile; // False sharing!
+  TiledFramebuffer framebuffer;
+  TileConvergenceTracker convergence; // Only used in the final passes, after the training.
+  TileSnapshot snapshot;
 
   int num_pixels = 0;
   SamplesPerPixelSchedule spp_schedule;
   //SimplePixelByPixelRenderingDetails::SamplesPerPixelScheduleConstant spp_schedule;
+  TimeBudget time_budget;
   tbb::task_group the_task_group;
   tbb::task_arena the_task_arena;
   tbb::atomic<bool> stop_flag = false;
@@ -720,6 +748,9 @@ private:
   std::unique_ptr<guiding::PathGuiding> radiance_recorder_surface;
   std::unique_ptr<guiding::PathGuiding> radiance_recorder_volume;
   bool record_samples_for_guiding = true;
+  long training_spp = 1; // Of the next training sweep. The first one is the initial iteration.
+  long samples_taken = 0; // Per pixel, over the training and the final sweeps. Numbers the pixel samples for the sampler.
+  bool have_pixel_approximations = false; // Not part of the checkpoints, and specific to the view.
 
 public:
   const RenderingParameters &render_params;
@@ -748,6 +779,34 @@ public:
   
   void RenderRadianceEstimates(fs::path filename);
 
+  bool SupportsSnapshots() const override { return true; }
+  int UpdateSnapshot(Image &dest) override { return snapshot.Update(dest, !render_params.linear_output); }
+
+  void SaveState(checkpoint::Writer &ar) override { SerializeState(ar); }
+  void LoadState(checkpoint::Reader &ar) override 
+  { 
+    SerializeState(ar);
+    for (int i = 0; i < tileset.size(); ++i)
+      if (framebuffer.SampleCount(i) > 0)
+        PublishSnapshot(i);
+  }
+  // The guiding structures are only consistent between training sweeps.
+  bool SupportsMidPassCheckpoints() const override { return false; }
+
+  // Only after completed training. Then the training is skipped.
+  bool AdoptSceneKnowledge(const RenderingAlgo &previous) override
+  {
+    const auto *other = dynamic_cast<const PathTracingAlgo2*>(&previous);
+    if (!other || other->record_samples_for_guiding)
+      return false;
+    checkpoint::CopyState(*other->pickers, *pickers);
+    checkpoint::CopyState(*other->radiance_recorder_surface, *radiance_recorder_surface);
+    checkpoint::CopyState(*other->radiance_recorder_volume, *radiance_recorder_volume);
+    record_samples_for_guiding = false;
+    training_spp = other->training_spp;
+    return true;
+  }
+
 protected:
   inline int GetNumPixels() const { return num_pixels; }
   inline int NumThreads() const {
@@ -757,6 +816,27 @@ protected:
   
   void PrintAndClearStats();
 
+private:
+  template<class Archive>
+  void SerializeState(Archive &ar)
+  {
+    ar.Expect(tileset.size(), "number of tiles");
+    ar(record_samples_for_guiding);
+    ar(training_spp);
+    ar(samples_taken);
+    ar(spp_schedule);
+    ar(framebuffer);
+    ar(debugbuffer);
+    ar(convergence);
+    ar(*pickers);
+    ar(*radiance_recorder_surface);
+    ar(*radiance_recorder_volume);
+  }
+
+  void PublishSnapshot(int tile_index)
+  {
+    snapshot.Publish(tile_index, [this](int pixel_index) { return framebuffer.Average(pixel_index); });
+  }
 };
 
 
@@ -775,7 +855,6 @@ class alignas(128) ApproximatePixelWorker
   Span<RGBErr> framebuffer;
   LambdaSelectionStrategyShuffling lambda_selection_factory;
   static constexpr int num_lambda_sweeps = decltype(lambda_selection_factory)::NUM_SAMPLES_REQUIRED;
-  ToyVector<BoundaryIntersection> boundary_intersection_buffer;
 
 public:
   ApproximatePixelWorker(PathTracingAlgo2* master, Span<RGBErr> framebuffer)
@@ -785,7 +864,6 @@ public:
     pickers{master->pickers.get()},
     framebuffer{framebuffer}
   {
-    boundary_intersection_buffer.reserve(1024);
   }
 
   //Accumulators::OnlineVariance<Eigen::Array3d,long> average_intensity{Eigen::Array3d{Eigen::zero}};
@@ -884,22 +962,16 @@ public:
     // Algo 1
 
     double tfar = LargeNumber;
-    const auto hit = master->scene.FirstIntersection(ray, 0., tfar);
+    const auto hit = master->scene.FirstHit(ray, 0., tfar);
     // The factor by which tfar is decreased is meant to prevent intersections which lie close to the end of the query segment.
     tfar *= 0.9999;
     
     Spectral3 transmittance{Eigen::ones};
     Spectral3Err integrated_inscatter;
 
-    Span<BoundaryIntersection> boundary_intersections = master->scene.IntersectionsWithVolumes(ray, 0., tfar);
-    
-    // boundary_intersection_buffer.clear();
-    // std::copy(boundary_intersections.begin(), boundary_intersections.end(), std::back_inserter(boundary_intersection_buffer));
-    // boundary_intersections = AsSpan(boundary_intersection_buffer);
-
     auto iter = guiding::CombinedIntervalsIterator<guiding::CellIterator, SegmentIterator>{
       radiance_recorder_volume->MakeCellIterator(ray, 0., tfar),
-      SegmentIterator { ray, medium_tracker, boundary_intersections, 0., tfar }
+      VolumeSegmentIterator(master->scene, ray, medium_tracker, 0., tfar)
     };
     for (; iter; ++iter)
     {
@@ -933,7 +1005,7 @@ public:
     // If we get here, there was no scattering in the medium.
     if (hit)
     {
-      return { *hit, tfar, transmittance, integrated_inscatter };
+      return { master->scene.Resolve(*hit, ray), tfar, transmittance, integrated_inscatter };
     }
     else
     {
@@ -1043,15 +1115,17 @@ PathTracingAlgo2::PathTracingAlgo2(
   :
   RenderingAlgo{}, 
   tileset({ render_params_.width, render_params_.height }),
+  framebuffer{ tileset },
+  convergence{ tileset, { render_params_.width, render_params_.height }, render_params_.target_error },
+  snapshot{ tileset },
   spp_schedule{ render_params_ },
+  time_budget{ render_params_ },
   render_params{ render_params_ }, scene{ scene_ }
 {
   the_task_arena.initialize(std::max(1, this->render_params.num_threads));
   num_pixels = render_params.width * render_params.height;
 
-  framebuffer.resize(num_pixels, RGB{Eigen::zero});
   debugbuffer.resize(num_pixels, RGB{Eigen::zero});
-  samplesPerTile.resize(tileset.size(), 0);
 
   pixel_intensity_approximations.resize(num_pixels, RGBErr{});
 
@@ -1090,8 +1164,10 @@ void PathTracingAlgo2::InnerRenderIteration()
     parallel_for_interruptible(0, this->tileset.size(), 1, [this](int i)
     {
       const int worker_num = tbb::this_task_arena::current_thread_index();
-      camerarender_workers[worker_num].Render(this->tileset[i], 1);
-      ++this->samplesPerTile[i];
+      camerarender_workers[worker_num].Render(this->tileset[i], 1, samples_taken);
+      this->framebuffer.AddSampleCount(i, 1);
+      PublishSnapshot(i);
+      time_budget.TileDone();
     },
       /*irq_handler=*/[this]() -> bool
     {
@@ -1101,6 +1177,7 @@ void PathTracingAlgo2::InnerRenderIteration()
       return true;
     }, the_task_group);
   });
+  ++samples_taken;
   
   radiance_recorder_surface->FinalizeRound(AsSpan(radrec_local_surface));
   radiance_recorder_volume->FinalizeRound(AsSpan(radrec_local_volume));
@@ -1109,35 +1186,40 @@ void PathTracingAlgo2::InnerRenderIteration()
 
 inline void PathTracingAlgo2::Run()
 {
-  if (!stop_flag.load())
+  if (!stop_flag.load() && record_samples_for_guiding && training_spp == 1)
   {
     pickers->ComputeDistribution();
+    time_budget.StartPass(tileset.size());
     InnerRenderIteration();
+    time_budget.EndPass(1);
     RenderRadianceEstimates(guiding::GetDebugFilePrefix() / fs::path{"initial_approx.png"});
+    training_spp = 2;
     CallInterruptCb(true);
   }
 
+  if (record_samples_for_guiding) // Else resumed from a checkpoint of the final passes.
   {
-    long num_samples = 2;
-    while (!stop_flag.load() && num_samples <= render_params.guiding_max_spp)
+    long &num_samples = training_spp;
+    // With a time limit, training stops when the final passes could not get at least as many samples.
+    while (!stop_flag.load() && num_samples <= render_params.guiding_max_spp && 
+           time_budget.FitSamplesPerPixel(2*num_samples, tileset.size()) >= 2*num_samples)
     {
       std::cout << "Guiding sweep " << num_samples << " start" << std::endl;
       // Clear the frame buffer to get rid of samples from previous iterations
       // which are assumed to be worse than current samples.
-      std::fill(framebuffer.begin(), framebuffer.end(), RGB::Zero());
+      framebuffer.Clear();
       std::fill(debugbuffer.begin(), debugbuffer.end(), RGB::Zero());
-      std::fill(samplesPerTile.begin(), samplesPerTile.end(), 0ul);
       pickers->ComputeDistribution();
 
+      time_budget.StartPass(num_samples*tileset.size());
       for (int inner_iter = 0; inner_iter < num_samples; ++inner_iter)
       {
         InnerRenderIteration();
       }
+      time_budget.EndPass(1);
 
       PrintAndClearStats();
       std::cout << "Guiding sweep " << num_samples << " finished" << std::endl;
-      
-      CallInterruptCb(true);
 
       radiance_recorder_surface->PrepareAdaptedStructures();
       radiance_recorder_volume->PrepareAdaptedStructures();
@@ -1156,6 +1238,9 @@ inline void PathTracingAlgo2::Run()
 
       //num_samples = num_samples + std::max(1, int(num_samples*0.5));
       num_samples *= 2;
+
+      // After the update of the guiding structures, so that checkpoints are consistent.
+      CallInterruptCb(true);
     } // Pass iteration
   }
 
@@ -1166,22 +1251,41 @@ inline void PathTracingAlgo2::Run()
     w.min_node_count = 2;
     w.max_node_count = 20;
   }
-  this->record_samples_for_guiding = false;
 
-  std::fill(framebuffer.begin(), framebuffer.end(), RGB::Zero());
-  std::fill(debugbuffer.begin(), debugbuffer.end(), RGB::Zero());
-  std::fill(samplesPerTile.begin(), samplesPerTile.end(), 0ul);
+  // The splitting needs them also after resuming the final passes or adopting the guiding data of another view.
+  if (!stop_flag.load() && !have_pixel_approximations)
+    RenderRadianceEstimates(guiding::GetDebugFilePrefix() / fs::path{"final_approx.png"});
 
-  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0)
+  if (record_samples_for_guiding && !stop_flag.load())
   {
+    this->record_samples_for_guiding = false;
+    if (!time_budget.Expired()) // Else keep the image from the training.
+    {
+      framebuffer.Clear();
+      std::fill(debugbuffer.begin(), debugbuffer.end(), RGB::Zero());
+    }
+  }
+
+  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0 && !convergence.AllConverged() && !time_budget.Expired())
+  {
+    const int num_active_tiles = convergence.NumActive();
+    spp_schedule.LimitPerIteration(time_budget.FitSamplesPerPixel(spp_schedule.GetPerIteration(), num_active_tiles));
+    if (spp_schedule.GetPerIteration() <= 0)
+      break;
+    time_budget.StartPass(num_active_tiles);
     std::cout << "Sweep " << spp_schedule.GetTotal() << " start" << std::endl;
 
     the_task_arena.execute([this] {
       parallel_for_interruptible(0, this->tileset.size(), 1, [this](int i)
       {
+        if (!convergence.IsActive(i) || time_budget.Expired())
+          return;
         const int worker_num = tbb::this_task_arena::current_thread_index();
-        camerarender_workers[worker_num].Render(this->tileset[i], spp_schedule.GetPerIteration());
-        this->samplesPerTile[i] += spp_schedule.GetPerIteration();
+        camerarender_workers[worker_num].Render(this->tileset[i], spp_schedule.GetPerIteration(), samples_taken);
+        this->framebuffer.AddSampleCount(i, spp_schedule.GetPerIteration());
+        convergence.Update(i, this->tileset[i], this->framebuffer, spp_schedule.GetPerIteration());
+        PublishSnapshot(i);
+        time_budget.TileDone();
       },
         /*irq_handler=*/[this]() -> bool
       {
@@ -1192,9 +1296,12 @@ inline void PathTracingAlgo2::Run()
       }, the_task_group);
     });
 
+    time_budget.EndPass(spp_schedule.GetPerIteration());
+    samples_taken += spp_schedule.GetPerIteration();
     PrintAndClearStats();
     std::cout << "Sweep " << spp_schedule.GetTotal() << " finished" << std::endl;
-    CallInterruptCb(true);
+    if (convergence.Enabled())
+      std::cout << "Tiles still active " << convergence.NumActive() << " of " << tileset.size() << std::endl;
 
     // the_task_arena.execute([this,num_samples=spp_schedule.GetTotal()] 
     // {  
@@ -1207,16 +1314,18 @@ inline void PathTracingAlgo2::Run()
     //});
 
     spp_schedule.UpdateForNextPass();
+    CallInterruptCb(true); // After the update, so that checkpoints taken here account for the pass.
   } // Pass iteration
+  time_budget.PrintSummary(spp_schedule.GetTotal());
 }
 
 
 inline std::unique_ptr<Image> PathTracingAlgo2::GenerateImage()
 {
-  auto bm = std::make_unique<Image>();
+  auto bm = std::make_unique<Image>(render_params.width, render_params.height);
   the_task_arena.execute([this, bm = bm.get()] 
   {  
-    ::GenerateImage(*bm, AsSpan(framebuffer), AsSpan(samplesPerTile), tileset, {render_params.width, render_params.height}, !render_params.linear_output);
+    framebuffer::ToImage(*bm, framebuffer, !render_params.linear_output);
   });
   return bm;
 }
@@ -1273,6 +1382,7 @@ void PathTracingAlgo2::RenderRadianceEstimates(fs::path filename)
 
     // std::cout << "Done. Avg intensity = " << average_intensity << std::endl;
   });
+  have_pixel_approximations = true;
 }
 
 
@@ -1301,7 +1411,7 @@ CameraRenderWorker::CameraRenderWorker(PathTracingAlgo2* master, int worker_inde
   ray_termination{ master->render_params },
   enable_nee{ true }
 {
-  framebuffer = AsSpan(master->framebuffer);
+  framebuffer = &master->framebuffer;
   debugbuffer = AsSpan(master->debugbuffer);
   pixel_intensity_approximations = AsSpan(master->pixel_intensity_approximations);
   if (master->render_params.pt_sample_mode == "bsdf")
@@ -1311,28 +1421,41 @@ CameraRenderWorker::CameraRenderWorker(PathTracingAlgo2* master, int worker_inde
 }
 
 
-void CameraRenderWorker::Render(const ImageTileSet::Tile &tile, const int samples_per_pixel)
+void CameraRenderWorker::Render(const ImageTileSet::Tile &tile, const int samples_per_pixel, const long first_sample)
 {
   const Int2 end = tile.corner + tile.shape;
 
-  for (int iy = tile.corner[1]; iy < end[1]; ++iy)
-  for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+  // One path per pixel is started at a time, so that all camera rays of the tile can be intersected in one batch.
+  for (int i = 0; i < samples_per_pixel; ++i)
   {
-    const auto pixel = master->scene.GetCamera().PixelToUnit({ ix, iy});      
-    for (int i = 0; i < samples_per_pixel; ++i)
+    tile_camera_samples.clear();
+    primary_rays.Clear();
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+    for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+    {
+      // Only the camera ray is sampled right after reseeding. The paths are traced after the batch,
+      // continuing the generator from where the last camera ray left it.
+      sampler.SetPixelSample({ ix, iy }, static_cast<int>(first_sample + i));
+      const auto pixel = master->scene.GetCamera().PixelToUnit({ ix, iy});
+      tile_camera_samples.push_back(SampleCameraRay(pixel));
+      primary_rays.rays.push_back(tile_camera_samples.back().ray);
+    }
+
+    primary_rays.Intersect(master->scene);
+
+    for (int path_index = 0; path_index < isize(tile_camera_samples); ++path_index)
     {
-      RenderPixel(pixel);
+      RenderPixel(tile_camera_samples[path_index], primary_rays.hits[path_index], primary_rays.tfars[path_index]);
     }
   }
 }
 
 
-void CameraRenderWorker::RenderPixel(int pixel)
+void CameraRenderWorker::RenderPixel(const CameraRaySample &camera_sample, const std::optional<HitRecord> &hit, double tfar)
 {
-  const auto lambda_selection = lambda_selection_factory.WithWeights(sampler);
-  context = PathContext(lambda_selection, pixel);
+  context = camera_sample.context;
 
-  PathNode root = GenerateFirstInteractionNode(lambda_selection);
+  PathNode root = GenerateFirstInteractionNode(camera_sample, hit, tfar);
 
 #if 1
   PathTraceRecursive(root);
@@ -1369,13 +1492,15 @@ void CameraRenderWorker::PrepassRender(long sample_count)
 {
   while (sample_count-- > 0)
   {
-    const auto lambda_selection = lambda_selection_factory.WithWeights(sampler);
     int ix = sampler.UniformInt(0, master->render_params.width-1);
     int iy = sampler.UniformInt(0, master->render_params.height-1);
     const auto pixel = master->scene.GetCamera().PixelToUnit({ ix, iy});      
-    context = PathContext(lambda_selection, pixel);
+    const CameraRaySample camera_sample = SampleCameraRay(pixel);
+    context = camera_sample.context;
 
-    PathNode root = GenerateFirstInteractionNode(lambda_selection);
+    double tfar = LargeNumber;
+    const auto hit = master->scene.FirstHit(camera_sample.ray, 0., tfar);
+    PathNode root = GenerateFirstInteractionNode(camera_sample, hit, tfar);
 
     PathTraceRecursive(root);
 
@@ -1626,9 +1751,11 @@ const Spectral3Err CameraRenderWorker::ComputeApproximateInscatter(const PathNod
 }
 
 
-PathNode CameraRenderWorker::GenerateFirstInteractionNode(const LambdaSelection &lambda_selection)
+CameraRaySample CameraRenderWorker::SampleCameraRay(int pixel)
 {
   const auto& camera = master->scene.GetCamera();
+  const auto lambda_selection = lambda_selection_factory.WithWeights(sampler);
+  const PathContext context{lambda_selection, pixel};
   
   Spectral3 weight = lambda_selection.weights;
 
@@ -1636,12 +1763,24 @@ PathNode CameraRenderWorker::GenerateFirstInteractionNode(const LambdaSelection
   weight *= pos.value / pos.pdf_or_pmf;
   auto dir = camera.TakeDirectionSampleFrom(context.pixel_index, pos.coordinates, sampler, context);
   weight *= dir.value / dir.pdf_or_pmf;
-  Ray ray{ pos.coordinates, dir.coordinates };
+
+  return CameraRaySample{
+    context,
+    weight,
+    Ray{ pos.coordinates, dir.coordinates }
+  };
+}
+
+
+PathNode CameraRenderWorker::GenerateFirstInteractionNode(const CameraRaySample &camera_sample, const std::optional<HitRecord> &hit, double tfar_hit)
+{
+  const Ray &ray = camera_sample.ray;
+  const Spectral3 &weight = camera_sample.weight;
 
   MediumTracker medium_tracker{master->scene};
-  medium_tracker.initializePosition(pos.coordinates);
+  medium_tracker.initializePosition(ray.org);
 
-  auto[interaction, tfar, track_weight] = TrackToNextInteraction(master->scene, ray, context, Spectral3::Ones(), sampler, medium_tracker, nullptr);
+  auto[interaction, tfar, track_weight] = TrackToNextInteraction(master->scene, ray, hit, tfar_hit, context, Spectral3::Ones(), sampler, medium_tracker, nullptr);
 
   const RadianceFit* radiance_fit = interaction ? FindRadianceEstimate(*interaction) : nullptr;
 
@@ -1953,7 +2092,7 @@ void CameraRenderWorker::RecordMeasurementToCurrentPixel(const PathNode &node) c
 
   assert(measurement.isFinite().all());
   auto color = Color::SpectralSelectionToRGB(measurement, context.lambda_idx);
-  framebuffer[context.pixel_index] += color;
+  framebuffer->Add(context.pixel_index, color);
 }
 
 
@@ -21,12 +21,14 @@
 #include "renderingalgorithms_interface.hxx"
 #include "renderingalgorithms_simplebase.hxx"
 #include "lightpicker_trivial.hxx"
+#include "checkpoint.hxx"
 
 
 namespace Photonmapping
 {
 using SimplePixelByPixelRenderingDetails::SamplesPerPixelSchedule;
 using SimplePixelByPixelRenderingDetails::SamplesPerPixelScheduleConstant;
+using SimplePixelByPixelRenderingDetails::TimeBudget;
 class PhotonmappingRenderingAlgo;
 struct EmitterSampleVisitor;
 using Lights::LightRef;
@@ -203,6 +205,25 @@ struct PathState
   boost::optional<Pdf> last_scatter_pdf_value; // For MIS.
   int current_node_count;
   bool monochromatic;
+  std::uint32_t subsequence_position = 0; // Where the sampler left off when the path was put aside.
+  Int2 pixel;
+  int point_num;
+};
+
+
+// NEE contribution waiting for the result of the shadow ray. The transmittance through media
+// is only estimated if it is not occluded.
+struct DeferredNee
+{
+  LightRef light_ref;
+  RaySegment segment_to_light;
+  MediumTracker medium_tracker;
+  PathContext context;
+  Spectral3 measurement; // Without transmittance.
+  // Where the sampler left off after sampling the light.
+  Int2 pixel;
+  int point_num;
+  std::uint32_t subsequence_position;
 };
 
 
@@ -211,18 +232,24 @@ class CameraRenderWorker
   const PhotonmappingRenderingAlgo * const master;
   LightPickersCombined* const pickers;
   mutable Sampler sampler;
-  mutable Span<RGB> framebuffer;
+  TiledFramebuffer* framebuffer = nullptr;
   LambdaSelection lambda_selection;
   RayTermination ray_termination; 
   Kernel2d kernel2d;
   Kernel3d kernel3d;
   const int worker_index;
+  ToyVector<PathState> tile_paths;
+  PrimaryRayBatch primary_rays;
+  mutable ShadowRayQueue<DeferredNee> shadow_rays;
 #ifdef LOGGING
   mutable Pathlogger logger;
 #endif
 private:
   void InitializePathState(PathState &p, Int2 pixel) const;
+  void StartPath(PathState &ps, Int2 pixel, int point_num) const;
+  void ResumePath(const PathState &ps) const;
   bool TrackToNextInteractionAndRecordPixel(PathState &ps) const;
+  bool TrackToNextInteractionAndRecordPixel(PathState &ps, const std::optional<HitRecord> &hit, double tfar) const;
   void AddPhotonContributions(const SurfaceInteraction &interaction, const PathState &ps) const;
   //void AddPhotonContributions(const VolumeInteraction& interaction, const Double3& incident_dir, const Spectral3& path_weight);
   bool MaybeScatterAtSpecularLayer(const SurfaceInteraction &interaction, PathState &ps) const;
@@ -232,13 +259,15 @@ private:
   void AddEnvEmission(const PathState &ps) const;
   void AddPhotonBeamContributions(const RaySegment &segment, const Medium &medium, const PiecewiseConstantTransmittance &pct, const Spectral3 &track_weight, const PathState &ps) const;
   void MaybeAddDirectLighting(const SurfaceInteraction &interaction, const PathState &ps) const;
+  void FlushShadowRays() const;
 #ifdef DEBUG_BUFFERS
   void AddToDebugBuffer(int id, int level, const Spectral3 &measurement_estimate);
 #endif
 public:
   CameraRenderWorker(PhotonmappingRenderingAlgo *master, int worker_index);
   void StartNewPass(const LambdaSelection &lambda_selection);
-  void Render(const ImageTileSet::Tile & tile);
+  // first_sample numbers the camera samples of the tile's pixels for the sampler.
+  void Render(const ImageTileSet::Tile & tile, std::uint64_t first_sample);
 
 };
 
@@ -248,9 +277,10 @@ class PhotonmappingRenderingAlgo : public RenderingAlgo
   friend class PhotonmappingWorker;
   friend class CameraRenderWorker;
 private:
-  ToyVector<RGB> framebuffer;
   ImageTileSet tileset;
-  ToyVector<std::uint64_t> samplesPerTile; // False sharing!
+  TiledFramebuffer framebuffer;
+  TileConvergenceTracker convergence;
+  TileSnapshot snapshot;
 
   std::unique_ptr<HashGrid> hashgrid_volume; // Photon Lookup
   std::unique_ptr<HashGrid> hashgrid_surface;
@@ -265,6 +295,7 @@ private:
   double current_volume_photon_radius = 0;
   double radius_reduction_alpha = 2./3.; // Less means faster reduction. 2/3 is suggested in the unified path sampling paper.
   SamplesPerPixelScheduleConstant spp_schedule;
+  TimeBudget time_budget; // A pass consists of the photon tracing and one camera sample per pixel.
   tbb::task_group the_task_group;
   tbb::task_arena the_task_arena;
   tbb::atomic<bool> stop_flag = false;
@@ -308,6 +339,18 @@ public:
   }
   
   std::unique_ptr<Image> GenerateImage() override;
+
+  bool SupportsSnapshots() const override { return true; }
+  int UpdateSnapshot(Image &dest) override { return snapshot.Update(dest); }
+
+  void SaveState(checkpoint::Writer &ar) override { SerializeState(ar); }
+  void LoadState(checkpoint::Reader &ar) override 
+  { 
+    SerializeState(ar);
+    for (int i = 0; i < tileset.size(); ++i)
+      if (framebuffer.SampleCount(i) > 0)
+        PublishSnapshot(i);
+  }
   
 protected:
   inline int GetNumPixels() const { return num_pixels; }
@@ -319,6 +362,24 @@ protected:
 private:
   void PrepareGlobalPhotonMap();
   void UpdatePhotonRadii();
+
+  // The photon maps are rebuilt in every pass. Only the radii progress.
+  template<class Archive>
+  void SerializeState(Archive &ar)
+  {
+    ar.Expect(tileset.size(), "number of tiles");
+    ar(spp_schedule);
+    ar(framebuffer);
+    ar(convergence);
+    ar(pass_index);
+    ar(current_surface_photon_radius);
+    ar(current_volume_photon_radius);
+  }
+
+  void PublishSnapshot(int tile_index)
+  {
+    snapshot.Publish(tile_index, [this](int pixel_index) { return framebuffer.Average(pixel_index); });
+  }
 };
 
 
@@ -328,7 +389,11 @@ Photonmapping::PhotonmappingRenderingAlgo::PhotonmappingRenderingAlgo(
   : 
   RenderingAlgo{},
     tileset({ render_params_.width, render_params_.height }),
+    framebuffer{ tileset },
+    convergence{ tileset, { render_params_.width, render_params_.height }, render_params_.target_error },
+    snapshot{ tileset },
     spp_schedule{ render_params_ }, 
+    time_budget{ render_params_ },
     render_params{ render_params_ }, scene{ scene_ }
 {
   the_task_arena.initialize(std::max(1, this->render_params.num_threads));
@@ -342,9 +407,6 @@ Photonmapping::PhotonmappingRenderingAlgo::PhotonmappingRenderingAlgo(
   }
 #endif
 
-  framebuffer.resize(num_pixels, RGB{});
-  samplesPerTile.resize(tileset.size(), 0);
-
   pickers = std::make_unique<LightPickersCombined>(scene, NumThreads());
 
   for (int i = 0; i < the_task_arena.max_concurrency(); ++i)
@@ -362,7 +424,7 @@ inline void PhotonmappingRenderingAlgo::Run()
 {
   Sampler sampler;
 
-  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0)
+  while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0 && !convergence.AllConverged() && !time_budget.Expired())
   {
     num_photons_traced = num_pixels * GetSamplesPerPixel();
     emitter_refs.resize(num_photons_traced);
@@ -373,9 +435,11 @@ inline void PhotonmappingRenderingAlgo::Run()
     // But one sweep will require multiple photon mapping passes since 
     // each pass only covers part of the spectrum.
     for (int spectrum_sweep_idx = 0;
-      (spectrum_sweep_idx <= decltype(lambda_selection_factory)::NUM_SAMPLES_REQUIRED) && !stop_flag.load();
+      (spectrum_sweep_idx <= decltype(lambda_selection_factory)::NUM_SAMPLES_REQUIRED) && !stop_flag.load() &&
+      time_budget.FitSamplesPerPixel(1, convergence.NumActive()) > 0;
       ++spectrum_sweep_idx)
     {
+      time_budget.StartPass(convergence.NumActive());
       //shared_pixel_index = 0;
       auto lambda_selection = lambda_selection_factory.WithWeights(sampler);
 
@@ -408,9 +472,14 @@ inline void PhotonmappingRenderingAlgo::Run()
       the_task_arena.execute([this] {
           parallel_for_interruptible(0, this->tileset.size(), 1, [this](int i)
           {
+              if (!convergence.IsActive(i) || time_budget.Expired())
+                  return;
               const int worker_num = tbb::this_task_arena::current_thread_index();
-              camerarender_workers[worker_num].Render(this->tileset[i]);
-              this->samplesPerTile[i]++;
+              camerarender_workers[worker_num].Render(this->tileset[i], this->framebuffer.SampleCount(i));
+              this->framebuffer.AddSampleCount(i, 1);
+              convergence.Update(i, this->tileset[i], this->framebuffer, 1);
+              PublishSnapshot(i);
+              time_budget.TileDone();
           },
               /*irq_handler=*/[this]() -> bool
           {
@@ -422,6 +491,7 @@ inline void PhotonmappingRenderingAlgo::Run()
       });
 
       pickers->OnPassEnd(AsSpan(emitter_refs));
+      time_budget.EndPass(1);
 
 #ifdef LOGGING
       IncompletePaths::Clear();
@@ -429,24 +499,21 @@ inline void PhotonmappingRenderingAlgo::Run()
 
     } // For spectrum sweep
     std::cout << "Sweep " << spp_schedule.GetTotal() << " finished" << std::endl;
-    CallInterruptCb(true);
+    if (convergence.Enabled())
+      std::cout << "Tiles still active " << convergence.NumActive() << " of " << tileset.size() << std::endl;
     spp_schedule.UpdateForNextPass();
     ++pass_index;
     UpdatePhotonRadii();
+    CallInterruptCb(true); // After the update, so that checkpoints taken here account for the pass.
   } // Pass iteration
+  time_budget.PrintSummary((int)framebuffer.MaxSampleCount());
 }
 
 
 inline std::unique_ptr<Image> PhotonmappingRenderingAlgo::GenerateImage()
 {
   auto bm = std::make_unique<Image>(render_params.width, render_params.height);
-  tbb::parallel_for(0, tileset.size(), [this, bm{bm.get()}](int i) {
-    const auto tile = tileset[i];
-    if (this->samplesPerTile[i] > 0)
-    {
-      framebuffer::ToImage(*bm, tile, AsSpan(this->framebuffer), this->samplesPerTile[i]);
-    }
-  });
+  framebuffer::ToImage(*bm, framebuffer);
 #ifdef DEBUG_BUFFERS
   int buf_num = 0;
   for (auto &b : debugbuffers)
@@ -748,7 +815,7 @@ CameraRenderWorker::CameraRenderWorker(Photonmapping::PhotonmappingRenderingAlgo
     ray_termination{master->render_params},
     worker_index{ worker_index }
 {
-  framebuffer = AsSpan(master->framebuffer);
+  framebuffer = &master->framebuffer;
 }
 
 void CameraRenderWorker::StartNewPass(const LambdaSelection& lambda_selection)
@@ -759,31 +826,72 @@ void CameraRenderWorker::StartNewPass(const LambdaSelection& lambda_selection)
 }
 
 
-void CameraRenderWorker::Render(const ImageTileSet::Tile &tile)
+void CameraRenderWorker::Render(const ImageTileSet::Tile &tile, std::uint64_t first_sample)
 {
   const Int2 end = tile.corner + tile.shape;
-  const int image_width = master->render_params.width;
   const int samples_per_pixel = master->GetSamplesPerPixel();
-  PathState state{ master->scene, lambda_selection };
+  
+  // One path per pixel is started at a time, so that all camera rays of the tile can be intersected in one batch.
+  tile_paths.clear();
+  for (int i = 0; i < tile.shape[0]*tile.shape[1]; ++i)
+    tile_paths.emplace_back(master->scene, lambda_selection);
 
-  for (int iy = tile.corner[1]; iy < end[1]; ++iy)
+  for (int i = 0; i < samples_per_pixel; ++i)
   {
-    for (int ix = tile.corner[0]; ix < end[0]; ++ix)
+    primary_rays.Clear();
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
     {
-      for (int i = 0; i < samples_per_pixel; ++i)
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix)
       {
-        InitializePathState(state, { ix, iy });
-        bool keepgoing = true;
-        do
-        {
-          keepgoing = TrackToNextInteractionAndRecordPixel(state);
-        } while (keepgoing);
+        PathState &state = tile_paths[isize(primary_rays.rays)];
+        StartPath(state, { ix, iy }, static_cast<int>(first_sample + i));
+        primary_rays.rays.push_back(state.ray);
+      }
+    }
+
+    primary_rays.Intersect(master->scene);
+
+    for (int path_index = 0; path_index < isize(primary_rays.rays); ++path_index)
+    {
+      PathState &state = tile_paths[path_index];
+      ResumePath(state);
+      bool keepgoing = TrackToNextInteractionAndRecordPixel(state, primary_rays.hits[path_index], primary_rays.tfars[path_index]);
+      while (keepgoing)
+      {
+        keepgoing = TrackToNextInteractionAndRecordPixel(state);
       }
+      // Only between paths, because the flush moves the sampler elsewhere.
+      if (shadow_rays.IsFull())
+        FlushShadowRays();
     }
   }
+
+  // Everything must be in the framebuffer when the tile is done.
+  FlushShadowRays();
+}
+
+
+
+
+void CameraRenderWorker::StartPath(PathState &ps, Int2 pixel, int point_num) const
+{
+  sampler.SetPixelSample(pixel, point_num);
+  InitializePathState(ps, pixel);
+  ps.pixel = pixel;
+  ps.point_num = point_num;
+  ps.subsequence_position = sampler.GetSubsequencePosition();
 }
 
 
+void CameraRenderWorker::ResumePath(const PathState &ps) const
+{
+  // The camera paths draw all their samples from the first subsequence. It continues where
+  // the camera sample left off, as if the path had been traced without interruption.
+  sampler.SetPixelIndex(ps.pixel);
+  sampler.SetPointNum(ps.point_num);
+  sampler.SetSubsequenceId(0);
+  sampler.SetSubsequencePosition(ps.subsequence_position);
+}
 
 
 void CameraRenderWorker::InitializePathState(PathState &p, Int2 pixel) const
@@ -817,9 +925,17 @@ void CameraRenderWorker::InitializePathState(PathState &p, Int2 pixel) const
 
 
 bool CameraRenderWorker::TrackToNextInteractionAndRecordPixel(PathState &ps) const
+{
+  double tfar = LargeNumber;
+  const auto hit = master->scene.FirstHit(ps.ray, 0., tfar);
+  return TrackToNextInteractionAndRecordPixel(ps, hit, tfar);
+}
+
+
+bool CameraRenderWorker::TrackToNextInteractionAndRecordPixel(PathState &ps, const std::optional<HitRecord> &hit, double tfar) const
 {
   bool keepgoing = false;
-  TrackBeam(master->scene, ps.ray, ps.context, sampler, ps.medium_tracker,
+  TrackBeam(master->scene, ps.ray, hit, tfar, ps.context, sampler, ps.medium_tracker,
     /*surface_visitor=*/[&ps, this, &keepgoing](const SurfaceInteraction &interaction, const Spectral3 &track_weight)
     {
 #ifdef LOGGING
@@ -931,22 +1047,23 @@ void CameraRenderWorker::MaybeAddDirectLighting(const SurfaceInteraction &intera
 #endif
     MediumTracker medium_tracker{ps.medium_tracker}; // Copy because well don't want to keep modifications.
     MaybeGoingThroughSurface(medium_tracker, ray.dir, interaction);
-    Spectral3 transmittance = TransmittanceEstimate(master->scene, segment_to_light, medium_tracker, ps.context, sampler);
     
-    path_weight *= MisWeight(pdf, bsdf_pdf)*transmittance*bsdf_weight;
+    path_weight *= MisWeight(pdf, bsdf_pdf)*bsdf_weight;
     
 #ifdef DEBUG_BUFFERS 
     AddToDebugBuffer(PhotonmappingRenderingAlgo::DEBUGBUFFER_ID_DIRECT, 0, path_weight*weight);
 #endif
     Spectral3 measurement_estimator = path_weight*light_weight;
 
-    pickers->ObserveReturnNee(this->worker_index, light_ref, measurement_estimator);
-    RecordMeasurementToCurrentPixel(measurement_estimator, ps);
+    // The occlusion test and the transmittance estimate are deferred to the shadow ray queue.
+    shadow_rays.Push(ShadowRaySegment(segment_to_light), 
+      DeferredNee{ light_ref, segment_to_light, medium_tracker, ps.context, measurement_estimator,
+                   ps.pixel, ps.point_num, sampler.GetSubsequencePosition() });
 
 #ifdef LOGGING
     {
       auto &ln1 = logger.GetNode(-1);
-      ln1.transmission_weight_to_next = transmittance;
+      ln1.transmission_weight_to_next.setOnes(); // Not known before the shadow ray returns.
       ln1.weight = bsdf_weight;
       ln1.exitant_dir = ray.dir;
     }
@@ -968,6 +1085,28 @@ void CameraRenderWorker::MaybeAddDirectLighting(const SurfaceInteraction &intera
 }
 
 
+void CameraRenderWorker::FlushShadowRays() const
+{
+  shadow_rays.Flush(master->scene, [this](const DeferredNee &nee, bool occluded)
+  {
+    Spectral3 measurement{ 0. };
+    if (!occluded)
+    {
+      // Continue the sampler where the path left off, as if the transmittance had been estimated right away.
+      sampler.SetPixelIndex(nee.pixel);
+      sampler.SetPointNum(nee.point_num);
+      sampler.SetSubsequenceId(0);
+      sampler.SetSubsequencePosition(nee.subsequence_position);
+      MediumTracker medium_tracker{ nee.medium_tracker };
+      measurement = nee.measurement * UnoccludedTransmittanceEstimate(master->scene, nee.segment_to_light, medium_tracker, nee.context, sampler);
+    }
+    pickers->ObserveReturnNee(this->worker_index, nee.light_ref, measurement);
+    if (!occluded)
+      framebuffer->Add(nee.context.pixel_index, Color::SpectralSelectionToRGB(measurement, lambda_selection.indices));
+  });
+}
+
+
 bool CameraRenderWorker::MaybeScatterAtSpecularLayer(const SurfaceInteraction &interaction, PathState &ps) const
 {
   const auto &shader = GetShaderOf(interaction,master->scene);
@@ -1209,7 +1348,7 @@ void CameraRenderWorker::AddPhotonBeamContributions(const RaySegment &segment, c
 void CameraRenderWorker::RecordMeasurementToCurrentPixel(const Spectral3 &measurement, const PathState &ps) const
 {
   auto color = Color::SpectralSelectionToRGB(measurement, lambda_selection.indices);
-  framebuffer[ps.context.pixel_index] += color;
+  framebuffer->Add(ps.context.pixel_index, color);
 }
 
 
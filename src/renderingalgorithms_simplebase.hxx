@@ -1,11 +1,18 @@
 #pragma once
 
 #include <functional>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
 
 #include <tbb/atomic.h>
 #include <tbb/mutex.h>
 #include <tbb/spin_mutex.h>
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 #include "scene.hxx"
 #include "util.hxx"
@@ -14,6 +21,7 @@
 #include "renderbuffer.hxx"
 #include "util_thread.hxx"
 #include "renderingalgorithms_interface.hxx"
+#include "checkpoint.hxx"
 
 
 
@@ -59,6 +67,23 @@ public:
   inline int GetPerIteration() const { return spp; }
   inline int GetTotal() const { return total_spp; }
   inline int GetMaxSppPerIteration() const { return MAX_SPP_PER_ITERATION;  }
+  // For the time budget. The doubling continues from the reduced count.
+  void LimitPerIteration(int max_spp_this_pass) { spp = std::max(0, std::min(spp, max_spp_this_pass)); }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(spp);
+    ar(total_spp);
+    if (Archive::is_loading)
+    {
+      // The limit may have changed since the checkpoint was written.
+      if (spp <= 0)
+        spp = 1;
+      if (max_spp > 0)
+        LimitPerIteration(max_spp - total_spp);
+    }
+  }
 };
 
 
@@ -84,16 +109,97 @@ public:
   
   inline int GetPerIteration() const { return spp; }
   inline int GetTotal() const { return total_spp; }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(spp);
+    ar(total_spp);
+    if (Archive::is_loading)
+      spp = (max_spp > 0 && total_spp >= max_spp) ? 0 : 1;
+  }
 };
 
 
 
+// For rendering against a deadline. Measures how many tile samples the passes got done per 
+// second and tells how many samples per pixel the next pass can afford. Expired() is meant to
+// be checked before each tile so that passes which run late are cut at tile granularity.
+class TimeBudget
+{
+  using Clock = std::chrono::steady_clock;
+  std::optional<Clock::time_point> deadline;
+  Clock::time_point start;
+  Clock::time_point pass_start;
+  std::uint64_t rays_at_start = 0;
+  tbb::atomic<int> tiles_done = 0; // In the current pass.
+  int tiles_planned = 0;
+  double tile_samples_per_second = 0.;
+
+public:
+  TimeBudget(const RenderingParameters &render_params)
+    : start{ Clock::now() }, pass_start{ start }, rays_at_start{ EmbreeAccelerator::NumRaysTraced() }
+  {
+    if (render_params.time_limit > 0.)
+    {
+      // Some slack for generating and writing the final image.
+      const double reserve = std::min(1., 0.05*render_params.time_limit);
+      deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(render_params.time_limit - reserve));
+    }
+  }
+
+  bool Enabled() const { return deadline.has_value(); }
+
+  bool Expired() const { return deadline && Clock::now() >= *deadline; }
+
+  void StartPass(int num_tiles)
+  {
+    pass_start = Clock::now();
+    tiles_done = 0;
+    tiles_planned = num_tiles;
+  }
+
+  void TileDone() { ++tiles_done; }
+
+  void EndPass(int samples_per_pixel)
+  {
+    const double seconds = std::chrono::duration<double>(Clock::now() - pass_start).count();
+    if (seconds > 0. && tiles_done > 0)
+      tile_samples_per_second = double(tiles_done)*samples_per_pixel / seconds;
+  }
+
+  bool LastPassWasCut() const { return tiles_done < tiles_planned; }
+
+  // Largest spp, at most the requested one, with which a pass over num_tiles tiles is expected to 
+  // finish in time. Zero if not even one sample fits.
+  int FitSamplesPerPixel(int spp, int num_tiles) const
+  {
+    if (!deadline || tile_samples_per_second <= 0. || num_tiles <= 0)
+      return spp;
+    const double seconds_left = std::chrono::duration<double>(*deadline - Clock::now()).count();
+    const double affordable = seconds_left * tile_samples_per_second / num_tiles;
+    return (int)std::max(0., std::min<double>(spp, std::floor(affordable)));
+  }
+
+  void PrintSummary(int total_spp) const
+  {
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const double rays = double(EmbreeAccelerator::NumRaysTraced() - rays_at_start);
+    std::cout << "Achieved " << total_spp << " spp";
+    if (LastPassWasCut())
+      std::cout << " (last pass covered " << tiles_done << " of " << tiles_planned << " tiles)";
+    std::cout << " in " << seconds << " sec, " << (seconds > 0. ? rays / seconds : 0.) << " rays/sec" << std::endl;
+  }
+};
+
+
 class Worker
 {
   public: 
     virtual ~Worker() {}
     virtual RGB RenderPixel(int _pixel_index) = 0;
     virtual ToyVector<SensorResponse>& GetSensorResponses() = 0;
+    virtual Sampler& GetSampler() = 0;
 };
 
 
@@ -103,43 +209,100 @@ protected:
   const RenderingParameters &render_params;
   const Scene &scene;
 private:
-  static constexpr int PIXEL_STRIDE = 64 / sizeof(Spectral3); // Because false sharing.
+  // Tiles should be plentiful enough for load balancing but otherwise as large as possible.
+  static constexpr int MIN_TILES_PER_THREAD = 8;
+  static constexpr int MIN_TILE_SIZE = 4;
+  static constexpr int MAX_TILE_SIZE = 64;
+  // Between passes the tile size is adapted to the measured load imbalance, i.e. the fraction of 
+  // the pass during which workers sat idle at the end because the remaining tiles were too coarse.
+  // Doubling the edge quadruples the time per tile and, roughly, the imbalance. Hence the 
+  // threshold for growing is well below a quarter of the one for shrinking, lest it oscillates.
+  static constexpr double SHRINK_TILES_ABOVE_IMBALANCE = 0.1;
+  static constexpr double GROW_TILES_BELOW_IMBALANCE = 0.01;
+
+  // Light tracing splats all over the image. The splats of a pass go to a shared light image, which
+  // is added to the main buffer when the workers are idle. It is locked in stripes of rows, so that
+  // workers rarely wait for each other.
+  static constexpr int SPLAT_STRIPE_ROWS = 4;
+
+  struct alignas(64) SplatStripe
+  {
+    tbb::spin_mutex mutex;
+  };
+
+  struct alignas(64) SplatCounters // Per worker
+  {
+    long num_eye_samples = 0; // Each contributes to the normalization of the light image.
+    std::chrono::steady_clock::duration time{}; // For profiling
+    std::chrono::steady_clock::duration lock_wait{};
+  };
+
   Spectral3ImageBuffer buffer;
   int num_threads = 1;
   int num_pixels = 0;
   SamplesPerPixelSchedule spp_schedule;
-  tbb::atomic<int> shared_pixel_index = 0;
+  TimeBudget time_budget;
+  std::optional<ImageTileSet> tileset;
+  std::optional<TileConvergenceTracker> convergence;
+  std::optional<TileSnapshot> snapshot;
+  ToyVector<int> tile_order; // Morton order, so that tiles handed out in sequence are close to each other.
+  ToyVector<int> pass_tiles; // Subset of tile_order which is not converged yet.
+  WorkStealingRanges tile_ranges;
+  ToyVector<std::chrono::steady_clock::duration> scheduling_time; // Per worker
+  std::chrono::steady_clock::time_point pass_start;
+  ToyVector<std::chrono::steady_clock::time_point> worker_finish; // When each worker completed its last tile of the pass.
   tbb::task_group the_task_group;
   tbb::atomic<bool> stop_flag = false;
-  tbb::spin_mutex buffer_mutex;
+  ToyVector<SplatCounters> splat_counters;
+  ToyVector<RGB> pass_light_accum; // Allocated on first use. Only algorithms with light tracing need it.
+  std::unique_ptr<SplatStripe[]> splat_stripes;
+  std::once_flag splat_image_allocated;
+  std::chrono::steady_clock::duration splat_reduction_time{};
   ToyVector<std::unique_ptr<Worker>> workers;
 public:
   SimplePixelByPixelRenderingAlgo(const RenderingParameters &render_params_, const Scene &scene_)
     : RenderingAlgo{}, render_params{render_params_}, scene{scene_},
-      buffer{render_params_.width, render_params_.height}, num_threads{0},
-      spp_schedule{render_params_}
+      buffer{render_params_.width, render_params_.height}, num_threads{std::max(1, render_params_.num_threads)},
+      spp_schedule{render_params_}, time_budget{render_params_}
   {
     num_pixels = render_params.width * render_params.height;
+    // Here rather than in Run, so that a checkpoint can be loaded into the tile state.
+    SetupTiles();
   }
   
   void Run() override
   {
-    for (int i=0; i<std::max(1, this->render_params.num_threads); ++i)
+    for (int i=0; i<num_threads; ++i)
       workers.push_back(AllocateWorker(i));
-    num_threads = isize(workers);
-    int pass = 0;
-    while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0)
+    splat_counters.resize(num_threads);
+    while (!stop_flag.load() && spp_schedule.GetPerIteration() > 0 && !convergence->AllConverged() && !time_budget.Expired())
     {
-      shared_pixel_index = 0;
-      buffer.AddSampleCount(GetSamplesPerPixel());
-      while_parallel_fed_interruptible(
-        /*func=*/[this](int pixel_index, int worker_num)
+      pass_tiles.clear();
+      std::copy_if(tile_order.begin(), tile_order.end(), std::back_inserter(pass_tiles), [this](int i) { return convergence->IsActive(i); });
+      if (pass_tiles.empty()) // Can happen with a tile range.
+        break;
+      spp_schedule.LimitPerIteration(time_budget.FitSamplesPerPixel(GetSamplesPerPixel(), isize(pass_tiles)));
+      if (GetSamplesPerPixel() <= 0)
+        break;
+      time_budget.StartPass(isize(pass_tiles));
+      tile_ranges.Reset(isize(pass_tiles), num_threads);
+      scheduling_time.assign(num_threads, {});
+      pass_start = std::chrono::steady_clock::now();
+      worker_finish.assign(num_threads, pass_start);
+      parallel_workers_interruptible(
+        /*func=*/[this](int tile_index, int worker_num)
         {
-          this->RunRenderingWorker(pixel_index, *workers[worker_num]);
+          const auto tile = (*tileset)[tile_index];
+          this->RunRenderingWorker(tile, *workers[worker_num], splat_counters[worker_num]);
+          buffer.AddSampleCount(tile, GetSamplesPerPixel());
+          convergence->Update(tile_index, tile, buffer.Accumulator(), GetSamplesPerPixel());
+          snapshot->Publish(tile_index, [this](int pixel_index) { return buffer.Average(pixel_index); });
+          time_budget.TileDone();
+          worker_finish[worker_num] = std::chrono::steady_clock::now();
         },
-        /*feeder=*/[this]() -> boost::optional<int>
+        /*next_item=*/[this](int worker_num) -> std::optional<int>
         {
-          return this->FeedPixelIndex();
+          return this->NextTile(worker_num);
         },
         /*irq_handler=*/[this]() -> bool
         {
@@ -149,11 +312,19 @@ public:
           return true;
         },
         num_threads, the_task_group);
+      ReduceSplats();
+      time_budget.EndPass(GetSamplesPerPixel());
       std::cout << "Iteration finished, past spp = " << GetSamplesPerPixel() << ", total taken " << spp_schedule.GetTotal() << std::endl;
+      if (convergence->Enabled())
+        std::cout << "Tiles rendered " << pass_tiles.size() << ", still active " << convergence->NumActive() << std::endl;
+      PrintSchedulingOverhead();
+      if (!stop_flag.load() && !time_budget.LastPassWasCut())
+        AdaptTileSize();
       PassCompleted();
-      CallInterruptCb(true);
       spp_schedule.UpdateForNextPass();
+      CallInterruptCb(true); // After the update, so that checkpoints taken here account for the pass.
     } // Pass iteration
+    time_budget.PrintSummary(spp_schedule.GetTotal());
   }
   
   // Will potentially be called before Run is invoked!
@@ -171,12 +342,36 @@ public:
   
   std::unique_ptr<Image> GenerateImage() override
   {
+    ReduceSplats();
     auto bm = std::make_unique<Image>(render_params.width, render_params.height);
     tbb::parallel_for(0, render_params.height, [&](int row){
       buffer.ToImage(*bm, row, row+1, !render_params.linear_output);  
     });
     return bm;
   }
+
+  void SaveState(checkpoint::Writer &ar) override { SerializeState(ar); }
+  void LoadState(checkpoint::Reader &ar) override 
+  { 
+    SerializeState(ar);
+    PublishRenderedTiles();
+  }
+
+  bool SupportsPartialRendering() const override { return true; }
+
+  bool SupportsSnapshots() const override { return true; }
+
+  // Light tracing contributions of the current pass appear only after the pass.
+  int UpdateSnapshot(Image &dest) override
+  {
+    return snapshot->Update(dest, !render_params.linear_output);
+  }
+
+  std::unique_ptr<PartialImage> GeneratePartialImage() override
+  {
+    ReduceSplats();
+    return std::make_unique<PartialImage>(buffer.ToPartialImage());
+  }
   
 protected:
   // Implementation must override this.
@@ -187,49 +382,206 @@ protected:
   inline int GetNumPixels() const { return num_pixels; }
   
   inline int GetSamplesPerPixel() const { return spp_schedule.GetPerIteration(); }
+
+  // Derived classes with progressive state of their own override Save/LoadState and call this.
+
+  template<class Archive>
+  void SerializeState(Archive &ar)
+  {
+    // The convergence state is per tile. Therefore the tiling is restored, too, in case
+    // the number of threads changed between runs.
+    int tile_size = tileset->tileSize();
+    ar(tile_size);
+    if (Archive::is_loading && tile_size != tileset->tileSize())
+      SetupTiles(tile_size);
+    if (!Archive::is_loading)
+      ReduceSplats();
+    ar(spp_schedule);
+    ar(buffer);
+    ar(*convergence);
+  }
   
 private:
-  boost::optional<int> FeedPixelIndex()
+  void SetupTiles(std::optional<int> fixed_tile_size = {})
+  {
+    const Int2 im_shape{ render_params.width, render_params.height };
+    // With a tile range the tiling must not depend on the number of threads, so that the ranges 
+    // given to different processes fit together.
+    const bool has_tile_range = render_params.tile_end >= 0;
+    int tile_size = fixed_tile_size.value_or(ImageTileSet::basicTileSize());
+    while (!fixed_tile_size && !has_tile_range && tile_size > MIN_TILE_SIZE && ImageTileSet(im_shape, tile_size).size() < MIN_TILES_PER_THREAD*num_threads)
+      tile_size /= 2;
+    tileset.emplace(im_shape, tile_size);
+    tile_order = tileset->mortonOrder();
+    if (has_tile_range)
+    {
+      const int begin = render_params.tile_begin, end = std::min(render_params.tile_end, tileset->size());
+      tile_order.erase(std::remove_if(tile_order.begin(), tile_order.end(), [=](int i) { return i < begin || i >= end; }), tile_order.end());
+      std::cout << "Rendering tiles " << begin << " to " << end << " of " << tileset->size() << std::endl;
+    }
+    convergence.emplace(*tileset, im_shape, render_params.target_error);
+    snapshot.emplace(*tileset);
+    std::cout << "Rendering " << tileset->size() << " tiles of " << tile_size << "x" << tile_size << " pixels" << std::endl;
+  }
+
+
+  void PublishRenderedTiles()
+  {
+    for (int i = 0; i < tileset->size(); ++i)
+    {
+      const auto tile = (*tileset)[i];
+      if (buffer.SampleCount(tile.corner[0] + tile.corner[1]*render_params.width) > 0)
+        snapshot->Publish(i, [this](int pixel_index) { return buffer.Average(pixel_index); });
+    }
+  }
+
+
+  // The convergence state is per tile and a tile range refers to a fixed tiling. So only 
+  // renders without either are retiled.
+  void AdaptTileSize()
+  {
+    if (convergence->Enabled() || render_params.tile_end >= 0)
+      return;
+    double sum_busy = 0., max_busy = 0.;
+    for (auto t : worker_finish)
+    {
+      const double busy = std::chrono::duration<double>(t - pass_start).count();
+      sum_busy += busy;
+      max_busy = std::max(max_busy, busy);
+    }
+    if (max_busy <= 0.)
+      return;
+    const double imbalance = 1. - sum_busy / (num_threads * max_busy);
+    const Int2 im_shape{ render_params.width, render_params.height };
+    int tile_size = tileset->tileSize();
+    if (imbalance > SHRINK_TILES_ABOVE_IMBALANCE && tile_size > MIN_TILE_SIZE)
+      tile_size /= 2;
+    else if (imbalance < GROW_TILES_BELOW_IMBALANCE && tile_size < MAX_TILE_SIZE &&
+             ImageTileSet(im_shape, tile_size*2).size() >= MIN_TILES_PER_THREAD*num_threads)
+      tile_size *= 2;
+    else
+      return;
+    std::cout << "Load imbalance " << imbalance*100. << "%, retiling" << std::endl;
+    SetupTiles(tile_size);
+    PublishRenderedTiles();
+  }
+
+
+  std::optional<int> NextTile(int worker_num)
+  {
+    if (time_budget.Expired())
+      return {};
+    const auto start = std::chrono::steady_clock::now();
+    const auto i = tile_ranges.Pop(worker_num);
+    scheduling_time[worker_num] += std::chrono::steady_clock::now() - start;
+    return i ? pass_tiles[*i] : std::optional<int>{};
+  }
+
+
+  void PrintSchedulingOverhead()
   {
-    int i = shared_pixel_index.fetch_and_add(PIXEL_STRIDE);
-    return i <= num_pixels ? i : boost::optional<int>();
+    std::chrono::steady_clock::duration total{};
+    for (auto t : scheduling_time)
+      total += t;
+    std::cout << "Scheduling overhead: " << std::chrono::duration<double, std::micro>(total).count() << " us summed over threads, " 
+              << tile_ranges.NumSteals() << " steals" << std::endl;
+    std::chrono::steady_clock::duration splat_time{}, lock_wait{};
+    for (auto &s : splat_counters)
+    {
+      splat_time += s.time;
+      lock_wait += s.lock_wait;
+      s.time = {};
+      s.lock_wait = {};
+    }
+    if (splat_time.count() > 0)
+    {
+      std::cout << "Splatting: " << std::chrono::duration<double, std::micro>(splat_time).count() << " us summed over threads, of which "
+                << std::chrono::duration<double, std::micro>(lock_wait).count() << " us waiting for locks, reduction "
+                << std::chrono::duration<double, std::micro>(splat_reduction_time).count() << " us" << std::endl;
+    }
+    splat_reduction_time = {};
   }
   
   
-  void RunRenderingWorker(int pixel_index, Worker &worker)
+  void RunRenderingWorker(const ImageTileSet::Tile &tile, Worker &worker, SplatCounters &splats)
   {
-    RenderPixels(pixel_index, worker);
+    RenderPixels(tile, worker);
+    splats.num_eye_samples += tile.shape.prod() * GetSamplesPerPixel();
     if (worker.GetSensorResponses().size() > 0)
     { // Fill in the samples from light tracing.
-      tbb::spin_mutex::scoped_lock lock(buffer_mutex);
-      SplatLightSamples(worker);
+      SplatLightSamples(worker, splats);
     }
   }
   
   
-  void RenderPixels(int pixel_index, Worker &worker)
+  void RenderPixels(const ImageTileSet::Tile &tile, Worker &worker)
   {
-    int current_end_index = std::min(pixel_index + PIXEL_STRIDE, num_pixels);
-    for (; pixel_index < current_end_index; ++pixel_index)
+    const Int2 end = tile.corner + tile.shape;
+    const int nsmpl = GetSamplesPerPixel();
+    for (int iy = tile.corner[1]; iy < end[1]; ++iy)
     {
-      const int nsmpl = GetSamplesPerPixel();
-      for(int i=0;i<nsmpl;i++)
+      for (int ix = tile.corner[0]; ix < end[0]; ++ix)
       {
-        auto smpl = worker.RenderPixel(pixel_index);
-        buffer.Insert(pixel_index, smpl);
+        const int pixel_index = ix + iy*render_params.width;
+        const int first_sample = render_params.sample_offset + buffer.SampleCount(pixel_index);
+        for(int i=0;i<nsmpl;i++)
+        {
+          worker.GetSampler().SetPixelSample({ ix, iy }, first_sample + i);
+          auto smpl = worker.RenderPixel(pixel_index);
+          buffer.Accumulate(pixel_index, smpl);
+        }
       }
-    }    
+    }
   }
   
   
-  void SplatLightSamples(Worker &worker)
+  void SplatLightSamples(Worker &worker, SplatCounters &splats)
   {
-    for (const auto &r : worker.GetSensorResponses())
+    const auto start = std::chrono::steady_clock::now();
+    const int stripe_pixels = SPLAT_STRIPE_ROWS*render_params.width;
+    std::call_once(splat_image_allocated, [this, stripe_pixels] {
+      pass_light_accum.resize(num_pixels, RGB::Zero());
+      splat_stripes = std::make_unique<SplatStripe[]>((num_pixels + stripe_pixels - 1) / stripe_pixels);
+    });
+    // Sorted, so that each stripe is locked once.
+    auto &responses = worker.GetSensorResponses();
+    std::sort(responses.begin(), responses.end(), [](const SensorResponse &a, const SensorResponse &b) { return a.unit_index < b.unit_index; });
+    for (auto it = responses.begin(); it != responses.end();)
+    {
+      assert(*it);
+      const int stripe = it->unit_index / stripe_pixels;
+      const auto wait_start = std::chrono::steady_clock::now();
+      tbb::spin_mutex::scoped_lock lock(splat_stripes[stripe].mutex);
+      splats.lock_wait += std::chrono::steady_clock::now() - wait_start;
+      for (; it != responses.end() && it->unit_index / stripe_pixels == stripe; ++it)
+        pass_light_accum[it->unit_index] += it->weight;
+    }
+    responses.clear();
+    splats.time += std::chrono::steady_clock::now() - start;
+  }
+
+
+  // Only while the workers are idle.
+  void ReduceSplats()
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if (!pass_light_accum.empty())
+    {
+      tbb::parallel_for(tbb::blocked_range<int>(0, num_pixels, 4096), [this](const tbb::blocked_range<int> &r)
+      {
+        for (int i = r.begin(); i < r.end(); ++i)
+        {
+          buffer.Splat(i, pass_light_accum[i]);
+          pass_light_accum[i] = RGB::Zero();
+        }
+      });
+    }
+    for (auto &splats : splat_counters)
     {
-      assert(r);
-      buffer.Splat(r.unit_index, r.weight);
+      buffer.AddSplatCount(splats.num_eye_samples);
+      splats.num_eye_samples = 0;
     }
-    worker.GetSensorResponses().clear();
+    splat_reduction_time += std::chrono::steady_clock::now() - start;
   }
 };
 
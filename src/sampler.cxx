@@ -298,6 +298,16 @@ Dimension reservation
     scrambling_mask = id << SEQ_ID_SHIFT;
     subsequence_id = 0;
   }
+
+  uint32_t GetSubsequencePosition() const override
+  {
+    return subsequence_id;
+  }
+
+  void SetSubsequencePosition(uint32_t position) override
+  {
+    subsequence_id = position;
+  }
   
   double Uniform01() override
   {
@@ -315,6 +325,11 @@ Dimension reservation
     return x;
   }
   
+  void Seed(std::uint64_t seed, std::uint64_t stream) override
+  {
+    pcg.seed(seed, stream);
+  }
+  
   Double2 UniformUnitSquare() override
   {
     double x = SobolMatrixMult(point_idx, sobol_generator_matrices[scrambling_mask]);
@@ -338,6 +353,7 @@ class PseudoRandomSequence : public SampleSequence
 public:
   double Uniform01() override { return rg.Uniform01(); }
   Double2 UniformUnitSquare() override { return rg.UniformUnitSquare(); }
+  void Seed(std::uint64_t seed, std::uint64_t stream) override { rg.Seed(seed, stream); }
 };
 
 
@@ -363,6 +379,32 @@ Sampler::Sampler(std::unique_ptr<SampleSequence> &&sequence)
 }
 
 
+namespace
+{
+// Ref: SplitMix64 by Sebastiano Vigna. Scrambles neighboring inputs into unrelated outputs.
+inline std::uint64_t MixBits(std::uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+}
+
+
+void Sampler::SetPixelSample(Int2 pixel_coord, int sample_num)
+{
+  sequence->SetPixelIndex(pixel_coord);
+  sequence->SetPointNum(sample_num);
+  sequence->SetSubsequenceId(0);
+  const std::uint64_t pixel_key = (std::uint64_t(std::uint32_t(pixel_coord[1])) << 32) | std::uint32_t(pixel_coord[0]);
+  const std::uint64_t stream = MixBits(pixel_key);
+  const std::uint64_t seed = MixBits(stream ^ std::uint64_t(sample_num));
+  randgen.Seed(seed, stream);
+  sequence->Seed(seed, stream);
+}
+
+
 RandGen::RandGen()
 {
 }
@@ -374,6 +416,12 @@ void RandGen::Seed(std::uint64_t seed)
 }
 
 
+void RandGen::Seed(std::uint64_t seed, std::uint64_t stream)
+{
+  generator.seed(seed, stream);
+}
+
+
 void RandGen::Uniform01(double* dest, int count)
 {
   for (int i=0; i<count; ++i)
@@ -33,6 +33,7 @@ class RandGen
 public:
   RandGen();
   void Seed(std::uint64_t seed);
+  void Seed(std::uint64_t seed, std::uint64_t stream);
 
   void Uniform01(double *dest, int count);
   int UniformInt(int a, int b_inclusive);
@@ -73,6 +74,12 @@ public:
   virtual void SetPointNum(int i) {}
   // Normally the dimension
   virtual void SetSubsequenceId(uint32_t id) {}
+  // Number of samples drawn from the current subsequence. Setting it back lets interleaved
+  // paths, like those traced in batches, continue where they left off.
+  virtual uint32_t GetSubsequencePosition() const { return 0; }
+  virtual void SetSubsequencePosition(uint32_t position) {}
+  // Restarts the pseudo-random part, if any.
+  virtual void Seed(std::uint64_t seed, std::uint64_t stream) {}
 
   virtual double Uniform01() = 0;
   virtual Double2 UniformUnitSquare() = 0;
@@ -105,6 +112,13 @@ public:
   void SetPixelIndex(Int2 pixel_coord) { sequence->SetPixelIndex(pixel_coord); }
   void SetPointNum(int i) { sequence->SetPointNum(i); }
   void SetSubsequenceId(uint32_t id) { sequence->SetSubsequenceId(id); }
+  uint32_t GetSubsequencePosition() const { return sequence->GetSubsequencePosition(); }
+  void SetSubsequencePosition(uint32_t position) { sequence->SetSubsequencePosition(position); }
+
+  // Sets pixel and point number, starts at the first subsequence and reseeds the random
+  // generators. Thus the samples are the same regardless of which thread or process takes
+  // them, and distinct samples are decorrelated. Needed to split a render over processes.
+  void SetPixelSample(Int2 pixel_coord, int sample_num);
 
   // TODO: use the quasi-random sequence here.
   int UniformInt(int a, int b_inclusive) { return randgen.UniformInt(a, b_inclusive); }
@@ -427,6 +441,15 @@ public:
   {
     return xy_matrix.diagonal() / counter;
   }
+
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(means);
+    ar(offset);
+    ar(xy_matrix);
+    ar(counter);
+  }
 };
 
 
@@ -463,6 +486,14 @@ public:
     counts[i] = ov.n;
   }
 
+  template<class Archive>
+  void Serialize(Archive &ar)
+  {
+    ar(mean);
+    ar(sqr_dev);
+    ar(counts);
+  }
+
 private:
   ArrayXd mean, sqr_dev;
   ArrayXi counts;
@@ -19,10 +19,8 @@ Scene::Scene()
     this->default_shader = def_shader.get();
     this->black_shader = black_shader.get();
 
-    materials.push_back(Material{def_shader.get(), vac_medium.get()});
-    default_material_index = MaterialIndex(isize(materials)-1);
-    materials.push_back(Material{inv_shader.get(), vac_medium.get()});
-    vacuum_material_index = MaterialIndex(isize(materials)-1);
+    default_material_index = GetOrAddMaterial(Material{def_shader.get(), vac_medium.get()});
+    vacuum_material_index = GetOrAddMaterial(Material{inv_shader.get(), vac_medium.get()});
 
     media.push_back(std::move(vac_medium));
     shaders.push_back(std::move(inv_shader));      
@@ -35,6 +33,38 @@ Scene::~Scene()
 {}
 
 
+std::unique_ptr<Camera> Scene::ReplaceCamera(std::unique_ptr<Camera> new_camera)
+{
+  std::swap(camera, new_camera);
+  return new_camera;
+}
+
+
+void Scene::AddView(const CameraView &view, int xres, int yres)
+{
+  views.push_back(view);
+  camera = view.MakeCamera(xres, yres);
+}
+
+
+std::unique_ptr<Camera> CameraView::MakeCamera(int xres, int yres) const
+{
+  if (fisheye)
+    return std::make_unique<FisheyeHemisphereCamera>(from, at - from, up, xres, yres);
+  else
+    return std::make_unique<PerspectiveCamera>(from, at - from, up, fov, xres, yres);
+}
+
+
+CameraView CameraView::Orbited(double angle) const
+{
+  const Eigen::Matrix3d m = Eigen::AngleAxisd(angle, Normalized(up)).toRotationMatrix();
+  CameraView v = *this;
+  v.from = at + m*(from - at);
+  return v;
+}
+
+
 const Material& Scene::GetMaterialOf(int geom_idx, int prim_idx) const
 {
   assert(geom_idx>=0 && geom_idx<GetNumGeometries());
@@ -47,65 +77,113 @@ const Material& Scene::GetMaterialOf(const PrimRef ref) const
   return materials[value(ref.geom->material_index)];
 }
 
-namespace {
+MaterialIndex Scene::GetOrAddMaterial(const Material &mat)
+{
+  auto [it, is_new] = material_indices.emplace(mat, MaterialIndex(isize(materials)));
+  if (is_new)
+    materials.push_back(mat);
+  return it->second;
+}
+
 
-Geometry* FindMatchingGeo(ToyVector<std::unique_ptr<Geometry>> &v, MaterialIndex searchIndex, Geometry::Type searchType)
+void Scene::Append(const Geometry &geo, const Material &mat)
 {
-  auto other_geo_it = std::find_if(v.begin(), v.end(), [&](const auto &g)
+  if (geo.type == Geometry::PRIMITIVES_TRIANGLES)
   {
-    return g->material_index == searchIndex && g->type == searchType;
-  });
-  return other_geo_it == v.end() ? nullptr : other_geo_it->get();
-}
+    Append(Mesh(static_cast<const Mesh&>(geo)), mat);
+    return;
+  }
 
+  const MaterialIndex material_index = GetOrAddMaterial(mat);
+  const auto key = std::make_pair(value(material_index), static_cast<int>(geo.type));
+
+  // Add new geometry or append to existing.
+  auto it = merge_targets.find(key);
+  if (it == merge_targets.end())
+  {
+    AddGeometry(geo.Clone(), material_index);
+    merge_targets.emplace(key, geometries.back().get());
+  }
+  else
+  {
+    it->second->Append(geo);
+    if (mat.emitter != nullptr)
+      UpdateEmissiveIndexOffset();
+  }
 }
 
 
-void Scene::Append(const Geometry &geo, const Material &mat)
+void Scene::Append(Mesh &&mesh, const Material &mat)
 {
-  const bool is_emissive = mat.emitter != nullptr;
-  const bool is_volume = mat.shader == nullptr;
-  assert(!(is_emissive && is_volume));
-  assert(!(is_volume && mat.medium == nullptr));
-
-  Geometry* existing_geom_with_mat = nullptr;
-  MaterialIndex material_index{ -1 };
+  const MaterialIndex material_index = GetOrAddMaterial(mat);
+  const auto key = std::make_pair(value(material_index), static_cast<int>(mesh.type));
 
-  // First look if we have a matching material already.
-  auto mat_it = std::find(materials.begin(), materials.end(), mat);
-  if (mat_it == materials.end())
+  auto it = merge_targets.find(key);
+  if (it == merge_targets.end())
   {
-    materials.push_back(mat);
-    material_index = MaterialIndex(isize(materials) - 1);
+    AddGeometry(std::make_unique<Mesh>(std::move(mesh)), material_index);
+    merge_targets.emplace(key, geometries.back().get());
   }
   else
   {
-    material_index = MaterialIndex(mat_it - materials.begin());
-    existing_geom_with_mat = FindMatchingGeo(geometries, material_index, geo.type);
+    // Appending one by one would copy the whole mesh each time.
+    pending_mesh_appends[static_cast<Mesh*>(it->second)].push_back(
+      std::make_unique<Mesh>(std::move(mesh)));
   }
+}
 
-  // Add new geometry or append to existing.
-  if (existing_geom_with_mat)
+
+void Scene::FlushAppends()
+{
+  bool emissive_changed = false;
+  for (auto &[mesh, pieces] : pending_mesh_appends)
+  {
+    mesh->AppendAll(util::TransformVector(pieces, [](const auto &p) -> const Mesh* { return p.get(); }));
+    emissive_changed |= materials[value(mesh->material_index)].emitter != nullptr;
+  }
+  pending_mesh_appends.clear();
+  if (emissive_changed)
+    UpdateEmissiveIndexOffset();
+}
+
+
+const Mesh& Scene::AddPrototype(std::unique_ptr<Mesh> mesh)
+{
+  prototypes.push_back(std::move(mesh));
+  return *prototypes.back();
+}
+
+
+void Scene::AppendInstance(const Mesh &prototype, const Instance::Transform &transform, const Material &mat)
+{
+  assert(std::any_of(prototypes.begin(), prototypes.end(), [&](const auto &p) { return p.get() == &prototype; }));
+  const MaterialIndex material_index = GetOrAddMaterial(mat);
+  // Instances are never merged. That would defeat their purpose.
+  AddGeometry(std::make_unique<Instance>(prototype, transform), material_index);
+}
+
+
+void Scene::AddGeometry(std::unique_ptr<Geometry> geo, MaterialIndex material_index)
+{
+  const Material &mat = materials[value(material_index)];
+  const bool is_emissive = mat.emitter != nullptr;
+  const bool is_volume = mat.shader == nullptr;
+  assert(!(is_emissive && is_volume));
+  assert(!(is_volume && mat.medium == nullptr));
+
+  geo->index_in_scene = isize(geometries);
+  geo->material_index = material_index;
+  geometries.push_back(std::move(geo));
+  if (is_volume)
   {
-    existing_geom_with_mat->Append(geo);
+    volumes.push_back(geometries.back().get());
   }
   else
   {
-    auto clone = geo.Clone();
-    clone->index_in_scene = isize(geometries);
-    clone->material_index = material_index;
-    geometries.push_back(std::move(clone));
-    if (is_volume)
-    {
-      volumes.push_back(geometries.back().get());
-    }
+    if (is_emissive)
+      emissive_surfaces.push_back(geometries.back().get());
     else
-    {
-      if (is_emissive)
-        emissive_surfaces.push_back(geometries.back().get());
-      else
-        surfaces.push_back(geometries.back().get());
-    }
+      surfaces.push_back(geometries.back().get());
   }
 
   if (is_emissive)
@@ -115,19 +193,25 @@ void Scene::Append(const Geometry &geo, const Material &mat)
 
 void Scene::BuildAccelStructure()
 {
-  for (auto &surf : surfaces)
+  FlushAppends();
+  auto insert_surface = [this](Geometry &surf)
   {
-    assert(materials[value(surf->material_index)].shader != nullptr);
-    embreeaccelerator.InsertRefTo(*surf);
-  }
+    const auto &mat = materials[value(surf.material_index)];
+    assert(mat.shader != nullptr);
+    // MediumTracker::initializePosition counts the crossings of surfaces which bound a medium, too.
+    if (surf.type == Geometry::PRIMITIVES_SPHERES && (mat.medium || mat.outer_medium))
+      embreeaccelerator.InsertRefTo(static_cast<Spheres&>(surf), /*force_callbacks=*/true);
+    else
+      embreeaccelerator.InsertRefTo(surf);
+  };
+  for (auto &surf : surfaces)
+    insert_surface(*surf);
   for (auto &surf : emissive_surfaces)
-  {
-    assert(materials[value(surf->material_index)].shader != nullptr);
-    embreeaccelerator.InsertRefTo(*surf);
-  }
+    insert_surface(*surf);
   // Iterating over intersections along some ray is required to initialize the MediumTracker.
   embreeaccelerator.Build(true);
 
+  embreevolumes.ForceSphereCallbacks();
   for (auto &v : volumes)
   {
     assert(materials[value(v->material_index)].shader == nullptr);
@@ -140,9 +224,42 @@ void Scene::BuildAccelStructure()
   this->boundingBox.Extend(embreevolumes.GetSceneBounds());
 }
 
+void Scene::CompactMeshes()
+{
+  FlushAppends();
+  auto compact = [](Geometry &geo) {
+    if (geo.type == Geometry::PRIMITIVES_TRIANGLES)
+      static_cast<Mesh&>(geo).Compact();
+  };
+  for (auto &geo : geometries)
+    compact(*geo);
+  for (auto &geo : prototypes)
+    compact(*geo);
+}
+
+
 void Scene::PrintInfo() const
 {
+  std::size_t memory_meshes = 0, memory_other = 0;
+  Geometry::index_t num_triangles = 0;
+  auto account = [&](const Geometry &geo) {
+    if (geo.type == Geometry::PRIMITIVES_TRIANGLES)
+    {
+      memory_meshes += geo.MemoryUsage();
+      num_triangles += geo.Size();
+    }
+    else
+      memory_other += geo.MemoryUsage();
+  };
+  for (auto &geo : geometries)
+    account(*geo);
+  for (auto &geo : prototypes)
+    account(*geo);
+  constexpr double MiB = 1024.*1024.;
   std::cout << "Number of geometries: " << GetNumGeometries() << std::endl;
+  std::cout << "Number of triangles (not counting instances): " << num_triangles << std::endl;
+  std::cout << "Memory of meshes: " << memory_meshes / MiB << " MiB" << std::endl;
+  std::cout << "Memory of other geometry: " << memory_other / MiB << " MiB" << std::endl;
   std::cout << "Number of lights: " << lights.size() << std::endl;
   std::cout << std::endl;
   std::cout << "bounding box min: "
@@ -7,6 +7,7 @@
 #include "ray.hxx"
 
 #include <memory>
+#include <unordered_map>
 #include <boost/functional/hash.hpp>
 #include <mpark/variant.hpp>
 #include <optional>
@@ -30,9 +31,16 @@ struct RenderingParameters
   int num_threads = { -1 };
   int max_ray_depth = 25;
   int max_samples_per_pixel = {-1};
+  double target_error = 0.; // Relative error at which tiles are considered converged. Disabled if zero.
+  double time_limit = 0.; // Seconds available to the rendering algorithm. Unlimited if zero.
+  int tile_begin = 0; // Range of tiles to render. For splitting a frame over several processes.
+  int tile_end = -1; // Exclusive. All tiles if negative.
+  int sample_offset = 0; // Number of the first sample of each pixel. Likewise for splitting frames.
   std::string pt_sample_mode = {};
   std::string algo_name = {};
   std::vector<std::string> search_paths = { "" };
+  std::string scene_cache_dir = {}; // Meshes loaded from model files are cached here. Disabled if empty.
+  double texture_cache_mb = 0.; // Memory budget of the texture cache. Unlimited if zero.
   double initial_photon_radius = 0.01;
   double guiding_prior_strength = 50.;
   int guiding_em_every = 200;
@@ -40,6 +48,20 @@ struct RenderingParameters
   int guiding_max_spp = 512;
   bool linear_output = false;
   bool qmc = false;
+  bool compact_meshes = false;
+};
+
+
+// Camera as declared in the scene file. Scenes may declare several, e.g. for turntables or multi-view sets.
+struct CameraView
+{
+  bool fisheye = false;
+  Double3 from, at, up;
+  double fov = 0.; // Degrees. Unused by the fisheye.
+
+  std::unique_ptr<Camera> MakeCamera(int xres, int yres) const;
+  // Rotated about the axis through 'at' along 'up'.
+  CameraView Orbited(double angle) const;
 };
 
 
@@ -150,14 +172,20 @@ private:
   EmbreeAccelerator embreeaccelerator;
   EmbreeAccelerator embreevolumes;
   std::unique_ptr<Camera> camera;
+  ToyVector<CameraView> views;
 
   ToyVector<std::unique_ptr<Geometry>> geometries;
+  ToyVector<std::unique_ptr<Mesh>> prototypes; // Referenced by instances. Not part of the scene by themselves.
   ToyVector<Geometry*> emissive_surfaces; // Indicies into geometries array
   ToyVector<Geometry*> surfaces;
   ToyVector<Geometry*> volumes;
   index_t num_area_lights = 0;
 
   ToyVector<Material> materials;
+  std::unordered_map<Material, MaterialIndex, Material::Hash> material_indices; // Reverse of materials.
+  // Where Append merges into, by material index and geometry type.
+  std::unordered_map<std::pair<int, int>, Geometry*, boost::hash<std::pair<int, int>>> merge_targets;
+  std::unordered_map<Mesh*, ToyVector<std::unique_ptr<Mesh>>> pending_mesh_appends;
   Medium* empty_space_medium;
   Shader* invisible_shader;
   Shader* default_shader;
@@ -198,6 +226,17 @@ public:
     return camera != nullptr;
   }
 
+  // Returns the previous camera. The accelerators do not depend on it.
+  std::unique_ptr<Camera> ReplaceCamera(std::unique_ptr<Camera> new_camera);
+
+  // The camera is made from the last one added.
+  void AddView(const CameraView &view, int xres, int yres);
+
+  const ToyVector<CameraView>& GetViews() const
+  {
+    return views;
+  }
+
 
   bool HasLights() const;
 
@@ -283,15 +322,39 @@ public:
 
   std::optional<SurfaceInteraction> FirstIntersection(const Ray &ray, double tnear, double &tfar) const
   {
-    SurfaceInteraction meh; // ... oh well this needs to change ...
-    bool hit = embreeaccelerator.FirstIntersection(ray, tnear, tfar, meh);
-    return hit ? meh : std::optional<SurfaceInteraction>{};
+    const auto hit = FirstHit(ray, tnear, tfar);
+    return hit ? Resolve(*hit, ray) : std::optional<SurfaceInteraction>{};
+  }
+
+  // Cheap variant of FirstIntersection. Use Resolve to get the SurfaceInteraction if needed.
+  std::optional<HitRecord> FirstHit(const Ray &ray, double tnear, double &tfar) const
+  {
+    HitRecord hit;
+    return embreeaccelerator.FirstHit(ray, tnear, tfar, hit) ? hit : std::optional<HitRecord>{};
+  }
+
+  SurfaceInteraction Resolve(const HitRecord &hit, const Ray &ray) const
+  {
+    SurfaceInteraction intersection;
+    embreeaccelerator.Resolve(hit, ray, intersection);
+    return intersection;
+  }
+
+  // For bundles of coherent rays. Traced together which is faster than one by one.
+  void FirstHits(Span<const Ray> rays, double tnear, Span<double> tfars, Span<std::optional<HitRecord>> hits) const
+  {
+    embreeaccelerator.FirstHits(rays, tnear, tfars, hits);
   }
 
   Span<BoundaryIntersection> IntersectionsWithVolumes(const Ray &ray, double tnear, double tfar) const
   {
     return embreevolumes.IntersectionsInOrder(ray, tnear, tfar);
   }
+  // Incremental alternative to IntersectionsWithVolumes, for walks which may end early.
+  BoundaryIntersectionIterator VolumeBoundariesInOrder(const Ray &ray, double tnear, double tfar) const
+  {
+    return BoundaryIntersectionIterator{ embreevolumes, ray, tnear, tfar };
+  }
   Span<BoundaryIntersection> IntersectionsWithSurfaces(const Ray &ray, double tnear, double tfar) const
   {
     return embreeaccelerator.IntersectionsInOrder(ray, tnear, tfar);
@@ -302,14 +365,33 @@ public:
     return embreeaccelerator.IsOccluded(ray, tnear, tfar);
   }
 
+  void AreOccluded(Span<const Ray> rays, double tnear, Span<const double> tfars, Span<std::uint8_t> occluded) const
+  {
+    embreeaccelerator.AreOccluded(rays, tnear, tfars, occluded);
+  }
+
   void BuildAccelStructure();
+  // Quantizes the vertex attributes of all meshes. Must be called before BuildAccelStructure.
+  void CompactMeshes();
   
   void PrintInfo() const;
   
   Box GetBoundingBox() const;
 
+  // Merges into the geometry of the same material and type if there is one. Merged meshes are 
+  // only collected. They are concatenated in one go by FlushAppends. The parsers and 
+  // BuildAccelStructure call it, so normally there is no need to.
   void Append(const Geometry &geo, const Material &mat);
+  void Append(Mesh &&mesh, const Material &mat); // Saves a copy of the mesh.
+  void FlushAppends();
+
+  // Takes ownership of a mesh which is not rendered by itself but can be referenced by instances.
+  const Mesh& AddPrototype(std::unique_ptr<Mesh> mesh);
+  // Places the prototype in the scene. The geometry data is shared among all instances.
+  void AppendInstance(const Mesh &prototype, const Instance::Transform &transform, const Material &mat);
 
 private:
+  MaterialIndex GetOrAddMaterial(const Material &mat);
+  void AddGeometry(std::unique_ptr<Geometry> geo, MaterialIndex material_index);
   void UpdateEmissiveIndexOffset();
 };
@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <random>
 #include <boost/filesystem.hpp>
 
 #ifdef HAVE_JSON
@@ -386,6 +388,27 @@ TEST_F(IntersectorTests, Sphere)
 }
 
 
+TEST_F(IntersectorTests, ManySpheres)
+{
+  // Enough spheres to get Embree's native sphere primitive.
+  Spheres s;
+  this->Initialize([&](EmbreeAccelerator &scene) {
+    for (int i = 0; i < 32; ++i)
+      s.Append({ 0., 0., 4.f*i }, 1.);
+    scene.InsertRefTo(s);
+  });
+  Intersect({{0., 0., -2.},{0., 0., 1.}});
+  EXPECT_NEAR(distance, 1., 1.e-6);
+  CheckPosition({0., 0., -1.});
+  CheckNormal({0.,0.,-1.});
+  // From the inside the exit is hit.
+  Intersect({{0., 0., 8.},{1., 0., 0.}});
+  EXPECT_NEAR(distance, 1., 1.e-6);
+  EXPECT_EQ(intersection.hitid.index, int{2});
+  CheckPosition({1., 0., 8.});
+}
+
+
 TEST_F(IntersectorTests, Triangle)
 {
   /*     x
@@ -569,6 +592,194 @@ TEST(Embree, SphereIntersectionMadness3)
 }
 
 
+TEST(Embree, BatchedFirstHitsMatchSingleRays)
+{
+  Sampler sampler;
+  Spheres spheres;
+  spheres.Append({ 0.f, 0.f, 0.f }, 1.f);
+  spheres.Append({ 2.f, 0.f, 0.f }, 0.5f);
+  Mesh mesh(0, 0);
+  AppendSingleTriangle(mesh, { -3.f, -3.f, -1.f }, { 3.f, -3.f, -1.f }, { 0.f, 3.f, -1.f }, { 0.f, 0.f, 1.f });
+  EmbreeAccelerator world;
+  world.InsertRefTo(spheres);
+  world.InsertRefTo(mesh);
+  world.Build();
+
+  const int N = 256; // Like a 16x16 image tile.
+  ToyVector<Ray> rays;
+  for (int i = 0; i < N; ++i)
+  {
+    Double3 target = SampleTrafo::ToUniformDisc(sampler.UniformUnitSquare()) * 3.;
+    Ray ray{ { 0., 0., 5. }, target - Double3{ 0., 0., 5. } };
+    Normalize(ray.dir);
+    rays.push_back(ray);
+  }
+  ToyVector<double> tfars(N, LargeNumber);
+  ToyVector<std::optional<HitRecord>> hits(N);
+  world.FirstHits(AsSpan(rays), 0., AsSpan(tfars), AsSpan(hits));
+
+  int num_hits = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    HitRecord expected;
+    double expected_tfar = LargeNumber;
+    bool bhit = world.FirstHit(rays[i], 0., expected_tfar, expected);
+    ASSERT_EQ(bhit, (bool)hits[i]);
+    if (!bhit)
+      continue;
+    ++num_hits;
+    EXPECT_EQ(tfars[i], expected_tfar);
+    EXPECT_EQ(hits[i]->geom, expected.geom);
+    EXPECT_EQ(hits[i]->prim, expected.prim);
+    EXPECT_EQ(hits[i]->geom_id, expected.geom_id);
+    EXPECT_NEAR(hits[i]->u, expected.u, 1.e-6);
+    EXPECT_NEAR(hits[i]->v, expected.v, 1.e-6);
+  }
+  EXPECT_GT(num_hits, 0);
+}
+
+
+TEST(Embree, ResolvedHitsLieOnTheRay)
+{
+  Sampler sampler;
+  Spheres spheres;
+  spheres.Append({ 0.f, 0.f, 0.f }, 1.f);
+  Mesh mesh(0, 0);
+  AppendSingleTriangle(mesh, { -3.f, -3.f, -1.f }, { 3.f, -3.f, -1.f }, { 0.f, 3.f, -1.f }, { 0.f, 0.f, 1.f });
+  Instance instance{ mesh, Instance::Transform{ Eigen::Translation3f{ 1.5f, 0.f, 0.5f } } };
+  EmbreeAccelerator world;
+  world.InsertRefTo(spheres);
+  world.InsertRefTo(instance);
+  world.InsertRefTo(mesh);
+  world.Build();
+
+  int num_hits = 0, num_instance_hits = 0;
+  for (int i = 0; i < 100; ++i)
+  {
+    Double3 target = SampleTrafo::ToUniformDisc(sampler.UniformUnitSquare()) * 3.;
+    Ray ray{ { 0., 0., 5. }, target - Double3{ 0., 0., 5. } };
+    Normalize(ray.dir);
+    SurfaceInteraction resolved;
+    HitRecord hit;
+    double tfar = LargeNumber;
+    if (!world.FirstHit(ray, 0., tfar, hit))
+      continue;
+    ++num_hits;
+    num_instance_hits += hit.geom == &instance;
+    world.Resolve(hit, ray, resolved);
+    EXPECT_EQ(resolved.hitid.geom, hit.geom);
+    EXPECT_EQ(resolved.hitid.index, hit.prim);
+    EXPECT_NEAR((resolved.pos - ray.PointAt(tfar)).norm(), 0., 1.e-4);
+    EXPECT_LE(Dot(resolved.normal, ray.dir), 0.);
+  }
+  EXPECT_GT(num_hits, 0);
+  EXPECT_GT(num_instance_hits, 0);
+}
+
+
+TEST(Embree, BatchedOcclusionMatchesSingleRays)
+{
+  Sampler sampler;
+  Spheres spheres;
+  spheres.Append({ 0.f, 0.f, 0.f }, 1.f);
+  spheres.Append({ 2.f, 0.f, 0.f }, 0.5f);
+  EmbreeAccelerator world;
+  world.InsertRefTo(spheres);
+  world.Build();
+
+  const int N = 100;
+  ToyVector<Ray> rays;
+  ToyVector<double> tfars;
+  for (int i = 0; i < N; ++i)
+  {
+    // Random segments, many of which start or end inside the spheres.
+    Double3 org = SampleTrafo::ToUniformSphere(sampler.UniformUnitSquare()) * 3.;
+    Double3 target = SampleTrafo::ToUniformSphere(sampler.UniformUnitSquare()) * 1.5;
+    Ray ray{ org, target - org };
+    tfars.push_back(Length(ray.dir));
+    Normalize(ray.dir);
+    rays.push_back(ray);
+  }
+  ToyVector<std::uint8_t> occluded(N);
+  world.AreOccluded(AsSpan(rays), 0., AsSpan(tfars), AsSpan(occluded));
+
+  for (int i = 0; i < N; ++i)
+  {
+    EXPECT_EQ((bool)occluded[i], world.IsOccluded(rays[i], 0., tfars[i]));
+  }
+}
+
+
+TEST(Embree, CompactMeshAttributes)
+{
+  Mesh m{ 1, 3 };
+  m.vertices << -1.f, -1.f, 0.f,
+                 1.f, -1.f, 0.f,
+                 0.f,  1.f, 0.f;
+  m.vert_indices << 0, 1, 2;
+  m.normals << Normalized(Float3{ 0.3f, 0.1f, -1.f }).transpose(),
+               Normalized(Float3{ -0.2f, 0.5f, -1.f }).transpose(),
+               Normalized(Float3{ 0.f, -0.7f, 1.f }).transpose();
+  m.uvs << 0.f, 0.f,
+           2.f, 0.f,
+           0.5f, 3.f;
+  Mesh packed = m;
+  packed.Compact();
+  EXPECT_LT(packed.MemoryUsage(), m.MemoryUsage());
+  for (int i = 0; i < 3; ++i)
+  {
+    const Float3 n = Normalized(packed.Normal(i));
+    const Float2 uv = packed.Uv(i);
+    for (int k = 0; k < 3; ++k)
+      EXPECT_NEAR(n[k], m.normals(i, k), 1.e-4);
+    for (int k = 0; k < 2; ++k)
+      EXPECT_NEAR(uv[k], m.uvs(i, k), 1.e-4);
+  }
+
+  EmbreeAccelerator full_accel, packed_accel;
+  full_accel.InsertRefTo(m);
+  full_accel.Build();
+  packed_accel.InsertRefTo(packed);
+  packed_accel.Build();
+  const Ray ray{ { 0.1, -0.2, -1. }, { 0., 0., 1. } };
+  SurfaceInteraction a, b;
+  double ta = LargeNumber, tb = LargeNumber;
+  ASSERT_TRUE(full_accel.FirstIntersection(ray, 0., ta, a));
+  ASSERT_TRUE(packed_accel.FirstIntersection(ray, 0., tb, b));
+  EXPECT_EQ(ta, tb);
+  for (int k = 0; k < 3; ++k)
+    EXPECT_NEAR(a.smooth_normal[k], b.smooth_normal[k], 1.e-3);
+  for (int k = 0; k < 2; ++k)
+    EXPECT_NEAR(a.tex_coord[k], b.tex_coord[k], 1.e-3);
+}
+
+
+TEST(Embree, CompactMeshUvChunks)
+{
+  // Two chunks far apart in texture space. Each must keep its precision.
+  const int n = 2*Mesh::UV_CHUNK_SIZE;
+  Mesh m{ 0, n };
+  for (int i = 0; i < n; ++i)
+  {
+    m.vertices.row(i) = Float3{ float(i), 0.f, 0.f };
+    m.normals.row(i) = Float3{ 0.f, 0.f, 1.f };
+    m.uvs.row(i) = Float2{ (i < Mesh::UV_CHUNK_SIZE ? 0.f : 1000.f) + 0.001f*i, 0.5f };
+  }
+  Mesh packed = m;
+  packed.Compact();
+  EXPECT_EQ(packed.uvs.rows(), 0);
+  for (int i = 0; i < n; ++i)
+    EXPECT_NEAR(packed.Uv(i)[0], m.uvs(i, 0), 1.e-4);
+
+  // Too wide a range within a chunk. Then the uvs are not quantized at all.
+  m.uvs(1, 0) = 2.f*Mesh::MAX_UV_CHUNK_RANGE;
+  Mesh unpacked = m;
+  unpacked.Compact();
+  EXPECT_EQ(unpacked.packed_uvs.rows(), 0);
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(unpacked.Uv(i)[0], m.uvs(i, 0));
+}
+
 TEST(Embree, FindPlaceIfUnique)
 {
   ToyVector<int> items{ 1, 3, 5, 7, 9 };
@@ -635,6 +846,51 @@ TEST(Embree, AllIntersections)
 }
 
 
+TEST(Embree, IncrementalIntersectionsMatchAllIntersections)
+{
+  // More boundaries than fit into the buffer of the iterator.
+  Spheres geom;
+  for (int i = 1; i <= 2*BoundaryIntersectionIterator::BUFFER_SIZE; ++i)
+    geom.Append({ 0.f, 0.f, 0.f }, 0.5f*i);
+  geom.Append({ 0.f, 0.f, 0.f }, 1.f); // Intentional duplicate
+
+  // So many spheres use Embree's native primitive. The volume accelerator forces the user geometry
+  // callbacks, though, so both are checked.
+  auto Check = [&geom](bool force_sphere_callbacks)
+  {
+    EmbreeAccelerator world;
+    if (force_sphere_callbacks)
+      world.ForceSphereCallbacks();
+    world.InsertRefTo(geom);
+    world.Build(true);
+    Ray ray{ {0, 0, -10}, {0, 0, 1} };
+    ToyVector<BoundaryIntersection> expected;
+    for (auto is : world.IntersectionsInOrder(ray, 0, 20))
+      expected.push_back(is);
+    ASSERT_EQ(isize(expected), 4*BoundaryIntersectionIterator::BUFFER_SIZE);
+
+    BoundaryIntersectionIterator it{ world, ray, 0, 20 };
+    int n = 0;
+    for (; it; ++it, ++n)
+    {
+      ASSERT_LT(n, isize(expected));
+      EXPECT_EQ(it->t, expected[n].t);
+      EXPECT_EQ(it->prim, expected[n].prim);
+    }
+    EXPECT_EQ(n, isize(expected));
+    EXPECT_GT(it.NumQueries(), 1);
+  };
+  {
+    SCOPED_TRACE("native spheres");
+    Check(false);
+  }
+  {
+    SCOPED_TRACE("sphere callbacks");
+    Check(true);
+  }
+}
+
+
 //TEST(Scene, VolumeIntersection)
 //{
 //  const char* scenestr = R"""(
@@ -794,6 +1050,116 @@ TEST_F(TextureLoadTest, Float3Chn)
   CompareTexture(Texture("testing/scenes/texloadtest2.exr"), 2, 5, expected);
 }
 
+
+TEST_F(TextureLoadTest, TilesUnderMemoryBudget)
+{
+  // Several tiles, with partial ones at the right and bottom border.
+  const int w = 150, h = 70;
+  auto Pattern = [](int x, int y) {
+    return std::array<Image::uchar, 3>{ Image::uchar(x*7 % 256), Image::uchar(y*13 % 256), Image::uchar((x + y) % 256) };
+  };
+  Image img(w, h);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+    {
+      const auto c = Pattern(x, y);
+      img.set_pixel(x, y, c[0], c[1], c[2]);
+    }
+  const auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("texcache-%%%%-%%%%.png");
+  img.write(path.string());
+  // Less than a tile. So all but the most recently loaded tile are evicted.
+  texture_cache::SetMemoryBudget(1);
+  SCOPE_EXIT(boost::filesystem::remove(path); texture_cache::SetMemoryBudget(0););
+  const auto stats_before = texture_cache::GetStatistics();
+
+  Texture tex(path);
+  ASSERT_EQ(tex.Width(), w);
+  ASSERT_EQ(tex.Height(), h);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+    {
+      const auto c = Pattern(x, y);
+      const RGB expected{ 
+        Color::SRGBToLinear(Color::RGBScalar(c[0] / 255.)), 
+        Color::SRGBToLinear(Color::RGBScalar(c[1] / 255.)), 
+        Color::SRGBToLinear(Color::RGBScalar(c[2] / 255.)) };
+      ASSERT_TRUE(((tex.GetPixel(x, y) - expected).abs() < 1.e-3_rgb).all()) << "at " << x << ", " << y;
+    }
+
+  const auto stats = texture_cache::GetStatistics();
+  EXPECT_GE(stats.tiles_loaded - stats_before.tiles_loaded, 3*2);
+  EXPECT_GT(stats.tiles_evicted, stats_before.tiles_evicted);
+  EXPECT_GT(stats.thread_hits, stats_before.thread_hits);
+}
+
+
+TEST_F(TextureLoadTest, ScanlineImageIsLoadedRowOfTilesByRowOfTiles)
+{
+  const int w = 150, h = 200; // 3x4 tiles
+  Image img(w, h);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img.set_pixel(x, y, Image::uchar(x), Image::uchar(y), 0);
+  const auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("texonce-%%%%-%%%%.png");
+  img.write(path.string());
+  SCOPE_EXIT(boost::filesystem::remove(path););
+  Texture tex(path);
+
+  // The rows above are skipped, not kept.
+  const auto stats_before = texture_cache::GetStatistics();
+  const RGB bottom = tex.GetPixel(w-1, h-1);
+  EXPECT_NEAR(value(bottom[1]), value(Color::SRGBToLinear(Color::RGBScalar((h-1) / 255.))), 1.e-3);
+  const auto stats_after_bottom = texture_cache::GetStatistics();
+  EXPECT_EQ(stats_after_bottom.tiles_loaded - stats_before.tiles_loaded, 3);
+
+  // Going down from the top, every row of tiles comes in one piece.
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      ASSERT_NEAR(value(tex.GetPixel(x, y)[0]), value(Color::SRGBToLinear(Color::RGBScalar(x / 255.))), 1.e-3);
+  EXPECT_EQ(texture_cache::GetStatistics().tiles_loaded - stats_after_bottom.tiles_loaded, 3*3);
+}
+
+
+// Prints the cost of texture lookups like those of the shaders. Run with --gtest_also_run_disabled_tests.
+TEST_F(TextureLoadTest, DISABLED_LookupThroughput)
+{
+  const int size = 2048;
+  Image img(size, size);
+  for (int y = 0; y < size; ++y)
+    for (int x = 0; x < size; ++x)
+      img.set_pixel(x, y, Image::uchar(x), Image::uchar(y), Image::uchar(x ^ y));
+  const auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("texbench-%%%%-%%%%.png");
+  img.write(path.string());
+  SCOPE_EXIT(boost::filesystem::remove(path););
+  Texture tex(path);
+
+  const int n = 1 << 22;
+  ToyVector<Float2> coherent_uvs; coherent_uvs.reserve(n);
+  ToyVector<Float2> random_uvs; random_uvs.reserve(n);
+  // A small window which is swept row by row, like adjacent camera rays would do.
+  for (int i = 0; i < n; ++i)
+    coherent_uvs.emplace_back((i % 256 + 0.5f) / size, ((i / 256) % 256 + 0.5f) / size);
+  std::mt19937 rng{ 42 };
+  std::uniform_real_distribution<float> uniform{ 0.f, 1.f };
+  for (int i = 0; i < n; ++i)
+    random_uvs.emplace_back(uniform(rng), uniform(rng));
+
+  auto Measure = [&](const char* name, const ToyVector<Float2> &uvs)
+  {
+    RGB sum = RGB::Zero();
+    for (const auto &uv : uvs) // Warm up, and decode the tiles.
+      sum += tex.GetPixel(UvToPixel(tex, uv));
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto &uv : uvs)
+      sum += tex.GetPixel(UvToPixel(tex, uv));
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << name << ": " << (seconds * 1.e9 / uvs.size()) << " ns per lookup (checksum " << value(sum.sum()) << ")" << std::endl;
+  };
+  Measure("Coherent uv", coherent_uvs);
+  Measure("Random uv", random_uvs);
+  std::cout << texture_cache::GetStatistics() << std::endl;
+}
+
 namespace materials { namespace Atmosphere
 {
 
@@ -1015,6 +1381,166 @@ TEST(Utils,GenerateArray)
 /// HashGrid
 ///////////////////////////////////////////////
 
+TEST(Utils, WorkStealingRangesHandOutEachItemOnce)
+{
+  const int num_items = 1000, num_workers = 7;
+  WorkStealingRanges ranges;
+  ranges.Reset(num_items, num_workers);
+  ToyVector<tbb::atomic<int>> counts(num_items);
+  for (auto &c : counts) c = 0;
+  // Worker 0 is slowed down so that the others have to steal from it.
+  tbb::parallel_for(0, num_workers, [&](int w) {
+    while (auto i = ranges.Pop(w))
+    {
+      counts[*i].fetch_and_increment();
+      if (w == 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+  for (int i = 0; i < num_items; ++i)
+    EXPECT_EQ(counts[i].load(), 1) << "item " << i;
+}
+
+
+TEST(Utils, ImageTileMortonOrder)
+{
+  ImageTileSet tileset{ {100, 37}, 8 };
+  EXPECT_EQ(tileset.size(), 13*5);
+  auto order = tileset.mortonOrder();
+  ASSERT_EQ(isize(order), tileset.size());
+  // Starts with the 2x2 block in the corner.
+  EXPECT_EQ(order[0], 0);
+  EXPECT_EQ(order[1], 1);
+  EXPECT_EQ(order[2], 13);
+  EXPECT_EQ(order[3], 14);
+  std::sort(order.begin(), order.end());
+  for (int i = 0; i < isize(order); ++i)
+    EXPECT_EQ(order[i], i);
+}
+
+
+TEST(Utils, TileConvergenceTrackerStopsNoiseFreeTiles)
+{
+  // Left tile receives constant samples, the right one random samples.
+  const Int2 im_shape{ 8, 4 };
+  ImageTileSet tileset{ im_shape, 4 };
+  TileConvergenceTracker tracker{ tileset, im_shape, 0.01 };
+  ToyVector<RGB> framebuffer(im_shape.prod(), RGB::Zero());
+  Sampler sampler;
+  const int spp = 4;
+  for (int pass = 0; pass < 4; ++pass)
+  {
+    EXPECT_TRUE(tracker.IsActive(0));
+    for (int i = 0; i < tileset.size(); ++i)
+    {
+      const auto tile = tileset[i];
+      for (int iy = 0; iy < tile.shape[1]; ++iy)
+        for (int ix = tile.corner[0]; ix < tile.corner[0] + tile.shape[0]; ++ix)
+          for (int s = 0; s < spp; ++s)
+            framebuffer[ix + iy*im_shape[0]] += RGB::Constant(Color::RGBScalar(i == 0 ? 0.5 : sampler.Uniform01()));
+      tracker.Update(i, tile, AsSpan(framebuffer), spp);
+    }
+  }
+  EXPECT_FALSE(tracker.IsActive(0));
+  EXPECT_NEAR(tracker.Error(0), 0., 1.e-6);
+  EXPECT_TRUE(tracker.IsActive(1));
+  EXPECT_GT(tracker.Error(1), 0.01);
+  EXPECT_EQ(tracker.NumActive(), 1);
+  EXPECT_FALSE(tracker.AllConverged());
+}
+
+
+TEST(Utils, CheckpointRoundTrip)
+{
+  const Int2 im_shape{ 8, 4 };
+  ImageTileSet tileset{ im_shape, 4 };
+  TileConvergenceTracker tracker{ tileset, im_shape, 0.01 };
+  ToyVector<RGB> framebuffer(im_shape.prod(), RGB::Zero());
+  for (int pass = 0; pass < 4; ++pass)
+  {
+    for (auto &x : framebuffer)
+      x += RGB::Constant(Color::RGBScalar(0.5));
+    tracker.Update(0, tileset[0], AsSpan(framebuffer), 1);
+  }
+  Eigen::ArrayXXd matrix = Eigen::ArrayXXd::Random(3, 5);
+  ToyVector<std::string> strings{ "foo", "", "bar" };
+
+  std::stringstream ss;
+  {
+    checkpoint::Writer ar{ ss };
+    ar.Expect(tileset.size(), "tiles");
+    ar(tracker);
+    ar(framebuffer);
+    ar(matrix);
+    ar(strings);
+  }
+
+  TileConvergenceTracker tracker2{ tileset, im_shape, 0.01 };
+  ToyVector<RGB> framebuffer2;
+  Eigen::ArrayXXd matrix2;
+  ToyVector<std::string> strings2;
+  {
+    checkpoint::Reader ar{ ss };
+    ar.Expect(tileset.size(), "tiles");
+    ar(tracker2);
+    ar(framebuffer2);
+    ar(matrix2);
+    ar(strings2);
+  }
+  EXPECT_FALSE(tracker2.IsActive(0));
+  EXPECT_TRUE(tracker2.IsActive(1));
+  EXPECT_EQ(tracker2.Error(0), tracker.Error(0));
+  ASSERT_EQ(framebuffer2.size(), framebuffer.size());
+  EXPECT_EQ(framebuffer2[7][0], framebuffer[7][0]);
+  EXPECT_TRUE((matrix2 == matrix).all());
+  EXPECT_EQ(strings2, strings);
+
+  std::stringstream ss_other;
+  checkpoint::Writer{ ss_other }(42);
+  checkpoint::Reader reader{ ss_other };
+  EXPECT_THROW(reader.Expect(43, "number"), checkpoint::Error);
+  EXPECT_THROW(reader(matrix2), checkpoint::Error); // Truncated
+}
+
+
+TEST(Utils, TiledFramebuffer)
+{
+  // Border tiles are smaller than the others.
+  const Int2 im_shape{ 10, 7 };
+  ImageTileSet tileset{ im_shape, 4 };
+  TiledFramebuffer framebuffer{ tileset };
+  for (int i = 0; i < im_shape.prod(); ++i)
+    framebuffer.Add(i, RGB::Constant(Color::RGBScalar(i)));
+  for (int i = 0; i < tileset.size(); ++i)
+    framebuffer.AddSampleCount(i, 2);
+  for (int i = 0; i < im_shape.prod(); ++i)
+  {
+    EXPECT_EQ(value(framebuffer.Sum(i)[1]), i);
+    EXPECT_EQ(value(framebuffer.Average(i)[1]), 0.5*i);
+  }
+
+  // Summing all in float would be off by several percent here. In float per pass and in double
+  // over the passes, it is not.
+  const int passes = 1 << 12, per_pass = 1 << 10;
+  const int tile_of_13 = 0; // At x=3, y=1.
+  for (int p = 0; p < passes; ++p)
+  {
+    for (int k = 0; k < per_pass; ++k)
+      framebuffer.Add(13, RGB::Constant(Color::RGBScalar(0.1)));
+    framebuffer.AddSampleCount(tile_of_13, 0);
+  }
+  const double n = double(passes)*per_pass;
+  EXPECT_NEAR(value(framebuffer.Sum(13)[0]), 13. + 0.1*n, 1.e-4*0.1*n);
+
+  std::stringstream ss;
+  checkpoint::Writer{ ss }(framebuffer);
+  TiledFramebuffer framebuffer2{ tileset };
+  checkpoint::Reader{ ss }(framebuffer2);
+  EXPECT_EQ(value(framebuffer2.Sum(13)[2]), value(framebuffer.Sum(13)[2]));
+  EXPECT_EQ(framebuffer2.SampleCount(5), 2);
+}
+
+
 TEST(HashGrid,HashGrid)
 {
   // Generate points uniformly distributed on a sphere. Put them into the hash grid.
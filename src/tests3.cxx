@@ -14,6 +14,7 @@
 #include <boost/filesystem.hpp>
 
 #include "renderingalgorithms_simplebase.hxx"
+#include "renderingalgorithms_interface.hxx"
 #include "rendering_randomwalk_impl.hxx"
 
 using namespace RandomWalk;
@@ -112,6 +113,22 @@ s 0 0 6 0.5
 }
 
 
+TEST(Rendering, MediumTrackerWithManySurfaceSpheres)
+{
+  // Enough spheres for Embree's native sphere primitive. Their crossings must be counted anyway.
+  std::string scenestr = "diffuse white 1 1 1 0.5\nmedium med1 1 1 1 2 2 2\n";
+  for (int i = 0; i < 20; ++i)
+    scenestr += fmt::format("s {} 0 0 0.4\n", i);
+  Scene scene;
+  scene.ParseNFFString(scenestr);
+  scene.BuildAccelStructure();
+  MediumTracker mt(scene);
+  mt.initializePosition({ 3., 0., 0. });
+  EXPECT_NE(&mt.getCurrentMedium(), &scene.GetEmptySpaceMedium());
+  mt.initializePosition({ 3.5, 0., 0. });
+  EXPECT_EQ(&mt.getCurrentMedium(), &scene.GetEmptySpaceMedium());
+}
+
 TEST(Rendering, MediaTransmission2)
 {
   const std::string scenestr {R"""(
@@ -550,4 +567,92 @@ m testing/scenes/unitcube.dae
   EXPECT_LE(combined_estimate.MeanErr(), transmission_estimate.MeanErr());
   EXPECT_LE(combined_estimate.MeanErr(), n_track_through.MeanErr());
 }
-#endif
\ No newline at end of file
+#endif
+
+namespace
+{
+
+std::unique_ptr<Image> RenderLinearImage(const std::string &scenestr, const std::string &algo_name, int samples_per_pixel)
+{
+  RenderingParameters params;
+  Scene scene;
+  scene.ParseNFFString(scenestr, &params);
+  scene.BuildAccelStructure();
+  params.algo_name = algo_name;
+  params.num_threads = 2;
+  params.max_samples_per_pixel = samples_per_pixel;
+  params.linear_output = true;
+  params.qmc = true;
+  auto algo = RenderAlgorithmFactory(scene, params);
+  algo->SetInterruptCallback([](bool) {});
+  algo->Run();
+  return algo->GenerateImage();
+}
+
+} // anonymous namespace
+
+
+TEST(Rendering, WavefrontMatchesPathtracing2)
+{
+  const std::string scenestr{ R"""(
+v
+from 5 5 0.5
+at 0 0 0.5
+up 0 1 0
+resolution 16 16
+angle 15
+
+larea arealight1 uniform 1. 1. 1. 3
+shader black
+p 4
+0 1 0
+0 1 1
+0 0 1
+0 0 0
+larea none
+
+diffuse white  1 1 1 0.7
+p 4
+0 0 0
+1 0 0
+1 0 1
+0 0 1
+
+shader none
+medium med1 0.5 0.5 0.5 0.5 0.5 0.5
+s 0.5 0.3 0.5 0.25
+)""" };
+  const int spp = 256;
+  const auto pt2 = RenderLinearImage(scenestr, "pt2", spp);
+  const auto ptw = RenderLinearImage(scenestr, "ptw", spp);
+  ASSERT_EQ(pt2->width(), ptw->width());
+  ASSERT_EQ(pt2->height(), ptw->height());
+
+  // The QMC points are the same but the pseudo-random decisions differ. Hence the means over regions
+  // of the image are compared within their statistical error. The standard deviation of a single sample
+  // is estimated from the spread of the pixels of a region, which is that of spp samples, so too large,
+  // if anything, because the image varies within the region, too.
+  const int region_size = 4;
+  const int samples_per_region = region_size*region_size*spp;
+  Accumulators::OnlineAverage<double> brightness;
+  for (int ry = 0; ry < pt2->height(); ry += region_size)
+  for (int rx = 0; rx < pt2->width(); rx += region_size)
+  for (int c = 0; c < 3; ++c)
+  {
+    Accumulators::OnlineVariance<double> acc_pt2, acc_ptw;
+    for (int y = ry; y < ry + region_size; ++y)
+      for (int x = rx; x < rx + region_size; ++x)
+      {
+        acc_pt2 += pt2->get_pixel_uc3(x, y)[c];
+        acc_ptw += ptw->get_pixel_uc3(x, y)[c];
+      }
+    // Of the difference of the region means.
+    const double variance = (acc_pt2.Var() + acc_ptw.Var()) * spp / samples_per_region;
+    // Plus one for the rounding to 8 bits.
+    const double tolerance = 4.*std::sqrt(variance) + 1.;
+    EXPECT_NEAR(acc_ptw.Mean(), acc_pt2.Mean(), tolerance) << "region at " << rx << "," << ry << " channel " << c;
+    brightness += acc_pt2.Mean();
+  }
+  // Not all black.
+  EXPECT_GT(brightness(), 10.);
+}
@@ -218,6 +218,30 @@ TEST_F(RandomSamplingFixture, UniformIntInclusive)
 }
 
 
+TEST(Sampler, PixelSampleSeedingIsReproducible)
+{
+  for (bool qmc : { false, true })
+  {
+    Sampler a{ qmc }, b{ qmc };
+    // Different history before, as if the pixel sample was taken by another thread or process.
+    for (int i = 0; i < 17; ++i)
+      b.Uniform01();
+    a.SetPixelSample({ 3, 5 }, 7);
+    b.SetPixelSample({ 3, 5 }, 7);
+    for (int i = 0; i < 100; ++i) // Beyond the dimensions served by the Sobol sequence.
+      ASSERT_EQ(a.Uniform01(), b.Uniform01());
+    EXPECT_EQ(a.UniformInt(0, 1000), b.UniformInt(0, 1000));
+    a.SetPixelSample({ 3, 5 }, 8);
+    b.SetPixelSample({ 4, 5 }, 7);
+    const double x = a.Uniform01(), y = b.Uniform01();
+    a.SetPixelSample({ 3, 5 }, 7);
+    const double z = a.Uniform01();
+    EXPECT_NE(x, z);
+    EXPECT_NE(y, z);
+  }
+}
+
+
 TEST_F(RandomSamplingFixture, UniformIntDistribution)
 {
   // Put random throws in bins and do statistics on the number of hits per bin.
@@ -13,6 +13,8 @@
 
 #include "sampler.hxx"
 #include "scene.hxx"
+#include "camera.hxx"
+#include "parse_common.hxx"
 
 
 
@@ -164,6 +166,45 @@ m testing/scenes/unitcube.dae
 }
 
 
+TEST(Parser, InstancedModels)
+{
+  const char* scenestr = R"""(
+scopes:
+  - transforms:
+      - pos: [ -3., 0., 0. ]
+    models:
+      - file: testing/scenes/unitcube.dae
+        instanced: true
+  - transforms:
+      - pos: [ 3., 0., 0. ]
+      - scale: [ 2., 2., 2. ]
+    models:
+      - file: testing/scenes/unitcube.dae
+        instanced: true
+  )""";
+  Scene scene;
+  std::istringstream is; is.str(scenestr);
+  scene.ParseYAML(is, nullptr, {});
+  ASSERT_EQ(scene.GetNumGeometries(), 2);
+  ASSERT_TRUE(scene.GetGeometry(0).type == Geometry::PRIMITIVES_INSTANCE);
+  ASSERT_TRUE(scene.GetGeometry(1).type == Geometry::PRIMITIVES_INSTANCE);
+  scene.BuildAccelStructure();
+
+  const Box box = scene.GetBoundingBox();
+  EXPECT_NEAR(box.min[0], -3.5, 1.e-3);
+  EXPECT_NEAR(box.max[0], 4., 1.e-3);
+
+  double tfar = 100.;
+  auto intersection = scene.FirstIntersection(Ray{ {3., 0., -5.}, {0., 0., 1.} }, 0., tfar);
+  ASSERT_TRUE((bool)intersection);
+  EXPECT_EQ(intersection->hitid.geom, &scene.GetGeometry(1));
+  EXPECT_NEAR(tfar, 4., 1.e-3);
+  EXPECT_NEAR(intersection->pos[2], -1., 1.e-3);
+  EXPECT_NEAR(intersection->geometry_normal.cwiseAbs()[2], 1., 1.e-3);
+  EXPECT_NEAR(intersection->normal[2], -1., 1.e-3);
+}
+
+
 TEST(Parser, LightIndices)
 {
   const char* scenestr = R"""(
@@ -197,6 +238,207 @@ s 0 0 0 1
 }
 
 
+TEST(Parser, SeveralViews)
+{
+  const char* scenestr = R"""(
+v
+from 0 0 -2
+at 0 0 0
+up 0 1 0
+resolution 64 48
+angle 40
+vfisheye
+from 1 0 0
+at 0 0 0
+up 0 1 0
+resolution 64 48
+)""";
+  Scene scene;
+  scene.ParseNFFString(scenestr);
+  ASSERT_EQ(isize(scene.GetViews()), 2);
+  EXPECT_FALSE(scene.GetViews()[0].fisheye);
+  EXPECT_TRUE(scene.GetViews()[1].fisheye);
+  ASSERT_TRUE(scene.HasCamera()); // From the last view.
+  EXPECT_EQ(scene.GetCamera().xres, 64);
+  const auto half_turn = scene.GetViews()[0].Orbited(Pi);
+  EXPECT_NEAR((half_turn.from - Double3{0., 0., 2.}).norm(), 0., 1.e-6);
+  EXPECT_NEAR((half_turn.at - Double3{0., 0., 0.}).norm(), 0., 1.e-6);
+}
+
+
+TEST(Parser, SceneCache)
+{
+  namespace fs = boost::filesystem;
+  const auto cache_dir = fs::temp_directory_path() / fs::unique_path("toytrace-cache-%%%%%%%%");
+  fs::create_directories(cache_dir);
+  const scenereader::Transform trafo{ Eigen::Translation3d{ 1., 2., 3. } };
+  const auto loaded = scenereader::assimp::Load(trafo, false, "testing/scenes/unitcube.dae", cache_dir);
+  ASSERT_EQ(std::distance(fs::directory_iterator{ cache_dir }, fs::directory_iterator{}), 1);
+  const auto cached = scenereader::assimp::Load(trafo, false, "testing/scenes/unitcube.dae", cache_dir);
+  ASSERT_EQ(cached.size(), loaded.size());
+  for (std::size_t i = 0; i < loaded.size(); ++i)
+  {
+    EXPECT_EQ(cached[i].mesh.vertices, loaded[i].mesh.vertices);
+    EXPECT_EQ(cached[i].mesh.vert_indices, loaded[i].mesh.vert_indices);
+    EXPECT_EQ(cached[i].mesh.normals, loaded[i].mesh.normals);
+    EXPECT_EQ(cached[i].material_name, loaded[i].material_name);
+  }
+  // Another transform is another entry.
+  scenereader::assimp::Load(scenereader::Transform::Identity(), false, "testing/scenes/unitcube.dae", cache_dir);
+  EXPECT_EQ(std::distance(fs::directory_iterator{ cache_dir }, fs::directory_iterator{}), 2);
+  fs::remove_all(cache_dir);
+}
+
+
+TEST(Parser, MergedPolygons)
+{
+  std::string scenestr;
+  for (int i = 0; i < 100; ++i)
+    scenestr += fmt::format("p 3\n{0} 0 0\n{0} 1 0\n{0} 0 1\n", i);
+  Scene scene;
+  scene.ParseNFFString(scenestr);
+  ASSERT_EQ(scene.GetNumGeometries(), 1);
+  const auto &mesh = static_cast<const Mesh&>(scene.GetGeometry(0));
+  ASSERT_EQ(mesh.NumTriangles(), 100);
+  ASSERT_EQ(mesh.NumVertices(), 300);
+  for (int i = 0; i < 100; ++i)
+  {
+    EXPECT_EQ(mesh.vert_indices(i, 0), 3u*i);
+    EXPECT_EQ(mesh.vertices(mesh.vert_indices(i, 2), 0), float(i));
+  }
+}
+
+
+TEST(Parser, PrimitiveRecords)
+{
+  // Windows line endings, spheres between polygons and no newline at the end.
+  const char* scenestr =
+    "p 4\r\n0 0 0\r\n1 0 0\r\n1 1 0\r\n0 1 0\r\n"
+    "s 1 2 3 0.5\r\n"
+    "p 3\r\n0 0 1 0 0 -1 0.5 0.5\r\n1 0 1 0 0 -1\r\n0 1 1 0 0 -1\r\n"
+    "s 4 5 6 +1.5";
+  Scene scene;
+  scene.ParseNFFString(scenestr);
+  ASSERT_EQ(scene.GetNumGeometries(), 2);
+  const auto &mesh = static_cast<const Mesh&>(scene.GetGeometry(0));
+  ASSERT_EQ(mesh.NumTriangles(), 3);
+  ASSERT_EQ(mesh.NumVertices(), 6 + 3); // The quad is flat shaded, so each triangle has its own vertices.
+  EXPECT_NEAR(mesh.normals(0, 2), 1.f, 1.e-6);
+  EXPECT_NEAR(mesh.normals(6, 2), -1.f, 1.e-6);
+  EXPECT_NEAR(mesh.uvs(6, 0), 0.5f, 1.e-6);
+  const auto &spheres = static_cast<const Spheres&>(scene.GetGeometry(1));
+  ASSERT_EQ(spheres.NumSpheres(), 2);
+  EXPECT_NEAR(spheres.Get(1).second, 1.5f, 1.e-6);
+}
+
+
+// Prints how fast big scenes are parsed. Run with --gtest_also_run_disabled_tests.
+TEST(Parser, DISABLED_NFFThroughput)
+{
+  namespace fs = boost::filesystem;
+  auto path = fs::temp_directory_path() / fs::unique_path("throughput-%%%%-%%%%-%%%%-%%%%.nff");
+  {
+    std::ofstream os(path.string());
+    for (int block = 0; block < 200; ++block)
+    {
+      for (int i = 0; i < 1000; ++i)
+        os << fmt::format("p 3\n{0} 0 0 0 0 1 0 0\n{0} 1 0 0 0 1 1 0\n{0} 0 1 0 0 1 0 1\n", block + i*0.001);
+      for (int i = 0; i < 1000; ++i)
+        os << fmt::format("s {} 1.5 -2.25 0.125\n", block + i*0.001);
+    }
+  }
+  const double megabytes = fs::file_size(path) / (1024.*1024.);
+  auto Measure = [&](const char* name, auto &&parse)
+  {
+    Scene scene;
+    auto start = std::chrono::steady_clock::now();
+    parse(scene);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_EQ(scene.GetNumGeometries(), 2);
+    std::cout << fmt::format("{}: {:.1f} MB in {:.2f} s = {:.1f} MB/s", name, megabytes, seconds, megabytes / seconds) << std::endl;
+  };
+  Measure("Memory mapped file", [&](Scene &scene) { scene.ParseNFF(path); });
+  Measure("Stream", [&](Scene &scene) { std::ifstream is(path.string()); scene.ParseNFF(is); });
+  fs::remove(path);
+}
+
+
+TEST(Parser, ObjFile)
+{
+  namespace fs = boost::filesystem;
+  auto path = fs::temp_directory_path() / fs::unique_path("model-%%%%-%%%%-%%%%-%%%%.obj");
+  {
+    std::ofstream os(path.string());
+    os << R"""(# A quad with relative indices and two triangles
+o first
+v 0 0 0
+v 1 0 0
+v 1 1 0
+v 0 1 0
+vt 0 0
+vt 1 0
+vt 1 1
+vt 0 1
+usemtl red
+f -4/-4 -3/-3 -2/-2 -1/-1
+o second
+vn 0 0 1
+usemtl blue
+f 1//1 2//1 4//1
+usemtl red
+f 2 3 4
+)""";
+  }
+  const scenereader::Transform transform = scenereader::Transform::Identity();
+  for (bool by_object_names : { false, true })
+  {
+    const auto meshes = scenereader::obj::Load(transform, by_object_names, path);
+    // One line per chunk.
+    const auto chunked = scenereader::obj::Load(transform, by_object_names, path, 1);
+    ASSERT_EQ(meshes.size(), 2);
+    ASSERT_EQ(chunked.size(), 2);
+    for (int i = 0; i < 2; ++i)
+    {
+      EXPECT_EQ(meshes[i].material_name, chunked[i].material_name);
+      EXPECT_TRUE(meshes[i].mesh.vertices == chunked[i].mesh.vertices);
+      EXPECT_TRUE(meshes[i].mesh.vert_indices == chunked[i].mesh.vert_indices);
+    }
+    EXPECT_EQ(*meshes[0].material_name, by_object_names ? "first" : "red");
+    EXPECT_EQ(*meshes[1].material_name, by_object_names ? "second" : "blue");
+    EXPECT_EQ(meshes[0].mesh.NumTriangles(), by_object_names ? 2 : 3);
+    EXPECT_EQ(meshes[1].mesh.NumTriangles(), by_object_names ? 2 : 1);
+  }
+  fs::remove(path);
+}
+
+
+TEST(Parser, ObjFileSharesVerticesWithSameAttributes)
+{
+  namespace fs = boost::filesystem;
+  auto path = fs::temp_directory_path() / fs::unique_path("model-%%%%-%%%%-%%%%-%%%%.obj");
+  {
+    std::ofstream os(path.string());
+    // Two quads on the same positions, which differ in the uvs.
+    os << R"""(v 0 0 0
+v 1 0 0
+v 1 1 0
+v 0 1 0
+vt 0 0
+vt 1 1
+f 1/1 2/1 3/1
+f 1/2 2/2 3/2
+f 1/1 3/1 4/1
+f 1/2 3/2 4/2
+)""";
+  }
+  const auto meshes = scenereader::obj::Load(scenereader::Transform::Identity(), false, path);
+  ASSERT_EQ(meshes.size(), 1);
+  EXPECT_EQ(meshes[0].mesh.NumTriangles(), 4);
+  EXPECT_EQ(meshes[0].mesh.vertices.rows(), 8);
+  fs::remove(path);
+}
+
+
 TEST(Parser, ImportCompleteSceneWithDaeBearingMaterials)
 {
   const char* scenestr = R"""(
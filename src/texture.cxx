@@ -6,15 +6,143 @@
 
 #include <OpenImageIO/imageio.h>
 
+#include <list>
+#include <mutex>
+#include <utility>
+
 namespace fs = boost::filesystem;
 
 
+// See https://github.com/OpenImageIO/oiio/commit/29110dae8de657ddf9938c4e3b056f1112c41b6d
+#if OIIO_PLUGIN_VERSION >= 22
+using ImageInputPtr = std::unique_ptr<OIIO::ImageInput>;
+#else
+using ImageInputPtr = std::unique_ptr<OIIO::ImageInput, void(*)(OIIO::ImageInput*)>;
+#endif
+
+
+const std::array<Color::RGBScalar, 256> Texture::srgb_byte_to_linear = []() {
+  std::array<Color::RGBScalar, 256> table;
+  for (int i = 0; i < 256; ++i)
+    table[i] = Color::SRGBToLinear(Color::RGBScalar(i / 255.0));
+  return table;
+}();
+
+
+namespace
+{
+ImageInputPtr OpenImage(const std::string &filename)
+{
+#if OIIO_PLUGIN_VERSION >= 22
+  ImageInputPtr in = OIIO::ImageInput::open (filename);
+#else
+  ImageInputPtr in{OIIO::ImageInput::open (filename), &OIIO::ImageInput::destroy};
+#endif
+  if (!in)
+    throw std::invalid_argument(fmt::format("Failed to open image file: {}", filename));
+  return in;
+}
+}
+
+
+// At most MAX_OPEN files are kept open over all textures. The least recently used are closed and
+// reopened on demand. Those which are busy are skipped, so the limit may be exceeded briefly.
+struct Texture::File
+{
+  static constexpr std::size_t MAX_OPEN = 64;
+
+  std::mutex mutex; // ImageInput is not thread safe. Guards everything but lru_position.
+  ImageInputPtr in; // Null while closed.
+  std::string filename;
+  int x0, y0; // Origin of the pixel data window.
+  int channels;
+  // If the file is tiled such that our tiles can be read separately. Else whole rows of our tiles are decoded at once.
+  bool tiles_readable;
+  // Of scanline files. Going back means decoding from the start. Rows in between are skipped.
+  int next_row = 0;
+  std::list<File*>::iterator lru_position; // Valid while open.
+
+  File(ImageInputPtr in_, const std::string &filename) 
+    : filename{filename} 
+  {
+    in = std::move(in_);
+    Register();
+  }
+
+  ~File()
+  {
+    std::lock_guard<std::mutex> lock{ RegistryMutex() };
+    if (in)
+      OpenFiles().erase(lru_position);
+  }
+
+  // Call with the mutex held.
+  OIIO::ImageInput& Input()
+  {
+    if (in)
+    {
+      std::lock_guard<std::mutex> lock{ RegistryMutex() };
+      OpenFiles().splice(OpenFiles().begin(), OpenFiles(), lru_position);
+    }
+    else
+    {
+      in = OpenImage(filename);
+      next_row = 0;
+      Register();
+    }
+    return *in;
+  }
+
+  // Call with the mutex held.
+  void Close()
+  {
+    std::lock_guard<std::mutex> lock{ RegistryMutex() };
+    if (!in)
+      return;
+    OpenFiles().erase(lru_position);
+    in.reset();
+  }
+
+private:
+  static std::mutex& RegistryMutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  static std::list<File*>& OpenFiles() // Most recently used first.
+  {
+    static std::list<File*> files;
+    return files;
+  }
+
+  void Register()
+  {
+    std::lock_guard<std::mutex> lock{ RegistryMutex() };
+    auto &files = OpenFiles();
+    files.push_front(this);
+    lru_position = files.begin();
+    // Only try_lock, because the owner of a busy file may wait for the registry.
+    for (auto it = files.end(); files.size() > MAX_OPEN && it != files.begin();)
+    {
+      File* victim = *(--it);
+      if (victim == this || !victim->mutex.try_lock())
+        continue;
+      it = files.erase(it);
+      victim->in.reset();
+      victim->mutex.unlock();
+    }
+  }
+};
+
+
 Texture::Texture(const fs::path &filename)
+  : cache_id{texture_cache::NewTextureId()}
 {
   if (fs::exists(filename))
   {
     std::cout << "Texture: " << filename << std::endl;
-    ReadFile(filename.string());
+    OpenFile(filename.string());
   }
   else
   {
@@ -23,50 +151,113 @@ Texture::Texture(const fs::path &filename)
 }
 
 
+Texture::~Texture()
+{
+  texture_cache::Forget(cache_id);
+}
+
+
 namespace {
 void MakeThreeChannels(Span<std::uint8_t> dst, Span<const std::uint8_t> src, int num_pixels, int bytes_per_channel, int dst_channels, int src_channels); 
 }
 
-void Texture::ReadFile(const std::string &filename)
+void Texture::OpenFile(const std::string &filename)
 {
-// See https://github.com/OpenImageIO/oiio/commit/29110dae8de657ddf9938c4e3b056f1112c41b6d
-#if OIIO_PLUGIN_VERSION >= 22
-  auto in = OIIO::ImageInput::open (filename);
-  if (!in)
-    throw std::invalid_argument(fmt::format("Failed to open image file: {}", filename));
-#else
-  auto *in = OIIO::ImageInput::open (filename);
-  if (! in)
-    throw std::invalid_argument(fmt::format("Failed to open image file: {}", filename));
-  SCOPE_EXIT(OIIO::ImageInput::destroy (in););
-#endif
-  
-  const OIIO::ImageSpec &spec = in->spec();
+  ImageInputPtr in = OpenImage(filename);
+  const OIIO::ImageSpec spec = in->spec(); // Copied, since the file may be closed by others once it is registered.
   w = spec.width;
   h = spec.height;
-  int channels = spec.nchannels;
-  int bytes_per_channel = 1;
-  if (spec.format.is_floating_point())
-  {
-    type = FLOAT;
-    bytes_per_channel = sizeof(float);
-    data.resize(w*h*bytes_per_channel*channels);
-    in->read_image (OIIO::TypeDesc::FLOAT, (float*)&data[0]);
-  }
-  else
+  tiles_x = (w + texture_cache::TILE_SIZE - 1) / texture_cache::TILE_SIZE;
+  tiles_y = (h + texture_cache::TILE_SIZE - 1) / texture_cache::TILE_SIZE;
+  type = spec.format.is_floating_point() ? FLOAT : BYTE;
+
+  file = std::make_unique<File>(std::move(in), filename);
+  file->x0 = spec.x;
+  file->y0 = spec.y;
+  file->channels = std::min(spec.nchannels, 3);
+  file->tiles_readable = spec.tile_width > 0 && spec.tile_height > 0 && spec.tile_depth <= 1 &&
+    texture_cache::TILE_SIZE % spec.tile_width == 0 && texture_cache::TILE_SIZE % spec.tile_height == 0;
+}
+
+
+ToyVector<std::pair<int, texture_cache::TilePtr>> Texture::LoadTiles(int tile_index) const
+{
+  using namespace texture_cache;
+  const int tile_x = tile_index % tiles_x;
+  const int tile_y = tile_index / tiles_x;
+  assert(tile_y < tiles_y);
+  // Whole rows of tiles are decoded from scanline images. Starting where the previous read left
+  // off, or else from the top. The scanlines above the requested row of tiles are decoded into
+  // a scratch row and dropped, so that only one row of tiles is held and returned at a time.
+  const int xbegin = file->tiles_readable ? tile_x*TILE_SIZE : 0;
+  const int xend   = file->tiles_readable ? std::min(w, xbegin + TILE_SIZE) : w;
+  const int ybegin = tile_y*TILE_SIZE;
+  const int yend   = std::min(h, ybegin + TILE_SIZE);
+  const int bytes_per_channel = type == FLOAT ? sizeof(float) : 1;
+  const auto format = type == FLOAT ? OIIO::TypeDesc::FLOAT : OIIO::TypeDesc::UINT8;
+  const int src_pixel_size = file->channels*bytes_per_channel;
+
+  ToyVector<std::uint8_t> buffer((xend-xbegin)*(yend-ybegin)*src_pixel_size);
   {
-    type = BYTE;
-    data.resize(w*h*channels);
-    in->read_image (OIIO::TypeDesc::UINT8, &data[0]);
+    std::lock_guard<std::mutex> lock{file->mutex};
+    auto &in = file->Input();
+    bool ok = true;
+    if (file->tiles_readable)
+    {
+#if OIIO_PLUGIN_VERSION >= 22
+      ok = in.read_tiles(0, 0, file->x0 + xbegin, file->x0 + xend, file->y0 + ybegin, file->y0 + yend, 0, 1, 0, file->channels, format, buffer.data());
+#else
+      ok = in.read_tiles(file->x0 + xbegin, file->x0 + xend, file->y0 + ybegin, file->y0 + yend, 0, 1, 0, file->channels, format, buffer.data());
+#endif
+    }
+    else
+    {
+      auto ReadScanlines = [&](int y, int yfinal, void* dst) -> bool {
+#if OIIO_PLUGIN_VERSION >= 22
+        return in.read_scanlines(0, 0, file->y0 + y, file->y0 + yfinal, 0, 0, file->channels, format, dst);
+#else
+        return in.read_scanlines(file->y0 + y, file->y0 + yfinal, 0, 0, file->channels, format, dst);
+#endif
+      };
+      ToyVector<std::uint8_t> scratch_row(w*src_pixel_size);
+      for (int y = file->next_row <= ybegin ? file->next_row : 0; ok && y < ybegin; ++y)
+        ok = ReadScanlines(y, y + 1, scratch_row.data());
+      ok = ok && ReadScanlines(ybegin, yend, buffer.data());
+      file->next_row = yend;
+    }
+    if (!ok)
+      throw std::runtime_error(fmt::format("Failed to read image file {}: {}", file->filename, in.geterror()));
+    // Only a restart from the top would need it again.
+    if (!file->tiles_readable && file->next_row >= h)
+      file->Close();
   }
-  in->close ();
-  
-  if (channels != 3)
+
+  const int dst_pixel_size = 3*bytes_per_channel;
+  const int row_pixels = xend - xbegin;
+  ToyVector<std::uint8_t> row_buffer(TILE_SIZE*dst_pixel_size);
+  ToyVector<std::pair<int, TilePtr>> result;
+  const int valid_rows = yend - ybegin;
+  for (int tx = xbegin / TILE_SIZE; tx*TILE_SIZE < xend; ++tx)
   {
-    ToyVector<std::uint8_t> bad; std::swap(bad, data);
-    data.resize(w*h*bytes_per_channel*3);
-    MakeThreeChannels(AsSpan(data), AsSpan(bad), w*h, bytes_per_channel, 3, channels);
+    auto tile = std::make_shared<Tile>();
+    tile->data.resize(TILE_SIZE*TILE_SIZE*dst_pixel_size);
+    const int valid_cols = std::min(TILE_SIZE, xend - tx*TILE_SIZE);
+    for (int row = 0; row < TILE_SIZE; ++row)
+    {
+      // Pad by repeating the last row and column.
+      const int src_row = std::min(row, valid_rows - 1);
+      auto src_row_span = Subspan(AsSpan(std::as_const(buffer)), (src_row*row_pixels + tx*TILE_SIZE - xbegin)*src_pixel_size, valid_cols*src_pixel_size);
+      MakeThreeChannels(AsSpan(row_buffer), src_row_span, valid_cols, bytes_per_channel, 3, file->channels);
+      for (int col = 0; col < TILE_SIZE; ++col)
+        memcpy(&tile->data[TexelIndex(col, row)*dst_pixel_size], &row_buffer[std::min(col, valid_cols-1)*dst_pixel_size], dst_pixel_size);
+    }
+    const int index = tile_y*tiles_x + tx;
+    if (index == tile_index)
+      result.insert(result.begin(), std::make_pair(index, std::move(tile)));
+    else
+      result.emplace_back(index, std::move(tile));
   }
+  return result;
 }
 
 
@@ -5,31 +5,43 @@
 #include"vec3f.hxx"
 #include"spectral.hxx"
 #include"util.hxx"
+#include"texture_cache.hxx"
 
 namespace boost { namespace filesystem { 
   class path;
 }}
 
 
+// Only the image dimensions are read upon construction. Pixels are loaded lazily through the texture cache.
 class Texture
 {
-  ToyVector<std::uint8_t> data;
+  struct File;
+  std::unique_ptr<File> file;
   int w, h;
+  int tiles_x, tiles_y;
+  std::uint32_t cache_id;
   // Always 3 channels
   enum Type {
     BYTE, // 1 byte per channel
     FLOAT // 4 byte per channel, data really contains floats
   } type;
  
-  //void MakeDefaultImage();
-  void ReadFile(const std::string &filename);
+  static const std::array<Color::RGBScalar, 256> srgb_byte_to_linear;
+
+  void OpenFile(const std::string &filename);
+  inline const texture_cache::Tile& GetTile(int x, int y) const;
  
 public:
   Texture(const boost::filesystem::path &filename);
+  ~Texture();
   int Width() const { return w; }
   int Height() const { return h; }
   inline RGB GetPixel(int x, int y) const;
   inline RGB GetPixel(std::pair<int,int> xy) const;
+
+  // Decodes the tile with the given index, numbered row by row, and returns it first.
+  // Neighbors which had to be decoded along with it are returned, too.
+  ToyVector<std::pair<int, texture_cache::TilePtr>> LoadTiles(int tile_index) const;
 };
 
 
@@ -91,18 +103,28 @@ inline RGB Texture::GetPixel(std::pair<int,int> xy) const
 }
 
 
+// For pixel x, y.
+inline const texture_cache::Tile& Texture::GetTile(int x, int y) const
+{
+  using namespace texture_cache;
+  return Lookup(*this, cache_id, (y >> TILE_SIZE_LOG2) * tiles_x + (x >> TILE_SIZE_LOG2));
+}
+
+
 inline RGB Texture::GetPixel(int x, int y) const
 {
+  using namespace texture_cache;
   assert (x>=0 && x<Width());
   assert (y>=0 && y<Height());
   constexpr int num_channels = 3;
-  const int idx = (y * w + x)*num_channels;
+  const auto &data = GetTile(x, y).data;
+  const int idx = TexelIndex(x, y)*num_channels;
   if (type == BYTE)
   {
     return RGB{
-      Color::SRGBToLinear(Color::RGBScalar(data[idx  ] / 255.0)),
-      Color::SRGBToLinear(Color::RGBScalar(data[idx+1] / 255.0)),
-      Color::SRGBToLinear(Color::RGBScalar(data[idx+2] / 255.0))
+      srgb_byte_to_linear[data[idx  ]],
+      srgb_byte_to_linear[data[idx+1]],
+      srgb_byte_to_linear[data[idx+2]]
     };
   }
   else
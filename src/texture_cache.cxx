@@ -0,0 +1,232 @@
+#include "texture_cache.hxx"
+#include "texture.hxx"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+#include <fmt/format.h>
+
+namespace texture_cache
+{
+
+namespace
+{
+
+class SharedCache
+{
+  struct Entry
+  {
+    TilePtr tile;
+    std::list<Key>::iterator lru_position;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<Key, Entry> entries;
+  std::list<Key> lru; // Most recently used first.
+  std::size_t budget = 0;
+  std::size_t resident = 0;
+  std::size_t peak = 0;
+  std::uint64_t shared_hits = 0;
+  std::uint64_t tiles_loaded = 0;
+  std::uint64_t tiles_evicted = 0;
+
+  // Counters of the thread caches which exist, and the sums over those which are gone.
+  std::vector<const ThreadCache*> thread_caches;
+  std::uint64_t retired_hits = 0;
+  std::uint64_t retired_misses = 0;
+
+  void Insert(Key key, TilePtr tile)
+  {
+    resident += tile->data.size();
+    peak = std::max(peak, resident);
+    lru.push_front(key);
+    entries.emplace(key, Entry{ std::move(tile), lru.begin() });
+    ++tiles_loaded;
+  }
+
+  void Erase(std::unordered_map<Key, Entry>::iterator it)
+  {
+    resident -= it->second.tile->data.size();
+    lru.erase(it->second.lru_position);
+    entries.erase(it);
+  }
+
+  void EvictOverBudget(Key keep)
+  {
+    if (budget == 0)
+      return;
+    auto it = lru.end();
+    while (resident > budget && it != lru.begin())
+    {
+      --it;
+      if (*it == keep)
+        continue;
+      auto entry = entries.find(*(it++));
+      Erase(entry);
+      ++tiles_evicted;
+    }
+  }
+
+public:
+  TilePtr Fetch(const Texture &texture, std::uint32_t texture_id, int tile_index)
+  {
+    const Key key = MakeKey(texture_id, tile_index);
+    {
+      std::lock_guard<std::mutex> lock{ mutex };
+      if (auto it = entries.find(key); it != entries.end())
+      {
+        lru.splice(lru.begin(), lru, it->second.lru_position);
+        ++shared_hits;
+        return it->second.tile;
+      }
+    }
+
+    // Decoding is slow. So other threads may use the cache meanwhile.
+    auto loaded = texture.LoadTiles(tile_index);
+
+    std::lock_guard<std::mutex> lock{ mutex };
+    TilePtr result;
+    for (auto &[index, tile] : loaded)
+    {
+      const Key loaded_key = MakeKey(texture_id, index);
+      if (auto it = entries.find(loaded_key); it != entries.end())
+      {
+        // Another thread was faster.
+        if (index == tile_index)
+          result = it->second.tile;
+        continue;
+      }
+      if (index == tile_index)
+        result = tile;
+      Insert(loaded_key, std::move(tile));
+    }
+    assert(result);
+    EvictOverBudget(key);
+    return result;
+  }
+
+  void Forget(std::uint32_t texture_id)
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+      if ((it->first >> 32) == texture_id)
+        Erase(it++);
+      else
+        ++it;
+    }
+  }
+
+  void SetBudget(std::size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    budget = bytes;
+    EvictOverBudget(~Key{});
+  }
+
+  void Register(const ThreadCache *cache)
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    thread_caches.push_back(cache);
+  }
+
+  void Unregister(const ThreadCache *cache)
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    retired_hits += cache->hits.load(std::memory_order_relaxed);
+    retired_misses += cache->misses.load(std::memory_order_relaxed);
+    thread_caches.erase(std::remove(thread_caches.begin(), thread_caches.end(), cache), thread_caches.end());
+  }
+
+  Statistics GetStatistics()
+  {
+    std::lock_guard<std::mutex> lock{ mutex };
+    Statistics stats;
+    stats.thread_hits = retired_hits;
+    stats.thread_misses = retired_misses;
+    for (const auto *cache : thread_caches)
+    {
+      stats.thread_hits += cache->hits.load(std::memory_order_relaxed);
+      stats.thread_misses += cache->misses.load(std::memory_order_relaxed);
+    }
+    stats.shared_hits = shared_hits;
+    stats.tiles_loaded = tiles_loaded;
+    stats.tiles_evicted = tiles_evicted;
+    stats.resident_bytes = resident;
+    stats.peak_bytes = peak;
+    stats.budget_bytes = budget;
+    return stats;
+  }
+};
+
+
+// Never destroyed, because thread caches may unregister during static destruction.
+SharedCache& TheSharedCache()
+{
+  static SharedCache *cache = new SharedCache{};
+  return *cache;
+}
+
+} // anonymous namespace
+
+
+ThreadCache::ThreadCache()
+{
+  TheSharedCache().Register(this);
+}
+
+
+ThreadCache::~ThreadCache()
+{
+  TheSharedCache().Unregister(this);
+}
+
+
+TilePtr Fetch(const Texture &texture, std::uint32_t texture_id, int tile_index)
+{
+  return TheSharedCache().Fetch(texture, texture_id, tile_index);
+}
+
+
+std::uint32_t NewTextureId()
+{
+  static std::atomic<std::uint32_t> next_id{ 0 };
+  return next_id++;
+}
+
+
+void Forget(std::uint32_t texture_id)
+{
+  TheSharedCache().Forget(texture_id);
+}
+
+
+void SetMemoryBudget(std::size_t bytes)
+{
+  TheSharedCache().SetBudget(bytes);
+}
+
+
+Statistics GetStatistics()
+{
+  return TheSharedCache().GetStatistics();
+}
+
+
+std::ostream& operator<<(std::ostream &os, const Statistics &stats)
+{
+  const auto lookups = stats.thread_hits + stats.thread_misses;
+  const double MB = 1024.*1024.;
+  os << fmt::format("Texture cache: {} lookups, {:.2f}% thread cache hits, {} shared cache hits, {} tiles loaded, {} evicted, {:.1f} MB resident, {:.1f} MB peak",
+    lookups, lookups > 0 ? 100.*stats.thread_hits/lookups : 0.,
+    stats.shared_hits, stats.tiles_loaded, stats.tiles_evicted,
+    stats.resident_bytes/MB, stats.peak_bytes/MB);
+  if (stats.budget_bytes > 0)
+    os << fmt::format(", {:.1f} MB budget", stats.budget_bytes/MB);
+  return os;
+}
+
+} // namespace texture_cache
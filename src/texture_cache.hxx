@@ -0,0 +1,134 @@
+#pragma once
+
+#include "util.hxx"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+
+class Texture;
+
+/* Pixels of textures are loaded in square tiles on first access, and kept in a process-wide
+ * cache which drops the least recently used tiles once its memory budget is exceeded.
+ * In front of it, every thread has a small direct-mapped cache of its own, so that most
+ * lookups take no lock. Tiles which are still referenced from there survive their eviction.
+ * Hence the budget can be exceeded by up to THREAD_CACHE_SIZE tiles per thread.
+ */
+namespace texture_cache
+{
+
+static constexpr int TILE_SIZE_LOG2 = 6;
+static constexpr int TILE_SIZE = 1 << TILE_SIZE_LOG2;
+static constexpr int TILE_MASK = TILE_SIZE - 1;
+static constexpr int THREAD_CACHE_SIZE = 64; // Power of two.
+
+// TILE_SIZE x TILE_SIZE pixels with 3 channels, ordered by TexelIndex. Tiles at the right
+// and bottom borders of the image are padded by repeating the last column and row.
+struct Tile
+{
+  ToyVector<std::uint8_t> data;
+};
+
+
+namespace detail
+{
+// Spreads the bits of x so that there is a zero between each.
+constexpr std::array<std::uint16_t, TILE_SIZE> MakeMortonSpread()
+{
+  std::array<std::uint16_t, TILE_SIZE> result{};
+  for (int x = 0; x < TILE_SIZE; ++x)
+    for (int bit = 0; bit < TILE_SIZE_LOG2; ++bit)
+      result[x] |= ((x >> bit) & 1) << (2*bit);
+  return result;
+}
+
+inline constexpr auto morton_spread = MakeMortonSpread();
+} // namespace detail
+
+
+// Offset in pixels of pixel x, y within its tile. Morton order, so that the pixels of small
+// 2d neighborhoods share cache lines, no matter in which direction lookups move.
+inline int TexelIndex(int x, int y)
+{
+  return detail::morton_spread[x & TILE_MASK] | (detail::morton_spread[y & TILE_MASK] << 1);
+}
+
+using TilePtr = std::shared_ptr<const Tile>;
+using Key = std::uint64_t;
+
+inline Key MakeKey(std::uint32_t texture_id, int tile_index)
+{
+  return (Key(texture_id) << 32) | Key(std::uint32_t(tile_index));
+}
+
+
+struct ThreadCache
+{
+  struct Slot
+  {
+    Key key = ~Key{};
+    TilePtr tile;
+  };
+  std::array<Slot, THREAD_CACHE_SIZE> slots;
+  // Written only by the owning thread. Atomic so the statistics can be read at any time.
+  std::atomic<std::uint64_t> hits{ 0 };
+  std::atomic<std::uint64_t> misses{ 0 };
+
+  ThreadCache();
+  ~ThreadCache();
+  ThreadCache(const ThreadCache &) = delete;
+  ThreadCache& operator=(const ThreadCache &) = delete;
+};
+
+inline thread_local ThreadCache thread_cache;
+
+// Slow path of Lookup. Goes to the shared cache, which loads the tile if needed.
+TilePtr Fetch(const Texture &texture, std::uint32_t texture_id, int tile_index);
+
+// The reference remains valid until the next lookup by the calling thread.
+inline const Tile& Lookup(const Texture &texture, std::uint32_t texture_id, int tile_index)
+{
+  ThreadCache &cache = thread_cache;
+  const Key key = MakeKey(texture_id, tile_index);
+  // Neighboring tiles go to consecutive slots.
+  auto &slot = cache.slots[(tile_index + texture_id * 7919u) & (THREAD_CACHE_SIZE - 1)];
+  if (slot.key == key)
+  {
+    cache.hits.store(cache.hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return *slot.tile;
+  }
+  cache.misses.store(cache.misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  slot.tile = Fetch(texture, texture_id, tile_index);
+  slot.key = key;
+  return *slot.tile;
+}
+
+
+std::uint32_t NewTextureId();
+
+// Removes the tiles of a texture which is destroyed.
+void Forget(std::uint32_t texture_id);
+
+// In bytes of tile data. Zero means unlimited, which is the default.
+void SetMemoryBudget(std::size_t bytes);
+
+
+struct Statistics
+{
+  std::uint64_t thread_hits = 0;
+  std::uint64_t thread_misses = 0; // Either hit the shared cache or loaded the tile.
+  std::uint64_t shared_hits = 0;
+  std::uint64_t tiles_loaded = 0; // Including the neighbors which were decoded in the same go.
+  std::uint64_t tiles_evicted = 0;
+  std::size_t resident_bytes = 0;
+  std::size_t peak_bytes = 0;
+  std::size_t budget_bytes = 0;
+};
+
+Statistics GetStatistics();
+
+std::ostream& operator<<(std::ostream &os, const Statistics &stats);
+
+} // namespace texture_cache
@@ -1,15 +1,26 @@
 #include "image.hxx"
 #include "scene.hxx"
+#include "camera.hxx"
 #include "renderbuffer.hxx"
 #include "renderingalgorithms_interface.hxx"
 #include "pathlogger.hxx"
+#include "texture_cache.hxx"
+#include "checkpoint.hxx"
+#ifndef _WIN32
+#include "render_server.hxx"
+#endif
 
 #include <chrono>
+#include <fstream>
+#include <sstream>
 #include <thread>
 #include <memory>
 #include <tuple>
+#include <limits>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <fmt/core.h>
 
 #include <tbb/tbb_thread.h>
 #include <tbb/concurrent_queue.h>
@@ -80,19 +91,77 @@ inline T pop(tbb::concurrent_bounded_queue<T> &q)
 std::unique_ptr<MaybeDisplay> MakeDisplay(bool will_open_a_window);
 
 
-void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs::path &output_file, RenderingParameters &render_params, std::unique_ptr<MaybeDisplay> &display);
+// Only some of the tiles or samples. The raw sums are written instead of an image.
+inline bool IsPartialRender(const RenderingParameters &render_params)
+{
+  return render_params.tile_end >= 0;
+}
+
+
+struct CheckpointOptions
+{
+  fs::path filename; // Empty if disabled.
+  double interval = 300.; // Seconds
+  bool resume = false;
+  std::uint64_t scene_fingerprint = 0; // Of the contents of the scene file.
+};
+
+
+struct ViewOptions
+{
+  bool all_views = false; // Every camera declared in the scene file.
+  int turntable_frames = 0; // Orbit of the last declared camera. Disabled if zero.
+  bool reuse_learned = false; // Hand the light picker and guiding data on to the next view.
+};
+
+
+// Empty if only the scene camera is rendered.
+ToyVector<CameraView> MakeViewList(const Scene &scene, const ViewOptions &view_options)
+{
+  if (view_options.all_views)
+    return scene.GetViews();
+  ToyVector<CameraView> views;
+  if (view_options.turntable_frames > 0 && !scene.GetViews().empty())
+  {
+    const auto &base = scene.GetViews().back();
+    for (int i = 0; i < view_options.turntable_frames; ++i)
+      views.push_back(base.Orbited(2.*Pi*i/view_options.turntable_frames));
+  }
+  return views;
+}
+
+
+// out.png -> out_007.png
+inline fs::path NumberedOutputFile(const fs::path &output_file, int number)
+{
+  auto result = output_file.parent_path() / output_file.stem();
+  result += fmt::format("_{:03d}", number);
+  result += output_file.extension();
+  return result;
+}
+
+
+void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs::path &output_file, RenderingParameters &render_params, CheckpointOptions &checkpoint_options, ViewOptions &view_options, std::string &serve_address, std::unique_ptr<MaybeDisplay> &display);
+
+std::unique_ptr<RenderingAlgo> RenderView(Scene &scene, const RenderingParameters &render_params, const fs::path &output_file, const CheckpointOptions &checkpoint_options, std::unique_ptr<MaybeDisplay> &display, std::unique_ptr<RenderingAlgo> previous_algo);
 
 
 int main(int argc, char *argv[])
 {
+  const auto program_start_time = std::chrono::steady_clock::now();
   RenderingParameters render_params;
   fs::path input_file;
   fs::path output_file;
+  CheckpointOptions checkpoint_options;
+  ViewOptions view_options;
+  std::string serve_address; // Empty unless in server mode.
   std::unique_ptr<MaybeDisplay> display;
   
-  HandleCommandLineArguments(argc, argv, input_file, output_file, render_params, display);
+  HandleCommandLineArguments(argc, argv, input_file, output_file, render_params, checkpoint_options, view_options, serve_address, display);
   
   tbb::task_scheduler_init init(std::max(1, render_params.num_threads));
+
+  texture_cache::SetMemoryBudget(static_cast<std::size_t>(render_params.texture_cache_mb*1024.*1024.));
   
   Scene scene;
   
@@ -104,10 +173,21 @@ int main(int argc, char *argv[])
     if (input_file.string() != "-")
     {
       scene.ParseSceneFile(input_file.c_str(), &render_params);
+      if (!checkpoint_options.filename.empty())
+      {
+        std::ifstream is(input_file.string(), std::ios::binary);
+        std::ostringstream contents;
+        contents << is.rdbuf();
+        checkpoint_options.scene_fingerprint = checkpoint::Fingerprint(contents.str());
+      }
     }
     else
     {
-      scene.ParseNFF(std::cin, &render_params);
+      // Kept, so that checkpoints can be matched to the scene.
+      std::ostringstream contents;
+      contents << std::cin.rdbuf();
+      checkpoint_options.scene_fingerprint = checkpoint::Fingerprint(contents.str());
+      scene.ParseNFFString(contents.str(), &render_params);
     }
   }
   catch (const std::exception &e)
@@ -117,7 +197,7 @@ int main(int argc, char *argv[])
     std::exit(-1);
   }
   
-  if (!scene.HasCamera())
+  if (!scene.HasCamera() && serve_address.empty()) // Jobs for the server can bring their own camera.
   {
     std::cout << "There is no camera. Aborting." << std::endl;
     return -1;
@@ -129,9 +209,39 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  if (render_params.compact_meshes)
+    scene.CompactMeshes();
+
   std::cout << "building acceleration structure " << std::endl;
   scene.BuildAccelStructure();
   scene.PrintInfo();
+
+#ifndef _WIN32
+  if (!serve_address.empty())
+  {
+    try
+    {
+      render_server::Serve(scene, render_params, serve_address);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "Error in server mode: " << e.what() << "\n";
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  if (render_params.time_limit > 0.)
+  {
+    // The algorithms only see the time which remains after the setup.
+    render_params.time_limit -= std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start_time).count();
+    if (render_params.time_limit <= 0.)
+    {
+      std::cout << "Time limit exceeded during scene setup. Aborting." << std::endl;
+      return -1;
+    }
+  }
   
   {
     Image bm(render_params.width, render_params.height);
@@ -140,6 +250,59 @@ int main(int argc, char *argv[])
     display->Show(bm);
   }
 
+#ifdef HAVE_JSON
+  Pathlogger::Init("/tmp/paths.json");
+  IncompletePaths::Init();
+  //scene.WriteObj("/tmp/scene.obj");
+#endif
+
+  // Several views share the scene with its acceleration structures.
+  const auto views = MakeViewList(scene, view_options);
+  if (views.empty())
+  {
+    if (!RenderView(scene, render_params, output_file, checkpoint_options, display, nullptr))
+      return -1;
+  }
+  else
+  {
+    std::unique_ptr<RenderingAlgo> algo;
+    for (int i = 0; i < isize(views) && display->IsOkToKeepGoing(); ++i)
+    {
+      std::cout << "View " << (i+1) << " of " << views.size() << std::endl;
+      scene.ReplaceCamera(views[i].MakeCamera(render_params.width, render_params.height));
+      if (!view_options.reuse_learned)
+        algo.reset();
+      algo = RenderView(scene, render_params, NumberedOutputFile(output_file, i), checkpoint_options, display, std::move(algo));
+      if (!algo)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+// Returns the algorithm after rendering, or nullptr if it failed. The previous algorithm may pass on
+// what it learned about the scene. It is destroyed before the rendering starts.
+std::unique_ptr<RenderingAlgo> RenderView(Scene &scene, const RenderingParameters &render_params, const fs::path &output_file, const CheckpointOptions &checkpoint_options, std::unique_ptr<MaybeDisplay> &display, std::unique_ptr<RenderingAlgo> previous_algo)
+{
+  auto algo = RenderAlgorithmFactory(scene, render_params);
+  algo->InitializeScene(scene);
+
+  const bool partial_render = IsPartialRender(render_params);
+  if (partial_render && !algo->SupportsPartialRendering())
+  {
+    std::cout << "Algorithm " << render_params.algo_name << " does not support tile ranges or sample offsets. Aborting." << std::endl;
+    return nullptr;
+  }
+
+  if (previous_algo)
+  {
+    if (algo->AdoptSceneKnowledge(*previous_algo))
+      std::cout << "Reusing what was learned during the previous view" << std::endl;
+    previous_algo.reset();
+  }
+
   // Use a queue and an extra worker thread to perform image display and io in a non-blocking way.
   using ImageWorkItem = std::tuple<Image*, bool>; // Would like to use unique_ptr, but queue implementation requires items to be copyable!
   tbb::concurrent_bounded_queue<ImageWorkItem> image_queue;
@@ -151,7 +314,7 @@ int main(int argc, char *argv[])
         return;
       if (display->IsOkToKeepGoing())
         display->Show(*im);
-      if (is_complete_pass) // Partially rendered images are probably useless
+      if (is_complete_pass && !partial_render) // Partially rendered images are probably useless
         im->write(output_file.string());
       delete(im);
   };
@@ -164,17 +327,34 @@ int main(int argc, char *argv[])
     }
   });
   
-#ifdef HAVE_JSON
-  Pathlogger::Init("/tmp/paths.json");
-  IncompletePaths::Init();
-  //scene.WriteObj("/tmp/scene.obj");
-#endif
-  
+  if (checkpoint_options.resume)
+  {
+    try
+    {
+      std::cout << "Resuming from checkpoint " << checkpoint_options.filename << std::endl;
+      LoadCheckpoint(checkpoint_options.filename, *algo, render_params, checkpoint_options.scene_fingerprint);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "Error loading the checkpoint: " << e.what() << "\n";
+      std::cerr << "Exiting ...\n";
+      std::exit(-1);
+    }
+  }
 
-  auto algo = RenderAlgorithmFactory(scene, render_params);
-  algo->InitializeScene(scene);
+  auto WriteCheckpoint = [&]() {
+    try
+    {
+      SaveCheckpoint(checkpoint_options.filename, *algo, render_params, checkpoint_options.scene_fingerprint);
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "WARNING: Failed to write checkpoint: " << e.what() << std::endl;
+    }
+  };
   
   auto time_of_last_image_request = std::chrono::steady_clock::now();
+  auto time_of_last_checkpoint = std::chrono::steady_clock::now();
   
   algo->SetInterruptCallback([&](bool is_complete_pass){
     if ((std::chrono::steady_clock::now() - time_of_last_image_request > std::chrono::milliseconds(1000)) || is_complete_pass)
@@ -183,15 +363,42 @@ int main(int argc, char *argv[])
       image_queue.push(ImageWorkItem{im.release(), is_complete_pass}); // Would use emplace but my TBB believes that I have no variadic template argument support.
       time_of_last_image_request = std::chrono::steady_clock::now();
     }
+    if (!checkpoint_options.filename.empty() && 
+        (is_complete_pass || algo->SupportsMidPassCheckpoints()) &&
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - time_of_last_checkpoint).count() > checkpoint_options.interval)
+    {
+      WriteCheckpoint();
+      time_of_last_checkpoint = std::chrono::steady_clock::now();
+    }
   });
 
   tbb::tbb_thread watchdog_and_image_updater([&] {
+    // Algorithms with snapshots keep rendering while the preview is taken. The others must be interrupted.
+    const bool use_snapshots = algo->SupportsSnapshots();
+    Image preview;
+    if (use_snapshots && display->WantsPeriodicDisplay())
+      preview.init(render_params.width, render_params.height);
+    auto time_of_last_checkpoint_request = std::chrono::steady_clock::now();
     while (display->IsOkToKeepGoing() && stop_flag.load() == false)
     {    
       std::this_thread::sleep_for(std::chrono::seconds(1));
       if (display->WantsPeriodicDisplay())
       {
+        if (!use_snapshots)
           algo->RequestInterrupt();
+        else if (algo->UpdateSnapshot(preview) > 0)
+        {
+          auto *im = new Image(preview);
+          if (!image_queue.try_push(ImageWorkItem{im, false})) // Skip this one if the display is lagging behind.
+            delete im;
+        }
+      }
+      // Mid-pass checkpoints are taken in the interrupt callback.
+      if (!checkpoint_options.filename.empty() && algo->SupportsMidPassCheckpoints() &&
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - time_of_last_checkpoint_request).count() > checkpoint_options.interval)
+      {
+        algo->RequestInterrupt();
+        time_of_last_checkpoint_request = std::chrono::steady_clock::now();
       }
     }
     algo->RequestFullStop();
@@ -206,6 +413,10 @@ int main(int argc, char *argv[])
   std::cout << "Rendering ..." << std::endl;
   
   algo->Run();
+
+  // When the user closed the window, the algorithm was stopped in the middle of a pass.
+  if (!checkpoint_options.filename.empty() && (display->IsOkToKeepGoing() || algo->SupportsMidPassCheckpoints()))
+    WriteCheckpoint();
   
   stop_flag.store(true);
   image_queue.push({ nullptr, true});
@@ -217,11 +428,26 @@ int main(int argc, char *argv[])
   while (image_queue.size())
     PopAndProcessQueueItem();
 
+  if (partial_render)
+  {
+    try
+    {
+      SavePartialImage(output_file, *algo->GeneratePartialImage());
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "Error writing the output: " << e.what() << "\n";
+      return nullptr;
+    }
+  }
+
   auto end_time = std::chrono::steady_clock::now();
   std::cout << "Rendering time: " << std::chrono::duration<double>(end_time - start_time).count() << " sec." << std::endl;
+  if (const auto texture_stats = texture_cache::GetStatistics(); texture_stats.tiles_loaded > 0)
+    std::cout << texture_stats << std::endl;
   //////////////////////////////////
-  
-  return 0;
+
+  return algo;
 }
 
 
@@ -235,7 +461,7 @@ std::unique_ptr<MaybeDisplay> MakeDisplay(bool will_open_a_window)
 }
 
 
-void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs::path &output_file, RenderingParameters &render_params, std::unique_ptr<MaybeDisplay> &display)
+void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs::path &output_file, RenderingParameters &render_params, CheckpointOptions &checkpoint_options, ViewOptions &view_options, std::string &serve_address, std::unique_ptr<MaybeDisplay> &display)
 {
   namespace po = boost::program_options;
   try
@@ -250,8 +476,22 @@ void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs
       ("h,h", po::value<int>(), "Height")
       ("rd", po::value<int>(), "Max ray depth")
       ("spp", po::value<int>(), "Max samples per pixel")
+      ("target-error", po::value<double>(), "Stop sampling image tiles once their estimated relative error drops below this value")
+      ("time-limit", po::value<double>(), "Wall-clock time limit in seconds, counted from program start. The last complete image is written before it expires.")
+      ("tiles", po::value<std::string>(), "Render only tiles a to b-1, given as a:b. Tiles are 16x16 pixels, numbered row by row. The raw sums are written for toytrace-merge.")
+      ("sample-offset", po::value<int>(), "Number of the first sample per pixel, so that separate runs take distinct samples. The raw sums are written for toytrace-merge.")
+      ("checkpoint", po::value<fs::path>(), "Periodically save the render progress to this file, and once more at the end")
+      ("checkpoint-every", po::value<double>(), "Seconds between checkpoints. Default 300.")
+      ("resume", po::bool_switch()->default_value(false), "Continue the render from the file given by --checkpoint. Scene and settings must be the same.")
+      ("all-views", po::bool_switch()->default_value(false), "Render every camera of the scene file. Outputs are numbered, e.g. out_000.png. Limits on samples and time apply to each view.")
+      ("turntable", po::value<int>(), "Render this many views orbiting the scene camera around its look-at point. Numbered outputs like --all-views.")
+      ("reuse-learned", po::bool_switch()->default_value(false), "With several views, start each from what the previous one learned (light selection, path guiding)")
+      ("serve", po::value<std::string>(), "Keep the scene loaded and render jobs from this UNIX socket, or from stdin if '-'. See toytrace-client. The other options provide the defaults for the jobs.")
       ("sw", po::bool_switch()->default_value(false), "Single wavelength per path")
       ("qmc", po::bool_switch()->default_value(false), "Quasi-Monte-Carlo")
+      ("compact-meshes", po::bool_switch()->default_value(false), "Store mesh normals and uvs quantized to save memory")
+      ("scene-cache", po::value<fs::path>(), "Directory where meshes from model files are cached in binary form. Later runs read them from there unless the model file changed.")
+      ("texture-cache-mb", po::value<double>(), "Memory budget for texture tiles in megabytes. Least recently used tiles are dropped when exceeded. Unlimited by default.")
       ("guide-em-every", po::value<int>(), "Guiding: Expectancy maximization every x samples.")
       ("guide-prior-strength", po::value<double>(), "Guiding: Roughly the number of samples were prior becomes insignificant.")
       ("guide-subdiv-factor", po::value<int>(), "Guiding: Less makes the tree more refined. Value ranges around 100 to 10000.")
@@ -370,6 +610,7 @@ void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs
     render_params.algo_name = vm["algo"].as<std::string>();
     if (render_params.algo_name != "pt" &&
         render_params.algo_name != "pt2" &&
+        render_params.algo_name != "ptw" &&
         render_params.algo_name != "bdpt" &&
         render_params.algo_name != "normalvis" &&
         render_params.algo_name != "ptg" &&
@@ -384,11 +625,106 @@ void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs
         throw po::error("Max samples per pixel must be greater zero");
     }
     render_params.max_samples_per_pixel = max_spp;
+
+    if (vm.count("target-error"))
+    {
+      render_params.target_error = vm["target-error"].as<double>();
+      if (render_params.target_error <= 0.)
+        throw po::error("Target error must be greater zero");
+    }
+
+    if (vm.count("time-limit"))
+    {
+      render_params.time_limit = vm["time-limit"].as<double>();
+      if (render_params.time_limit <= 0.)
+        throw po::error("Time limit must be greater zero");
+    }
+    
+    if (vm.count("tiles"))
+    {
+      const auto range = vm["tiles"].as<std::string>();
+      const auto colon = range.find(':');
+      auto ParseInt = [](const std::string &s) -> int {
+        std::size_t end_of_number = 0;
+        const int x = std::stoi(s, &end_of_number);
+        if (end_of_number != s.size())
+          throw std::invalid_argument(s);
+        return x;
+      };
+      try
+      {
+        if (colon == std::string::npos)
+          throw std::invalid_argument(range);
+        render_params.tile_begin = ParseInt(range.substr(0, colon));
+        render_params.tile_end = ParseInt(range.substr(colon+1));
+      }
+      catch (const std::logic_error &)
+      {
+        throw po::error("Bad argument for tiles. Expected a:b");
+      }
+      if (render_params.tile_begin < 0 || render_params.tile_end <= render_params.tile_begin)
+        throw po::error("Bad argument for tiles. Need 0 <= a < b");
+    }
+
+    if (vm.count("sample-offset"))
+    {
+      render_params.sample_offset = vm["sample-offset"].as<int>();
+      if (render_params.sample_offset < 0)
+        throw po::error("Sample offset must not be negative");
+      if (render_params.tile_end < 0) // Selects the partial output, also for offset zero.
+        render_params.tile_end = std::numeric_limits<int>::max();
+    }
+
+    if (vm.count("checkpoint"))
+      checkpoint_options.filename = vm["checkpoint"].as<fs::path>();
+
+    if (vm.count("checkpoint-every"))
+    {
+      checkpoint_options.interval = vm["checkpoint-every"].as<double>();
+      if (checkpoint_options.interval < 0.)
+        throw po::error("Checkpoint interval must not be negative");
+    }
+
+    checkpoint_options.resume = vm["resume"].as<bool>();
+    if (checkpoint_options.resume && checkpoint_options.filename.empty())
+      throw po::error("--resume requires --checkpoint");
+    if (checkpoint_options.resume && !fs::exists(checkpoint_options.filename))
+      throw po::error("Checkpoint file does not exist: " + checkpoint_options.filename.string());
     
     if (vm.count("input-file"))
       input_file = vm["input-file"].as<fs::path>();
     else
       throw po::error("Input file is required.");
+
+    view_options.all_views = vm["all-views"].as<bool>();
+    if (vm.count("turntable"))
+    {
+      view_options.turntable_frames = vm["turntable"].as<int>();
+      if (view_options.turntable_frames <= 0)
+        throw po::error("Number of turntable views must be positive");
+    }
+    view_options.reuse_learned = vm["reuse-learned"].as<bool>();
+    const bool several_views = view_options.all_views || view_options.turntable_frames > 0;
+    if (view_options.all_views && view_options.turntable_frames > 0)
+      throw po::error("--all-views and --turntable cannot be combined");
+    if (view_options.reuse_learned && !several_views)
+      throw po::error("--reuse-learned requires --all-views or --turntable");
+    if (several_views && (IsPartialRender(render_params) || !checkpoint_options.filename.empty() || vm.count("serve")))
+      throw po::error("--all-views and --turntable do not work with --tiles, --sample-offset, --checkpoint or --serve");
+
+    if (vm.count("serve"))
+    {
+#ifdef _WIN32
+      throw po::error("--serve is not available on Windows");
+#endif
+      serve_address = vm["serve"].as<std::string>();
+      if (serve_address.empty())
+        throw po::error("--serve needs a socket path or '-'");
+      if (serve_address == "-" && input_file.string() == "-")
+        throw po::error("Cannot read the scene and the jobs both from stdin");
+      if (IsPartialRender(render_params) || !checkpoint_options.filename.empty())
+        throw po::error("--serve does not work with --tiles, --sample-offset or --checkpoint");
+    }
     
     if (vm.count("output-file"))
       output_file = vm["output-file"].as<fs::path>();
@@ -401,7 +737,7 @@ void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs
       else
       {
         output_file = input_file.parent_path() / input_file.stem();
-        output_file += ".png";
+        output_file += IsPartialRender(render_params) ? ".partial" : ".png";
       }
     }
     
@@ -414,12 +750,30 @@ void HandleCommandLineArguments(int argc, char* argv[], fs::path &input_file, fs
       render_params.pt_sample_mode = mode;
     }
     
-    bool open_display = !vm["no-display"].as<bool>();
-    if (!open_display && render_params.max_samples_per_pixel < 0)
+    bool open_display = !vm["no-display"].as<bool>() && serve_address.empty();
+    if (!open_display && serve_address.empty() && render_params.max_samples_per_pixel < 0 && render_params.target_error <= 0. && render_params.time_limit <= 0.)
       std::cout << "WARNING: Not opening display and no sample count given. Will run until killed." << std::endl;
     display = MakeDisplay(open_display);
     
     render_params.qmc = vm["qmc"].as<bool>();
+    render_params.compact_meshes = vm["compact-meshes"].as<bool>();
+
+    if (vm.count("scene-cache"))
+    {
+      const auto cache_dir = vm["scene-cache"].as<fs::path>();
+      boost::system::error_code ec;
+      fs::create_directories(cache_dir, ec);
+      if (ec)
+        throw po::error("Cannot create the scene cache directory: " + ec.message());
+      render_params.scene_cache_dir = cache_dir.string();
+    }
+
+    if (vm.count("texture-cache-mb"))
+    {
+      render_params.texture_cache_mb = vm["texture-cache-mb"].as<double>();
+      if (render_params.texture_cache_mb < 0.)
+        throw po::error("Texture cache budget must not be negative");
+    }
 
     if (vm.count("include"))
     {
@@ -0,0 +1,106 @@
+#include "image.hxx"
+#include "render_server.hxx"
+
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem/path.hpp>
+
+namespace fs = boost::filesystem;
+
+/* Submits a job to a render server, for example
+ *   toytrace --serve /tmp/toytrace.sock scene.yaml
+ *   toytrace-client -s /tmp/toytrace.sock -o view1.png algo=pt2 spp=64 w=320 h=240
+ *   toytrace-client -s /tmp/toytrace.sock --quit
+ * The job arguments are described in render_server.hxx. With progressive=1 the output
+ * file is overwritten after every pass.
+ */
+int main(int argc, char *argv[])
+{
+  namespace po = boost::program_options;
+  std::string socket_path;
+  fs::path output_file;
+  std::vector<std::string> job_args;
+  bool quit = false;
+  try
+  {
+    po::options_description desc{"Options"};
+    desc.add_options()
+      ("help", "Help screen")
+      ("socket,s", po::value<std::string>(), "Socket of the server")
+      ("output-file,o", po::value<fs::path>(), "Output file")
+      ("quit", po::bool_switch()->default_value(false), "Shut the server down")
+      ("job", po::value<std::vector<std::string>>(), "Job arguments as key=value");
+    po::positional_options_description pos_desc;
+    pos_desc.add("job", -1);
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                options(desc).
+                positional(pos_desc).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+
+    if (vm.count("socket"))
+      socket_path = vm["socket"].as<std::string>();
+    else
+      throw po::error("Socket is required.");
+
+    quit = vm["quit"].as<bool>();
+
+    if (vm.count("output-file"))
+      output_file = vm["output-file"].as<fs::path>();
+    else if (!quit)
+      throw po::error("Output file is required.");
+
+    if (vm.count("job"))
+      job_args = vm["job"].as<std::vector<std::string>>();
+  }
+  catch(po::error &ex)
+  {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+
+  try
+  {
+    auto connection = render_server::ConnectToServer(socket_path);
+    if (quit)
+    {
+      connection->Write("quit\n");
+      return 0;
+    }
+
+    std::string request = "render";
+    for (const auto &arg : job_args)
+      request += " " + arg;
+    connection->Write(request + "\n");
+
+    std::string line;
+    while (connection->ReadLine(line))
+    {
+      if (line.compare(0, 6, "error ") == 0)
+      {
+        std::cerr << "Server: " << line.substr(6) << std::endl;
+        return -1;
+      }
+      Image image;
+      int num_passes = 0;
+      const bool is_final = render_server::ReceiveImage(*connection, line, image, &num_passes);
+      image.write(output_file.string());
+      std::cout << (is_final ? "Final image" : "Image") << " after " << num_passes << " passes written to " << output_file << std::endl;
+      if (is_final)
+        return 0;
+    }
+    std::cerr << "Server closed the connection" << std::endl;
+    return -1;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return -1;
+  }
+}
@@ -0,0 +1,95 @@
+#include "image.hxx"
+#include "renderbuffer.hxx"
+#include "renderingalgorithms_interface.hxx"
+
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem/path.hpp>
+
+namespace fs = boost::filesystem;
+
+/* Sums the partial results of renders with --tiles or --sample-offset, for example
+ *   toytrace --tiles 0:100 -o a.partial scene.nff
+ *   toytrace --tiles 100:200 -o b.partial scene.nff
+ *   toytrace-merge -o scene.png a.partial b.partial
+ * If the output file ends in .partial, the sums are written in raw form again,
+ * so that merging can be done in stages.
+ */
+int main(int argc, char *argv[])
+{
+  namespace po = boost::program_options;
+  std::vector<fs::path> input_files;
+  fs::path output_file;
+  bool linear_output = false;
+  try
+  {
+    po::options_description desc{"Options"};
+    desc.add_options()
+      ("help", "Help screen")
+      ("output-file,o", po::value<fs::path>(), "Output file")
+      ("linear-out", po::bool_switch()->default_value(false), "Output image in linear color space. Like sRGB but without doing the gamma correction.")
+      ("input-file", po::value<std::vector<fs::path>>(), "Partial results of toytrace");
+    po::positional_options_description pos_desc;
+    pos_desc.add("input-file", -1);
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                options(desc).
+                positional(pos_desc).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+
+    if (vm.count("input-file"))
+      input_files = vm["input-file"].as<std::vector<fs::path>>();
+    else
+      throw po::error("Input files are required.");
+
+    if (vm.count("output-file"))
+      output_file = vm["output-file"].as<fs::path>();
+    else
+      throw po::error("Output file is required.");
+
+    linear_output = vm["linear-out"].as<bool>();
+  }
+  catch(po::error &ex)
+  {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+
+  try
+  {
+    std::unique_ptr<Spectral3ImageBuffer> buffer;
+    for (const auto &filename : input_files)
+    {
+      std::cout << "Adding " << filename << std::endl;
+      const auto part = LoadPartialImage(filename);
+      if (!buffer)
+        buffer = std::make_unique<Spectral3ImageBuffer>(part.xres, part.yres);
+      buffer->Add(part);
+    }
+
+    std::cout << "Output to " << output_file << std::endl;
+    if (output_file.extension() == ".partial")
+    {
+      SavePartialImage(output_file, buffer->ToPartialImage());
+    }
+    else
+    {
+      Image bm(buffer->xres, buffer->yres);
+      buffer->ToImage(bm, 0, buffer->yres, !linear_output);
+      bm.write(output_file.string());
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return -1;
+  }
+
+  return 0;
+}
@@ -199,14 +199,14 @@ inline bool Quadratic(T a, T b, T c, T ea, T eb, T ec, T &t0, T &t1, T &err0, T
 }
 
 
-inline bool startswith(const std::string &a, const std::string &b)
+inline bool startswith(std::string_view a, std::string_view b)
 {
   if (a.size() < b.size())
     return false;
   return a.substr(0, b.size()) == b;
 }
 
-inline bool endswith(const std::string &a, const std::string &b)
+inline bool endswith(std::string_view a, std::string_view b)
 {
   if (a.size() < b.size())
     return false;
@@ -2,7 +2,12 @@
 
 #include <tbb/parallel_do.h>
 #include <tbb/task_group.h>
+#include <tbb/spin_mutex.h>
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <optional>
 
 namespace ThreadUtilDetail
 {
@@ -94,9 +99,122 @@ void parallel_for_interruptible(int start, int end, int step, Func &&f, IrqHandl
 }
 
 
+/* Runs n_tasks long lived tasks. Each calls f(item, worker_num) for the items it gets from next_item(worker_num)
+ * until that returns an empty optional. In contrast to while_parallel_fed no task is spawned per item.
+ * Interruption works like in while_parallel_fed_interruptible. The tasks check for cancellation between items.
+ */
+template<class Func, class NextItem, class IrqHandler>
+void parallel_workers_interruptible(Func &&f, NextItem &&next_item, IrqHandler &&irq_handler, int n_tasks, tbb::task_group &tg)
+{
+  while (true)
+  {
+    for (int worker_num = 0; worker_num < n_tasks; ++worker_num)
+    {
+      tg.run([&f, &next_item, &tg, worker_num] {
+        while (!tg.is_canceling())
+        {
+          auto item = next_item(worker_num);
+          if (!item)
+            return;
+          f(*item, worker_num);
+        }
+      });
+    }
+    if (tg.wait() == tbb::task_group_status::complete || !irq_handler())
+      break;
+  }
+}
+
+
+/* Distributes the items 0 ... n-1 in contiguous chunks over the workers. A worker takes items 
+ * from the front of its own chunk. When that is exhausted, it steals the back half of the 
+ * largest remaining chunk. Thus neighbouring items stay with the same worker most of the time.
+ * Only the owner and occasional thieves touch a chunk, so the locks are hardly contended.
+ */
+class WorkStealingRanges
+{
+  struct alignas(64) Range // Own cache line against false sharing.
+  {
+    tbb::spin_mutex mutex;
+    std::atomic<int> begin = 0; // Modified under the lock. Atomic for the search of victims.
+    std::atomic<int> end = 0;
+    long num_steals = 0;
+  };
+  std::unique_ptr<Range[]> ranges;
+  int num_workers = 0;
+
+public:
+  void Reset(int num_items, int num_workers_)
+  {
+    if (num_workers_ != num_workers)
+    {
+      num_workers = num_workers_;
+      ranges = std::make_unique<Range[]>(num_workers);
+    }
+    for (int w = 0; w < num_workers; ++w)
+    {
+      ranges[w].begin = (long)num_items * w / num_workers;
+      ranges[w].end = (long)num_items * (w + 1) / num_workers;
+      ranges[w].num_steals = 0;
+    }
+  }
+
+  std::optional<int> Pop(int worker_num)
+  {
+    Range &mine = ranges[worker_num];
+    {
+      tbb::spin_mutex::scoped_lock lock(mine.mutex);
+      if (mine.begin < mine.end)
+        return mine.begin++;
+    }
+    while (true)
+    {
+      // Racy look for the victim. Checked again under the lock.
+      int victim = -1, victim_size = 0;
+      for (int w = 0; w < num_workers; ++w)
+      {
+        const int size = ranges[w].end - ranges[w].begin;
+        if (size > victim_size)
+        {
+          victim = w;
+          victim_size = size;
+        }
+      }
+      if (victim < 0)
+        return {};
+      int stolen_begin, stolen_end;
+      {
+        tbb::spin_mutex::scoped_lock lock(ranges[victim].mutex);
+        Range &r = ranges[victim];
+        if (r.begin >= r.end)
+          continue;
+        stolen_end = r.end;
+        stolen_begin = r.end - std::max(1, (r.end - r.begin) / 2);
+        r.end = stolen_begin;
+      }
+      tbb::spin_mutex::scoped_lock lock(mine.mutex);
+      mine.begin = stolen_begin + 1;
+      mine.end = stolen_end;
+      ++mine.num_steals;
+      return stolen_begin;
+    }
+  }
+
+  long NumSteals() const
+  {
+    long n = 0;
+    for (int w = 0; w < num_workers; ++w)
+      n += ranges[w].num_steals;
+    return n;
+  }
+};
+
+
 } // namespace ThreadUtilDetail
 
 
 using ThreadUtilDetail::while_parallel_fed;
 using ThreadUtilDetail::while_parallel_fed_interruptible;
-using ThreadUtilDetail::parallel_for_interruptible;
\ No newline at end of file
+using ThreadUtilDetail::parallel_for_interruptible;
+using ThreadUtilDetail::parallel_workers_interruptible;
+using ThreadUtilDetail::WorkStealingRanges;
\ No newline at end of file
@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+# coding: utf-8
+"""
+Renders one frame with several toytrace processes on the local machine and merges the results,
+as a stand-in for a render farm. Each process gets a contiguous range of tiles, or, with
+--split-samples, the full image with a distinct range of sample numbers.
+
+Example:
+  python render_distributed.py --exe build/toytrace --merge-exe build/toytrace-merge \
+    -n 4 --spp 64 -w 640 -h 480 -o out.png scene.nff
+"""
+import os, sys
+import subprocess
+import argparse
+import tempfile
+
+
+TILE_SIZE = 16 # Must agree with ImageTileSet::basicTileSize().
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter, conflict_handler='resolve')
+    parser.add_argument('--exe', default='toytrace')
+    parser.add_argument('--merge-exe', default='toytrace-merge')
+    parser.add_argument('-n', '--num-processes', type=int, default=2)
+    parser.add_argument('--threads-per-process', type=int, default=1)
+    parser.add_argument('--spp', type=int, required=True)
+    parser.add_argument('-w', '--width', type=int, required=True)
+    parser.add_argument('-h', '--height', type=int, required=True)
+    parser.add_argument('--split-samples', action='store_true', help='Split the samples instead of the tiles.')
+    parser.add_argument('-o', '--output', required=True)
+    parser.add_argument('scene')
+    parser.add_argument('extra', nargs=argparse.REMAINDER, help='Passed on to toytrace')
+    args = parser.parse_args()
+
+    n = args.num_processes
+    num_tiles = ((args.width + TILE_SIZE - 1) // TILE_SIZE) * ((args.height + TILE_SIZE - 1) // TILE_SIZE)
+    base_cmd = [args.exe, '--no-display', '--nt', str(args.threads_per_process),
+                '-w', str(args.width), '-h', str(args.height)] + args.extra + [args.scene]
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        processes = []
+        parts = []
+        for i in range(n):
+            part = os.path.join(tmpdir, f'part{i}.partial')
+            if args.split_samples:
+                spp_begin, spp_end = (args.spp * i) // n, (args.spp * (i + 1)) // n
+                if spp_end == spp_begin:
+                    continue
+                opts = ['--spp', str(spp_end - spp_begin), '--sample-offset', str(spp_begin)]
+            else:
+                tile_begin, tile_end = (num_tiles * i) // n, (num_tiles * (i + 1)) // n
+                if tile_end == tile_begin:
+                    continue
+                opts = ['--spp', str(args.spp), '--tiles', f'{tile_begin}:{tile_end}']
+            cmd = base_cmd[:1] + opts + ['-o', part] + base_cmd[1:]
+            print(' '.join(cmd))
+            processes.append(subprocess.Popen(cmd, stdout=subprocess.DEVNULL))
+            parts.append(part)
+        failed = [p.args for p in processes if p.wait() != 0]
+        if failed:
+            sys.exit(f'Failed: {failed}')
+        subprocess.check_call([args.merge_exe, '-o', args.output] + parts)
+
+
+if __name__ == '__main__':
+    main()